@@ -112,9 +112,13 @@ class LibChatLLM:
         self._chatllm_show_statistics   = self._lib.chatllm_show_statistics
         self._chatllm_save_session      = self._lib.chatllm_save_session
         self._chatllm_load_session      = self._lib.chatllm_load_session
+        self._chatllm_get_metrics       = self._lib.chatllm_get_metrics
         self._chatllm_multimedia_msg_prepare        = self._lib.chatllm_multimedia_msg_prepare
         self._chatllm_multimedia_msg_append         = self._lib.chatllm_multimedia_msg_append
         self._chatllm_user_input_multimedia_msg     = self._lib.chatllm_user_input_multimedia_msg
+        self._chatllm_append_audio_snippet          = self._lib.chatllm_append_audio_snippet
+        self._chatllm_clear_audio_snippets          = self._lib.chatllm_clear_audio_snippets
+        self._chatllm_speech_synthesis              = self._lib.chatllm_speech_synthesis
 
         self._chatllm_async_user_input      = self._lib.chatllm_async_user_input
         self._chatllm_async_ai_continue     = self._lib.chatllm_async_ai_continue
@@ -143,6 +147,15 @@ class LibChatLLM:
         self._chatllm_multimedia_msg_append.restype = c_int
         self._chatllm_multimedia_msg_append.argtypes = [c_void_p, c_char_p, c_char_p]
 
+        self._chatllm_append_audio_snippet.restype = c_int
+        self._chatllm_append_audio_snippet.argtypes = [c_void_p, c_void_p, c_int, c_int, c_int]
+        self._chatllm_clear_audio_snippets.restype = None
+        self._chatllm_clear_audio_snippets.argtypes = [c_void_p]
+
+        self._AUDIOFUNC = CFUNCTYPE(None, c_void_p, POINTER(c_short), c_int, c_int, c_int)
+        self._chatllm_speech_synthesis.restype = c_int
+        self._chatllm_speech_synthesis.argtypes = [c_void_p, c_char_p, self._AUDIOFUNC, c_void_p]
+
         self._chatllm_user_input.restype = c_int
         self._chatllm_user_input.argtypes = [c_void_p, c_char_p]
         self._chatllm_async_user_input.restype = c_int
@@ -192,6 +205,9 @@ class LibChatLLM:
         self._chatllm_load_session.restype = c_int
         self._chatllm_load_session.argtypes = [c_void_p, c_char_p]
 
+        self._chatllm_get_metrics.restype = c_char_p
+        self._chatllm_get_metrics.argtypes = []
+
         self._cb_print = self._PRINTFUNC(LibChatLLM.callback_print)
         self._cb_end = self._ENDFUNC(LibChatLLM.callback_end)
 
@@ -359,6 +375,22 @@ class LibChatLLM:
     def load_session(self, obj: c_void_p, file_name: str) -> str:
         return self._chatllm_load_session(obj, c_char_p(file_name.encode()))
 
+    def get_metrics(self) -> str:
+        return self._chatllm_get_metrics().decode()
+
+    def append_audio_snippet(self, obj: c_void_p, pcm: bytes, sample_rate: int, channel_num: int = 1) -> int:
+        sample_num = len(pcm) // (2 * channel_num)
+        return self._chatllm_append_audio_snippet(obj, pcm, sample_rate, sample_num, channel_num)
+
+    def clear_audio_snippets(self, obj: c_void_p) -> None:
+        self._chatllm_clear_audio_snippets(obj)
+
+    def speech_synthesis(self, obj: c_void_p, text: str, on_audio) -> int:
+        """`on_audio(pcm: bytes, sample_rate: int, channels: int)` receives 16-bit PCM chunks; empty `pcm` marks the end."""
+        def callback(user_data, pcm_samples, sample_num, sample_rate, channels):
+            on_audio(string_at(pcm_samples, sample_num * channels * 2) if sample_num > 0 else b'', sample_rate, channels)
+        return self._chatllm_speech_synthesis(obj, c_char_p(text.encode()), self._AUDIOFUNC(callback), None)
+
 class LLMChatDone:
     def __init__(self, id: Any) -> None:
         self.id = id
@@ -566,6 +598,16 @@ class ChatLLM:
     def load_session(self, file_name: str) -> str:
         return self._lib.load_session(self._chat, file_name)
 
+    def append_audio_snippet(self, pcm: bytes, sample_rate: int, channel_num: int = 1) -> int:
+        """16-bit PCM of an audio stream. Use empty `pcm` to end the stream."""
+        return self._lib.append_audio_snippet(self._chat, pcm, sample_rate, channel_num)
+
+    def clear_audio_snippets(self) -> None:
+        self._lib.clear_audio_snippets(self._chat)
+
+    def speech_synthesis(self, text: str, on_audio) -> int:
+        return self._lib.speech_synthesis(self._chat, text, on_audio)
+
     def callback_print_reference(self, s: str) -> None:
         self.references.append(s)
 
@@ -56,6 +56,7 @@ enum PrintType
 typedef void (*f_chatllm_print)(void *user_data, int print_type, const char *utf8_str);
 typedef void (*f_chatllm_end)(void *user_data);
 typedef void (*f_chatllm_lens_callback)(void *user_data, int layer_id, int n_tokens, const float *logits, const int *ordering);
+typedef void (*f_chatllm_audio_callback)(void *user_data, const short *pcm_samples, int sample_num, int sample_rate, int channels);
 
 /**
  * @brief append an initialization command line option (optional)
@@ -178,6 +179,35 @@ DLL_DECL void API_CALL chatllm_multimedia_msg_prepare(struct chatllm_obj *obj);
  */
 DLL_DECL int API_CALL chatllm_multimedia_msg_append(struct chatllm_obj *obj, const char *type, const char *utf8_str);
 
+/**
+ * @brief append a snippet of an audio stream (streaming ASR)
+ *
+ * Features are computed as snippets arrive. Complete windows are transcribed by the next user input,
+ * e.g. `chatllm_user_input(obj, "")`, so text is emitted while the stream goes on.
+ * Pass `sample_num == 0` to end the stream.
+ *
+ * Note: Call this from the same thread of `chatllm_user_input()`.
+ *
+ * @param[in] obj               model object
+ * @param[in] pcm_samples       interleaved 16-bit PCM samples
+ * @param[in] sample_rate       sample rate, which must match the model's (16000 for Qwen3-ASR)
+ * @param[in] sample_num        number of samples (per channel)
+ * @param[in] channel_num       number of channels (down-mixed to mono)
+ * @return                      number of windows waiting for transcription, or negative on error:
+ *                              -1: async generation ongoing; -2: model not loaded;
+ *                              -3: invalid audio or not supported (message is printed as an error)
+ */
+DLL_DECL int API_CALL chatllm_append_audio_snippet(struct chatllm_obj *obj, const short *pcm_samples, int sample_rate, int sample_num, int channel_num);
+
+/**
+ * @brief discard the audio stream and windows not transcribed yet
+ *
+ * Note: ignored while async generation is ongoing.
+ *
+ * @param[in] obj               model object
+ */
+DLL_DECL void API_CALL chatllm_clear_audio_snippets(struct chatllm_obj *obj);
+
 enum RoleType
 {
     ROLE_USER = 2,
@@ -251,6 +281,25 @@ DLL_DECL int API_CALL chatllm_user_input(struct chatllm_obj *obj, const char *ut
  */
 DLL_DECL int API_CALL chatllm_user_input_multimedia_msg(struct chatllm_obj *obj);
 
+/**
+ * @brief text to speech, streaming
+ *
+ * PCM chunks (16-bit, interleaved) are passed to `f_audio`, and a final call with `sample_num == 0` marks the end
+ * (also on failure).
+ * Orpheus and Maya pass chunks as soon as they are synthesized; OuteTTS passes the whole utterance in one chunk;
+ * Qwen3-TTS passes the whole utterance in one chunk, or windows of `stream_chunk` frames when it is set.
+ *
+ * This function is synchronized, i.e. it returns after synthesis ends.
+ *
+ * @param[in] obj               model object
+ * @param[in] utf8_str          text
+ * @param[in] f_audio           callback for PCM chunks
+ * @param[in] user_data         user data passed to `f_audio`
+ * @return                      0 if succeeded; -1 if busy; -2 if model not loaded; -3 if not a TTS model;
+ *                              -4 if `f_audio` is NULL; -5 if synthesis failed (error is reported via `PRINTLN_ERROR`)
+ */
+DLL_DECL int API_CALL chatllm_speech_synthesis(struct chatllm_obj *obj, const char *utf8_str, f_chatllm_audio_callback f_audio, void *user_data);
+
 /**
  * @brief set prefix for AI generation
  *
@@ -509,6 +558,17 @@ DLL_DECL void chatllm_set_lens_callback(struct chatllm_obj *obj, f_chatllm_lens_
  */
 DLL_DECL const char *chatllm_inspect_model(const char *model_path);
 
+/**
+ * @brief get metrics of all models
+ *
+ * Metrics (counters, gauges and latency histograms) are in Prometheus text exposition format.
+ *
+ * The returned data is available until a new call of this function on the same thread.
+ *
+ * @return                      pointing to a string
+ */
+DLL_DECL const char *chatllm_get_metrics(void);
+
 #ifdef __cplusplus
 }
 #endif
\ No newline at end of file
@@ -827,6 +827,24 @@ def tensor_type_fallback(shape, ndim: int, ggml_type: GGMLType):
         case _:
             return GGMLType.F16
 
+def experts_tensor_types(profile_fn: str, hot_ratio: float, hot_type: str, cold_type: str) -> list:
+    # hot experts (by routing histogram saved with `--set moe-profile FILE`) get `hot_type`, others get `cold_type`
+    with open(profile_fn, encoding='utf-8') as f:
+        profile = json.load(f)
+
+    r = []
+    for layer in profile['layers']:
+        path = re.escape(layer['path'])
+        if (hot_type != '') and (layer['num_tokens'] > 0):
+            hist = layer['histogram']
+            n_hot = max(1, int(len(hist) * hot_ratio + 0.5))
+            hot = sorted(range(len(hist)), key=lambda i: (-hist[i], i))[:n_hot]
+            for i in hot:
+                r.append((f'^{path}experts\\.{i}\\.', GGMLType[hot_type.upper()]))
+        if cold_type != '':
+            r.append((f'^{path}experts\\.\\d+\\.', GGMLType[cold_type.upper()]))
+    return r
+
 def tensor_quantization_type(name: str, tensor: torch.Tensor, def_type: GGMLType) -> GGMLType:
     global g_tensor_types
 
@@ -10687,11 +10705,18 @@ def main():
     parser.add_argument("--native_name", type=str, default='', help='model native name')
     parser.add_argument("--snac_model", type=str, default='', help='snac model path (required by Orpheus-TTS, etc)')
     parser.add_argument("--dac_model", type=str, default='', help='dac model path (required by Oute-TTS, etc)')
+    parser.add_argument("--experts-profile", type=str, default='', help='MoE routing profile (saved by `--set moe-profile FILE`) for mixed per-expert quantization')
+    parser.add_argument("--hot-experts-ratio", type=float, default=0.1, help='ratio of experts (most frequently selected) to be quantized as `--hot-experts-type`')
+    parser.add_argument("--hot-experts-type", type=str, default='q8_0', choices=["f32", "f16", "q8_0", "q4_0", "q4_1", "q4_k"])
+    parser.add_argument("--cold-experts-type", type=str, default='', choices=["", "f32", "f16", "q8_0", "q4_0", "q4_1", "q4_k"], help='default: `--type`')
     args = parser.parse_args()
 
     for l in reversed(args.tensor_type):
         g_tensor_types.append((l[0], GGMLType[l[1].upper()]))
 
+    if args.experts_profile != '':
+        g_tensor_types.extend(experts_tensor_types(args.experts_profile, args.hot_experts_ratio, args.hot_experts_type, args.cold_experts_type))
+
     arch = args.arch.lower()
 
     if args.lora_model_name_or_path is not None:
@@ -421,16 +421,11 @@ namespace chatllm::adept::fuyu
 
                 if (w <= 0) continue;
 
-                std::vector<float> scaled;
-                vision::image_rescale(pixels, scaled);
-
-                vision::image_normalize(scaled, vis_config->image_mean, vis_config->image_std);
-
                 tok->media_emb.push_back({.grid_width = w / patch_size, .grid_height = h / patch_size, .patch_size = patch_size, .data = {}});
 
                 auto &image = tok->media_emb.back();
 
-                vision::image_arrange(scaled, w, patch_size, image.data, vision::PatchesFormat::PatchesLeftRightDown_PixelsLeftRightDown_ChannelsRGB);
+                vision::image_to_patches(pixels, w, patch_size, vis_config->image_mean, vis_config->image_std, image.data, vision::PatchesFormat::PatchesLeftRightDown_PixelsLeftRightDown_ChannelsRGB);
 
                 image.emb_vec_number = image.grid_width * image.grid_height;
 
@@ -532,7 +532,7 @@ namespace chatllm::bailing::llada
     bool ConditionalGeneration::generate_next_block(const int *input_ids, const int ids_count, const GenerationConfig &gen_config,
         std::vector<float> *logits_output, const int batch_size)
     {
-        int batch = batch_input > 1 ? batch_input : 1;
+        int batch = get_input_batch_size();
         batch = (batch / block_length) * block_length;
         CHATLLM_CHECK(batch >= block_length);
 
@@ -729,7 +729,10 @@ namespace chatllm::bailing::llada
             }
 
             if (performance)
+            {
                 performance->Accumulate(ModelPerfInfo::Type::Generation, block_length - block_prefilled_size);
+                performance->TokenGenerated(block_length - block_prefilled_size);
+            }
 
             if (completed)
                 break;
@@ -17,6 +17,9 @@ namespace chatllm::glm::v1
 
         void encode(const std::string &text, std::vector<int> &ids) const override;
 
+        // punctuations are replaced depending on neighboring characters
+        bool is_postprocess_local(void) const override { return false; }
+
     protected:
         std::string preprocess(const std::string &text) const override;
         std::string postprocess(const std::string &text) const override;
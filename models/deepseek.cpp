@@ -296,6 +296,7 @@ namespace chatllm::deepseek::v2_light
             o_proj(ctx, v_head_dim * num_attention_heads, hidden_size, use_bias),
             kv_norm(ctx, kv_lora_rank)
     {
+        CHATLLM_CHECK(opt_speed || !compressor) << "KV cache compression is not supported by MLA in memory-saving mode";
     }
 
     BaseMLAttention::BaseMLAttention(InitContext *ctx, int hidden_size, int num_attention_heads, int num_kv_heads, int max_length,
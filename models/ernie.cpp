@@ -546,6 +546,7 @@ namespace chatllm::paddle::ocr::vit
         std::unique_ptr<VisionTransformer> vis_model;
         TensorGraphEvaluator eval;
         InitContext _ctx; // weight context
+        MediaEmbeddingCacheBinding media_cache;
     public:
         Config vis_config;
     };
@@ -553,7 +554,8 @@ namespace chatllm::paddle::ocr::vit
     VisualEmbeddingGeneration::VisualEmbeddingGeneration(const RuntimeConfig &runtime_config, int max_llm_tokens, size_t GRAPH_SIZE):
         max_llm_tokens(max_llm_tokens),
         eval(runtime_config, "vis", GRAPH_SIZE),
-        _ctx(eval.get_backend_context())
+        _ctx(eval.get_backend_context()),
+        media_cache(runtime_config)
     {
         _ctx.cache_dtype = runtime_config.cache_type;
     }
@@ -562,6 +564,7 @@ namespace chatllm::paddle::ocr::vit
     {
         if (vis_model.get())
         {
+            media_cache.bind(loader);
             loader.add_tensor_name_translations({
                 {"mlp_AR.fc0.",                     "mlp_AR.linear_1."},
                 {"mlp_AR.fc1.",                     "mlp_AR.linear_2."},
@@ -636,7 +639,9 @@ namespace chatllm::paddle::ocr::vit
 
         for (auto &image : tok->media_emb)
         {
-            run_model(gen_config, tok, dtype, image, buf);
+            media_cache.encode(image, dtype, buf, [&](std::vector<uint8_t> &output) {
+                return run_model(gen_config, tok, dtype, image, output);
+            });
         }
     }
 
@@ -782,16 +787,12 @@ namespace chatllm::paddle::ocr
             vision::image_load(piece.content.c_str(), pixels, w, h, patch_size, vision::PaddingMode::Black);
             if ((w <= 0) || (h <= 0)) return;
 
-            std::vector<float> scaled;
-            vision::image_rescale(pixels, scaled);
-            vision::image_normalize(scaled, vis_config->image_mean, vis_config->image_std);
-
             tok->media_emb.push_back({.grid_width = w / patch_size, .grid_height = h / patch_size, .patch_size = patch_size, .data = {}});
 
             auto &image = tok->media_emb.back();
 
             //vision::image_arrange(scaled, w, patch_size, image.data, vision::PatchesFormat::PatchesLeftRightDown_MergeN_ChannelsRGB_PixelsLeftRightDown);
-            vision::image_arrange(scaled, w, patch_size, image.data, vision::PatchesFormat::PatchesLeftRightDown_ChannelsRGB_PixelsLeftRightDown);
+            vision::image_to_patches(pixels, w, patch_size, vis_config->image_mean, vis_config->image_std, image.data, vision::PatchesFormat::PatchesLeftRightDown_ChannelsRGB_PixelsLeftRightDown);
 
             const int merge_length = vis_config->spatial_merge_size * vis_config->spatial_merge_size;
             image.emb_vec_number = image.grid_width * image.grid_height / merge_length;
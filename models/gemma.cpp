@@ -373,7 +373,8 @@ namespace chatllm::gemma::siglip
 
 
     VisualEmbeddingGeneration::VisualEmbeddingGeneration(const RuntimeConfig &runtime_config, size_t GRAPH_SIZE)
-        : GRAPH_SIZE(GRAPH_SIZE), _ctx(&backend_context), n_threads(runtime_config.n_threads)
+        : GRAPH_SIZE(GRAPH_SIZE), _ctx(&backend_context), n_threads(runtime_config.n_threads),
+          media_cache(runtime_config)
     {
         _ctx.cache_dtype = runtime_config.cache_type;
         model_gpu_layers = BackendContext::get_ngl_of_model(runtime_config.model_gpu_layers, "vis");
@@ -383,6 +384,7 @@ namespace chatllm::gemma::siglip
     {
         if (vis_model.get())
         {
+            media_cache.bind(loader);
             loader.push_allocator_manager(&backend_context.layer_allocators);
             vis_model->load("vision_model.", &loader);
             loader.pop_allocator_manager();
@@ -443,7 +445,9 @@ namespace chatllm::gemma::siglip
 
         for (auto &image : tok->media_emb)
         {
-            run_model(gen_config, tok, dtype, image, buf);
+            media_cache.encode(image, dtype, buf, [&](std::vector<uint8_t> &output) {
+                return run_model(gen_config, tok, dtype, image, output);
+            });
         }
     }
 
@@ -849,17 +853,11 @@ namespace chatllm::gemma::v3
         Tokenizer *tok = dynamic_cast<Tokenizer *>(tokenizer);
         if (nullptr == tok) return false;
 
-        std::vector<float> scaled;
-
-        vision::image_rescale(pixels, scaled);
-
-        vision::image_normalize(scaled, vis_config->image_mean, vis_config->image_std);
-
         tok->media_emb.push_back({.grid_width = w / patch_size, .grid_height = h / patch_size, .patch_size = patch_size, .data = {}});
 
         auto &image = tok->media_emb.back();
 
-        vision::image_arrange(scaled, w, patch_size, image.data, vision::PatchesFormat::ChannelsRGB_PixelsLeftRightDown);
+        vision::image_to_patches(pixels, w, patch_size, vis_config->image_mean, vis_config->image_std, image.data, vision::PatchesFormat::ChannelsRGB_PixelsLeftRightDown);
 
         image.emb_vec_number = vis_config->mm_tokens_per_image;
 
@@ -244,6 +244,7 @@ namespace chatllm::gemma::siglip
         InitContext _ctx; // weight context
         const int n_threads;
         std::string model_gpu_layers;
+        MediaEmbeddingCacheBinding media_cache;
     public:
         Config vis_config;
     };
@@ -1357,6 +1357,7 @@ namespace chatllm::gemma::vit
         std::unique_ptr<VisionModel> vis_model;
         TensorGraphEvaluator eval;
         InitContext _ctx; // weight context
+        MediaEmbeddingCacheBinding media_cache;
     public:
         Config vis_config;
     };
@@ -1364,7 +1365,8 @@ namespace chatllm::gemma::vit
     VisualEmbeddingGeneration::VisualEmbeddingGeneration(const RuntimeConfig &runtime_config, int max_llm_tokens, size_t GRAPH_SIZE):
         max_llm_tokens(max_llm_tokens),
         eval(runtime_config, "vis", GRAPH_SIZE),
-        _ctx(eval.get_backend_context())
+        _ctx(eval.get_backend_context()),
+        media_cache(runtime_config)
     {
         _ctx.cache_dtype = runtime_config.cache_type;
     }
@@ -1373,6 +1375,7 @@ namespace chatllm::gemma::vit
     {
         if (vis_model.get())
         {
+            media_cache.bind(loader);
             loader.push_allocator_manager(eval.get_layer_allocators());
             vis_model->load("visual.", &loader);
             loader.pop_allocator_manager();
@@ -1460,7 +1463,9 @@ namespace chatllm::gemma::vit
         for (auto &image : tok->media_emb)
         {
             if (image.type != media_type_image) continue;
-            run_model(gen_config, tok, dtype, image, buf);
+            media_cache.encode(image, dtype, buf, [&](std::vector<uint8_t> &output) {
+                return run_model(gen_config, tok, dtype, image, output);
+            });
         }
     }
 
@@ -2726,7 +2731,7 @@ namespace chatllm::gemma::v4
         Tokenizer *tok = dynamic_cast<Tokenizer *>(tokenizer);
         const double fps = tok->fps;
 
-        auto video = new vision::VideoLoader(piece.content.c_str(), (float)fps, vis_config->video_max_num_frames);
+        std::unique_ptr<vision::VideoLoader> video(new vision::VideoLoader(piece.content.c_str(), (float)fps, vis_config->video_max_num_frames));
         if (video->frames.size() < 1)
             return;
 
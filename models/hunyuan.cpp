@@ -640,7 +640,7 @@ namespace chatllm::hunyuan::wedlm
         std::vector<float> *aux_output,
         const int batch_size)
     {
-        int batch = batch_input > 1 ? batch_input : 1;
+        int batch = get_input_batch_size();
         CHATLLM_CHECK(batch >= block_size);
 
         int remain = ids_count;
@@ -883,7 +883,10 @@ namespace chatllm::hunyuan::wedlm
             }
 
             if (performance)
+            {
                 performance->Accumulate(ModelPerfInfo::Type::Generation, transferred);
+                performance->TokenGenerated(transferred);
+            }
 
             for (int i = next_pos_to_add; !completed && (i < (int)block_result.size()); i++)
             {
@@ -1387,16 +1390,11 @@ namespace chatllm::hunyuan::youtu::vl
             vision::image_load(piece.content.c_str(), pixels, w, h, patch_size, vision::PaddingMode::Black);
             if ((w <= 0) || (h <= 0)) continue;
 
-            std::vector<float> scaled;
-            vision::image_rescale(pixels, scaled);
-
-            vision::image_normalize(scaled, vis_config->image_mean, vis_config->image_std);
-
             tok->media_emb.push_back({.grid_width = w / patch_size, .grid_height = h / patch_size, .patch_size = patch_size, .data = {}});
 
             auto &image = tok->media_emb.back();
 
-            vision::image_arrange(scaled, w, patch_size, image.data, vision::PatchesFormat::PatchesLeftRightDown_MergeN_PixelsLeftRightDown_ChannelsRGB);
+            vision::image_to_patches(pixels, w, patch_size, vis_config->image_mean, vis_config->image_std, image.data, vision::PatchesFormat::PatchesLeftRightDown_MergeN_PixelsLeftRightDown_ChannelsRGB);
 
             const int merge_length = vis_config->spatial_merge_size * vis_config->spatial_merge_size;
             image.emb_vec_number = image.grid_width * image.grid_height / merge_length;
@@ -2071,16 +2069,11 @@ namespace chatllm::hunyuan::penguin::vl
                     vision::image_load(piece.content.c_str(), pixels, w, h, patch_size, vision::PaddingMode::Black);
                     if ((w <= 0) || (h <= 0)) continue;
 
-                    std::vector<float> scaled;
-                    vision::image_rescale(pixels, scaled);
-
-                    vision::image_normalize(scaled, vis_config->image_mean, vis_config->image_std);
-
                     tok->media_emb.push_back({.grid_width = w / patch_size, .grid_height = h / patch_size, .patch_size = patch_size, .data = {}});
 
                     auto &image = tok->media_emb.back();
 
-                    vision::image_arrange(scaled, w, patch_size, image.data, vision::PatchesFormat::PatchesLeftRightDown_ChannelsRGB_PixelsLeftRightDown);
+                    vision::image_to_patches(pixels, w, patch_size, vis_config->image_mean, vis_config->image_std, image.data, vision::PatchesFormat::PatchesLeftRightDown_ChannelsRGB_PixelsLeftRightDown);
 
                     image.emb_vec_number = image.grid_width * image.grid_height;
 
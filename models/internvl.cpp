@@ -569,13 +569,9 @@ namespace chatllm::intern::vl
 
         for (auto &pixels : crops)
         {
-            std::vector<float> scaled;
             std::vector<float> arranged;
 
-            vision::image_rescale(pixels, scaled);
-            vision::image_normalize(scaled, vis_config->image_mean, vis_config->image_std);
-
-            vision::image_arrange(scaled, vis_config->image_size, -1, arranged, vision::PatchesFormat::ChannelsRGB_PixelsLeftRightDown);
+            vision::image_to_patches(pixels, vis_config->image_size, -1, vis_config->image_mean, vis_config->image_std, arranged, vision::PatchesFormat::ChannelsRGB_PixelsLeftRightDown);
 
             image.data.insert(image.data.end(), arranged.begin(), arranged.begin() + arranged.size());
         }
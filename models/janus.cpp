@@ -636,16 +636,11 @@ namespace chatllm::janus::pro
 
                 vision::image_load(piece.content.c_str(), pixels, w, h, patch_size, vision::PaddingMode::Gray);
 
-                std::vector<float> scaled;
-                vision::image_rescale(pixels, scaled);
-
-                vision::image_normalize(scaled, vis_config->image_mean, vis_config->image_std);
-
                 tok->media_emb.push_back({.width = w, .height = h, .patch_size = patch_size, .data = {}});
 
                 auto &image = tok->media_emb.back();
 
-                vision::image_arrange(scaled, w, patch_size, image.data, vision::PatchesFormat::ChannelsRGB_PixelsLeftRightDown);
+                vision::image_to_patches(pixels, w, patch_size, vis_config->image_mean, vis_config->image_std, image.data, vision::PatchesFormat::ChannelsRGB_PixelsLeftRightDown);
 
                 image.emb_vec_number = (vis_config->image_size / patch_size) * (vis_config->image_size / patch_size);
 
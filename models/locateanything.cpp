@@ -279,16 +279,11 @@ namespace chatllm::locate_anything
 
             vision::image_load(piece.content.c_str(), pixels, w, h, patch_size, vision::PaddingMode::Black);
 
-            std::vector<float> scaled;
-            vision::image_rescale(pixels, scaled);
-
-            vision::image_normalize(scaled, vis_config->image_mean, vis_config->image_std);
-
             tok->media_emb.push_back({.grid_width = w / patch_size, .grid_height = h / patch_size, .patch_size = patch_size, .data = {}});
 
             auto &image = tok->media_emb.back();
 
-            vision::image_arrange(scaled, w, patch_size, image.data, vision::PatchesFormat::PatchesLeftRightDown_ChannelsRGB_PixelsLeftRightDown);
+            vision::image_to_patches(pixels, w, patch_size, vis_config->image_mean, vis_config->image_std, image.data, vision::PatchesFormat::PatchesLeftRightDown_ChannelsRGB_PixelsLeftRightDown);
 
             const int merge_length = vis_config->merge_kernel_size[0] * vis_config->merge_kernel_size[1];
             image.emb_vec_number = image.grid_width * image.grid_height / merge_length;
@@ -610,7 +610,8 @@ namespace chatllm::mistral::pixtral
         VisualEmbeddingGeneration(const RuntimeConfig &runtime_config, int max_llm_tokens, size_t GRAPH_SIZE = 4096):
             max_llm_tokens(max_llm_tokens),
             eval(runtime_config, "vis", GRAPH_SIZE),
-            _ctx(eval.get_backend_context())
+            _ctx(eval.get_backend_context()),
+            media_cache(runtime_config)
         {
             _ctx.cache_dtype = runtime_config.cache_type;
         }
@@ -619,6 +620,7 @@ namespace chatllm::mistral::pixtral
         {
             if (vis_model.get())
             {
+                media_cache.bind(loader);
                 loader.push_allocator_manager(eval.get_layer_allocators());
                 vis_model->load("vision_model.", &loader);
                 loader.pop_allocator_manager();
@@ -686,7 +688,9 @@ namespace chatllm::mistral::pixtral
 
             for (auto &image : tok->media_emb)
             {
-                run_model(gen_config, tok, dtype, image, buf);
+                media_cache.encode(image, dtype, buf, [&](std::vector<uint8_t> &output) {
+                    return run_model(gen_config, tok, dtype, image, output);
+                });
             }
         }
 
@@ -714,6 +718,7 @@ namespace chatllm::mistral::pixtral
         std::unique_ptr<VisionTransformer> vis_model;
         TensorGraphEvaluator eval;
         InitContext _ctx; // weight context
+        MediaEmbeddingCacheBinding media_cache;
     public:
         Config vis_config;
     };
@@ -1007,16 +1012,11 @@ Always prioritize using tools to provide the most accurate and helpful response.
 
                 vision::image_load(piece.content.c_str(), pixels, w, h, patch_size, vision::PaddingMode::Black);
 
-                std::vector<float> scaled;
-                vision::image_rescale(pixels, scaled);
-
-                vision::image_normalize(scaled, vis_config->image_mean, vis_config->image_std);
-
                 tok->media_emb.push_back({.grid_width = w / patch_size, .grid_height = h / patch_size, .patch_size = patch_size, .data = {}});
 
                 auto &image = tok->media_emb.back();
 
-                vision::image_arrange(scaled, w, patch_size, image.data, vision::PatchesFormat::ChannelsRGB_PixelsLeftRightDown);
+                vision::image_to_patches(pixels, w, patch_size, vis_config->image_mean, vis_config->image_std, image.data, vision::PatchesFormat::ChannelsRGB_PixelsLeftRightDown);
 
                 image.emb_vec_number = image.grid_width * image.grid_height;
 
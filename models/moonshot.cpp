@@ -382,7 +382,8 @@ namespace chatllm::kimi::vit
     VisualEmbeddingGeneration::VisualEmbeddingGeneration(const RuntimeConfig &runtime_config, size_t GRAPH_SIZE)
         :
         GRAPH_SIZE(GRAPH_SIZE), _ctx(&backend_context),
-        n_threads(runtime_config.n_threads)
+        n_threads(runtime_config.n_threads),
+        media_cache(runtime_config)
     {
         _ctx.cache_dtype = runtime_config.cache_type;
         model_gpu_layers = BackendContext::get_ngl_of_model(runtime_config.model_gpu_layers, "vis");
@@ -392,6 +393,7 @@ namespace chatllm::kimi::vit
     {
         if (vis_model.get())
         {
+            media_cache.bind(loader);
             loader.push_allocator_manager(&backend_context.layer_allocators);
             vis_model->load("vision_model.", &loader);
             loader.pop_allocator_manager();
@@ -474,7 +476,9 @@ namespace chatllm::kimi::vit
 
         for (auto &image : tok->media_emb)
         {
-            run_model(gen_config, tok, dtype, image, buf);
+            media_cache.encode(image, dtype, buf, [&](std::vector<uint8_t> &output) {
+                return run_model(gen_config, tok, dtype, image, output);
+            });
         }
     }
 
@@ -814,16 +818,11 @@ namespace chatllm::kimi::vl
 
                 vision::image_load(piece.content.c_str(), pixels, w, h, patch_size, vision::PaddingMode::Black);
 
-                std::vector<float> scaled;
-                vision::image_rescale(pixels, scaled);
-
-                vision::image_normalize(scaled, vis_config->image_mean, vis_config->image_std);
-
                 tok->media_emb.push_back({.grid_width = w / patch_size, .grid_height = h / patch_size, .patch_size = patch_size, .data = {}});
 
                 auto &image = tok->media_emb.back();
 
-                vision::image_arrange(scaled, w, patch_size, image.data, vision::PatchesFormat::PatchesLeftRightDown_ChannelsRGB_PixelsLeftRightDown);
+                vision::image_to_patches(pixels, w, patch_size, vis_config->image_mean, vis_config->image_std, image.data, vision::PatchesFormat::PatchesLeftRightDown_ChannelsRGB_PixelsLeftRightDown);
 
                 const int merge_length = vis_config->merge_kernel_size[0] * vis_config->merge_kernel_size[1];
                 image.emb_vec_number = image.grid_width * image.grid_height / merge_length;
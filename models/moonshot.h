@@ -118,6 +118,7 @@ namespace chatllm::kimi::vit
         InitContext _ctx; // weight context
         std::string model_gpu_layers;
         const int n_threads;
+        MediaEmbeddingCacheBinding media_cache;
     public:
         Config vis_config;
     };
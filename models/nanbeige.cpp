@@ -81,12 +81,19 @@ namespace chatllm::nanbeige
         size_t write_cache_data(const void *buffer, size_t buffer_size) override;
 
         ggml::tensor *forward(ComputeContext *ctx, ggml::tensor *hidden_states, int n_past) override;
+
+        void before_eval(ComputeContext *ctx) override;
+        void after_eval(ComputeContext *ctx) override;
     public:
         ggml::tensor *k_cache;
         ggml::tensor *v_cache;
     protected:
+        // swap caches (and states bound to them) with `attention`, calling it twice restores
+        void swap_with_attention(void);
+
         Block * const onto;
         KVCacheAttention * const attention;
+        KVCacheAttention::RuntimeState state;
     };
 
     LoopedLayer::LoopedLayer(InitContext *ctx, Block *layer_onto, KVCacheAttention *attention):
@@ -96,6 +103,14 @@ namespace chatllm::nanbeige
         onto(layer_onto),
         attention(attention)
     {
+        state.compressor = attention->new_compressor();
+    }
+
+    void LoopedLayer::swap_with_attention(void)
+    {
+        std::swap(attention->k_cache, k_cache);
+        std::swap(attention->v_cache, v_cache);
+        attention->swap_runtime_state(state);
     }
 
     int64_t LoopedLayer::get_param_num(bool effective_only) const
@@ -105,18 +120,24 @@ namespace chatllm::nanbeige
 
     ggml::tensor *LoopedLayer::forward(ComputeContext *ctx, ggml::tensor *hidden_states, int n_past)
     {
-        ggml::tensor *k_bak = attention->k_cache;
-        ggml::tensor *v_bak = attention->v_cache;
-
-        attention->k_cache = k_cache;
-        attention->v_cache = v_cache;
-
+        swap_with_attention();
         auto r = onto->forward(ctx, hidden_states, n_past);
+        swap_with_attention();
+        return r;
+    }
 
-        attention->k_cache = k_bak;
-        attention->v_cache = v_bak;
+    void LoopedLayer::before_eval(ComputeContext *ctx)
+    {
+        swap_with_attention();
+        attention->before_eval(ctx);
+        swap_with_attention();
+    }
 
-        return r;
+    void LoopedLayer::after_eval(ComputeContext *ctx)
+    {
+        swap_with_attention();
+        attention->after_eval(ctx);
+        swap_with_attention();
     }
 
     size_t LoopedLayer::read_cache_data(void *buffer, size_t buffer_size) const
@@ -235,6 +256,15 @@ namespace chatllm::nanbeige
             }
         }
 
+        void after_eval(ComputeContext *ctx) override
+        {
+            Base::after_eval(ctx);
+            for (auto &layer : looped_layers)
+            {
+                layer.after_eval(ctx);
+            }
+        }
+
         void set_ctx(int n_ctx) override
         {
             Base::set_ctx(n_ctx);
@@ -262,6 +262,7 @@ namespace chatllm::neochat::vit
         std::unique_ptr<FlowMatchingModules> fm_modules;
         TensorGraphEvaluator eval;
         InitContext _ctx;
+        MediaEmbeddingCacheBinding media_cache;
     public:
         Config vis_config;
     };
@@ -269,7 +270,8 @@ namespace chatllm::neochat::vit
     VisualEmbeddingGeneration::VisualEmbeddingGeneration(const RuntimeConfig &runtime_config, int max_llm_tokens, size_t GRAPH_SIZE):
         max_llm_tokens(max_llm_tokens),
         eval(runtime_config, "vis", GRAPH_SIZE),
-        _ctx(eval.get_backend_context())
+        _ctx(eval.get_backend_context()),
+        media_cache(runtime_config)
     {
         _ctx.cache_dtype = runtime_config.cache_type;
     }
@@ -286,6 +288,7 @@ namespace chatllm::neochat::vit
     {
         if (vis_embedding.get())
         {
+            media_cache.bind(loader);
             loader.push_allocator_manager(eval.get_layer_allocators());
             vis_embedding->load("vision.embeddings.", &loader);
                fm_modules->load("fm_modules.", &loader);
@@ -339,7 +342,9 @@ namespace chatllm::neochat::vit
 
         for (auto &image : tok->media_emb)
         {
-            run_embedding_model(gen_config, tok, dtype, image, buf);
+            media_cache.encode(image, dtype, buf, [&](std::vector<uint8_t> &output) {
+                return run_embedding_model(gen_config, tok, dtype, image, output);
+            });
         }
     }
 
@@ -1291,6 +1296,8 @@ namespace chatllm::neochat
                 }
 
                 curr_input_ids.push_back(next_token_id);
+                if (performance)
+                    performance->TokenGenerated();
 
                 int pop_output = 0;
                 int keep_idx = 0;
@@ -1385,6 +1392,8 @@ namespace chatllm::neochat
                 }
 
                 curr_input_ids.push_back(next_token_id);
+                if (performance)
+                    performance->TokenGenerated();
 
                 int pop_output = 0;
                 int keep_idx = 0;
@@ -1767,16 +1776,11 @@ namespace chatllm::neochat
 
                 vision::image_load(piece.content.c_str(), pixels, w, h, patch_size, vision::PaddingMode::Black);
 
-                std::vector<float> scaled;
-                vision::image_rescale(pixels, scaled);
-
-                vision::image_normalize(scaled, vis_config->image_mean, vis_config->image_std);
-
                 tok->media_emb.push_back({.grid_width = w / patch_size, .grid_height = h / patch_size, .patch_size = patch_size, .data = {}});
 
                 auto &image = tok->media_emb.back();
 
-                vision::image_arrange(scaled, w, patch_size, image.data, vision::PatchesFormat::PatchesLeftRightDown_ChannelsRGB_PixelsLeftRightDown);
+                vision::image_to_patches(pixels, w, patch_size, vis_config->image_mean, vis_config->image_std, image.data, vision::PatchesFormat::PatchesLeftRightDown_ChannelsRGB_PixelsLeftRightDown);
 
                 const int merge_length = vis_config->merge_size * vis_config->merge_size;
                 image.emb_vec_number = image.grid_width * image.grid_height / merge_length;
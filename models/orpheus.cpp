@@ -423,15 +423,58 @@ namespace chatllm::orpheus::tts
         }
     }
 
+    // passes vocoder tokens to the decoder as they are generated
+    class VocoderStreamer : public BaseStreamer
+    {
+    public:
+        VocoderStreamer(std::function<void (int id)> on_token)
+            : BaseStreamer(nullptr), on_token(on_token)
+        {}
+
+        void put(const std::vector<int> &output_ids) override
+        {
+            for (auto id : output_ids)
+                on_token(id);
+        }
+
+        void put_chunk(bool first, const std::string &chunk) override {}
+        void put_thought_chunk(bool first, const std::string &chunk) override {}
+        void end_thought(void) override {}
+        void putln(const std::string &line, TextType type = TextType::META) override {}
+    protected:
+        std::function<void (int id)> on_token;
+    };
+
     void ConditionalGeneration::speech_synthesis(const GenerationConfig &gen_config, const std::vector<int> &input_ids,
-        std::vector<int16_t> &audio, int &sample_rate, int &channels)
+        std::vector<int16_t> &audio, int &sample_rate, int &channels,
+        BaseStreamer *streamer, ModelPerfInfo *performance)
     {
         channels = 1;
         sample_rate = codec_config.sampling_rate;
 
+        std::vector<float> pcm_samples;
+        reset_decoder();
+
+        // each complete frame yields 2048 samples (the middle of the 4-frame window)
+        auto push_token = [&](int id)
+        {
+            if (id < custom_token_start || id > custom_token_end) return;
+
+            decoder_push_llm_tok_id(gen_config, id - custom_token_start, pcm_samples);
+            if (pcm_samples.size() == 8192)
+            {
+                const size_t start = audio.size();
+                for (int i = 2048; i < 4096; i++)
+                    audio.push_back((int16_t)pcm_samples[i]);
+                if (streamer)
+                    streamer->put_audio(audio.data() + start, (int)(audio.size() - start), sample_rate, channels);
+            }
+        };
+
         #if (1)
         bool completed = false;
-        auto tokens = generate(input_ids, gen_config, false, completed, nullptr, nullptr);
+        VocoderStreamer vocoder(push_token);
+        auto tokens = generate(input_ids, gen_config, false, completed, performance, &vocoder);
         ggml::log(GGML_LOG_LEVEL_INFO, "%zd vocoder tokens generated.", tokens.size());
         #else
         const int tokens[] = {
@@ -440,22 +483,10 @@ namespace chatllm::orpheus::tts
             140434, 141779, 146818, 151174, 153071, 128462, 135292, 139988, 140932, 147580, 150555, 153377, 128656, 134763, 138225, 141740, 146157, 150111, 154120, 131284, 134350, 138036, 140604, 145911, 149629, 154964, 130966, 135097, 137509, 144121, 147385, 152376, 156807, 131284, 133623, 139263, 140715, 145911, 149629, 154208, 129221, 132464, 136554, 142574, 145911, 149075, 154612, 129221, 133623, 137139,
             143025, 145911, 152494, 156041, 132028, 134350, 137769, 142925, 147609, 152409, 154168, 131132, 135926, 140025, 142972, 147153, 150765, 152951
         };
-        #endif
-
-        std::vector<float> pcm_samples;
-        reset_decoder();
 
         for (auto id : tokens)
-        {
-            if (id < custom_token_start || id > custom_token_end) continue;
-
-            decoder_push_llm_tok_id(gen_config, id - custom_token_start, pcm_samples);
-            if (pcm_samples.size() == 8192)
-            {
-                for (int i = 2048; i < 4096; i++)
-                    audio.push_back((int16_t)pcm_samples[i]);
-            }
-        }
+            push_token(id);
+        #endif
     }
 
     void ConditionalGeneration::set_additional_args(const std::map<std::string, std::string> &args)
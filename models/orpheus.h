@@ -161,7 +161,8 @@ namespace chatllm::orpheus::tts
         void load(ModelLoader &loader) override;
 
         void speech_synthesis(const GenerationConfig &gen_config, const std::vector<int> &input_ids,
-            std::vector<int16_t> &audio, int &sample_rate, int &channels) override;
+            std::vector<int16_t> &audio, int &sample_rate, int &channels,
+            BaseStreamer *streamer = nullptr, ModelPerfInfo *performance = nullptr) override;
 
         void set_additional_args(const std::map<std::string, std::string> &args) override;
 
@@ -311,7 +311,7 @@ namespace chatllm::ouro
 
         bool generate_next_token(const std::vector<int> &input_ids, const GenerationConfig &gen_config, std::vector<float> &lm_logits) override
         {
-            int batch = batch_input > 1 ? batch_input : 1;
+            int batch = get_input_batch_size();
 
             const int *p = input_ids.data();
             int remain = (int)input_ids.size();
@@ -635,7 +635,8 @@ namespace chatllm::oute::tts_llama
         }
 
         void speech_synthesis(const GenerationConfig &gen_config, const std::vector<int> &input_ids,
-            std::vector<int16_t> &audio, int &sample_rate, int &channels) override
+            std::vector<int16_t> &audio, int &sample_rate, int &channels,
+            BaseStreamer *streamer = nullptr, ModelPerfInfo *performance = nullptr) override
         {
             channels = 1;
             sample_rate = codec.config.sampling_rate;
@@ -643,13 +644,18 @@ namespace chatllm::oute::tts_llama
             Tokenizer *tok = dynamic_cast<Tokenizer *>(tokenizer);
 
             bool completed = false;
-            auto tokens = generate(input_ids, gen_config, false, completed, nullptr, nullptr);
+            auto tokens = generate(input_ids, gen_config, false, completed, performance, nullptr);
             ggml::log(GGML_LOG_LEVEL_INFO, "%zd vocoder tokens generated.", tokens.size());
 
+            const size_t start = audio.size();
             generate_audio(gen_config, codec,
                 tok->c1_0_token_id, tok->c1_0_token_id + codec.config.codebook_size - 1,
                 tok->c2_0_token_id, tok->c2_0_token_id + codec.config.codebook_size - 1,
                 tokens, audio);
+
+            // DAC is not causal: the whole utterance is decoded at once
+            if (streamer && (audio.size() > start))
+                streamer->put_audio(audio.data() + start, (int)(audio.size() - start), sample_rate, channels);
         }
 
         void set_additional_args(const std::map<std::string, std::string> &args) override
@@ -721,7 +727,8 @@ namespace chatllm::oute::tts_qwen3
         }
 
         void speech_synthesis(const GenerationConfig &gen_config, const std::vector<int> &input_ids,
-            std::vector<int16_t> &audio, int &sample_rate, int &channels) override
+            std::vector<int16_t> &audio, int &sample_rate, int &channels,
+            BaseStreamer *streamer = nullptr, ModelPerfInfo *performance = nullptr) override
         {
             channels = 1;
             sample_rate = codec.config.sampling_rate;
@@ -729,13 +736,17 @@ namespace chatllm::oute::tts_qwen3
             Tokenizer *tok = dynamic_cast<Tokenizer *>(tokenizer);
 
             bool completed = false;
-            auto tokens = generate(input_ids, gen_config, false, completed, nullptr, nullptr);
+            auto tokens = generate(input_ids, gen_config, false, completed, performance, nullptr);
             ggml::log(GGML_LOG_LEVEL_INFO, "%zd vocoder tokens generated.", tokens.size());
 
+            const size_t start = audio.size();
             tts_llama::ConditionalGeneration::generate_audio(gen_config, codec,
                 tok->c1_0_token_id, tok->c1_0_token_id + codec.config.codebook_size - 1,
                 tok->c2_0_token_id, tok->c2_0_token_id + codec.config.codebook_size - 1,
                 tokens, audio);
+
+            if (streamer && (audio.size() > start))
+                streamer->put_audio(audio.data() + start, (int)(audio.size() - start), sample_rate, channels);
         }
 
         void set_additional_args(const std::map<std::string, std::string> &args) override
@@ -1317,7 +1317,8 @@ namespace chatllm::qwen::vit
         GRAPH_SIZE(GRAPH_SIZE), _ctx(&backend_context),
         n_threads(runtime_config.n_threads),
         vis_config(),
-        max_patches(max_patches)
+        max_patches(max_patches),
+        media_cache(runtime_config)
     {
         _ctx.cache_dtype = runtime_config.cache_type;
         model_gpu_layers = BackendContext::get_ngl_of_model(runtime_config.model_gpu_layers, "vis");
@@ -1327,6 +1328,7 @@ namespace chatllm::qwen::vit
     {
         if (vis_model.get())
         {
+            media_cache.bind(loader);
             loader.push_allocator_manager(&backend_context.layer_allocators);
             vis_model->load("visual.", &loader);
             loader.pop_allocator_manager();
@@ -1423,7 +1425,9 @@ namespace chatllm::qwen::vit
 
         for (auto &image : tok->media_emb)
         {
-            run_model(gen_config, tok, dtype, image, buf);
+            media_cache.encode(image, dtype, buf, [&](std::vector<uint8_t> &output) {
+                return run_model(gen_config, tok, dtype, image, output);
+            });
         }
     }
 
@@ -1745,11 +1749,6 @@ namespace chatllm::qwen::v2_5_vl
         const int patch_size = vis_config->patch_size;
         if ((w <= 0) || (h <= 0)) return false;
 
-        std::vector<float> scaled;
-        vision::image_rescale(pixels, scaled);
-
-        vision::image_normalize(scaled, vis_config->image_mean, vis_config->image_std);
-
         tok->media_emb.push_back({.grid_width = w / patch_size, .grid_height = h / patch_size, .patch_size = patch_size, .data = {}});
 
         auto &image = tok->media_emb.back();
@@ -1760,14 +1759,11 @@ namespace chatllm::qwen::v2_5_vl
         // # Reorder dimensions to group grid and patch information for subsequent flattening.
         // # (batch, grid_t, grid_h, grid_w, merge_h, merge_w, channel, temp_patch_size, patch_h, patch_w)
 
-        vision::image_arrange(scaled, w, patch_size, image.data, vision::PatchesFormat::PatchesLeftRightDown_MergeN_ChannelsRGB_PixelsLeftRightDown);
+        vision::image_to_patches(pixels, w, patch_size, vis_config->image_mean, vis_config->image_std, image.data, vision::PatchesFormat::PatchesLeftRightDown_MergeN_ChannelsRGB_PixelsLeftRightDown);
 
         {
-            std::vector<float> scaled;
             std::vector<float> data;
-            vision::image_rescale(pixels2, scaled);
-            vision::image_normalize(scaled, vis_config->image_mean, vis_config->image_std);
-            vision::image_arrange(scaled, w, patch_size, data, vision::PatchesFormat::PatchesLeftRightDown_MergeN_ChannelsRGB_PixelsLeftRightDown);
+            vision::image_to_patches(pixels2, w, patch_size, vis_config->image_mean, vis_config->image_std, data, vision::PatchesFormat::PatchesLeftRightDown_MergeN_ChannelsRGB_PixelsLeftRightDown);
 
             image.data.insert(image.data.end(), data.begin(), data.end());
         }
@@ -1825,7 +1821,7 @@ namespace chatllm::qwen::v2_5_vl
             {
                 CHATLLM_CHECK(vit_loaded) << "Vision model not loaded";
 
-                auto video = new vision::VideoLoader(piece.content.c_str(), (float)tok->fps, tok->video_max_frames);
+                std::unique_ptr<vision::VideoLoader> video(new vision::VideoLoader(piece.content.c_str(), (float)tok->fps, tok->video_max_frames));
                 if (video->frames.size() < 1)
                     continue;
 
@@ -2367,7 +2363,8 @@ namespace chatllm::qwen::v3_vl::vit
     VisualEmbeddingGeneration::VisualEmbeddingGeneration(const RuntimeConfig &runtime_config, int max_llm_tokens, size_t GRAPH_SIZE):
         max_llm_tokens(max_llm_tokens),
         eval(runtime_config, "vis", GRAPH_SIZE),
-        _ctx(eval.get_backend_context())
+        _ctx(eval.get_backend_context()),
+        media_cache(runtime_config)
     {
         _ctx.cache_dtype = runtime_config.cache_type;
     }
@@ -2376,6 +2373,7 @@ namespace chatllm::qwen::v3_vl::vit
     {
         if (vis_model.get())
         {
+            media_cache.bind(loader);
             loader.push_allocator_manager(eval.get_layer_allocators());
             vis_model->load("visual.", &loader);
             loader.pop_allocator_manager();
@@ -2454,7 +2452,9 @@ namespace chatllm::qwen::v3_vl::vit
 
         for (auto &image : tok->media_emb)
         {
-            run_model(gen_config, tok, dtype, image, buf);
+            media_cache.encode(image, dtype, buf, [&](std::vector<uint8_t> &output) {
+                return run_model(gen_config, tok, dtype, image, output);
+            });
         }
     }
 
@@ -2964,10 +2964,11 @@ namespace chatllm::qwen::v3_asr
     {
     public:
         typedef v1::ChatHistoryEncoder Base;
+        void append_user(int round_idx, const std::string &user, std::vector<int> &ids) const override;
         void append_user(int round_idx, const Content &user, std::vector<int> &ids) const override;
         void append_ai_opening(int round_idx, std::vector<int> &ids) const override;
     protected:
-        void load_audio(const Content &user) const;
+        void load_audio(int round_idx, const Content &user) const;
     public:
         const v3::audio_tower::Config *aud_config = nullptr;
         bool aud_loaded = false;
@@ -2982,12 +2983,19 @@ namespace chatllm::qwen::v3_asr
         Tokenizer(const BaseConfig &config, BaseHistoryEncoder *encoder);
         void add_tokens(const std::map<std::string, int> &added_tokens);
         std::string normalize_lang(const std::string &s) const;
+
+        std::vector<int> encode_history(const Messages &history, int max_length,
+                                        const bool incremental = false,
+                                        const bool ai_opening = true,
+                                        const bool reversed_role = false) override;
     public:
         int asr_text_token_id;
         int timestamp_token_id;
         std::string language = "auto";
         std::string format   = "srt";
         std::string delimiter = "";
+        std::vector<audio::mel> stream_windows;     // see `ConditionalGeneration::append_audio_snippet`
+        std::map<int, std::vector<audio::mel>> round_windows;   // streamed windows kept with the latest user message
     };
 
     Tokenizer::Tokenizer(const BaseConfig &config):
@@ -3029,6 +3037,8 @@ namespace chatllm::qwen::v3_asr
         void before_generate(const GenerationConfig &gen_config) override;
         void set_tokenizer(BaseTokenizer *tokenizer) override;
         std::string normalize_lang(const std::string &s) const;
+        int append_audio_snippet(const int16_t *pcm_samples, int sample_rate, int sample_num, int channel_num = 1) override;
+        void clear_audio_snippets(void) override;
     public:
         v3::audio_tower::AudioEmbeddingGeneration audio;
     private:
@@ -3036,6 +3046,7 @@ namespace chatllm::qwen::v3_asr
         std::map<std::string, int> added_tokens;
         bool aud_loaded = false;
         std::map<std::string, std::string> support_languages;
+        std::unique_ptr<audio::MelStream> mel_stream;
     };
 
     ConditionalGeneration::ConditionalGeneration(const Config &config, const RuntimeConfig &runtime_config,
@@ -3066,6 +3077,65 @@ namespace chatllm::qwen::v3_asr
         return support_languages.count(l) > 0 ? support_languages.find(l)->second : "";
     }
 
+    // streaming: mel features are computed as snippets arrive, and every `n_window_infer` frames
+    // (the attention window of the audio encoder) are queued as a window. Queued windows are
+    // transcribed by the next user input, and kept with it. `sample_num == 0` ends the stream.
+    int ConditionalGeneration::append_audio_snippet(const int16_t *pcm_samples, int sample_rate, int sample_num, int channel_num)
+    {
+        Tokenizer *tok = dynamic_cast<Tokenizer *>(tokenizer);
+        const auto &cfg = audio.config;
+
+        CHATLLM_CHECK(aud_loaded) << "Audio model not loaded";
+        CHATLLM_CHECK(sample_rate == cfg.sampling_rate) << "sample rate must be " << cfg.sampling_rate;
+        CHATLLM_CHECK(channel_num >= 1) << "invalid channel number: " << channel_num;
+
+        if (!mel_stream)
+            mel_stream.reset(new audio::MelStream(cfg.sampling_rate, cfg.feature_size, cfg.n_fft, cfg.hop_length));
+
+        const int window = (cfg.n_window_infer > 0) && (cfg.n_window_infer % (cfg.n_window * 2) == 0) ?
+                            cfg.n_window_infer : cfg.n_window * 2;
+
+        if (sample_num > 0)
+        {
+            std::vector<float> samples(sample_num);
+            for (int i = 0; i < sample_num; i++)
+            {
+                int sum = 0;
+                for (int c = 0; c < channel_num; c++)
+                    sum += pcm_samples[i * channel_num + c];
+                samples[i] = (float)sum / (32768.0f * channel_num);
+            }
+            mel_stream->append(samples.data(), sample_num);
+        }
+        else
+            mel_stream->flush();
+
+        while (mel_stream->available() >= window)
+        {
+            tok->stream_windows.emplace_back();
+            mel_stream->take(window, tok->stream_windows.back());
+        }
+
+        if (sample_num <= 0)
+        {
+            if (mel_stream->available() > 0)
+            {
+                tok->stream_windows.emplace_back();
+                mel_stream->take(v3::audio_tower::pad_mel_len((int)mel_stream->available()), tok->stream_windows.back());
+            }
+            mel_stream.reset();
+        }
+
+        return (int)tok->stream_windows.size();
+    }
+
+    void ConditionalGeneration::clear_audio_snippets(void)
+    {
+        Tokenizer *tok = dynamic_cast<Tokenizer *>(tokenizer);
+        mel_stream.reset();
+        tok->stream_windows.clear();
+    }
+
     void ConditionalGeneration::set_additional_args(const std::map<std::string, std::string> &args)
     {
         Tokenizer *tok = dynamic_cast<Tokenizer *>(tokenizer);
@@ -3129,7 +3199,42 @@ namespace chatllm::qwen::v3_asr
         Backend::write_tensor_data(emb->weight, buf.data(), offset, buf.size());
     }
 
-    void ChatHistoryEncoder::load_audio(const Content &user) const
+    // queued windows belong to the latest user message, and are kept with it, so that re-encoding
+    // the history (e.g. after running out of context) transcribes them again.
+    //
+    // Windows of earlier rounds are already in the KV cache once a later round is encoded, and are released,
+    // so memory is bounded by the audio streamed between two user inputs, not by the length of the recording.
+    // The trade-off: when the history is re-encoded from scratch, earlier rounds keep their text only.
+    std::vector<int> Tokenizer::encode_history(const Messages &history, int max_length, const bool incremental,
+                                               const bool ai_opening, const bool reversed_role)
+    {
+        // messages after the cursor are new: drop windows of rounds that were cleared or rewound
+        const int cursor = history.get_cursor();
+        if (cursor < (int)history.size())
+            round_windows.erase(round_windows.lower_bound(history[cursor].round), round_windows.end());
+
+        int i = (int)history.size() - 1;
+        for (; i >= 0; i--)
+            if (history[i].role == MsgRole::User) break;
+
+        if (i >= 0)
+        {
+            const int round = history[i].round;
+            round_windows.erase(round_windows.begin(), round_windows.lower_bound(round));
+
+            if (stream_windows.size() > 0)
+            {
+                auto &windows = round_windows[round];
+                for (auto &mel : stream_windows)
+                    windows.push_back(std::move(mel));
+                stream_windows.clear();
+            }
+        }
+
+        return v2_audio::Tokenizer::encode_history(history, max_length, incremental, ai_opening, reversed_role);
+    }
+
+    void ChatHistoryEncoder::load_audio(int round_idx, const Content &user) const
     {
         Tokenizer *tok = dynamic_cast<Tokenizer *>(tokenizer);
 
@@ -3163,6 +3268,23 @@ namespace chatllm::qwen::v3_asr
             auto &media = tok->media_emb.back();
             media.data = std::move(mel.data);
         }
+
+        auto it = tok->round_windows.find(round_idx);
+        if (it != tok->round_windows.end())
+        {
+            CHATLLM_CHECK(aud_loaded) << "Audio model not loaded";
+
+            for (auto &mel : it->second)
+            {
+                tok->media_emb.push_back({.emb_vec_number = v3::audio_tower::get_feat_extract_output_lengths((int)mel.n_len), .data = mel.data});
+            }
+        }
+    }
+
+    void ChatHistoryEncoder::append_user(int round_idx, const std::string &user, std::vector<int> &ids) const
+    {
+        // plain text input, e.g. `chatllm_user_input(obj, "")`, transcribes streamed windows
+        append_user(round_idx, Content(nullptr, user), ids);
     }
 
     void ChatHistoryEncoder::append_user(int round_idx, const Content &user, std::vector<int> &ids) const
@@ -3171,7 +3293,7 @@ namespace chatllm::qwen::v3_asr
 
         tok->media_emb.clear();
 
-        load_audio(user);
+        load_audio(round_idx, user);
         tok->encode("user", ids, true, false, true);
         tok->inject_audio_ids(ids, tok->vocab_size, tok->get_image_total_emb_vectors());
         ids.push_back(tok->im_end_token_id);
@@ -3622,7 +3744,7 @@ namespace chatllm::qwen::v3_forcedaligner
         tok->cleaned_words.clear();
         tok->sentences.clear();
 
-        load_audio(user);
+        load_audio(round_idx, user);
         tok->inject_audio_ids(ids, tok->vocab_size, tok->get_image_total_emb_vectors());
 
         if (tok->delimiter.size() > 0)
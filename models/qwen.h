@@ -637,6 +637,8 @@ namespace chatllm::qwen
         public:
             Config vis_config;
             const int max_patches;
+        protected:
+            MediaEmbeddingCacheBinding media_cache;
         };
     }
 
@@ -948,6 +950,7 @@ namespace chatllm::qwen::v3_vl::vit
         std::unique_ptr<VisionTransformer> vis_model;
         TensorGraphEvaluator eval;
         InitContext _ctx; // weight context
+        MediaEmbeddingCacheBinding media_cache;
     public:
         Config vis_config;
     };
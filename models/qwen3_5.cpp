@@ -148,52 +148,6 @@ namespace chatllm::qwen::v3_5
         ggml::tensor *forward(ComputeContext *ctx, ggml::tensor *input, ggml::tensor *gate) override;
     };
 
-    class CausalConv1D : public Conv1D
-    {
-    public:
-        CausalConv1D(InitContext *ctx, int in_channels, int out_channels, int kernel_size, int stride = 1,
-               int dilation = 1, int groups = 1, bool bias = true);
-        ggml::tensor *forward(ComputeContext *ctx, ggml::tensor *input, int n_past) override;
-    protected:
-        ggml::tensor *state;
-    };
-
-    CausalConv1D::CausalConv1D(InitContext *ctx, int in_channels, int out_channels, int kernel_size, int stride,
-        int dilation, int groups, bool bias):
-        Conv1D(ctx, in_channels, out_channels, kernel_size, stride, 0, dilation, groups, bias),
-        state(ggml::new_tensor_2d(ctx, ggml::type::GGML_TYPE_F32, kernel_size - 1, in_channels))
-    {
-        ctx->get_allocator()->alloc(state);
-    }
-
-    ggml::tensor *CausalConv1D::forward(ComputeContext *ctx, ggml::tensor *input, int n_past)
-    {
-        const int kernel_size = ggml::get_dim(state, 0) + 1;
-
-        if (n_past < 1)
-        {
-            auto clear = ggml::scale(ctx, state, 0.0f);
-            ggml::build_forward_expand(ctx, clear);
-        }
-
-        input = ggml::concat(ctx, state, input, 0);
-        {
-            const int hist_size = kernel_size - 1;
-            const int offset = ggml::get_dim(input, 0) - hist_size;
-            auto hist = ggml::view_3d(ctx, input, hist_size, ggml::get_dim(input, 1), ggml::get_dim(input, 2),
-                ggml::row_size(input),
-                ggml::row_size(input) * ggml::get_dim(input, 1),
-                ggml::element_size(input) * offset);
-            auto v = ggml::cpy(ctx, hist, state);
-            ggml::build_forward_expand(ctx, v);
-        }
-
-        auto out = Conv1D::forward(ctx, input);
-        out = ggml::act(ctx, ActFunc::SILU, out);
-
-        return out;
-    }
-
     class QwenGatedDeltaNet : public Block
     {
     public:
@@ -201,6 +155,12 @@ namespace chatllm::qwen::v3_5
         int64_t get_param_num(bool effective_only) const override;
         ggml::tensor *forward(ComputeContext *ctx, ggml::tensor *input, int n_past) override;
         void load(const std::string &path, TensorLoader *loader) override;
+
+        // cache: the recurrent state, then the conv state
+        size_t get_cache_size(void) const override;
+        void   set_cache_buffer(BackendBuffer *buffer) override;
+        size_t read_cache_data(void *buffer, size_t buffer_size) const override;
+        size_t write_cache_data(const void *buffer, size_t buffer_size) override;
     protected:
         ggml::tensor *causal_conv1d_update(ComputeContext *ctx, ggml::tensor *input, int n_past);
         ggml::tensor *recurrent_gated_delta_rule(ComputeContext *ctx, ggml::tensor *query, ggml::tensor *key, ggml::tensor *value,
@@ -280,8 +240,8 @@ namespace chatllm::qwen::v3_5
         key_dim(key_head_dim * num_key_heads),
         value_dim(value_head_dim * num_value_heads),
         num_v_heads(num_value_heads), num_k_heads(num_key_heads),
-        state(ggml::new_tensor_3d(ctx, ggml::type::GGML_TYPE_F16, head_v_dim, head_k_dim, num_v_heads)),
-        conv1d(ctx, key_dim * 2 + value_dim, key_dim * 2 + value_dim, conv_kernel_dim, 1, 1, key_dim * 2 + value_dim, false),
+        state(ggml::new_tensor_3d(ctx, ggml::type::GGML_TYPE_F32, head_v_dim, head_k_dim, num_v_heads)),
+        conv1d(ctx, key_dim * 2 + value_dim, key_dim * 2 + value_dim, conv_kernel_dim, 1, key_dim * 2 + value_dim, false),
         dt_bias(ggml::new_tensor_1d(ctx, ggml::type::GGML_TYPE_F32, num_value_heads)),
         A_log(ggml::new_tensor_1d(ctx, ggml::type::GGML_TYPE_F32, num_value_heads)),
         norm(ctx, head_v_dim, 1e-6f),
@@ -291,10 +251,30 @@ namespace chatllm::qwen::v3_5
         in_proj_b(ctx, hidden_size, num_value_heads, false),
         in_proj_a(ctx, hidden_size, num_value_heads, false)
     {
-        ctx->get_allocator()->alloc(state);
         ggml::set_name(state, "QwenGatedDeltaNet::state");
     }
 
+    size_t QwenGatedDeltaNet::get_cache_size(void) const
+    {
+        return ggml::nbytes(state) + conv1d.get_cache_size();
+    }
+
+    void QwenGatedDeltaNet::set_cache_buffer(BackendBuffer *buffer)
+    {
+        buffer->assign_to(state);
+        buffer->assign_to(conv1d.state, ggml::nbytes(state));
+    }
+
+    size_t QwenGatedDeltaNet::read_cache_data(void *buffer, size_t buffer_size) const
+    {
+        return read_cache_tensors({state, conv1d.state}, buffer, buffer_size);
+    }
+
+    size_t QwenGatedDeltaNet::write_cache_data(const void *buffer, size_t buffer_size)
+    {
+        return write_cache_tensors({state, conv1d.state}, buffer, buffer_size);
+    }
+
     int64_t QwenGatedDeltaNet::get_param_num(bool effective_only) const
     {
         int64_t r = 0;
@@ -335,6 +315,7 @@ namespace chatllm::qwen::v3_5
         mixed_qkv = ggml::permute(ctx, mixed_qkv, 1, 0);
 
         mixed_qkv = conv1d.forward(ctx, mixed_qkv, n_past);
+        mixed_qkv = ggml::act(ctx, ActFunc::SILU, mixed_qkv);
         mixed_qkv = ggml::permute(ctx, mixed_qkv, 1, 0);
 
         return mixed_qkv;
@@ -351,71 +332,24 @@ namespace chatllm::qwen::v3_5
             key   = ggml::norm_p2(ctx, key,   1e-6f);
         }
 
-        auto reshape = [](ComputeContext *ctx, ggml::tensor *x) {
-            auto t = ggml::permute(ctx, x, 0, 2, 1);
-            t = ggml::cont(ctx, t);
-            return t;
-        };
-
-        auto get_t = [](ComputeContext *ctx, ggml::tensor *x, int t) {
-            auto r = ggml::view_2d(ctx, x, ggml::get_dim(x, 0), ggml::get_dim(x, 2),
-                ggml::row_size(x) * ggml::get_dim(x, 1),
-                ggml::row_size(x) * t);
-            return r;
-        };
-
-        query = reshape(ctx, query);
-        key   = reshape(ctx, key);
-        value = reshape(ctx, value);
-        // beta  = reshape(ctx, beta);
-        // g     = reshape(ctx, g);
+        const int64_t dk      = ggml::get_dim(key,   0);
+        const int64_t dv      = ggml::get_dim(value, 0);
+        const int64_t n_heads = ggml::get_dim(value, 1);
+        const int64_t qlen    = ggml::get_dim(value, 2);
 
-        const int sequence_length   = (int)ggml::get_dim(key, 1);
-
-        const float scale = 1.0f / sqrtf((float)ggml::get_dim(query, 0));
-        query = ggml::scale(ctx, query, scale);
-
-        auto last_state = state;
-        std::vector<ggml::tensor *> attn_outs;
-
-        for (int i = 0; i < sequence_length; i++)
-        {
-            auto q_t    = get_t(ctx, query, i);
-            auto k_t    = get_t(ctx, key,   i);
-            auto v_t    = get_t(ctx, value, i);
-            auto g_t    = get_t(ctx, g,     i);
-            auto beta_t = get_t(ctx, beta,  i);
-
-            g_t     = ggml::exp(ctx, g_t);
-            g_t     = ggml::reshape(ctx, g_t, 1, 1, ggml::get_dim(g_t,    0), ggml::get_dim(g_t, 1));
-            beta_t  = ggml::reshape(ctx, beta_t, 1, ggml::get_dim(beta_t, 0), ggml::get_dim(beta_t, 1));
-            k_t     = ggml::reshape(ctx, k_t,    1, ggml::get_dim(k_t,    0), ggml::get_dim(k_t,    1), ggml::get_dim(k_t,    2));
-            q_t     = ggml::reshape(ctx, q_t,    1, ggml::get_dim(q_t,    0), ggml::get_dim(q_t,    1), ggml::get_dim(q_t,    2));
-
-            last_state   = ggml::mul(ctx, last_state,   g_t);
-            auto kv_mem  = ggml::mul(ctx, last_state,   k_t);
-            kv_mem       = ggml::sum(ctx, kv_mem,       1);
-            auto delta   = ggml::sub(ctx, v_t,          kv_mem);
-            delta        = ggml::mul(ctx, delta,        beta_t);
-            delta        = ggml::reshape(ctx, delta,    ggml::get_dim(delta, 0), 1, ggml::get_dim(delta, 1), ggml::get_dim(delta, 2));
-            k_t          = ggml::repeat(ctx, k_t, ggml::get_dim(delta, 0));
-            delta        = ggml::mul(ctx, k_t,          delta);
-            last_state   = ggml::add(ctx, last_state,   delta);
-
-            auto attn_t  = ggml::mul(ctx, last_state,   q_t);
-            attn_t       = ggml::sum(ctx, attn_t,       1);
-            attn_t       = ggml::reshape(ctx, attn_t,   ggml::get_dim(attn_t, 0), 1, ggml::get_dim(attn_t, 1), ggml::get_dim(attn_t, 2));
-
-            attn_outs.push_back(attn_t);
-        }
+        CHATLLM_CHECK(dk == dv) << "gated delta rule: dk (" << dk << ") != dv (" << dv << ") not supported";
 
-        ggml::build_forward_expand(ctx, ggml::cpy(ctx, last_state, state));
+        // query is scaled by the op
+        g    = ggml::reshape(ctx, g,    1, n_heads, qlen);
+        beta = ggml::reshape(ctx, beta, 1, n_heads, qlen);
+        ggml::tensor *r = ggml::gated_delta_net(ctx, query, key, value, g, beta, state);
 
-        ggml::tensor *core_attn_out = ggml::concat(ctx, attn_outs, 1);
-        core_attn_out = ggml::permute(ctx, core_attn_out, 0, 2, 1, 3);
-        core_attn_out = ggml::cont(ctx, core_attn_out);
+        // outputs ([dv, n_heads, qlen]), followed by the new state
+        const size_t es = ggml::element_size(r);
+        auto new_state = ggml::view_3d(ctx, r, dv, dk, n_heads, es * dv, es * dv * dk, es * dv * n_heads * qlen);
+        ggml::build_forward_expand(ctx, ggml::cpy(ctx, new_state, state));
 
-        return core_attn_out;
+        return ggml::view_3d(ctx, r, dv, n_heads, qlen, es * dv, es * dv * n_heads, 0);
     }
 
     ggml::tensor *QwenGatedDeltaNet::forward(ComputeContext *ctx, ggml::tensor *input, int n_past)
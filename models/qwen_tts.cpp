@@ -178,43 +178,17 @@ namespace chatllm::qwen::tts
         int out_channels,
         int kernel_size,
         int dilation,
-        int stride,
-        int groups):
-        Block(),
-        kernel_size((kernel_size - 1) * dilation + 1),
-        stride(stride),
-        padding(this->kernel_size - this->stride),
-        conv(ctx, in_channels, out_channels, kernel_size, stride, 0, dilation, groups)
-    {
-    }
-
-    ggml::tensor *Qwen3TTSTokenizerV2CausalConvNet::forward(ComputeContext *ctx, ggml::tensor *input)
+        int groups,
+        int max_batch):
+        CausalConv1D(ctx, in_channels, out_channels, kernel_size, dilation, groups, true, max_batch)
     {
-        auto _get_extra_padding_for_conv1d = [this](ggml::tensor *hidden_state)
-        {
-            int length = ggml::get_dim(hidden_state, 0);
-            double n_frames = (double)(length - kernel_size + padding) / stride + 1;
-            int ideal_length = ((int)std::ceil(n_frames) - 1) * stride + (kernel_size - padding);
-            return ideal_length - length;
-        };
-
-        auto extra_padding = _get_extra_padding_for_conv1d(input);
-        auto hidden_state = ggml::pad(ctx, input, padding, extra_padding);
-
-        hidden_state = conv.forward(ctx, hidden_state);
-        return hidden_state;
-    }
-
-    int64_t Qwen3TTSTokenizerV2CausalConvNet::get_param_num(bool effective_only) const
-    {
-        int64_t r = 0;
-        r += conv.get_param_num(effective_only);
-        return r;
+        if (get_cache_size() > 0)
+            set_cache_buffer(ctx->get_allocator()->alloc(get_cache_size(), BackendBufAllocator::Usage::Matrix));
     }
 
     void Qwen3TTSTokenizerV2CausalConvNet::load(const std::string &path, TensorLoader *loader)
     {
-        conv.load(path + "conv.", loader);
+        CausalConv1D::load(path + "conv.", loader);
     }
 
     Qwen3TTSTokenizerV2CausalTransConvNet::Qwen3TTSTokenizerV2CausalTransConvNet(InitContext *ctx,
@@ -225,25 +199,71 @@ namespace chatllm::qwen::tts
         Block(),
         left_pad(kernel_size - stride),
         right_pad(kernel_size - stride),
-        conv(ctx, in_channels, out_channels, kernel_size, stride)
+        conv(ctx, in_channels, out_channels, kernel_size, stride),
+        state(right_pad > 0 ? ggml::new_tensor_3d(ctx, ggml::type::GGML_TYPE_F32, right_pad, out_channels, 1) : nullptr)
     {
+        if (nullptr == state) return;
+        ggml::set_name(state, "trans_conv_state");
+        set_cache_buffer(ctx->get_allocator()->alloc(get_cache_size(), BackendBufAllocator::Usage::Matrix));
     }
 
     ggml::tensor *Qwen3TTSTokenizerV2CausalTransConvNet::forward(ComputeContext *ctx, ggml::tensor *input)
     {
-        CHATLLM_CHECK(ggml::get_dim(input, 0) > left_pad + right_pad);
+        return forward(ctx, input, 0);
+    }
 
+    // output samples of a frame are complete once the next frame is added, so the last `right_pad` ones
+    // are kept, and added to the head of the next output. A new sequence drops its first `left_pad` samples.
+    ggml::tensor *Qwen3TTSTokenizerV2CausalTransConvNet::forward(ComputeContext *ctx, ggml::tensor *input, int n_past)
+    {
         auto hidden_state = conv.forward(ctx, input);
+        const int64_t len = ggml::get_dim(hidden_state, 0) - right_pad;
+
+        if (state)
+        {
+            CHATLLM_CHECK(ggml::get_dim(hidden_state, 2) == 1) << "batch size must be 1";
+
+            if (n_past > 0)
+                hidden_state = ggml::add(ctx, hidden_state, ggml::pad(ctx, state, 0, (int)len));
+
+            auto tail = ggml::view_3d(ctx, hidden_state, right_pad, ggml::get_dim(hidden_state, 1), 1,
+                            ggml::row_size(hidden_state), ggml::row_size(hidden_state) * ggml::get_dim(hidden_state, 1),
+                            ggml::element_size(hidden_state) * len);
+            ggml::build_forward_expand(ctx, ggml::cpy(ctx, tail, state));
+        }
+
+        const int64_t start = n_past > 0 ? 0 : left_pad;
+        CHATLLM_CHECK(len > start) << "input too short";
         hidden_state = ggml::view_4d(ctx, hidden_state,
-            ggml::get_dim(hidden_state, 0) - left_pad - right_pad, ggml::get_dim(hidden_state, 1), ggml::get_dim(hidden_state, 2), ggml::get_dim(hidden_state, 3),
+            len - start, ggml::get_dim(hidden_state, 1), ggml::get_dim(hidden_state, 2), ggml::get_dim(hidden_state, 3),
             ggml::row_size(hidden_state),
             ggml::row_size(hidden_state) * ggml::get_dim(hidden_state, 1),
             ggml::row_size(hidden_state) * ggml::get_dim(hidden_state, 1) * ggml::get_dim(hidden_state, 2),
-            ggml::element_size(hidden_state) * left_pad);
+            ggml::element_size(hidden_state) * start);
         hidden_state = ggml::cont(ctx, hidden_state);
         return hidden_state;
     }
 
+    size_t Qwen3TTSTokenizerV2CausalTransConvNet::get_cache_size(void) const
+    {
+        return state ? ggml::nbytes(state) : 0;
+    }
+
+    void Qwen3TTSTokenizerV2CausalTransConvNet::set_cache_buffer(BackendBuffer *buffer)
+    {
+        if (state) buffer->assign_to(state);
+    }
+
+    size_t Qwen3TTSTokenizerV2CausalTransConvNet::read_cache_data(void *buffer, size_t buffer_size) const
+    {
+        return read_cache_tensors({state}, buffer, buffer_size);
+    }
+
+    size_t Qwen3TTSTokenizerV2CausalTransConvNet::write_cache_data(const void *buffer, size_t buffer_size)
+    {
+        return write_cache_tensors({state}, buffer, buffer_size);
+    }
+
     int64_t Qwen3TTSTokenizerV2CausalTransConvNet::get_param_num(bool effective_only) const
     {
         int64_t r = 0;
@@ -259,7 +279,7 @@ namespace chatllm::qwen::tts
     Qwen3TTSTokenizerV2ConvNeXtBlock::Qwen3TTSTokenizerV2ConvNeXtBlock(InitContext *ctx, int dim):
         Block(),
         act(ActFunc::GELU),
-        dwconv(ctx, dim, dim, 7, 1, 1, dim),
+        dwconv(ctx, dim, dim, 7, 1, dim),
         norm(ctx, dim),
         pwconv1(ctx, dim, dim * 4),
         pwconv2(ctx, dim * 4, dim),
@@ -268,9 +288,14 @@ namespace chatllm::qwen::tts
     }
 
     ggml::tensor *Qwen3TTSTokenizerV2ConvNeXtBlock::forward(ComputeContext *ctx, ggml::tensor *input)
+    {
+        return forward(ctx, input, 0);
+    }
+
+    ggml::tensor *Qwen3TTSTokenizerV2ConvNeXtBlock::forward(ComputeContext *ctx, ggml::tensor *input, int n_past)
     {
         auto hidden_states = input;
-        hidden_states = dwconv.forward(ctx, hidden_states);
+        hidden_states = dwconv.forward(ctx, hidden_states, n_past);
         hidden_states = ggml::permute(ctx, hidden_states, 1, 0, 2);
         hidden_states = norm.forward(ctx, hidden_states);
         hidden_states = pwconv1.forward(ctx, hidden_states);
@@ -365,11 +390,16 @@ namespace chatllm::qwen::tts
     {}
 
     ggml::tensor *Qwen3TTSTokenizerV2DecoderDecoderResidualUnit::forward(ComputeContext *ctx, ggml::tensor *input)
+    {
+        return forward(ctx, input, 0);
+    }
+
+    ggml::tensor *Qwen3TTSTokenizerV2DecoderDecoderResidualUnit::forward(ComputeContext *ctx, ggml::tensor *input, int n_past)
     {
         auto residual = input;
         auto hidden_states = input;
         hidden_states =  act1.forward(ctx, hidden_states);
-        hidden_states = conv1.forward(ctx, hidden_states);
+        hidden_states = conv1.forward(ctx, hidden_states, n_past);
         hidden_states =  act2.forward(ctx, hidden_states);
         hidden_states = conv2.forward(ctx, hidden_states);
         hidden_states = ggml::add(ctx, hidden_states, residual);
@@ -389,7 +419,7 @@ namespace chatllm::qwen::tts
     void Qwen3TTSTokenizerV2DecoderDecoderResidualUnit::load(const std::string &path, TensorLoader *loader)
     {
         conv1.load(path + "conv1.", loader);
-        conv2.load(path + "conv2.", loader);
+        conv2.load(path + "conv2.conv.", loader);
          act1.load(path + "act1.", loader);
          act2.load(path + "act2.", loader);
     }
@@ -412,6 +442,11 @@ namespace chatllm::qwen::tts
         return block.forward(ctx, input);
     }
 
+    ggml::tensor *Qwen3TTSTokenizerV2DecoderDecoderBlock::forward(ComputeContext *ctx, ggml::tensor *input, int n_past)
+    {
+        return block.forward(ctx, input, n_past);
+    }
+
     int64_t Qwen3TTSTokenizerV2DecoderDecoderBlock::get_param_num(bool effective_only) const
     {
         return block.get_param_num(effective_only);
@@ -659,7 +694,7 @@ namespace chatllm::qwen::tts
         total_upsample(get_total_upsample(config)),
         pre_transformer(ctx, config),
         quantizer(ctx, config),
-        pre_conv(ctx, config.codebook_dim, config.latent_dim, 3)
+        pre_conv(ctx, config.codebook_dim, config.latent_dim, 3, 1, 1, 0)      // stateless: it runs before the transformer
     {
         for (auto factor : config.upsampling_ratios)
         {
@@ -727,6 +762,41 @@ namespace chatllm::qwen::tts
         return wav;
     }
 
+    ggml::tensor *Qwen3TTSTokenizerV2Decoder::decode_step(ComputeContext *ctx, ggml::tensor *codes, const int context, const int n_past)
+    {
+        CHATLLM_CHECK(ggml::get_dim(codes, 1) == config.num_quantizers);
+
+        auto hidden = quantizer.forward(ctx, codes);
+        hidden = pre_conv.forward(ctx, hidden);
+
+        hidden = ggml::permute(ctx, hidden, 1, 0, 2);
+        hidden = ggml::cont(ctx, hidden);
+
+        hidden = pre_transformer.forward(ctx, hidden);
+
+        // context frames are only attended to, the convolutions continue from their caches
+        const int64_t qlen = ggml::get_dim(hidden, 1);
+        hidden = ggml::view_2d(ctx, hidden, ggml::get_dim(hidden, 0), qlen - context,
+                                ggml::row_size(hidden), context * ggml::row_size(hidden));
+        hidden = ggml::permute(ctx, hidden, 1, 0, 2);
+        hidden = ggml::cont(ctx, hidden);
+
+        hidden = upsample.forward(ctx, hidden, n_past);
+        auto wav = decoder.forward(ctx, hidden, n_past);
+        wav = ggml::clamp(ctx, wav, -1.0f, 1.0f);
+        return wav;
+    }
+
+    // frames that affect the transformer output of the next frame: each sliding-window layer looks back
+    // `sliding_window - 1` frames, and `pre_conv` (stateless) needs its history.
+    int Qwen3TTSTokenizerV2Decoder::get_stream_context(void) const
+    {
+        int r = pre_conv.history;
+        for (auto sliding : config.layer_type_sliding)
+            r += sliding ? config.sliding_window - 1 : config.max_position_embeddings;
+        return r;
+    }
+
     int64_t Qwen3TTSTokenizerV2Decoder::get_param_num(bool effective_only) const
     {
         int64_t r = 0;
@@ -1391,6 +1461,10 @@ namespace chatllm::qwen::v3_tts
             const float *past_hidden, const float *last_id_hidden);
 
         void speech_decode(const GenerationConfig &gen_config, const std::vector<int> &encoded, std::vector<float> &decoded);
+
+        // decode frames [start, end) of `encoded`, continuing from the decoder state left by frames before `start`
+        void speech_decode(const GenerationConfig &gen_config, const std::vector<int> &encoded, const int start, const int end,
+            std::vector<float> &decoded);
     protected:
         int code_predict(const GenerationConfig &gen_config, Sampler *sampler, const int *input_text_ids, const int id_num, int n_past, const int generation_step);
         int code_predict(const GenerationConfig &gen_config, Sampler *sampler, ggml::type dtype, const float *past_hidden, const float *last_id_hidden, int n_past, const int generation_step);
@@ -1427,7 +1501,8 @@ namespace chatllm::qwen::v3_tts
         void set_tokenizer(BaseTokenizer *tokenizer) override;
         void set_additional_args(const std::map<std::string, std::string> &args) override;
         void speech_synthesis(const GenerationConfig &gen_config, const std::vector<int> &input_ids,
-            std::vector<int16_t> &audio, int &sample_rate, int &channels) override;
+            std::vector<int16_t> &audio, int &sample_rate, int &channels,
+            BaseStreamer *streamer = nullptr, ModelPerfInfo *performance = nullptr) override;
 
     protected:
         void test(const GenerationConfig &gen_config, std::vector<int16_t> &audio);
@@ -1438,7 +1513,9 @@ namespace chatllm::qwen::v3_tts
             const std::string &voice_clone_prompt,
             const int language_id,
             const int speaker_id,
-            std::vector<int16_t> &audio);
+            std::vector<int16_t> &audio,
+            BaseStreamer *streamer,
+            ModelPerfInfo *performance);
         void inject_text_ids(const GenerationConfig &gen_config, const std::vector<int> &input_ids, std::vector<int> &mapped_ids);
         void inject_text_ids(const GenerationConfig &gen_config, const int *input_ids, const int num, std::vector<int> &mapped_ids);
         void map_text_ids(const GenerationConfig &gen_config, const std::vector<int> &input_ids, std::vector<int> &mapped_ids);
@@ -1476,6 +1553,7 @@ namespace chatllm::qwen::v3_tts
         int tts_eos_token_id = -1;
         int tts_pad_token_id = -1;
         int trailing_text_next_index = 0;
+        int stream_chunk = 12;
     };
 
     bool TalkerGeneration::load_more(ggml::type dtype, const json::JSON &config)
@@ -1495,7 +1573,7 @@ namespace chatllm::qwen::v3_tts
         const int text_vocab_size   = (int)p["text_vocab_size"].ToInt();
 
         const size_t tensor_ovhd = ggml_tensor_overhead();
-        const size_t num_tensors = 600; // TODO: counting tensors (this is boring)
+        const size_t num_tensors = 700; // TODO: counting tensors (this is boring)
         const size_t ctx_size = num_tensors * tensor_ovhd;
         _ctx.gctx = GGMLContext({.mem_size = ctx_size, .mem_buffer = nullptr, .no_alloc = true});
         _ctx.dtype = dtype;
@@ -1615,6 +1693,28 @@ namespace chatllm::qwen::v3_tts
         memcpy(decoded.data(), buf.data(), buf.size());
     }
 
+    void TalkerGeneration::speech_decode(const GenerationConfig &gen_config, const std::vector<int> &encoded, const int start, const int end,
+        std::vector<float> &decoded)
+    {
+        const int context = std::min(start, speech_tokenizer->decoder.get_stream_context());
+        ggml::tensor *input = nullptr;
+        const auto make_graph = [this, &input, start, end, context](ComputeContext *ctx) -> ggml::tensor * {
+            input = ggml::new_tensor_2d(ctx, ggml::type::GGML_TYPE_I32, code_block_size, end - start + context);
+            auto r = ggml::cont(ctx, ggml::transpose(ctx, input));
+            r = speech_tokenizer->decoder.decode_step(ctx, r, context, start);
+            return r;
+        };
+        const auto write_input_data = [this, &input, &encoded, start, context](ComputeContext *ctx) {
+            Backend::write_tensor_data(input, encoded.data() + (start - context) * code_block_size, 0, ggml::nbytes(input));
+        };
+
+        std::vector<int64_t> shape;
+        std::vector<uint8_t> buf;
+        eval.evaluate(gen_config, make_graph, write_input_data, ggml::type::GGML_TYPE_F32, shape, buf);
+        decoded.resize(buf.size() / sizeof(decoded[0]));
+        memcpy(decoded.data(), buf.data(), buf.size());
+    }
+
     bool TalkerGeneration::project_speaker_embedding(const GenerationConfig &gen_config, const std::vector<float> &pcm_samples,
         ggml::type dtype, std::vector<uint8_t> &buf)
     {
@@ -1695,6 +1795,7 @@ namespace chatllm::qwen::v3_tts
         tok->ref_audio_file =           utils::get_opt(args, "ref_audio_file", tok->ref_audio_file);
         tok->ref_text       =           utils::get_opt(args, "ref_text", tok->ref_text);
         tok->voice_clone_mode =         utils::get_opt(args, "voice_clone_mode", tok->voice_clone_mode);
+        stream_chunk  = std::max(0, utils::get_opt(args, "stream_chunk", stream_chunk));
     }
 
     bool ConditionalGeneration::load_more(const json::JSON &config)
@@ -2112,9 +2213,13 @@ namespace chatllm::qwen::v3_tts
             const std::string &voice_clone_prompt,
             const int language_id,
             const int speaker_id,
-            std::vector<int16_t> &audio)
+            std::vector<int16_t> &audio,
+            BaseStreamer *streamer,
+            ModelPerfInfo *performance)
     {
         prepare_ids(gen_config, input_ids, instruct_ids, ref_ids, voice_clone_prompt, language_id, speaker_id);
+        if (performance)
+            performance->PromptEncoded();
         n_past = 0;
         n_past_offset = 0;
 
@@ -2125,6 +2230,22 @@ namespace chatllm::qwen::v3_tts
         last_hidden_states.clear();
         last_id_hidden.resize(config.hidden_size);
 
+        // streaming: frames are decoded in windows of `stream_chunk` (the first one is short to reduce latency).
+        // Convolutions continue from their caches, and the transformer attends to its receptive field of
+        // preceding frames, so the output matches decoding the whole utterance at once.
+        int decoded_frames = 0;
+        auto decode_window = [&](const int end)
+        {
+            std::vector<float> pcm_samples;
+            talker.speech_decode(gen_config, codec_ids, decoded_frames, end, pcm_samples);
+            decoded_frames = end;
+
+            const size_t start = audio.size();
+            for (size_t i = 0; i < pcm_samples.size(); i++)
+                audio.push_back((int16_t)(32768 * pcm_samples[i]));
+            streamer->put_audio(audio.data() + start, (int)(audio.size() - start), tts::sample_rate, 1);
+        };
+
         int last_id = -1;
         while ((gen_config.max_new_tokens <= 0) || ((int)codec_ids.size() < gen_config.max_new_tokens))
         {
@@ -2139,6 +2260,9 @@ namespace chatllm::qwen::v3_tts
                 last_id = run_main_model(gen_config, last_hidden_states, sampler.get());
             }
 
+            if (performance)
+                performance->TokenGenerated();
+
             if (termination_token_ids.find(last_id) != termination_token_ids.end())
                 break;
             if (last_id > talker.code_predictor->vocab_size)
@@ -2156,6 +2280,22 @@ namespace chatllm::qwen::v3_tts
             talker.code_predict(gen_config, sampler.get(), block_ids, last_hidden_states.data(), last_id_hidden.data());
 
             codec_ids.insert(codec_ids.end(), block_ids.begin(), block_ids.end());
+
+            if (streamer && (stream_chunk > 0))
+            {
+                const int frames = (int)codec_ids.size() / talker.code_block_size;
+                const int chunk  = decoded_frames > 0 ? stream_chunk : std::min(stream_chunk, 4);
+                if (frames - decoded_frames >= chunk)
+                    decode_window(frames);
+            }
+        }
+
+        if (streamer && (stream_chunk > 0))
+        {
+            const int frames = (int)codec_ids.size() / talker.code_block_size;
+            if (frames > decoded_frames)
+                decode_window(frames);
+            return;
         }
 
         // decode
@@ -2165,10 +2305,14 @@ namespace chatllm::qwen::v3_tts
         audio.resize(pcm_samples.size());
         for (size_t i = 0; i < pcm_samples.size(); i++)
             audio[i] = (int16_t)(32768 * pcm_samples[i]);
+
+        if (streamer && (audio.size() > 0))
+            streamer->put_audio(audio.data(), (int)audio.size(), tts::sample_rate, 1);
     }
 
     void ConditionalGeneration::speech_synthesis(const GenerationConfig &gen_config, const std::vector<int> &input_ids,
-            std::vector<int16_t> &audio, int &sample_rate, int &channels)
+            std::vector<int16_t> &audio, int &sample_rate, int &channels,
+            BaseStreamer *streamer, ModelPerfInfo *performance)
     {
         Tokenizer *tok = dynamic_cast<Tokenizer *>(tokenizer);
 
@@ -2215,7 +2359,7 @@ namespace chatllm::qwen::v3_tts
         generate_audio_codes(gen_config, input_ids, instruct_ids,
             ref_ids, "",
             lang_id, s_id,
-            audio);
+            audio, streamer, performance);
     }
 }
 
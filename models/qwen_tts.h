@@ -156,7 +156,8 @@ namespace chatllm::qwen::tts
         std::unique_ptr<ResidualVectorQuantizer> rvq_rest;
     };
 
-    class Qwen3TTSTokenizerV2CausalConvNet : public Block
+    // history is cached (own buffer) unless `max_batch` is 0, so decoding can continue from the last frame
+    class Qwen3TTSTokenizerV2CausalConvNet : public CausalConv1D
     {
     public:
         Qwen3TTSTokenizerV2CausalConvNet(InitContext *ctx,
@@ -164,18 +165,13 @@ namespace chatllm::qwen::tts
             int out_channels,
             int kernel_size,
             int dilation = 1,
-            int stride = 1,
-            int groups = 1);
-        ggml::tensor *forward(ComputeContext *ctx, ggml::tensor *input) override;
-        int64_t get_param_num(bool effective_only) const override;
+            int groups = 1,
+            int max_batch = 1);
         void load(const std::string &path, TensorLoader *loader) override;
-    public:
-        const int kernel_size;
-        const int stride;
-        const int padding;
-        Conv1D conv;
     };
 
+    // the tail (`kernel_size - stride` samples) that overlaps the output of next frames is cached,
+    // so decoding can continue from the last frame
     class Qwen3TTSTokenizerV2CausalTransConvNet : public Block
     {
     public:
@@ -185,12 +181,19 @@ namespace chatllm::qwen::tts
             int kernel_size,
             int stride = 1);
         ggml::tensor *forward(ComputeContext *ctx, ggml::tensor *input) override;
+        ggml::tensor *forward(ComputeContext *ctx, ggml::tensor *input, int n_past) override;
         int64_t get_param_num(bool effective_only) const override;
         void load(const std::string &path, TensorLoader *loader) override;
+
+        size_t get_cache_size(void) const override;
+        void   set_cache_buffer(BackendBuffer *buffer) override;
+        size_t read_cache_data(void *buffer, size_t buffer_size) const override;
+        size_t write_cache_data(const void *buffer, size_t buffer_size) override;
     public:
         const int left_pad;
         const int right_pad;
         ConvTransposed1D conv;
+        ggml::tensor *state;    // [right_pad, out_channels, 1], null if `right_pad` is 0
     };
 
     class Qwen3TTSTokenizerV2ConvNeXtBlock : public Block
@@ -198,6 +201,7 @@ namespace chatllm::qwen::tts
     public:
         Qwen3TTSTokenizerV2ConvNeXtBlock(InitContext *ctx, int dim);
         ggml::tensor *forward(ComputeContext *ctx, ggml::tensor *input) override;
+        ggml::tensor *forward(ComputeContext *ctx, ggml::tensor *input, int n_past) override;
         int64_t get_param_num(bool effective_only) const override;
         void load(const std::string &path, TensorLoader *loader) override;
     public:
@@ -215,6 +219,7 @@ namespace chatllm::qwen::tts
         SnakeBeta(InitContext *ctx, int dim);
 
         ggml::tensor *forward(ComputeContext *ctx, ggml::tensor *input) override;
+        ggml::tensor *forward(ComputeContext *ctx, ggml::tensor *input, int n_past) override { return forward(ctx, input); }
         int64_t get_param_num(bool effective_only) const override;
         void load(const std::string &path, TensorLoader *loader) override;
     public:
@@ -228,13 +233,14 @@ namespace chatllm::qwen::tts
     public:
         Qwen3TTSTokenizerV2DecoderDecoderResidualUnit(InitContext *ctx, int dim = 16, int dilation = 1);
         ggml::tensor *forward(ComputeContext *ctx, ggml::tensor *input) override;
+        ggml::tensor *forward(ComputeContext *ctx, ggml::tensor *input, int n_past) override;
         int64_t get_param_num(bool effective_only) const override;
         void load(const std::string &path, TensorLoader *loader) override;
     public:
         SnakeBeta act1;
         SnakeBeta act2;
         Qwen3TTSTokenizerV2CausalConvNet conv1;
-        Qwen3TTSTokenizerV2CausalConvNet conv2;
+        Conv1D                           conv2;     // kernel size 1
     };
 
     class Qwen3TTSTokenizerV2DecoderDecoderBlock : public Block
@@ -245,6 +251,7 @@ namespace chatllm::qwen::tts
             int out_dim,
             int upsample_rate);
         ggml::tensor *forward(ComputeContext *ctx, ggml::tensor *input) override;
+        ggml::tensor *forward(ComputeContext *ctx, ggml::tensor *input, int n_past) override;
         int64_t get_param_num(bool effective_only) const override;
         void load(const std::string &path, TensorLoader *loader) override;
     public:
@@ -316,6 +323,10 @@ namespace chatllm::qwen::tts
         ggml::tensor *forward(ComputeContext *ctx, ggml::tensor *input) override;
         ggml::tensor *chunked_decode(ComputeContext *ctx, ggml::tensor *codes,
             const int chunk_size=300, const int left_context_size=25);
+        // incremental decoding: `codes` are new frames preceded by `context` decoded ones (see `get_stream_context`),
+        // and `n_past` frames have been decoded before
+        ggml::tensor *decode_step(ComputeContext *ctx, ggml::tensor *codes, const int context, const int n_past);
+        int get_stream_context(void) const;
         int64_t get_param_num(bool effective_only) const override;
         void load(const std::string &path, TensorLoader *loader) override;
     public:
@@ -242,6 +242,7 @@ namespace chatllm::siglip
     {
         if (model.get())
         {
+            bind_cache(loader);
             loader.push_allocator_manager(&backend_context.layer_allocators);
             model->load(path, &loader);
             loader.pop_allocator_manager();
@@ -256,4 +257,10 @@ namespace chatllm::siglip
         CHATLLM_CHECK((media.width == config.image_size) && (media.width == config.image_size));
         return ggml::new_tensor_3d(ctx, ggml::type::GGML_TYPE_F32, media.width, media.height, 3);
     }
+
+    bool VisualEmbeddingGeneration::support_batch(void) const
+    {
+        // `AttentionPoolLatent` works on a single image
+        return config.global_pool == CONFIG_GLOBAL_POOL_NONE;
+    }
 }
\ No newline at end of file
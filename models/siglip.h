@@ -109,6 +109,7 @@ namespace chatllm::siglip
         bool load(const std::string &path, ModelLoader &loader);
     protected:
         ggml::tensor *make_media_tensor(ComputeContext *ctx, const BaseTokenizer::MediaAsEmbeddingVector &media) override;
+        bool support_batch(void) const override;
     public:
         Config config;
     };
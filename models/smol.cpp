@@ -165,8 +165,13 @@ namespace chatllm::smol::vit
 
     ggml::tensor *MultiModalProjector::pixel_shuffle(ComputeContext *ctx, ggml::tensor *image_features, int image_width, int image_height)
     {
+        // images of a batch are stacked vertically into a single grid: merged patches never cross images,
+        // and they are still ordered image by image.
+        const int64_t batch = ggml::get_dim(image_features, 2);
+        image_features = ggml::reshape_2d(ctx, image_features, ggml::get_dim(image_features, 0), ggml::get_dim(image_features, 1) * batch);
+
         merge_param.grid_w = image_width  / patch_size;
-        merge_param.grid_h = image_height / patch_size;
+        merge_param.grid_h = image_height / patch_size * (int)batch;
 
         ggml::tensor *r = ggml::merge_patch(ctx, image_features, &merge_param);
         r = ggml::reshape_4d(ctx, r, ggml::get_dim(r, 0) * scale_factor * scale_factor, ggml::get_dim(r, 1) / (scale_factor * scale_factor), ggml::get_dim(r, 2), ggml::get_dim(r, 3));
@@ -177,8 +182,7 @@ namespace chatllm::smol::vit
         : embeddings(LayerMover(ctx, LayerAllocatorManager::MiscLayer::Prolog),
                     config.hidden_size, config.patch_size, config.image_size_per_split),
         post_layernorm(LayerMover(ctx, LayerAllocatorManager::MiscLayer::Epilog), config.hidden_size),
-        multi_modal_projector(LayerMover(ctx, LayerAllocatorManager::MiscLayer::Epilog), config, lm_hidden_size),
-        loaded(false)
+        multi_modal_projector(LayerMover(ctx, LayerAllocatorManager::MiscLayer::Epilog), config, lm_hidden_size)
     {
         const int max_length = config.image_seq_len * config.video.max_frames;
         for (int layer_id = 0; layer_id < config.num_hidden_layers; layer_id++)
@@ -213,11 +217,13 @@ namespace chatllm::smol::vit
             std::string block_path = path + "encoder.layers." + std::to_string(i) + ".";
             layers[i]->load(block_path, loader);
         }
-        loaded = true;
+        _loaded = true;
     }
 
-    ggml::tensor *VisionTransformer::forward(ComputeContext *ctx, ggml::tensor *input, int image_width, int image_height)
+    ggml::tensor *VisionTransformer::forward(ComputeContext *ctx, ggml::tensor *input)
     {
+        const int image_width  = (int)ggml::get_dim(input, 0);
+        const int image_height = (int)ggml::get_dim(input, 1);
         auto output = embeddings.forward(ctx, input, image_width, image_height);
 
         for (size_t i = 0; i < layers.size(); i++)
@@ -229,15 +235,8 @@ namespace chatllm::smol::vit
         return output;
     }
 
-    bool VisionTransformer::is_loaded(void) const
-    {
-        return loaded;
-    }
-
     VisualEmbeddingGeneration::VisualEmbeddingGeneration(const RuntimeConfig &runtime_config, size_t GRAPH_SIZE)
-        :
-        GRAPH_SIZE(GRAPH_SIZE), _ctx(&backend_context),
-        n_threads(runtime_config.n_threads)
+        : BaseMediaProjectedEmbeddingGeneration(runtime_config, GRAPH_SIZE)
     {
         _ctx.cache_dtype = runtime_config.cache_type;
         model_gpu_layers = BackendContext::get_ngl_of_model(runtime_config.model_gpu_layers, "vis");
@@ -245,12 +244,13 @@ namespace chatllm::smol::vit
 
     bool VisualEmbeddingGeneration::load(ModelLoader &loader)
     {
-        if (vis_model.get())
+        if (model.get())
         {
+            bind_cache(loader);
             loader.push_allocator_manager(&backend_context.layer_allocators);
-            vis_model->load("vision_model.", &loader);
+            model->load("vision_model.", &loader);
             loader.pop_allocator_manager();
-            return vis_model->is_loaded();
+            return model->is_loaded();
         }
         else
             return false;
@@ -301,64 +301,16 @@ namespace chatllm::smol::vit
         _ctx.dtype = dtype;
         backend_context.init(model_gpu_layers, vis_config.num_hidden_layers, GRAPH_SIZE, n_threads);
 
-        vis_model.reset(new VisionTransformer(&_ctx, vis_config, lm_hidden_size));
+        model.reset(new VisionTransformer(&_ctx, vis_config, lm_hidden_size));
 
         CHATLLM_CHECK(_ctx.get_used_mem() == _ctx.get_mem_size()) << "tensor number mismatch: " << _ctx.get_used_mem() / tensor_ovhd << " vs "  << _ctx.get_mem_size() / tensor_ovhd;
 
         return true;
     }
 
-    void VisualEmbeddingGeneration::generate(const GenerationConfig &gen_config, BaseTokenizer *tok, ggml::type dtype, std::vector<uint8_t> &buf)
+    ggml::tensor *VisualEmbeddingGeneration::make_media_tensor(ComputeContext *ctx, const BaseTokenizer::MediaAsEmbeddingVector &media)
     {
-        if ((vis_model.get() == nullptr) || (tok->media_emb.size() < 1)) return;
-        if (!vis_model->is_loaded()) return;
-
-        for (auto &image : tok->media_emb)
-        {
-            run_model(gen_config, tok, dtype, image, buf);
-        }
-    }
-
-    bool VisualEmbeddingGeneration::run_model(const GenerationConfig &gen_config, BaseTokenizer *tok, ggml::type dtype, const BaseTokenizer::MediaAsEmbeddingVector &image, std::vector<uint8_t> &buf)
-    {
-        ForwardContext ctx(&backend_context);
-        ctx.gctx = GGMLContext({.mem_size = backend_context.buf_compute_meta.size(), .mem_buffer = backend_context.buf_compute_meta.data(), .no_alloc = true});
-        ctx.gf = ggml::new_graph_custom(&ctx, GRAPH_SIZE, false);
-
-        ctx.move_to_layer(LayerAllocatorManager::MiscLayer::Prolog);
-        ggml::tensor *media_emb = ggml::new_tensor_3d(&ctx, ggml::type::GGML_TYPE_F32, image.width, image.height, 3);
-
-        set_dbg_ctx(&ctx);
-
-        auto r = vis_model->forward(&ctx, media_emb, image.width, image.height);
-
-        if (ggml::type_of(r) != dtype)
-        {
-            ctx.move_to_layer(LayerAllocatorManager::MiscLayer::Epilog);
-            ggml::tensor *t = ggml::new_tensor_4d(&ctx, dtype, ggml::get_dim(r, 0), ggml::get_dim(r, 1), ggml::get_dim(r, 2), ggml::get_dim(r, 3));
-            r = ggml::cpy(&ctx, r, t);
-        }
-
-        ggml::build_forward_expand(&ctx, r);
-
-        CHATLLM_CHECK(ctx.allocate()) << "failed to allocate memory";
-
-        if (gen_config.dump_dot.size() > 0)
-        {
-            backend_context.dump_graph(ctx.get_cgraph(), gen_config.dump_dot.c_str());
-            exit(-1);
-        }
-
-        Backend::write_tensor_data(media_emb, image.data.data(), 0, image.data.size() * sizeof(image.data[0]));
-
-        ctx.compute();
-
-        size_t offset = buf.size();
-        buf.resize(offset + ggml::nbytes(r));
-        Backend::read_tensor_data(r, buf.data() + offset);
-        ctx.reset();
-
-        return true;
+        return ggml::new_tensor_3d(ctx, ggml::type::GGML_TYPE_F32, media.width, media.height, 3);
     }
 }
 
@@ -607,19 +559,14 @@ namespace chatllm::smol::vlm
 
                 vision::image_load_split(piece.content.c_str(), splits, tok->do_split, image_size_per_split,  image_size_per_split, splits_cols_num, splits_rows_num);
 
-                std::vector<float> scaled;
-
                 for (int r = 0; r < splits_rows_num; r++)
                 {
                     for (int c = 0; c < splits_cols_num; c++)
                     {
                         const int split_id = r * splits_cols_num + c;
-                        vision::image_rescale(splits[split_id], scaled);
-                        vision::image_normalize(scaled, vis_config->image_mean, vis_config->image_std);
-
                         tok->media_emb.push_back({.width = image_size_per_split, .height = image_size_per_split, .patch_size = patch_size, .data = {}});
                         auto &image = tok->media_emb.back();
-                        vision::image_arrange(scaled, image_size_per_split, -1, image.data, vision::PatchesFormat::ChannelsRGB_PixelsLeftRightDown);
+                        vision::image_to_patches(splits[split_id], image_size_per_split, -1, vis_config->image_mean, vis_config->image_std, image.data, vision::PatchesFormat::ChannelsRGB_PixelsLeftRightDown);
                         image.emb_vec_number = vis_config->image_seq_len;
 
                         const int id_start = tok->get_image_total_emb_vectors() - image.emb_vec_number + tok->vocab_size;
@@ -627,12 +574,9 @@ namespace chatllm::smol::vlm
                     }
                 }
 
-                vision::image_rescale(splits[splits_cols_num * splits_rows_num], scaled);
-                vision::image_normalize(scaled, vis_config->image_mean, vis_config->image_std);
-
                 tok->media_emb.push_back({.width = image_size_per_split, .height = image_size_per_split, .patch_size = patch_size, .data = {}});
                 auto &image = tok->media_emb.back();
-                vision::image_arrange(scaled, image_size_per_split, -1, image.data, vision::PatchesFormat::ChannelsRGB_PixelsLeftRightDown);
+                vision::image_to_patches(splits[splits_cols_num * splits_rows_num], image_size_per_split, -1, vis_config->image_mean, vis_config->image_std, image.data, vision::PatchesFormat::ChannelsRGB_PixelsLeftRightDown);
                 image.emb_vec_number = vis_config->image_seq_len;
 
                 const int id_start = tok->get_image_total_emb_vectors() - image.emb_vec_number + tok->vocab_size;
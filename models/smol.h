@@ -96,7 +96,7 @@ namespace chatllm::smol::vit
         Linear    proj;
     };
 
-    class VisionTransformer : public Block
+    class VisionTransformer : public DynamicBlock
     {
     public:
         typedef LMBlock1<LayerNorm, ViTSelfAttention, LayerNorm, MLP2> LayerBlock;
@@ -105,34 +105,24 @@ namespace chatllm::smol::vit
         int64_t get_param_num(bool effective_only) const override;
         void load(const std::string &path, TensorLoader *loader) override;
 
-        ggml::tensor *forward(ComputeContext *ctx, ggml::tensor *input, int image_width, int image_height);
-        bool is_loaded(void) const;
+        // input: [width, height, 3, batch]
+        ggml::tensor *forward(ComputeContext *ctx, ggml::tensor *input) override;
     public:
         PatchEmbedding embeddings;
         std::vector<std::unique_ptr<LayerBlock>> layers;
         LayerNorm  post_layernorm;
         MultiModalProjector multi_modal_projector;
-    protected:
-        bool loaded;
     };
 
-    class VisualEmbeddingGeneration
+    class VisualEmbeddingGeneration : public BaseMediaProjectedEmbeddingGeneration
     {
     public:
         VisualEmbeddingGeneration(const RuntimeConfig &runtime_config, size_t GRAPH_SIZE = 4096);
-        bool load(ModelLoader &loader);
-        bool load_more(ggml::type dtype, int lm_hidden_size, const json::JSON &config);
-        void generate(const GenerationConfig &gen_config, BaseTokenizer *tok, ggml::type dtype, std::vector<uint8_t> &buf);
-    protected:
-        bool run_model(const GenerationConfig &gen_config, BaseTokenizer *tok, ggml::type dtype, const BaseTokenizer::MediaAsEmbeddingVector &image, std::vector<uint8_t> &buf);
-
+        bool load(ModelLoader &loader) override;
+        bool load_more(ggml::type dtype, int lm_hidden_size, const json::JSON &config) override;
     protected:
-        std::unique_ptr<VisionTransformer> vis_model;
-        BackendContext backend_context;
-        const size_t GRAPH_SIZE;
-        InitContext _ctx; // weight context
-        std::string model_gpu_layers;
-        const int n_threads;
+        ggml::tensor *make_media_tensor(ComputeContext *ctx, const BaseTokenizer::MediaAsEmbeddingVector &media) override;
+        bool support_batch(void) const override { return true; }
     public:
         Config vis_config;
     };
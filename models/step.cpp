@@ -433,7 +433,8 @@ namespace chatllm::step::vit
         VisualEmbeddingGeneration(const RuntimeConfig &runtime_config, int max_llm_tokens, size_t GRAPH_SIZE = 4096):
             max_llm_tokens(max_llm_tokens),
             eval(runtime_config, "vis", GRAPH_SIZE),
-            _ctx(eval.get_backend_context())
+            _ctx(eval.get_backend_context()),
+            media_cache(runtime_config)
         {
             _ctx.cache_dtype = runtime_config.cache_type;
         }
@@ -442,6 +443,7 @@ namespace chatllm::step::vit
         {
             if (vis_model.get())
             {
+                media_cache.bind(loader);
                 loader.push_allocator_manager(eval.get_layer_allocators());
                 vis_model->load("visual.", &loader);
                 loader.pop_allocator_manager();
@@ -494,7 +496,9 @@ namespace chatllm::step::vit
 
             for (auto &image : tok->media_emb)
             {
-                run_model(gen_config, tok, dtype, image, buf);
+                media_cache.encode(image, dtype, buf, [&](std::vector<uint8_t> &output) {
+                    return run_model(gen_config, tok, dtype, image, output);
+                });
             }
         }
 
@@ -526,6 +530,7 @@ namespace chatllm::step::vit
         std::unique_ptr<VisionTransformer> vis_model;
         TensorGraphEvaluator eval;
         InitContext _ctx; // weight context
+        MediaEmbeddingCacheBinding media_cache;
     public:
         Config vis_config;
     };
@@ -764,18 +769,14 @@ namespace chatllm::step::vl
 
                     const int w = id == 0 ? whole_image_width  : vis_config->big_patch_size;
                     const int h = id == 0 ? whole_image_height : vis_config->big_patch_size;
-                    std::vector<float> scaled;
                     const int patch_size = vis_config->patch_size;
 
-                    vision::image_rescale(pixels, scaled);
-                    vision::image_normalize(scaled, vis_config->image_mean, vis_config->image_std);
-
                     tok->media_emb.push_back({.width = w, .height = h, .grid_width = w / patch_size, .grid_height = h / patch_size, .patch_size = patch_size, .data = {}});
 
                     auto &image = tok->media_emb.back();
                     image.emb_vec_number = (image.grid_height / 4) * (image.grid_width / 4);
 
-                    vision::image_arrange(scaled, w, patch_size, image.data, vision::PatchesFormat::ChannelsRGB_PixelsLeftRightDown);
+                    vision::image_to_patches(pixels, w, patch_size, vis_config->image_mean, vis_config->image_std, image.data, vision::PatchesFormat::ChannelsRGB_PixelsLeftRightDown);
 
                     const int id_start = tok->get_image_total_emb_vectors() - image.emb_vec_number + tok->vocab_size;
 
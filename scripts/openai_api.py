@@ -1,5 +1,5 @@
-import sys, signal, time, os
-from http.server import HTTPServer, BaseHTTPRequestHandler
+import sys, signal, time, os, threading
+from http.server import ThreadingHTTPServer, BaseHTTPRequestHandler
 import json
 import itertools
 from dataclasses import dataclass, field, asdict
@@ -167,6 +167,42 @@ class LegacyCompletionStreamResponder(HttpResponder):
     def done(self) -> None:
         self.send_str('data: [DONE]\n')
 
+class QueueTimeMetrics:
+    # time from receiving a request to handing it over to the model (i.e. waiting for requests ahead of it),
+    # as a Prometheus histogram.
+    # buckets are the same as latency histograms of `chatllm_get_metrics`.
+    BOUNDS = [0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0, 30.0, 60.0]
+
+    def __init__(self) -> None:
+        self.lock = threading.Lock()
+        self.buckets: dict[str, list[int]] = {}
+        self.sums: dict[str, float] = {}
+
+    def observe(self, model: str, seconds: float) -> None:
+        with self.lock:
+            if model not in self.buckets:
+                self.buckets[model] = [0] * (len(QueueTimeMetrics.BOUNDS) + 1)
+                self.sums[model] = 0.0
+            i = 0
+            while (i < len(QueueTimeMetrics.BOUNDS)) and (seconds > QueueTimeMetrics.BOUNDS[i]): i += 1
+            self.buckets[model][i] += 1
+            self.sums[model] += seconds
+
+    def expose(self) -> str:
+        name = 'chatllm_queue_seconds'
+        lines = [f'# HELP {name} Time from receiving a request to passing it to the model.', f'# TYPE {name} histogram']
+        with self.lock:
+            for model, buckets in self.buckets.items():
+                count = 0
+                for bound, n in zip(QueueTimeMetrics.BOUNDS + ['+Inf'], buckets):
+                    count += n
+                    lines.append(f'{name}_bucket{{endpoint="{model}",le="{bound}"}} {count}')
+                lines.append(f'{name}_sum{{endpoint="{model}"}} {self.sums[model]}')
+                lines.append(f'{name}_count{{endpoint="{model}"}} {count}')
+        return '\n'.join(lines) + '\n'
+
+queue_metrics: QueueTimeMetrics = QueueTimeMetrics()
+
 class SessionManager:
     def __init__(self) -> None:
         self._id = 1
@@ -179,7 +215,14 @@ session_man: SessionManager = SessionManager()
 chat_streamer: ChatLLMStreamer = None
 fim_streamer: ChatLLMStreamer = None
 emb_model_obj: ChatLLM = None
-http_server: HTTPServer = None
+http_server: ThreadingHTTPServer = None
+
+# requests are served on their own threads (so that GET /metrics is not blocked by generation),
+# while each model serves one request at a time.
+model_locks: dict[int, threading.Lock] = {}
+
+def get_model_lock(model) -> threading.Lock:
+    return model_locks.setdefault(id(model), threading.Lock())
 
 model_info = {}
 ui_file_name = 'chat_ui.html'
@@ -223,8 +266,10 @@ class HttpHandler(BaseHTTPRequestHandler):
             input = [input]
 
         rsp = DataListResponse(model=obj['model'])
-        for i, s in enumerate(input):
-            rsp.data.append(Embedding(index=i, embedding=emb_model_obj.embedding(s)))
+        with get_model_lock(emb_model_obj):
+            queue_metrics.observe('emb', time.perf_counter() - self.received)
+            for i, s in enumerate(input):
+                rsp.data.append(Embedding(index=i, embedding=emb_model_obj.embedding(s)))
 
         self.wfile.write(json.dumps(asdict(rsp)).encode('utf-8'))
 
@@ -282,15 +327,17 @@ class HttpHandler(BaseHTTPRequestHandler):
         responder = responder_cls(self, id, timestamp, model)
         streamer = get_streamer(model)
         if streamer is not None:
-            streamer.set_max_gen_tokens(max_tokens)
+            with get_model_lock(streamer):
+                queue_metrics.observe('fim' if streamer is fim_streamer else 'chat', time.perf_counter() - self.received)
+                streamer.set_max_gen_tokens(max_tokens)
 
-            try:
-                if restart: streamer.restart()
+                try:
+                    if restart: streamer.restart()
 
-                for x in streamer.chat(prompt):
-                    responder.recv_chunk(x)
-            except:
-                streamer.abort()
+                    for x in streamer.chat(prompt):
+                        responder.recv_chunk(x)
+                except:
+                    streamer.abort()
         else:
             responder.recv_chunk('CHAT model not loaded!')
 
@@ -328,6 +375,8 @@ class HttpHandler(BaseHTTPRequestHandler):
         self.wfile.flush()
 
     def do_POST(self):
+        # stamped before waiting for the model, see `get_model_lock`
+        self.received = time.perf_counter()
         print(f"POST {self.path}")
         args = self.rfile.read(int(self.headers['content-length'])).decode('utf-8')
         try:
@@ -365,6 +414,20 @@ class HttpHandler(BaseHTTPRequestHandler):
         self.wfile.flush()
         return
 
+    def handle_METRICS(self, obj: dict):
+        llm = chat_streamer.llm if chat_streamer is not None else fim_streamer.llm if fim_streamer is not None else emb_model_obj
+        if llm is None:
+            self.send_error(404, 'NOT FOUND')
+            return
+        metrics = (llm._lib.get_metrics() + queue_metrics.expose()).encode('utf-8')
+        self.send_response(200)
+        self.send_header('Content-type', 'text/plain; version=0.0.4')
+        self.send_header('Content-Length', str(len(metrics)))
+        self.end_headers()
+        self.wfile.write(metrics)
+        self.wfile.flush()
+        return
+
     def handle_TAGS(self, obj: dict):
         global model_info
         models = [{"name": model_info[k]['name']} for k in model_info.keys()]
@@ -454,6 +517,9 @@ class HttpHandler(BaseHTTPRequestHandler):
         elif self.path.endswith('/props'):
             self.handle_llama_props({})
             return
+        elif self.path.endswith('/metrics'):
+            self.handle_METRICS({})
+            return
         elif self.path.endswith('/ui') or self.path.startswith('/?') or (self.path in ['', '/']):
             self.handle_UI({})
             return
@@ -543,5 +609,5 @@ if __name__ == '__main__':
 
     print(f"LLM Loaded. Starting server on port {port}...")
     print(f"http://localhost:{port}")
-    http_server = HTTPServer(('0.0.0.0', port), HttpHandler)
+    http_server = ThreadingHTTPServer(('0.0.0.0', port), HttpHandler)
     http_server.serve_forever()
\ No newline at end of file
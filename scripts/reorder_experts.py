@@ -0,0 +1,182 @@
+"""
+Reorder experts of MoE layers in a GGMM model file, so that frequently co-selected experts are stored contiguously.
+
+1. Collect routing statistics (use a workload that is typical to your deployment):
+
+    main -m model.bin ... --set moe-profile profile.json
+
+1. Reorder:
+
+    python reorder_experts.py -i model.bin -p profile.json -o reordered.bin
+
+Routers (`gate`, `gate_score_correction_bias`, `router_scale`) are permuted together with experts,
+so outputs of the reordered model are identical. Experts are only moved within their routing groups.
+
+Note: models sharing experts across layers are not supported.
+"""
+import argparse
+import json
+import struct
+
+GGML_MEM_ALIGN = 16
+
+# ggml type: (block size, bytes per block)
+GGML_TYPE_SIZES = {
+    0:  (1,   4),   # F32
+    1:  (1,   2),   # F16
+    2:  (32,  18),  # Q4_0
+    3:  (32,  20),  # Q4_1
+    8:  (32,  34),  # Q8_0
+    12: (256, 144), # Q4_K
+    30: (1,   2),   # BF16
+}
+
+class Tensor:
+    def __init__(self, name: str, shape: list, dtype: int, data: bytes):
+        self.name = name
+        self.shape = shape
+        self.dtype = dtype
+        self.data = data
+
+    def permute(self, perm: list):
+        # slices along the outer-most dim are contiguous
+        n = self.shape[0]
+        assert n == len(perm), f"{self.name}: shape {self.shape} mismatch with {len(perm)} experts"
+        size = len(self.data) // n
+        self.data = b''.join(self.data[i * size : (i + 1) * size] for i in perm)
+
+def aligned(pos: int) -> int:
+    return (pos + (GGML_MEM_ALIGN - 1)) // GGML_MEM_ALIGN * GGML_MEM_ALIGN
+
+def load_model(fn: str):
+    with open(fn, 'rb') as f:
+        data = f.read()
+
+    assert data[:4] == b'ggmm', "only GGMM files are supported"
+    offset_tensors = struct.unpack('i', data[16:20])[0]
+
+    tensors = {}
+    pos = offset_tensors
+    while pos < len(data):
+        name_len = struct.unpack_from('i', data, pos)[0]
+        pos += 4
+        name = data[pos : pos + name_len].decode()
+        pos += name_len
+        ndim = struct.unpack_from('i', data, pos)[0]
+        pos += 4
+        shape = list(struct.unpack_from('i' * ndim, data, pos))
+        pos += 4 * ndim
+        dtype = struct.unpack_from('i', data, pos)[0]
+        pos += 4
+
+        assert dtype in GGML_TYPE_SIZES, f"{name}: unsupported type {dtype}"
+        block, block_bytes = GGML_TYPE_SIZES[dtype]
+        n = 1
+        for d in shape: n *= d
+        size = n // block * block_bytes
+
+        pos = aligned(pos)
+        tensors[name] = Tensor(name, shape, dtype, data[pos : pos + size])
+        pos += size
+
+    return data[:offset_tensors], tensors
+
+def save_model(fn: str, header: bytes, tensors: dict):
+    with open(fn, 'wb') as f:
+        f.write(header)
+        for t in tensors.values():
+            encoded = t.name.encode()
+            f.write(struct.pack('i', len(encoded)))
+            f.write(encoded)
+            f.write(struct.pack('i' * (2 + len(t.shape)), len(t.shape), *t.shape, t.dtype))
+            f.seek(aligned(f.tell()))
+            f.write(t.data)
+
+def find_order(layer: dict) -> list:
+    n = layer['num_experts']
+    group_size = max(1, layer['group_size'])
+    hist = layer['histogram']
+    co = layer['co_activation']
+
+    # greedy chaining: start from the hottest expert, then append the one most frequently co-selected with the last one
+    order = []
+    for start in range(0, n, group_size):
+        remain = set(range(start, min(n, start + group_size)))
+        last = max(remain, key=lambda i: (hist[i], -i))
+        while True:
+            order.append(last)
+            remain.remove(last)
+            if len(remain) < 1: break
+            last = max(remain, key=lambda i: (co[last][i], hist[i], -i))
+
+    return order
+
+def reorder_layer(tensors: dict, layer: dict) -> bool:
+    path = layer['path']
+    n = layer['num_experts']
+    perm = find_order(layer)
+    if perm == list(range(n)): return False
+
+    if path + 'gate.weight' not in tensors:
+        print(f"{path}: router not found, skipped")
+        return False
+
+    experts = path + 'experts.'
+    names = []
+    renames = {}
+    for proj in ['gate', 'up', 'down']:
+        for suffix in ['weight', 'bias']:
+            stacked = f'{experts}experts_{proj}.{suffix}'
+            if stacked in tensors:
+                names.append(stacked)
+                continue
+            per_expert = [f'{experts}{i}.{proj}_proj.{suffix}' for i in range(n)]
+            found = [name in tensors for name in per_expert]
+            if not any(found): continue
+            if not all(found):
+                print(f"{path}: some experts not found, skipped")
+                return False
+            for i, j in enumerate(perm):
+                renames[per_expert[i]] = per_expert[j]
+
+    if (len(names) < 1) and (len(renames) < 1):
+        print(f"{path}: experts not found, skipped")
+        return False
+
+    for name in [path + 'gate.weight', path + 'gate.bias', path + 'gate_score_correction_bias', path + 'router_scale']:
+        if name in tensors: names.append(name)
+
+    for name in names:
+        tensors[name].permute(perm)
+
+    if len(renames) > 0:
+        old = {name: tensors[name] for name in renames.values()}
+        for new_name, old_name in renames.items():
+            t = old[old_name]
+            tensors[new_name] = Tensor(new_name, t.shape, t.dtype, t.data)
+
+    return True
+
+def main():
+    parser = argparse.ArgumentParser("reorder-experts")
+    parser.add_argument("-i", "--model", type=str, required=True, help='input model file (GGMM)')
+    parser.add_argument("-p", "--profile", type=str, required=True, help='routing profile saved by `--set moe-profile FILE`')
+    parser.add_argument("-o", "--save_path", type=str, required=True)
+    args = parser.parse_args()
+
+    with open(args.profile, encoding='utf-8') as f:
+        profile = json.load(f)
+
+    header, tensors = load_model(args.model)
+
+    count = 0
+    for layer in profile['layers']:
+        if layer['num_tokens'] < 1: continue
+        if reorder_layer(tensors, layer):
+            count += 1
+
+    save_model(args.save_path, header, tensors)
+    print(f"{count} layers reordered, saved to {args.save_path}")
+
+if __name__ == "__main__":
+    main()
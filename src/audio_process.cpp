@@ -323,6 +323,49 @@ namespace audio
         std::vector<float> out_scratch;
     };
 
+    // one frame: `fft_in` (windowed by `fft`) -> `mel_out[j * mel_stride]`
+    static void log_mel_frame(const float *fft_in, float *fft_out,
+        const stft &fft,
+        const mel_filter_bank & filters,
+        std::function<float (float)> range_compression,
+        std::function<void (float *fft_power_spectrum, int n_fft)> power_spectrum_pp,
+        float *mel_out, const int64_t mel_stride)
+    {
+        const int n_fft = fft.get_length();
+
+        fft.transform(fft_in, fft_out);
+
+        // power spectrum
+        for (int j = 0; j < n_fft; j++)
+        {
+            fft_out[j] = fft_out[2 * j + 0] * fft_out[2 * j + 0] + fft_out[2 * j + 1] * fft_out[2 * j + 1];
+        }
+
+        power_spectrum_pp(fft_out, n_fft);
+
+        // mel spectrogram
+        for (int j = 0; j < (int)filters.filters.size(); j++)
+        {
+            const auto &f = filters.filters[j];
+            const int off = f.offset;
+            size_t k = 0;
+            float sum = 0.0f;
+            for (; k + 3 < f.weights.size(); k += 4)
+            {
+                sum +=  f.weights[k + 0] * fft_out[off + k + 0]
+                      + f.weights[k + 1] * fft_out[off + k + 1]
+                      + f.weights[k + 2] * fft_out[off + k + 2]
+                      + f.weights[k + 3] * fft_out[off + k + 3];
+            }
+            for (; k < f.weights.size(); k++)
+            {
+                sum +=  f.weights[k + 0] * fft_out[off + k + 0];
+            }
+
+            mel_out[j * mel_stride] = range_compression(sum);
+        }
+    }
+
     static void log_mel_spectrogram_worker_thread(int ith,
         const std::vector<float> & samples,
         const int64_t n_samples,
@@ -353,37 +396,8 @@ namespace audio
                 std::fill(fft_in.begin() + len, fft_in.end(), 0.0f);
             }
 
-            fft.transform(fft_in.data(), fft_out.data());
-
-            // power spectrum
-            for (int j = 0; j < n_fft; j++)
-            {
-                fft_out[j] = fft_out[2 * j + 0] * fft_out[2 * j + 0] + fft_out[2 * j + 1] * fft_out[2 * j + 1];
-            }
-
-            power_spectrum_pp(fft_out.data(), n_fft);
-
-            // mel spectrogram
-            for (int j = 0; j < mel.n_mel; j++)
-            {
-                const auto &f = filters.filters[j];
-                const int off = f.offset;
-                size_t k = 0;
-                float sum = 0.0f;
-                for (; k + 3 < f.weights.size(); k += 4)
-                {
-                    sum +=  f.weights[k + 0] * fft_out[off + k + 0]
-                          + f.weights[k + 1] * fft_out[off + k + 1]
-                          + f.weights[k + 2] * fft_out[off + k + 2]
-                          + f.weights[k + 3] * fft_out[off + k + 3];
-                }
-                for (; k < f.weights.size(); k++)
-                {
-                    sum +=  f.weights[k + 0] * fft_out[off + k + 0];
-                }
-
-                mel.data[j * mel.n_len + i] = range_compression(sum);
-            }
+            log_mel_frame(fft_in.data(), fft_out.data(), fft, filters, range_compression, power_spectrum_pp,
+                          mel.data.data() + i, mel.n_len);
         }
 
         for (; i < mel.n_len; i += n_threads)
@@ -580,6 +594,112 @@ namespace audio
         return true;
     }
 
+    MelStream::MelStream(const int sample_rate, const int mel_feature_size, const int fft_size, const int hop_length)
+        : n_mel(mel_feature_size), n_fft(fft_size), hop_length(hop_length),
+          filters(new mel_filter_bank()), fft(new stft(fft_size)),
+          samples(fft_size / 2, 0.0f),
+          offset(0), n_received(0), n_computed(0), max_value(-1e20f)
+    {
+        build_mel_filter_bank(*filters, sample_rate, fft_size, mel_feature_size);
+    }
+
+    MelStream::~MelStream()
+    {
+    }
+
+    void MelStream::append(const float *data, const int64_t n_samples)
+    {
+        const int prefix = n_fft / 2;
+        const bool reflected = n_received > prefix;
+
+        samples.insert(samples.end(), data, data + n_samples);
+        n_received += n_samples;
+
+        // reflect padding at the beginning (see `padding_samples_reverse_prefix_0_suffix`)
+        if (!reflected && (n_received > prefix))
+            std::reverse_copy(samples.begin() + prefix + 1, samples.begin() + prefix * 2 + 1, samples.begin());
+
+        // a frame is ready when all of its samples are available
+        if ((n_received > prefix) && (n_received + prefix >= n_fft))
+            compute_frames((n_received + prefix - n_fft) / hop_length + 1);
+    }
+
+    void MelStream::flush(void)
+    {
+        const int prefix = n_fft / 2;
+        if ((n_received <= prefix) && (offset == 0))
+        {
+            for (int i = 0; i < prefix; i++)
+                samples[i] = prefix - i < n_received ? samples[prefix + prefix - i] : 0.0f;
+        }
+
+        compute_frames(mel_len(n_received, hop_length));
+    }
+
+    void MelStream::compute_frames(const int64_t n_total_frames)
+    {
+        auto range_compression = [](float sum) {
+            return log10f(std::max(1e-10f, sum));
+        };
+
+        std::vector<float> fft_in(n_fft);
+        std::vector<float> fft_out(n_fft * 2);
+
+        for (; n_computed < n_total_frames; n_computed++)
+        {
+            // samples beyond the end are zeros
+            const int64_t start = n_computed * hop_length;
+            const int len = (int)std::max<int64_t>(0, std::min<int64_t>(n_fft, offset + (int64_t)samples.size() - start));
+            std::fill(fft_in.begin(), fft_in.end(), 0.0f);
+            if (len > 0)
+                std::copy(samples.data() + (start - offset), samples.data() + (start - offset) + len, fft_in.data());
+
+            const size_t pos = frames.size();
+            frames.resize(pos + n_mel);
+            log_mel_frame(fft_in.data(), fft_out.data(), *fft, *filters, range_compression, [](float *fft_power, int n_fft) {},
+                          frames.data() + pos, 1);
+            for (int j = 0; j < n_mel; j++)
+                max_value = std::max(max_value, frames[pos + j]);
+        }
+
+        // samples before the next frame are not needed any more
+        const int64_t consumed = std::min(n_computed * hop_length, offset + (int64_t)samples.size()) - offset;
+        if (consumed > 0)
+        {
+            samples.erase(samples.begin(), samples.begin() + consumed);
+            offset += consumed;
+        }
+    }
+
+    int64_t MelStream::available(void) const
+    {
+        return (int64_t)frames.size() / n_mel;
+    }
+
+    void MelStream::take(const int64_t n_frames, mel &output)
+    {
+        const int64_t n = std::min(n_frames, available());
+        const float mmax = max_value - 8.0f;
+
+        output.n_mel = n_mel;
+        output.n_len = n_frames;
+        output.data.resize(n_mel * n_frames);
+
+        for (int j = 0; j < n_mel; j++)
+        {
+            float *d = output.data.data() + j * n_frames;
+            for (int64_t i = 0; i < n_frames; i++)
+            {
+                float v = i < n ? frames[i * n_mel + j] : -10.0f;
+                if (v < mmax)
+                    v = mmax;
+                d[i] = (v + 4.0f) / 4.0f;
+            }
+        }
+
+        frames.erase(frames.begin(), frames.begin() + n * n_mel);
+    }
+
     int64_t mel_len(const int64_t n_samples, const int hop_length)
     {
         return n_samples / hop_length;
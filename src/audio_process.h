@@ -3,6 +3,7 @@
 #include <stdint.h>
 #include <vector>
 #include <string>
+#include <memory>
 
 namespace audio
 {
@@ -56,6 +57,44 @@ namespace audio
         std::vector<mel> & output,
         int64_t frames_per_chunk);
 
+    struct mel_filter_bank;
+    class stft;
+
+    // log-mel spectrogram (as `mel_spectrogram`) of an audio stream that arrives in snippets.
+    // frames are computed as soon as their samples are available; since the maximum of the whole
+    // audio is unknown, clamping uses the running maximum.
+    class MelStream
+    {
+    public:
+        MelStream(const int sample_rate, const int mel_feature_size, const int fft_size, const int hop_length);
+        ~MelStream();
+
+        void append(const float *samples, const int64_t n_samples);
+
+        // end of stream: the remaining frames are computed (zero padded)
+        void flush(void);
+
+        // number of frames not taken yet
+        int64_t available(void) const;
+
+        // take `n_frames` frames; frames beyond `available()` are padded as silence
+        void take(const int64_t n_frames, mel &output);
+    protected:
+        void compute_frames(const int64_t n_total_frames);
+    protected:
+        const int n_mel;
+        const int n_fft;
+        const int hop_length;
+        std::unique_ptr<mel_filter_bank> filters;
+        std::unique_ptr<stft> fft;
+        std::vector<float> samples;     // padded samples, starting from `offset`
+        int64_t offset;
+        int64_t n_received;
+        int64_t n_computed;
+        std::vector<float> frames;      // [n_frames][n_mel]
+        float max_value;
+    };
+
     int64_t mel_len(const int64_t n_samples, const int hop_length);
     int64_t sample_len_for_mel_len(const int64_t n_mel, const int hop_length);
 
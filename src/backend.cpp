@@ -1,11 +1,29 @@
 #include <cstring>
 #include <set>
+#include <fstream>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <algorithm>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
 #include <stdarg.h>
 
 #include "backend.h"
 #include "basics.h"
 
 #include "ggml-rpc.h"
+#include "ggml-cpu.h"
+#include "ggml-backend-impl.h"
+
+#if defined(__linux__)
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
 
 #ifndef GGML_USE_CPU
 #ifndef GGML_BACKEND_DL
@@ -117,6 +135,8 @@ namespace chatllm
         if (nullptr == buf) return false;
 
         buf->assign_to(tensor);
+        if (backend && backend->is_cpu() && buf->is_host())
+            ComputeManager::numa_place_tensor(tensor);
         return true;
     }
 
@@ -226,6 +246,8 @@ namespace chatllm
 
     LayerBufAllocator *LayerAllocatorManager::get_allocator(void)
     {
+        if (cur_shard >= 0)
+            return &shard_allocators[cur_shard];
         auto id = get_mapped_layer_id(cur_layer);
         return &allocators[id];
     }
@@ -251,6 +273,18 @@ namespace chatllm
         cpu_override = flag;
     }
 
+    void LayerAllocatorManager::override_to_shard(int shard)
+    {
+        CHATLLM_CHECK(shard < (int)shard_allocators.size()) << "shard #" << shard << " out of range";
+        cur_shard = shard;
+    }
+
+    int LayerAllocatorManager::get_shard_count(void) const
+    {
+        if (cpu_override || (cur_layer < 0)) return 0;
+        return (int)shard_allocators.size();
+    }
+
     int LayerAllocatorManager::get_mapped_layer_id(int layer_id)
     {
         int id = layer_id;
@@ -273,6 +307,7 @@ namespace chatllm
     }
 
     ggml_backend_reg_t ComputeManager::backend_rpc = nullptr;
+    ComputeManager::NumaMode ComputeManager::numa_mode = ComputeManager::NumaMode::Disabled;
 
     void ComputeManager::init(const std::string &ggml_dir)
     {
@@ -406,6 +441,145 @@ namespace chatllm
         }
     }
 
+    typedef void (*ggml_backend_cpu_numa_init_t)(enum ggml_numa_strategy numa);
+
+    bool ComputeManager::numa_init(const std::string &mode)
+    {
+        static const std::map<std::string, std::pair<NumaMode, ggml_numa_strategy>> modes = {
+            {"",            {NumaMode::Disabled,    GGML_NUMA_STRATEGY_DISABLED}},
+            {"distribute",  {NumaMode::Distribute,  GGML_NUMA_STRATEGY_DISTRIBUTE}},
+            {"isolate",     {NumaMode::Isolate,     GGML_NUMA_STRATEGY_ISOLATE}},
+            {"numactl",     {NumaMode::Numactl,     GGML_NUMA_STRATEGY_NUMACTL}},
+        };
+
+        auto it = modes.find(mode);
+        if (it == modes.end())
+        {
+            ggml::log(GGML_LOG_LEVEL_ERROR, "%s: unknown NUMA mode: %s", __FUNCTION__, mode.c_str());
+            return false;
+        }
+        // NUMA is initialized once per process
+        if ((it->second.first == NumaMode::Disabled) || (numa_mode != NumaMode::Disabled)) return true;
+
+        ComputeManager::init();
+
+        auto reg = ggml_backend_reg_by_name("CPU");
+        auto cpu_numa_init = reg ? (ggml_backend_cpu_numa_init_t)ggml_backend_reg_get_proc_address(reg, "ggml_backend_cpu_numa_init") : nullptr;
+        if (nullptr == cpu_numa_init)
+        {
+            ggml::log(GGML_LOG_LEVEL_ERROR, "%s: NUMA is not supported by CPU backend", __FUNCTION__);
+            return false;
+        }
+
+        // compute threads are pinned by the CPU backend: thread #i to node #(i % n_nodes) for `Distribute`.
+        cpu_numa_init(it->second.second);
+
+        numa_mode = it->second.first;
+        return true;
+    }
+
+    ComputeManager::NumaMode ComputeManager::get_numa_mode(void)
+    {
+        return numa_mode;
+    }
+
+    std::string ComputeManager::numa_mode_to_str(NumaMode mode)
+    {
+        switch (mode)
+        {
+        case NumaMode::Distribute:
+            return "distribute";
+        case NumaMode::Isolate:
+            return "isolate";
+        case NumaMode::Numactl:
+            return "numactl";
+        default:
+            return "disabled";
+        }
+    }
+
+#if defined(__linux__)
+    static size_t read_node_meminfo(int node, const char *key)
+    {
+        std::ifstream f("/sys/devices/system/node/node" + std::to_string(node) + "/meminfo");
+        std::string line;
+        while (std::getline(f, line))
+        {
+            auto pos = line.find(key);
+            if (pos == std::string::npos) continue;
+            return (size_t)std::stoull(line.substr(pos + strlen(key) + 1)) * 1024;
+        }
+        return 0;
+    }
+
+    static int numa_node_count(void)
+    {
+        int n = 0;
+        while (std::ifstream("/sys/devices/system/node/node" + std::to_string(n) + "/cpulist").good())
+            n++;
+        return n;
+    }
+
+    static void numa_bind(void *data, size_t size, int mode, const std::vector<int> &nodes)
+    {
+        const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        const uintptr_t start = ((uintptr_t)data + page - 1) / page * page;
+        const uintptr_t end   = ((uintptr_t)data + size) / page * page;
+        if (end <= start) return;
+
+        uint64_t mask[4] = {0};
+        for (auto n : nodes)
+            if (n < 64 * (int)(sizeof(mask) / sizeof(mask[0])))
+                mask[n / 64] |= (uint64_t)1 << (n % 64);
+
+        // pages not touched yet get the policy on first touch, others are migrated
+        long r = syscall(SYS_mbind, (void *)start, (unsigned long)(end - start), mode, mask, (unsigned long)(sizeof(mask) * 8), MPOL_MF_MOVE);
+        if (r != 0)
+            ggml::log(GGML_LOG_LEVEL_DEBUG, "%s: mbind failed: %d", __FUNCTION__, errno);
+    }
+#endif
+
+    void ComputeManager::get_numa_nodes(std::vector<NumaNodeInfo> &nodes)
+    {
+        nodes.clear();
+#if defined(__linux__)
+        for (int i = 0; i < numa_node_count(); i++)
+        {
+            NumaNodeInfo info;
+            info.id = i;
+            std::ifstream f("/sys/devices/system/node/node" + std::to_string(i) + "/cpulist");
+            std::getline(f, info.cpus);
+            info.total_memory = read_node_meminfo(i, "MemTotal:");
+            info.free_memory  = read_node_meminfo(i, "MemFree:");
+            nodes.push_back(info);
+        }
+#endif
+    }
+
+    void ComputeManager::numa_place_tensor(ggml::tensor *tensor)
+    {
+#if defined(__linux__)
+        if ((numa_mode != NumaMode::Distribute) && (numa_mode != NumaMode::Isolate))
+            return;
+
+        static const int n_nodes = numa_node_count();
+        if (n_nodes < 2) return;
+
+        if (numa_mode == NumaMode::Isolate)
+        {
+            unsigned cpu = 0;
+            unsigned node = 0;
+            if (syscall(SYS_getcpu, &cpu, &node, nullptr) != 0) return;
+            numa_bind(tensor->data, ggml::nbytes(tensor), MPOL_PREFERRED, {(int)node});
+            return;
+        }
+
+        std::vector<int> all(n_nodes);
+        for (int i = 0; i < n_nodes; i++) all[i] = i;
+        numa_bind(tensor->data, ggml::nbytes(tensor), MPOL_INTERLEAVE, all);
+#endif
+    }
+
     bool ComputeManager::prepare_rpc_devices(const std::string &endpoints)
     {
         if (endpoints.size() < 1) return true;
@@ -484,6 +658,199 @@ namespace chatllm
         return true;
     }
 
+    // Graph computation of an RPC backend blocks until the server responds. This wrapper runs it on a
+    // worker thread, so that the host can feed other stages of a pipeline while a server is computing.
+    //
+    // The graph is copied before `graph_compute` returns, since tensors of the caller are reused for the
+    // next graph. All other operations wait for the pending computation: `synchronize` is called by the
+    // scheduler before copying inputs to/outputs from a split, and before reallocating buffers; tensor
+    // data accessed through `Backend` waits with `wait_for`.
+    namespace async_backend
+    {
+        struct context
+        {
+            ggml_backend_t backend;
+            ggml_backend_buffer_type_t buft;
+            std::thread worker;
+            std::mutex mutex;
+            std::condition_variable cv;
+            bool pending = false;
+            bool stopping = false;
+            ggml_status status = GGML_STATUS_SUCCESS;
+
+            // copy of the graph being computed
+            std::vector<uint8_t> graph_meta;
+            std::deque<ggml_tensor> tensors;
+            ggml_cgraph *graph = nullptr;
+        };
+
+        static ggml_tensor *copy_tensor(context *ctx, std::unordered_map<const ggml_tensor *, ggml_tensor *> &copied, ggml_tensor *t)
+        {
+            if (nullptr == t) return nullptr;
+            auto it = copied.find(t);
+            if (it != copied.end()) return it->second;
+
+            ctx->tensors.push_back(*t);
+            ggml_tensor *r = &ctx->tensors.back();
+            copied[t] = r;
+            for (int i = 0; i < GGML_MAX_SRC; i++)
+                r->src[i] = copy_tensor(ctx, copied, t->src[i]);
+            r->view_src = copy_tensor(ctx, copied, t->view_src);
+            return r;
+        }
+
+        static void copy_graph(context *ctx, const ggml_cgraph *gf)
+        {
+            const int n_nodes = ggml_graph_n_nodes(const_cast<ggml_cgraph *>(gf));
+            ctx->graph_meta.resize(ggml_graph_overhead_custom(n_nodes, false));
+            ggml_init_params params = {
+                /*.mem_size   =*/ ctx->graph_meta.size(),
+                /*.mem_buffer =*/ ctx->graph_meta.data(),
+                /*.no_alloc   =*/ true,
+            };
+            ggml_context *meta = ggml_init(params);
+            ctx->graph = ggml_new_graph_custom(meta, n_nodes, false);
+            ggml_free(meta);
+
+            ctx->tensors.clear();
+            std::unordered_map<const ggml_tensor *, ggml_tensor *> copied;
+            for (int i = 0; i < n_nodes; i++)
+                ggml_graph_add_node(ctx->graph, copy_tensor(ctx, copied, ggml_graph_node(const_cast<ggml_cgraph *>(gf), i)));
+        }
+
+        static std::mutex registry_mutex;
+        static std::vector<context *> registry;
+
+        static void wait(context *ctx)
+        {
+            std::unique_lock<std::mutex> lock(ctx->mutex);
+            ctx->cv.wait(lock, [ctx] { return !ctx->pending; });
+        }
+
+        // wait for the backend that owns the buffer of `tensor`
+        static void wait_for(const ggml_tensor *tensor)
+        {
+            if (nullptr == tensor->buffer) return;
+            auto buft = ggml_backend_buffer_get_type(tensor->buffer);
+            std::lock_guard<std::mutex> lock(registry_mutex);
+            for (auto ctx : registry)
+                if (ctx->buft == buft) wait(ctx);
+        }
+
+        static void run(context *ctx)
+        {
+            std::unique_lock<std::mutex> lock(ctx->mutex);
+            while (true)
+            {
+                ctx->cv.wait(lock, [ctx] { return ctx->pending || ctx->stopping; });
+                if (!ctx->pending) break;
+
+                lock.unlock();
+                ggml_status status = ggml_backend_graph_compute(ctx->backend, ctx->graph);
+                lock.lock();
+
+                ctx->status = status;
+                ctx->pending = false;
+                ctx->cv.notify_all();
+            }
+        }
+
+        static const char *get_name(ggml_backend_t backend)
+        {
+            context *ctx = (context *)backend->context;
+            return ggml_backend_name(ctx->backend);
+        }
+
+        static void free(ggml_backend_t backend)
+        {
+            context *ctx = (context *)backend->context;
+            {
+                std::lock_guard<std::mutex> lock(registry_mutex);
+                registry.erase(std::find(registry.begin(), registry.end(), ctx));
+            }
+            {
+                std::lock_guard<std::mutex> lock(ctx->mutex);
+                ctx->stopping = true;
+            }
+            ctx->cv.notify_all();
+            ctx->worker.join();
+            ggml_backend_free(ctx->backend);
+            delete ctx;
+            delete backend;
+        }
+
+        // status of the last computation. a failure is reported only once, so that later graphs can run.
+        static ggml_status take_status(context *ctx)
+        {
+            std::lock_guard<std::mutex> lock(ctx->mutex);
+            ggml_status status = ctx->status;
+            ctx->status = GGML_STATUS_SUCCESS;
+            return status;
+        }
+
+        static void synchronize(ggml_backend_t backend)
+        {
+            context *ctx = (context *)backend->context;
+            wait(ctx);
+            ggml_backend_synchronize(ctx->backend);
+            ggml_status status = take_status(ctx);
+            CHATLLM_CHECK(status == GGML_STATUS_SUCCESS) << ggml_backend_name(ctx->backend) << ": graph compute failed: " << status;
+        }
+
+        static ggml_status graph_compute(ggml_backend_t backend, ggml_cgraph *gf)
+        {
+            context *ctx = (context *)backend->context;
+            wait(ctx);
+            ggml_status status = take_status(ctx);
+            if (status != GGML_STATUS_SUCCESS)
+                return status;
+
+            copy_graph(ctx, gf);
+            {
+                std::lock_guard<std::mutex> lock(ctx->mutex);
+                ctx->pending = true;
+            }
+            ctx->cv.notify_all();
+            return GGML_STATUS_SUCCESS;
+        }
+
+        static ggml_guid_t guid(void)
+        {
+            static ggml_guid guid = { 0x63, 0x68, 0x61, 0x74, 0x6c, 0x6c, 0x6d, 0x2e, 0x61, 0x73, 0x79, 0x6e, 0x63, 0x2e, 0x62, 0x65 };
+            return &guid;
+        }
+
+        static ggml_backend_t wrap(ggml_backend_t backend)
+        {
+            static ggml_backend_i iface = {
+                /* .get_name                = */ get_name,
+                /* .free                    = */ free,
+                /* .set_tensor_async        = */ nullptr,
+                /* .get_tensor_async        = */ nullptr,
+                /* .cpy_tensor_async        = */ nullptr,
+                /* .synchronize             = */ synchronize,
+                /* .graph_plan_create       = */ nullptr,
+                /* .graph_plan_free         = */ nullptr,
+                /* .graph_plan_update       = */ nullptr,
+                /* .graph_plan_compute      = */ nullptr,
+                /* .graph_compute           = */ graph_compute,
+                /* .event_record            = */ nullptr,
+                /* .event_wait              = */ nullptr,
+                /* .graph_optimize          = */ nullptr,
+            };
+
+            context *ctx = new context();
+            ctx->backend = backend;
+            ctx->buft    = ggml_backend_get_default_buffer_type(backend);
+            ctx->worker  = std::thread(run, ctx);
+            {
+                std::lock_guard<std::mutex> lock(registry_mutex);
+                registry.push_back(ctx);
+            }
+            return new ggml_backend { guid(), iface, backend->device, ctx };
+        }
+    }
+
     Backend::Backend(ggml_backend_t backend, int n_layers, bool use_gpu)
         : backend(backend), n_layers(n_layers), use_gpu(use_gpu)
     {
@@ -516,21 +883,25 @@ namespace chatllm
 
     void Backend::write_tensor_data(ggml::tensor * tensor, const void * data, size_t offset, size_t size)
     {
+        async_backend::wait_for(tensor);
         ggml_backend_tensor_set(tensor, data, offset, size);
     }
 
     void Backend::write_tensor_data(ggml::tensor * tensor, const void * data)
     {
+        async_backend::wait_for(tensor);
         ggml_backend_tensor_set(tensor, data, 0, ggml::nbytes(tensor));
     }
 
     void Backend::tensor_memset(ggml::tensor * tensor, uint8_t value)
     {
+        async_backend::wait_for(tensor);
         ggml_backend_tensor_memset(tensor, value, 0, ggml::nbytes(tensor));
     }
 
     void Backend::tensor_memset(ggml::tensor * tensor, uint8_t value, size_t offset, size_t size)
     {
+        async_backend::wait_for(tensor);
         ggml_backend_tensor_memset(tensor, value, offset, size);
     }
 
@@ -541,11 +912,13 @@ namespace chatllm
 
     void Backend::read_tensor_data(ggml::tensor * tensor, void * data, size_t offset, size_t size)
     {
+        async_backend::wait_for(tensor);
         ggml_backend_tensor_get(tensor, data, offset, size);
     }
 
     void Backend::read_tensor_data(ggml::tensor * tensor, void * data)
     {
+        async_backend::wait_for(tensor);
         ggml_backend_tensor_get(tensor, data, 0, ggml::nbytes(tensor));
     }
 
@@ -575,6 +948,14 @@ namespace chatllm
         return backends.size() > 1;
     }
 
+    int BackendContext::get_stage_count(void) const
+    {
+        int count = 0;
+        for (auto &backend : backends)
+            if (backend.n_layers > 0) count++;
+        return count;
+    }
+
     static bool parse_gpu_cfg(BackendContext::gpu_cfg &cfg, const std::string &s)
     {
         cfg.id = 0;
@@ -662,6 +1043,19 @@ namespace chatllm
         return gpu_cfgs;
     }
 
+    void BackendContext::set_tensor_parallel(const std::string &device_ids)
+    {
+        tensor_parallel_devices.clear();
+        if (device_ids.size() > 0)
+            utils::parse_int_lists(tensor_parallel_devices, device_ids, ComputeManager::get_device_count());
+        split_method = tensor_parallel_devices.size() > 1 ? SplitMethod::Row : SplitMethod::Layer;
+    }
+
+    void BackendContext::set_pipeline_micro_batch(int micro_batch)
+    {
+        pipelined = micro_batch > 0;
+    }
+
     void BackendContext::init(const std::map<std::string, std::string> &model_n_gpu_layers, const std::string &model_id, const int n_layers, const size_t graph_max_nodes_num, const int n_threads, const std::string fallback_id)
     {
         init(get_ngl_of_model(model_n_gpu_layers, model_id, fallback_id), n_layers, graph_max_nodes_num, n_threads);
@@ -690,17 +1084,33 @@ namespace chatllm
                 epilog_id = i;
         }
 
-        const bool use_gpu = n_gpu_layers > 0;
+        const int cpu_device = ComputeManager::get_device_count() - 1;
+
+        // devices holding only shards (tensor parallelism) need their own buffers too
+        bool use_gpu = n_gpu_layers > 0;
+        if (split_method == SplitMethod::Row)
+        {
+            for (auto device : tensor_parallel_devices)
+                use_gpu = use_gpu || (device != cpu_device);
+        }
 
         buf_compute_meta.resize(ggml_tensor_overhead() * graph_max_nodes_num + ggml_graph_overhead_custom(graph_max_nodes_num, false));
 
-        auto init_device = [this, use_gpu, n_threads](int device, ggml_backend_dev_t dev, int n_layers)
+        std::vector<int> device_of_backend;
+
+        // only pipelines and tensor parallelism can make use of RPC servers computing concurrently
+        const bool async_rpc = pipelined || (split_method == SplitMethod::Row);
+
+        auto init_device = [this, use_gpu, async_rpc, n_threads, &device_of_backend](int device, ggml_backend_dev_t dev, int n_layers)
         {
             auto reg = ggml_backend_dev_backend_reg(dev);
 
             ggml_backend_t backend = ComputeManager::init_backend_device(device);
             CHATLLM_CHECK(backend != nullptr) << __func__ << ": failed to initialize backend: #" << device;
+            if (async_rpc && (std::string(ggml_backend_reg_name(reg)) == "RPC"))
+                backend = async_backend::wrap(backend);
             backends.emplace_back(backend, n_layers, use_gpu);
+            device_of_backend.push_back(device);
 
             if (n_threads > 0)
             {
@@ -724,9 +1134,24 @@ namespace chatllm
             }
         }
 
+        // devices for tensor parallelism that do not hold any layers
+        if (split_method == SplitMethod::Row)
+        {
+            for (auto device : tensor_parallel_devices)
+            {
+                CHATLLM_CHECK((0 <= device) && (device <= cpu_device)) << __func__ << ": backend device: #" << device << " out of range";
+                if ((device == cpu_device) || (std::find(device_of_backend.begin(), device_of_backend.end(), device) != device_of_backend.end()))
+                    continue;
+
+                auto dev = ggml_backend_dev_get(device);
+                CHATLLM_CHECK(dev != nullptr) << __func__ << ": failed to found backend device: #" << device;
+                init_device(device, dev, 0);
+            }
+        }
+
         // append CPU backend
         {
-            int device = ComputeManager::get_device_count() - 1;
+            int device = cpu_device;
             auto dev = ggml_backend_dev_get(device);
             CHATLLM_CHECK(dev != nullptr) << __func__ << ": failed to found CPU device: #" << device;
             CHATLLM_CHECK(ggml_backend_dev_type(dev) == GGML_BACKEND_DEVICE_TYPE_CPU) << __func__ << ": device #" << device << " is not CPU, but " << ggml_backend_dev_type(dev);
@@ -766,6 +1191,17 @@ namespace chatllm
         // a "faked" layer for CPU
         layer_allocators.allocators.emplace_back(host_allocator.alloc_matrix, &backends[backends.size() - 1]);
 
+        layer_allocators.shard_allocators.clear();
+        if (split_method == SplitMethod::Row)
+        {
+            for (auto device : tensor_parallel_devices)
+            {
+                auto it = std::find(device_of_backend.begin(), device_of_backend.end(), device);
+                auto &backend = backends[it - device_of_backend.begin()];
+                layer_allocators.shard_allocators.emplace_back(backend.get_allocator(BufferType::Dedicated), &backend);
+            }
+        }
+
         gg_bufts.clear();
         gg_backends.clear();
 
@@ -797,16 +1233,212 @@ namespace chatllm
         return ggml_backend_sched_alloc_graph(sched, gf);
     }
 
+    struct ProfilerState
+    {
+        using Clock = std::chrono::steady_clock;
+
+        struct Item
+        {
+            double  ms = 0.0;
+            int64_t count = 0;
+        };
+
+        struct Event
+        {
+            const char *op;
+            int layer;
+            int backend;
+            OpProfiler::Phase phase;
+            double ts_us;
+            double dur_us;
+        };
+
+        bool enabled = false;
+        OpProfiler::Phase phase = OpProfiler::Phase::Prefill;
+        std::map<ggml::tensor *, int> layer_of_tensor;
+        Clock::time_point origin = Clock::now();
+        Clock::time_point last;
+        std::map<std::string, Item> by_op[OpProfiler::Phase::NUM];
+        std::map<int, Item> by_layer[OpProfiler::Phase::NUM];
+        std::map<int, Item> by_backend[OpProfiler::Phase::NUM];
+        std::vector<std::string> backends;
+        std::vector<Event> events;
+    };
+
+    static ProfilerState profiler;
+
+    // events beyond this are not kept for the trace (but still accounted in the summary)
+    static const size_t PROFILER_MAX_EVENTS = 4 * 1024 * 1024;
+    static const int    PROFILER_UNKNOWN_LAYER = INT_MIN;
+
+    void OpProfiler::enable(bool flag)
+    {
+        profiler.enabled = flag;
+    }
+
+    bool OpProfiler::is_enabled(void)
+    {
+        return profiler.enabled;
+    }
+
+    void OpProfiler::set_phase(Phase phase)
+    {
+        profiler.phase = phase;
+    }
+
+    void OpProfiler::tag(ggml::tensor *tensor, int layer_id)
+    {
+        profiler.layer_of_tensor[tensor] = layer_id;
+    }
+
+    void OpProfiler::begin_graph(void)
+    {
+        profiler.last = ProfilerState::Clock::now();
+    }
+
+    void OpProfiler::end_graph(void)
+    {
+        // buffers of graphs are reused, so are the addresses of tensors
+        profiler.layer_of_tensor.clear();
+    }
+
+    void OpProfiler::record(ggml::tensor *tensor, const char *backend_name)
+    {
+        auto now = ProfilerState::Clock::now();
+        const double ts_us  = std::chrono::duration<double, std::micro>(profiler.last - profiler.origin).count();
+        const double dur_us = std::chrono::duration<double, std::micro>(now - profiler.last).count();
+        profiler.last = now;
+
+        auto it = profiler.layer_of_tensor.find(tensor);
+        const int layer = it != profiler.layer_of_tensor.end() ? it->second : PROFILER_UNKNOWN_LAYER;
+
+        auto b = std::find(profiler.backends.begin(), profiler.backends.end(), backend_name);
+        const int backend = (int)(b - profiler.backends.begin());
+        if (b == profiler.backends.end())
+            profiler.backends.push_back(backend_name);
+
+        const char *op = ggml::op_name(tensor);
+        auto add = [dur_us](auto &item) { item.ms += dur_us / 1000; item.count++; };
+        add(profiler.by_op[profiler.phase][op]);
+        add(profiler.by_layer[profiler.phase][layer]);
+        add(profiler.by_backend[profiler.phase][backend]);
+
+        if (profiler.events.size() < PROFILER_MAX_EVENTS)
+            profiler.events.push_back({op, layer, backend, profiler.phase, ts_us, dur_us});
+    }
+
+    static std::string profiler_layer_name(int layer)
+    {
+        switch (layer)
+        {
+        case LayerAllocatorManager::MiscLayer::Prolog:
+            return "prolog";
+        case LayerAllocatorManager::MiscLayer::Epilog:
+            return "epilog";
+        case PROFILER_UNKNOWN_LAYER:
+            return "?";
+        default:
+            return "layer " + std::to_string(layer);
+        }
+    }
+
+    std::string OpProfiler::summary(void)
+    {
+        static const char *phase_names[] = {"prefill", "decode"};
+        std::string r;
+
+        auto table = [&r](const char *title, std::vector<std::pair<std::string, ProfilerState::Item>> items, double total, bool sort)
+        {
+            if (sort)
+                std::stable_sort(items.begin(), items.end(), [](const auto &a, const auto &b) { return a.second.ms > b.second.ms; });
+            r += utils::sprintf("  %-24s %10s %12s %8s\n", title, "count", "time (ms)", "%");
+            for (auto &item : items)
+                r += utils::sprintf("  %-24s %10lld %12.3f %7.2f%%\n", item.first.c_str(), (long long)item.second.count,
+                                    item.second.ms, total > 0 ? item.second.ms * 100 / total : 0.0);
+        };
+
+        for (int phase = 0; phase < Phase::NUM; phase++)
+        {
+            double total = 0.0;
+            for (auto &item : profiler.by_op[phase]) total += item.second.ms;
+            if (profiler.by_op[phase].size() < 1) continue;
+
+            r += utils::sprintf("profile of %s: %.3f ms in total\n", phase_names[phase], total);
+
+            std::vector<std::pair<std::string, ProfilerState::Item>> items;
+            for (auto &item : profiler.by_op[phase])
+                items.emplace_back(item.first, item.second);
+            table("op", items, total, true);
+
+            // prolog, layers, epilog, then unknown
+            items.clear();
+            auto order = [](int layer) -> int64_t
+            {
+                if (layer == LayerAllocatorManager::MiscLayer::Prolog) return -1;
+                if (layer == LayerAllocatorManager::MiscLayer::Epilog) return (int64_t)INT_MAX + 1;
+                if (layer == PROFILER_UNKNOWN_LAYER)                   return (int64_t)INT_MAX + 2;
+                return layer;
+            };
+            std::vector<int> layers;
+            for (auto &item : profiler.by_layer[phase]) layers.push_back(item.first);
+            std::sort(layers.begin(), layers.end(), [&order](int a, int b) { return order(a) < order(b); });
+            for (auto layer : layers)
+                items.emplace_back(profiler_layer_name(layer), profiler.by_layer[phase][layer]);
+            table("layer", items, total, false);
+
+            items.clear();
+            for (auto &item : profiler.by_backend[phase])
+                items.emplace_back(profiler.backends[item.first], item.second);
+            table("backend", items, total, true);
+        }
+        return r;
+    }
+
+    bool OpProfiler::save_trace(const std::string &file_name)
+    {
+        static const char *phase_names[] = {"prefill", "decode"};
+
+        FILE *f = fopen(file_name.c_str(), "w");
+        if (nullptr == f) return false;
+
+        fprintf(f, "{\"traceEvents\":[\n");
+        for (size_t i = 0; i < profiler.backends.size(); i++)
+            fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%zd,\"args\":{\"name\":\"%s\"}},\n",
+                    i, profiler.backends[i].c_str());
+        for (size_t i = 0; i < profiler.events.size(); i++)
+        {
+            auto &e = profiler.events[i];
+            fprintf(f, "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":0,\"tid\":%d,\"args\":{\"layer\":\"%s\"}}%s\n",
+                    e.op, phase_names[e.phase], e.ts_us, e.dur_us, e.backend, profiler_layer_name(e.layer).c_str(),
+                    i + 1 < profiler.events.size() ? "," : "");
+        }
+        fprintf(f, "]}\n");
+        fclose(f);
+        return true;
+    }
+
     static bool _backend_sched_eval_callback(ggml::tensor *t, bool ask, void *user_data)
     {
         auto *p = reinterpret_cast<BackendContext *>(user_data);
+        if (OpProfiler::is_enabled())
+        {
+            // every node is observed, so that each one is computed (and timed) separately
+            if (ask) return true;
+
+            ggml_backend_t backend = ggml_backend_sched_get_tensor_backend(p->sched, t);
+            OpProfiler::record(t, backend ? ggml_backend_name(backend) : "?");
+
+            if ((nullptr == p->observe_tensor_callback) || !p->need_observe_tensor_callback(t, p->observe_tensor_callback_data))
+                return true;
+        }
+
         if (ask)
             return p->need_observe_tensor_callback(t, p->observe_tensor_callback_data);
         else
             return p->observe_tensor_callback(t, p->observe_tensor_callback_data);
     }
 
-    void BackendContext::compute_graph(ggml_cgraph *gf)
+    void BackendContext::compute_graph(ggml_cgraph *gf, bool synchronize)
     {
         if (backend_cpu != nullptr)
         {
@@ -816,13 +1448,21 @@ namespace chatllm
             set_abort_callback(backend_cpu, abort_callback, abort_callback_data);
         }
 
-        if (observe_tensor_callback)
+        const bool profiling = OpProfiler::is_enabled();
+        if (observe_tensor_callback || profiling)
             ggml_backend_sched_set_eval_callback(sched, _backend_sched_eval_callback, this);
         else
             ggml_backend_sched_set_eval_callback(sched, nullptr, nullptr);
 
+        if (profiling)
+            OpProfiler::begin_graph();
+
         ggml_backend_sched_graph_compute_async(sched, gf);
-        ggml_backend_sched_synchronize(sched);
+        if (synchronize)
+            ggml_backend_sched_synchronize(sched);
+
+        if (profiling)
+            OpProfiler::end_graph();
     }
 
     void BackendContext::reset()
@@ -890,6 +1530,9 @@ namespace chatllm
 
     void ComputeContext::cb_op_tensor(ggml::tensor *tensor)
     {
+        if (OpProfiler::is_enabled())
+            OpProfiler::tag(tensor, backend_context->layer_allocators.get_cur_layer());
+
         if (get_backend() == nullptr) return;
         if (get_backend()->support(tensor))
         {
@@ -925,6 +1568,16 @@ namespace chatllm
         backend_context->layer_allocators.override_to_cpu_only(flag);
     }
 
+    void ComputeContext::backend_shard_override(int shard)
+    {
+        backend_context->layer_allocators.override_to_shard(shard);
+    }
+
+    int ComputeContext::get_shard_count(void)
+    {
+        return backend_context->layer_allocators.get_shard_count();
+    }
+
     BackendBufAllocator *ComputeContext::get_allocator(void)
     {
         return backend_context->layer_allocators.get_allocator();
@@ -953,8 +1606,33 @@ namespace chatllm
 
     void ComputeContext::compute(void)
     {
+        run_eval_callbacks(before_eval_callbacks);
         backend_context->compute_graph(get_cgraph());
         temp_params.clear();
+        run_eval_callbacks(after_eval_callbacks);
+    }
+
+    void ComputeContext::compute_async(void)
+    {
+        run_eval_callbacks(before_eval_callbacks);
+        backend_context->compute_graph(get_cgraph(), false);
+        temp_params.clear();
+        run_eval_callbacks(after_eval_callbacks);
+    }
+
+    void ComputeContext::register_eval_callbacks(std::function<void(void)> before, std::function<void(void)> after)
+    {
+        if (before) before_eval_callbacks.push_back(before);
+        if (after)  after_eval_callbacks.push_back(after);
+    }
+
+    void ComputeContext::run_eval_callbacks(std::vector<std::function<void(void)>> &callbacks)
+    {
+        // each registered pair is for a single computation
+        std::vector<std::function<void(void)>> pending;
+        pending.swap(callbacks);
+        for (auto &f : pending)
+            f();
     }
 
     void ComputeContext::synchronize(void)
@@ -974,6 +1652,8 @@ namespace chatllm
 
     void ComputeContext::reset(void)
     {
+        before_eval_callbacks.clear();
+        after_eval_callbacks.clear();
         backend_context->reset();
         if (get_ctx())
             ggml_reset(get_ctx());
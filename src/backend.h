@@ -81,8 +81,21 @@ namespace chatllm
         virtual void read_tensor(const std::string &name,
                         const std::string &layer_prefix, int num, const std::string &suffix,
                         ggml::tensor *tensor) = 0;
+        virtual void read_tensor(const std::string &name,
+                        const std::vector<std::string> &concat_list, ggml::tensor *tensor) = 0;
+        // read rows [`row_start`, `row_start` + ne[1]) of a 2D tensor. type of `tensor` follows the stored one.
+        virtual void read_tensor_rows(const std::string &name, int64_t row_start, ggml::tensor *tensor) = 0;
+        // read columns [`col_start`, `col_start` + ne[0]) of a 2D tensor, aligned to blocks of the stored type.
+        virtual void read_tensor_cols(const std::string &name, int64_t col_start, ggml::tensor *tensor) = 0;
         virtual void read_scaler(const std::string &name, float *value) = 0;
         virtual bool has_tensor(const std::string &name) const = 0;
+        virtual ggml::type get_tensor_type(const std::string &name) const = 0;
+
+        // locate raw data of each slice (along dim 2) of `tensor` within the model file, so that
+        // slices can be loaded on demand. returns false if not possible (e.g. type conversion is needed).
+        virtual bool locate_tensor(const std::string &name,
+                        const std::string &layer_prefix, int num, const std::string &suffix,
+                        ggml::tensor *tensor, std::string &path, std::vector<size_t> &offsets) { return false; }
         static void map_tensor_element(ggml::tensor *tensor, std::function<float (float)> f);
     };
 
@@ -212,16 +225,24 @@ namespace chatllm
 
         void override_to_cpu_only(bool flag);
 
+        // tensor parallelism: allocate (and compute) on shard #`shard` (-1: no override)
+        void override_to_shard(int shard);
+
+        // number of shards that weights of the current layer can be split into (0: not applicable)
+        int get_shard_count(void) const;
+
     protected:
         int get_mapped_layer_id(int layer_id);
     public:
         std::vector<LayerBufAllocator> allocators;
+        std::vector<LayerBufAllocator> shard_allocators;
     protected:
         int prolog_layer_backend_map_to_layer_id = -1;
         int epilog_layer_backend_map_to_layer_id = -1;
         int cur_layer = MiscLayer::Prolog;
         std::map<ggml::tensor *, LayerBufAllocator *> alloc_of_tensor;
         bool cpu_override = false;
+        int cur_shard = -1;
     };
 
     class ComputeManager
@@ -245,8 +266,33 @@ namespace chatllm
             size_t free_memory;
         };
 
+        enum NumaMode {
+            // no NUMA awareness
+            Disabled,
+            // compute threads are spread over all nodes, weights are interleaved across nodes
+            Distribute,
+            // compute threads and weights are kept on the node where the process is started
+            Isolate,
+            // compute threads are pinned to the CPU set given by `numactl`, memory policy is left to `numactl`
+            Numactl,
+        };
+        struct NumaNodeInfo
+        {
+            int id;
+            std::string cpus;
+            size_t total_memory;
+            size_t free_memory;
+        };
+
         static void init(const std::string &ggml_dir = "");
 
+        // must be called before any backend is initialized
+        static bool numa_init(const std::string &mode);
+        static NumaMode get_numa_mode(void);
+        static std::string numa_mode_to_str(NumaMode mode);
+        static void get_numa_nodes(std::vector<NumaNodeInfo> &nodes);
+        static void numa_place_tensor(ggml::tensor *tensor);
+
         static std::string dev_type_to_str(DeviceType type);
 
         static ggml_backend_allocator get_default_allocator_cpu(bool host_buffer, int gpu_id);
@@ -268,6 +314,7 @@ namespace chatllm
 
     protected:
         static ggml_backend_reg_t backend_rpc;
+        static NumaMode numa_mode;
     };
 
     enum BufferType
@@ -316,6 +363,37 @@ namespace chatllm
         bool _is_cpu;
     };
 
+    // per-op profiling. When enabled, nodes of graphs are evaluated (and synchronized) one by one,
+    // and the time of each node is accounted to its op, layer and backend.
+    class OpProfiler
+    {
+    public:
+        enum Phase
+        {
+            Prefill,
+            Decode,
+            NUM
+        };
+
+        static void enable(bool flag);
+        static bool is_enabled(void);
+
+        static void set_phase(Phase phase);
+
+        // remember the layer that `tensor` is built in
+        static void tag(ggml::tensor *tensor, int layer_id);
+
+        static void begin_graph(void);
+        static void end_graph(void);
+        static void record(ggml::tensor *tensor, const char *backend_name);
+
+        // tables of time by op, layer and backend of each phase
+        static std::string summary(void);
+
+        // Chrome trace event format (chrome://tracing, Perfetto)
+        static bool save_trace(const std::string &file_name);
+    };
+
     class BackendContext
     {
     public:
@@ -323,7 +401,7 @@ namespace chatllm
         {
             None,
             Layer,
-            Row,    // TODO: WIP. I can't figure out a _simple_ way for this yet.
+            Row,    // in addition to `Layer`, weights of `Linear` in hidden layers are split by rows across devices
         };
 
         struct gpu_cfg
@@ -345,6 +423,12 @@ namespace chatllm
 
         static std::string get_ngl_of_model(const std::map<std::string, std::string> &model_n_gpu_layers, const std::string &model_id, const std::string fallback_id = "any");
 
+        // must be called before `init`. `device_ids`: comma separated device IDs, e.g. "0,1"
+        void set_tensor_parallel(const std::string &device_ids);
+
+        // must be called before `init`. `micro_batch`: tokens per micro-batch of pipeline parallelism, 0 to disable
+        void set_pipeline_micro_batch(int micro_batch);
+
         void init(const std::map<std::string, std::string> &model_n_gpu_layers, const std::string &model_id, const int n_layers, const size_t graph_max_nodes_num, const int n_threads, const std::string fallback_id = "any");
         void init(const std::string &gpu_cfgs, const int n_layers, const size_t graph_max_nodes_num, const int n_threads);
         void init(const std::vector<gpu_cfg> &gpu_cfgs, const int n_layers, const size_t graph_max_nodes_num, const int n_threads);
@@ -355,7 +439,8 @@ namespace chatllm
 
         bool alloc_graph(ggml_cgraph *gf);
 
-        void compute_graph(ggml_cgraph *gf);
+        // when `synchronize` is false, it returns as soon as all splits are submitted
+        void compute_graph(ggml_cgraph *gf, bool synchronize = true);
 
         void reset();
 
@@ -372,11 +457,18 @@ namespace chatllm
 
         bool is_using_gpu(void) const;
 
+        // number of backends that layers are split across (i.e. stages of a pipeline)
+        int get_stage_count(void) const;
+
     public:
         std::vector<Backend> backends;
 
         ggml_backend_t backend_cpu = nullptr;
 
+        SplitMethod split_method = SplitMethod::Layer;
+        std::vector<int> tensor_parallel_devices;
+        bool pipelined = false;
+
         // memory buffers used to evaluate the model
         std::vector<uint8_t> buf_compute_meta;
         ggml_backend_sched_t sched = nullptr;
@@ -420,6 +512,8 @@ namespace chatllm
 
         virtual void move_to_layer(int layer_id);
         virtual void backend_cpu_override(bool flag);
+        virtual void backend_shard_override(int shard);
+        int get_shard_count(void);
 
         BackendBufAllocator *get_allocator(void);
         BackendBufAllocator *get_allocator(ggml::tensor *tensor);
@@ -428,6 +522,11 @@ namespace chatllm
         virtual Backend *get_backend(void);
 
         virtual void compute(void);
+        virtual void compute_async(void);
+
+        // `before` and `after` are called around the next computation of the graph (by `compute` or `compute_async`),
+        // so that host-side states of layers follow the graph whichever code runs it. dropped by `reset`.
+        void register_eval_callbacks(std::function<void(void)> before, std::function<void(void)> after);
 
         virtual void synchronize(void);
 
@@ -457,5 +556,9 @@ namespace chatllm
         std::vector<std::vector<uint8_t>> temp_params;
     private:
         void set_backend_context(BackendContext *backend_context);
+        void run_eval_callbacks(std::vector<std::function<void(void)>> &callbacks);
+
+        std::vector<std::function<void(void)>> before_eval_callbacks;
+        std::vector<std::function<void(void)>> after_eval_callbacks;
     };
 }
\ No newline at end of file
@@ -7,6 +7,7 @@
 #include <sstream>
 #include <map>
 #include <cstdarg>
+#include <cstdint>
 
 #if defined(_WIN32)
 #define strcasecmp stricmp
@@ -39,6 +40,24 @@ namespace base64
     std::string encode_utf8(const std::string &s);
 }
 
+namespace sha256
+{
+    class Context
+    {
+    public:
+        Context();
+        void update(const void *data, size_t size);
+        // lower case hex of the digest; the context can't be updated any more
+        std::string hex_digest(void);
+    private:
+        void transform(const uint8_t *block);
+        uint32_t state[8];
+        uint64_t total;
+        uint8_t buf[64];
+        size_t buf_len;
+    };
+}
+
 namespace utils
 {
     template <class T> void ordering(const std::vector<T> &lst, std::vector<size_t> &order, bool descending = false)
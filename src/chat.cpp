@@ -1,4 +1,5 @@
 #include "chat.h"
+#include "layers.h"
 #include <algorithm>
 #include <cmath>
 #include <codecvt>
@@ -15,6 +16,7 @@
 
 #include <sys/stat.h>
 #include <thread>
+#include <mutex>
 
 #ifdef __has_include
 #if __has_include(<unistd.h>)
@@ -406,7 +408,7 @@ namespace chatllm
     }
 
     BaseStreamer::BaseStreamer(BaseTokenizer *tokenizer)
-        : is_prompt(true), tokenizer(tokenizer), log_level(0), is_first(true), print_len(0),
+        : is_prompt(true), tokenizer(tokenizer), log_level(0), is_first(true),
           interceptor(nullptr)
     {
     }
@@ -415,30 +417,7 @@ namespace chatllm
     {
         is_prompt = false;
 
-        token_cache.insert(token_cache.end(), output_ids.begin(), output_ids.end());
-        std::string text = tokenizer->decode(token_cache);
-        if (text.empty())
-        {
-            return;
-        }
-
-        std::string printable_text;
-        if ((text.back() == '\n') || (text.back() == '\r'))
-        {
-            // flush the cache after newline
-            printable_text = text.substr(print_len);
-            token_cache.clear();
-            print_len = 0;
-        }
-        else
-        {
-            size_t end = tokenizer::get_end_of_valid_utf8(text, print_len);
-            if (end > print_len)
-            {
-                printable_text = text.substr(print_len, end - print_len);
-                print_len = end;
-            }
-        }
+        std::string printable_text = decoder.put(tokenizer, output_ids);
 
         if (printable_text.size() > 0)
         {
@@ -451,13 +430,9 @@ namespace chatllm
     {
         if (tokenizer)
         {
-            std::string text = tokenizer->decode(token_cache);
-            size_t end = tokenizer::get_end_of_valid_utf8(text, print_len);
-            if (end > print_len)
-            {
-                call_put_chunk(is_first, text.substr(print_len));
-                print_len = end;
-            }
+            std::string text = decoder.flush(tokenizer);
+            if (text.size() > 0)
+                call_put_chunk(is_first, text);
         }
 
         if (interceptor)
@@ -470,8 +445,61 @@ namespace chatllm
 
         is_first = true;
         is_prompt = true;
-        token_cache.clear();
-        print_len = 0;
+        decoder.reset();
+    }
+
+    std::string IncrementalDecoder::put(const BaseTokenizer *tokenizer, const std::vector<int> &ids)
+    {
+        for (auto id : ids)
+            pending.append(tokenizer->decode_piece(id));
+
+        std::string r;
+        if (pending.empty()) return r;
+
+        if (!tokenizer->is_postprocess_local())
+        {
+            // the whole line is needed
+            if (tokenizer::get_end_of_valid_utf8(pending, 0) < pending.size()) return r;
+            r = tokenizer->postprocess(pending);
+            if (r.empty() || ((r.back() != '\n') && (r.back() != '\r'))) return "";
+            pending.clear();
+            return r;
+        }
+
+        if ((pending.back() == '\n') || (pending.back() == '\r'))
+        {
+            // flush everything after newline
+            r.swap(pending);
+            return r;
+        }
+
+        size_t end = tokenizer::get_end_of_valid_utf8(pending, 0);
+
+        // an incomplete UTF-8 sequence is at most 3 bytes, so the leading byte is invalid. don't get stuck.
+        if (pending.size() - end > 3)
+            end = pending.size();
+
+        if (end > 0)
+        {
+            r = pending.substr(0, end);
+            pending.erase(0, end);
+        }
+        return r;
+    }
+
+    std::string IncrementalDecoder::flush(const BaseTokenizer *tokenizer)
+    {
+        std::string r;
+        const size_t end = tokenizer::get_end_of_valid_utf8(pending, 0);
+        if (end > 0)
+        {
+            if (tokenizer->is_postprocess_local())
+                r.swap(pending);
+            else
+                r = tokenizer->postprocess(pending.substr(0, end));
+        }
+        pending.clear();
+        return r;
     }
 
     void BaseStreamer::set_interceptor(ChunkInterceptor *interceptor)
@@ -664,13 +692,40 @@ namespace chatllm
     void BaseTokenizer::encode(const std::string &text, std::vector<int> &ids) const
     {
         std::string input = preprocess(text);
-        tp->Encode(input, &ids);
+        if (&ids != streaming_ids)
+        {
+            tp->Encode(input, &ids);
+            return;
+        }
+
+        tp->EncodeStream(input, [this, &ids](const std::vector<int> &chunk) {
+            ids.insert(ids.end(), chunk.begin(), chunk.end());
+            history_consumer(ids);
+        });
     }
 
-    void BaseTokenizer::encode_external_text_completion(const std::string &text, std::vector<int> &ids) const
+    void BaseTokenizer::set_history_consumer(tokenizer::Processor::IdsConsumer consumer)
+    {
+        history_consumer = consumer;
+        streaming_ids = nullptr;
+    }
+
+    void BaseTokenizer::set_encode_threads(int n_threads)
+    {
+        if (tp) tp->SetEncodeThreads(n_threads);
+    }
+
+    void BaseTokenizer::encode_external_text_completion(const std::string &text, const tokenizer::Processor::IdsConsumer &consumer) const
     {
         std::string input = preprocess(text);
-        tp->Encode(input, &ids);
+        tp->EncodeStream(input, consumer);
+    }
+
+    void BaseTokenizer::encode_external_text_completion(const std::string &text, std::vector<int> &ids) const
+    {
+        encode_external_text_completion(text, [&ids](const std::vector<int> &chunk) {
+            ids.insert(ids.end(), chunk.begin(), chunk.end());
+        });
     }
 
     void BaseTokenizer::encode_qa(const std::string &q, const std::string &a, std::vector<int> &ids) const
@@ -720,6 +775,15 @@ namespace chatllm
         return text;
     }
 
+    std::string BaseTokenizer::decode_piece(int id) const
+    {
+        if (is_special_id(id)) return "";
+
+        std::string text;
+        tp->Decode({id}, &text);
+        return is_postprocess_local() ? postprocess(text) : text;
+    }
+
     int BaseTokenizer::get_history_start(const Messages &history, int max_length) const
     {
         int start = (int)history.size() - 1;
@@ -753,11 +817,18 @@ namespace chatllm
                 ;
         }
 
+        // only the outermost history is streamed
+        const bool streaming = history_consumer && (nullptr == streaming_ids);
+        if (streaming) streaming_ids = &input_ids;
+
         for (; encode_start < (int)history.size(); encode_start++)
         {
             encoder->append_message(history[encode_start], input_ids);
+            if (streaming) history_consumer(input_ids);
         }
 
+        if (streaming) streaming_ids = nullptr;
+
         if (ai_opening)
         {
             if (reversed_role)
@@ -1074,6 +1145,13 @@ namespace chatllm
     }
 
     MappedFile::~MappedFile() { CHATLLM_CHECK(munmap(data, _size) == 0) << strerror(errno); }
+
+    void MappedFile::prefetch(int64_t offset, size_t len)
+    {
+        static const int64_t page_size = sysconf(_SC_PAGESIZE);
+        const int64_t start = offset & ~(page_size - 1);
+        madvise(data + start, (size_t)(offset - start) + len, MADV_WILLNEED);
+    }
 #elif defined(_WIN32)
     MappedFile::MappedFile(const std::string &path)
     {
@@ -1101,6 +1179,16 @@ namespace chatllm
     {
         CHATLLM_CHECK(UnmapViewOfFile(data)) << strerror(errno);
     }
+
+    void MappedFile::prefetch(int64_t offset, size_t len)
+    {
+#if defined(_WIN32_WINNT) && (_WIN32_WINNT >= 0x0602)
+        WIN32_MEMORY_RANGE_ENTRY range;
+        range.VirtualAddress = data + offset;
+        range.NumberOfBytes  = len;
+        PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+#endif
+    }
 #endif
 
     int64_t MappedFile::tell()
@@ -1485,6 +1573,74 @@ namespace chatllm
         read_tensor(name, layer_prefix, num, suffix, tensor, alloc_manager()->get_allocator(tensor));
     }
 
+    void ModelLoader::read_tensor(const std::string &name,
+                    const std::vector<std::string> &concat_list, ggml::tensor *tensor)
+    {
+        read_tensor(name, concat_list, tensor, alloc_manager()->get_allocator(tensor));
+    }
+
+    void ModelLoader::read_tensor_rows(const std::string &name, int64_t row_start, ggml::tensor *tensor)
+    {
+        auto translated = translate_tensor_name(name);
+        auto search = tensor_dict.find(translated);
+        CHATLLM_CHECK(search != tensor_dict.end()) << "tensor not exist: " << translated;
+
+        TensorInfo &t = search->second;
+        CHATLLM_CHECK(t._offset > 0) << "tensor " << name << " has no data in the file";
+        CHATLLM_CHECK(ggml::n_dims(&t.tensor) == 2) << "tensor " << name << " is not a matrix";
+        CHATLLM_CHECK(t.tensor.ne[0] == tensor->ne[0]) << "tensor " << name << " shape mismatch at dim 0: expect " << tensor->ne[0] << " but got " << t.tensor.ne[0];
+        CHATLLM_CHECK(row_start + tensor->ne[1] <= t.tensor.ne[1]) << "tensor " << name << " rows out of range";
+
+        // `t.tensor` is changed to the target type once loaded
+        const ggml::type file_type = t.data ? t.original_type : ggml::type_of(&t.tensor);
+
+        ggml::set_name(tensor, name.c_str());
+        ggml::change_type(tensor, file_type);
+
+        auto allocator = alloc_manager()->get_allocator(tensor);
+        CHATLLM_CHECK(allocator->alloc(tensor)) << "failed to allocate tensor: " << name;
+
+        std::vector<uint8_t> buf(ggml::nbytes(tensor));
+        _file->seek(t.aligned_data_start(t._offset) + row_start * ggml::row_size(file_type, t.tensor.ne[0]), SEEK_SET);
+        _file->read_buffer(buf.data(), buf.size());
+        Backend::write_tensor_data(tensor, buf.data());
+    }
+
+    void ModelLoader::read_tensor_cols(const std::string &name, int64_t col_start, ggml::tensor *tensor)
+    {
+        auto translated = translate_tensor_name(name);
+        auto search = tensor_dict.find(translated);
+        CHATLLM_CHECK(search != tensor_dict.end()) << "tensor not exist: " << translated;
+
+        TensorInfo &t = search->second;
+        CHATLLM_CHECK(t._offset > 0) << "tensor " << name << " has no data in the file";
+        CHATLLM_CHECK(ggml::n_dims(&t.tensor) == 2) << "tensor " << name << " is not a matrix";
+        CHATLLM_CHECK(t.tensor.ne[1] == tensor->ne[1]) << "tensor " << name << " shape mismatch at dim 1: expect " << tensor->ne[1] << " but got " << t.tensor.ne[1];
+        CHATLLM_CHECK(col_start + tensor->ne[0] <= t.tensor.ne[0]) << "tensor " << name << " columns out of range";
+
+        // `t.tensor` is changed to the target type once loaded
+        const ggml::type file_type = t.data ? t.original_type : ggml::type_of(&t.tensor);
+        const int64_t block = ggml::block_size(file_type);
+        CHATLLM_CHECK((col_start % block == 0) && (tensor->ne[0] % block == 0)) << "tensor " << name << " columns not aligned to blocks";
+
+        ggml::set_name(tensor, name.c_str());
+        ggml::change_type(tensor, file_type);
+
+        auto allocator = alloc_manager()->get_allocator(tensor);
+        CHATLLM_CHECK(allocator->alloc(tensor)) << "failed to allocate tensor: " << name;
+
+        const size_t file_row_size = ggml::row_size(file_type, t.tensor.ne[0]);
+        const size_t row_size      = ggml::row_size(file_type, tensor->ne[0]);
+        const size_t col_offset    = ggml::row_size(file_type, col_start);
+        std::vector<uint8_t> buf(ggml::nbytes(tensor));
+        for (int64_t i = 0; i < tensor->ne[1]; i++)
+        {
+            _file->seek(t.aligned_data_start(t._offset) + i * file_row_size + col_offset, SEEK_SET);
+            _file->read_buffer(buf.data() + i * row_size, row_size);
+        }
+        Backend::write_tensor_data(tensor, buf.data());
+    }
+
     bool ModelLoader::has_tensor(const std::string &name) const
     {
         auto translated = translate_tensor_name(name);
@@ -1492,6 +1648,14 @@ namespace chatllm
         return search != tensor_dict.end();
     }
 
+    ggml::type ModelLoader::get_tensor_type(const std::string &name) const
+    {
+        auto translated = translate_tensor_name(name);
+        auto search = tensor_dict.find(translated);
+        CHATLLM_CHECK(search != tensor_dict.end()) << "tensor not exist: " << translated;
+        return ggml::type_of(&search->second.tensor);
+    }
+
     void  ModelLoader::read_scaler(const std::string &name, float *value)
     {
         auto translated = translate_tensor_name(name);
@@ -1519,6 +1683,43 @@ namespace chatllm
         }
     }
 
+    bool ModelLoader::locate_tensor(const std::string &name,
+                    const std::string &layer_prefix, int num, const std::string &suffix,
+                    ggml::tensor *tensor, std::string &path, std::vector<size_t> &offsets)
+    {
+        if (file_path.size() < 1) return false;
+
+        auto matched = [tensor](TensorInfo &t, int n) {
+            // tensors created by concatenation (`_offset == 0`) have no data in the file
+            return (t._offset > 0) && (ggml::type_of(&t.tensor) == ggml::type_of(tensor))
+                && (t.tensor.ne[0] == tensor->ne[0]) && (t.tensor.ne[1] == tensor->ne[1]) && (t.tensor.ne[2] == n);
+        };
+
+        path = file_path;
+        offsets.clear();
+
+        auto search = tensor_dict.find(translate_tensor_name(name));
+        if (search != tensor_dict.end())
+        {
+            TensorInfo &t = search->second;
+            if (!matched(t, num)) return false;
+            for (int i = 0; i < num; i++)
+                offsets.push_back(t.aligned_data_start(t._offset) + i * tensor->nb[2]);
+            return true;
+        }
+
+        for (int i = 0; i < num; i++)
+        {
+            auto translated = translate_tensor_name(layer_prefix + std::to_string(i) + suffix);
+            auto search = tensor_dict.find(translated);
+            CHATLLM_CHECK(search != tensor_dict.end()) << "tensor " << translated << " not exists.";
+            TensorInfo &t = search->second;
+            if (!matched(t, 1)) return false;
+            offsets.push_back(t.aligned_data_start(t._offset));
+        }
+        return true;
+    }
+
     void ModelLoader::read_tensor(const std::string &name, ggml::tensor *tensor, LayerBufAllocator *allocator, bool partial)
     {
         auto translated = translate_tensor_name(name);
@@ -1805,6 +2006,9 @@ namespace chatllm
     {
         model = modelobj.model.get();
         tokenizer = modelobj.tokenizer.get();
+        performance.metrics = &metrics;
+        if (modelobj.loaded)
+            metrics.set_model_name(model->type_name());
     }
 
     std::string Pipeline::chat_with_restart(const Messages &history, const GenerationConfig &gen_config,
@@ -1812,6 +2016,7 @@ namespace chatllm
     {
         bool continuous = tokenizer->get_chat_format() == ChatFormat::CHAT;
         bool completed = false;
+        bool prefilled = false;
         std::vector<int> input_ids;
         if (initializing)
         {
@@ -1820,10 +2025,10 @@ namespace chatllm
         }
         else;
 
-        input_ids = tokenizer->encode_history(history, gen_config.max_context_length, continuous, true, gen_config.reversed_role);
+        input_ids = encode_history_prefilling(history, gen_config, continuous, prefilled);
         add_ai_prefix(input_ids, gen_config, streamer);
 
-        std::vector<int> output_ids = model->generate(input_ids, gen_config, continuous, completed, &performance, streamer);
+        std::vector<int> output_ids = model->generate(input_ids, gen_config, continuous || prefilled, completed, &performance, streamer);
         if (!completed)
         {
             if (continuous)
@@ -1846,6 +2051,7 @@ namespace chatllm
     {
         bool continuous = tokenizer->get_chat_format() == ChatFormat::CHAT;
         bool completed = false;
+        bool prefilled = false;
         std::vector<int> input_ids;
         if (initializing)
         {
@@ -1854,10 +2060,10 @@ namespace chatllm
         }
         else;
 
-        input_ids = tokenizer->encode_history(history, gen_config.max_context_length, continuous, true, gen_config.reversed_role);
+        input_ids = encode_history_prefilling(history, gen_config, continuous, prefilled);
         add_ai_prefix(input_ids, gen_config, streamer);
 
-        std::vector<int> output_ids = model->generate(input_ids, gen_config, continuous, completed, &performance, streamer);
+        std::vector<int> output_ids = model->generate(input_ids, gen_config, continuous || prefilled, completed, &performance, streamer);
         if (!completed)
         {
             streamer->putln("\nRUN OUT OF CONTEXT. I have to stop now.\n");
@@ -1879,10 +2085,11 @@ namespace chatllm
         }
         else;
 
-        std::vector<int> input_ids = tokenizer->encode_history(history, gen_config.max_context_length, continuous, true, gen_config.reversed_role);
+        bool prefilled = false;
+        std::vector<int> input_ids = encode_history_prefilling(history, gen_config, continuous, prefilled);
         add_ai_prefix(input_ids, gen_config, streamer);
 
-        std::vector<int> output_ids = model->generate(input_ids, gen_config, continuous, completed, &performance, streamer);
+        std::vector<int> output_ids = model->generate(input_ids, gen_config, continuous || prefilled, completed, &performance, streamer);
 
         while (!completed)
         {
@@ -1934,6 +2141,7 @@ namespace chatllm
 
         if (modelobj.loaded)
         {
+            performance.BeginRequest();
             switch (extending)
             {
             case ExtendingMethod::Shift:
@@ -1946,6 +2154,11 @@ namespace chatllm
                 r = chat_without_extending(history, gen_config, streamer);
                 break;
             }
+            performance.EndRequest(model->get_n_past(), model->get_max_length(), model->get_cache_bytes());
+
+            auto experts = model->get_expert_cache_stats();
+            metrics.expert_cache_hits.store(experts.hits, std::memory_order_relaxed);
+            metrics.expert_cache_misses.store(experts.misses, std::memory_order_relaxed);
         }
 
         post_chat(history, gen_config, streamer);
@@ -1971,6 +2184,64 @@ namespace chatllm
         }
     }
 
+    bool Pipeline::prefill(const std::vector<int> &input_ids, const GenerationConfig &gen_config)
+    {
+        performance.Reset();
+        if (!model->prefill(input_ids, gen_config)) return false;
+        performance.Accumulate(ModelPerfInfo::Type::Prompt, input_ids.size());
+        return true;
+    }
+
+    std::vector<int> Pipeline::encode_history_prefilling(const Messages &history, const GenerationConfig &gen_config, const bool continuous, bool &prefilled)
+    {
+        // the last id is always left to `generate`, which needs its logits.
+        // media embeddings are generated by `generate`, so nothing is prefilled once media show up.
+        const size_t PREFILL_MIN_IDS = 512;
+        const int n_past = continuous ? model->get_n_past() : 0;
+        std::vector<int> prefilled_ids;
+        bool prefilling = true;
+
+        tokenizer->set_history_consumer([&](const std::vector<int> &ids) {
+            if (!prefilling || (tokenizer->media_emb.size() > 0) || (ids.size() <= prefilled_ids.size() + PREFILL_MIN_IDS)) return;
+
+            // like `generate` does for a new sequence
+            if (!continuous && (prefilled_ids.size() < 1))
+                model->set_n_past(0);
+
+            std::vector<int> chunk(ids.begin() + prefilled_ids.size(), ids.end() - 1);
+            prefilling = prefill(chunk, gen_config);
+            if (prefilling)
+                prefilled_ids.insert(prefilled_ids.end(), chunk.begin(), chunk.end());
+        });
+
+        std::vector<int> input_ids;
+        try
+        {
+            input_ids = tokenizer->encode_history(history, gen_config.max_context_length, continuous, true, gen_config.reversed_role);
+        }
+        catch (...)
+        {
+            tokenizer->set_history_consumer(nullptr);
+            throw;
+        }
+        tokenizer->set_history_consumer(nullptr);
+
+        prefilled = false;
+        if (prefilled_ids.size() < 1) return input_ids;
+
+        // encoders changed ids already prefilled, or media showed up later: start over
+        if ((tokenizer->media_emb.size() > 0) || (input_ids.size() <= prefilled_ids.size())
+            || !std::equal(prefilled_ids.begin(), prefilled_ids.end(), input_ids.begin()))
+        {
+            rewind(n_past);
+            return input_ids;
+        }
+
+        prefilled = true;
+        input_ids.erase(input_ids.begin(), input_ids.begin() + prefilled_ids.size());
+        return input_ids;
+    }
+
     std::string Pipeline::chat_with_ext_completion(Messages &history, const std::string &external, const GenerationConfig &gen_config,
                          BaseStreamer *streamer)
     {
@@ -1982,10 +2253,23 @@ namespace chatllm
         rewind((int)input_ids.size());
         input_ids.clear();
 
-        tokenizer->encode_external_text_completion(external, input_ids);
         if (streamer)
             streamer->call_put_chunk(false, external);
 
+        // prefill while the rest of `external` is still being encoded.
+        // the last id is always left to `generate`, which needs its logits.
+        const size_t PREFILL_MIN_IDS = 512;
+        bool prefilling = true;
+        tokenizer->encode_external_text_completion(external, [&](const std::vector<int> &ids) {
+            input_ids.insert(input_ids.end(), ids.begin(), ids.end());
+            if (!prefilling || (input_ids.size() <= PREFILL_MIN_IDS)) return;
+
+            std::vector<int> prefix(input_ids.begin(), input_ids.end() - 1);
+            prefilling = prefill(prefix, gen_config);
+            if (prefilling)
+                input_ids.erase(input_ids.begin(), input_ids.end() - 1);
+        });
+
         history[history.size() - 1].content.push_back(external);
 
         std::vector<int> output_ids = model->generate(input_ids, gen_config, continuous, completed, &performance, streamer);
@@ -2053,12 +2337,15 @@ namespace chatllm
         model->embedding(gen_config, input_ids, result);
     }
 
-    bool Pipeline::speech_synthesis(const std::string &input, const GenerationConfig &gen_config, std::vector<int16_t> &audio, int &sample_rate, int &channels)
+    bool Pipeline::speech_synthesis(const std::string &input, const GenerationConfig &gen_config, std::vector<int16_t> &audio, int &sample_rate, int &channels,
+                                    BaseStreamer *streamer)
     {
         if (!modelobj.loaded) return false;
+        performance.BeginRequest();
         std::vector<int> input_ids;
         tokenizer->encode(input, input_ids);
-        model->speech_synthesis(gen_config, input_ids, audio, sample_rate, channels);
+        model->speech_synthesis(gen_config, input_ids, audio, sample_rate, channels, streamer, &performance);
+        performance.EndRequest(model->get_n_past(), model->get_max_length(), model->get_cache_bytes());
         return true;
     }
 
@@ -2593,8 +2880,23 @@ final:
 
     void ModelPerfInfo::Accumulate(Type type, size_t tok_count)
     {
-        timings[type].tok_count += tok_count;
-        timings[type].duration_ms += Elapsed();
+        const double elapsed = Elapsed();
+        {
+            std::lock_guard<std::mutex> lock(timings_mutex);
+            timings[type].tok_count += tok_count;
+            timings[type].duration_ms += elapsed;
+        }
+        if (nullptr == metrics) return;
+        if (type == Type::Prompt)
+            metrics->prompt_tokens.add(tok_count);
+        else
+            metrics->generated_tokens.add(tok_count);
+    }
+
+    ModelPerfInfo::Performance ModelPerfInfo::GetTiming(Type type) const
+    {
+        std::lock_guard<std::mutex> lock(timings_mutex);
+        return timings[type];
     }
 
     void ModelPerfInfo::Reset(void)
@@ -2609,6 +2911,195 @@ final:
         return r;
     }
 
+    void ModelPerfInfo::BeginRequest(void)
+    {
+        in_request  = true;
+        encoded     = false;
+        first_token = true;
+        req_beg     = Clock::now();
+    }
+
+    void ModelPerfInfo::PromptEncoded(void)
+    {
+        if (!in_request || encoded) return;
+        encoded = true;
+        if (metrics)
+            metrics->latency[Metrics::Latency::Tokenize].observe(std::chrono::duration<double>(Clock::now() - req_beg).count());
+    }
+
+    void ModelPerfInfo::TokenGenerated(int n)
+    {
+        if (!in_request || (n < 1)) return;
+        auto now = Clock::now();
+        if (metrics)
+        {
+            if (first_token)
+                metrics->latency[Metrics::Latency::TTFT].observe(std::chrono::duration<double>(now - req_beg).count());
+            else
+            {
+                const double interval = std::chrono::duration<double>(now - last_token).count() / n;
+                for (int i = 0; i < n; i++)
+                    metrics->latency[Metrics::Latency::InterToken].observe(interval);
+            }
+        }
+        first_token = false;
+        last_token  = now;
+    }
+
+    void ModelPerfInfo::EndRequest(int kv_cache_tokens, int kv_cache_capacity, size_t kv_cache_bytes)
+    {
+        if (!in_request) return;
+        in_request = false;
+        if (nullptr == metrics) return;
+        metrics->requests.add();
+        metrics->latency[Metrics::Latency::Request].observe(std::chrono::duration<double>(Clock::now() - req_beg).count());
+        metrics->kv_cache_tokens.store(kv_cache_tokens, std::memory_order_relaxed);
+        metrics->kv_cache_capacity.store(kv_cache_capacity, std::memory_order_relaxed);
+        const int64_t used = kv_cache_capacity > 0 ? (int64_t)((double)kv_cache_bytes * std::min(kv_cache_tokens, kv_cache_capacity) / kv_cache_capacity) : 0;
+        metrics->kv_cache_bytes.store(used, std::memory_order_relaxed);
+        metrics->kv_cache_capacity_bytes.store((int64_t)kv_cache_bytes, std::memory_order_relaxed);
+    }
+
+    // ===== metrics =====
+
+    static std::mutex           metrics_mutex;
+    static std::vector<Metrics *> metrics_registry;
+    static std::atomic<int>     metrics_next_id {0};
+
+    static int metrics_stripe(void)
+    {
+        static std::atomic<int> next_thread {0};
+        static thread_local int stripe = next_thread.fetch_add(1, std::memory_order_relaxed);
+        return stripe;
+    }
+
+    void Metrics::Counter::add(uint64_t v)
+    {
+        stripes[metrics_stripe() % STRIPES].v.fetch_add(v, std::memory_order_relaxed);
+    }
+
+    uint64_t Metrics::Counter::get(void) const
+    {
+        uint64_t r = 0;
+        for (auto &s : stripes)
+            r += s.v.load(std::memory_order_relaxed);
+        return r;
+    }
+
+    const double Metrics::Histogram::bounds[Metrics::Histogram::NUM_BOUNDS] =
+    {
+        0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0, 30.0, 60.0
+    };
+
+    void Metrics::Histogram::observe(double seconds)
+    {
+        int i = 0;
+        while ((i < NUM_BOUNDS) && (seconds > bounds[i])) i++;
+        buckets[i].add();
+        sum_us.add((uint64_t)(seconds * 1e6));
+    }
+
+    void Metrics::Histogram::expose(std::ostringstream &oss, const std::string &name, const std::string &labels) const
+    {
+        uint64_t count = 0;
+        for (int i = 0; i < NUM_BOUNDS; i++)
+        {
+            count += buckets[i].get();
+            oss << name << "_bucket{" << labels << ",le=\"" << bounds[i] << "\"} " << count << "\n";
+        }
+        count += buckets[NUM_BOUNDS].get();
+        oss << name << "_bucket{" << labels << ",le=\"+Inf\"} " << count << "\n";
+        oss << name << "_sum{"   << labels << "} " << sum_us.get() / 1e6 << "\n";
+        oss << name << "_count{" << labels << "} " << count << "\n";
+    }
+
+    Metrics::Metrics() : id(metrics_next_id.fetch_add(1))
+    {
+        std::lock_guard<std::mutex> lock(metrics_mutex);
+        metrics_registry.push_back(this);
+    }
+
+    Metrics::~Metrics()
+    {
+        std::lock_guard<std::mutex> lock(metrics_mutex);
+        metrics_registry.erase(std::find(metrics_registry.begin(), metrics_registry.end(), this));
+    }
+
+    void Metrics::set_model_name(const std::string &name)
+    {
+        std::lock_guard<std::mutex> lock(metrics_mutex);
+        model_name = name;
+    }
+
+    std::string Metrics::expose(void)
+    {
+        static const char *latency_names[Latency::NUM] =
+        {
+            "chatllm_tokenize_seconds",
+            "chatllm_time_to_first_token_seconds",
+            "chatllm_inter_token_seconds",
+            "chatllm_request_seconds",
+        };
+        static const char *latency_helps[Latency::NUM] =
+        {
+            "Time of encoding a request into tokens.",
+            "Time from the start of a request to the first generated token.",
+            "Time between two generated tokens.",
+            "Time of a whole request.",
+        };
+
+        std::lock_guard<std::mutex> lock(metrics_mutex);
+
+        std::vector<std::string> labels;
+        for (auto m : metrics_registry)
+        {
+            std::string name;
+            for (auto c : m->model_name)
+            {
+                if ((c == '"') || (c == '\\')) name.push_back('\\');
+                name.push_back(c);
+            }
+            labels.push_back("model=\"" + name + "\",id=\"" + std::to_string(m->id) + "\"");
+        }
+
+        std::ostringstream oss;
+        oss.precision(12);
+        auto family = [&oss, &labels](const char *name, const char *type, const char *help, std::function<void (Metrics *m, const std::string &labels)> sample)
+        {
+            oss << "# HELP " << name << " " << help << "\n";
+            oss << "# TYPE " << name << " " << type << "\n";
+            for (size_t i = 0; i < metrics_registry.size(); i++)
+                sample(metrics_registry[i], labels[i]);
+        };
+
+        family("chatllm_requests_total", "counter", "Number of served requests.",
+            [&oss](Metrics *m, const std::string &labels) { oss << "chatllm_requests_total{" << labels << "} " << m->requests.get() << "\n"; });
+        family("chatllm_prompt_tokens_total", "counter", "Number of evaluated prompt tokens.",
+            [&oss](Metrics *m, const std::string &labels) { oss << "chatllm_prompt_tokens_total{" << labels << "} " << m->prompt_tokens.get() << "\n"; });
+        family("chatllm_generated_tokens_total", "counter", "Number of generated tokens.",
+            [&oss](Metrics *m, const std::string &labels) { oss << "chatllm_generated_tokens_total{" << labels << "} " << m->generated_tokens.get() << "\n"; });
+        family("chatllm_kv_cache_tokens", "gauge", "Number of tokens in the KV cache.",
+            [&oss](Metrics *m, const std::string &labels) { oss << "chatllm_kv_cache_tokens{" << labels << "} " << m->kv_cache_tokens.load(std::memory_order_relaxed) << "\n"; });
+        family("chatllm_kv_cache_capacity_tokens", "gauge", "Capacity of the KV cache in tokens.",
+            [&oss](Metrics *m, const std::string &labels) { oss << "chatllm_kv_cache_capacity_tokens{" << labels << "} " << m->kv_cache_capacity.load(std::memory_order_relaxed) << "\n"; });
+        family("chatllm_kv_cache_bytes", "gauge", "Bytes of the KV cache in use (estimated from the number of tokens).",
+            [&oss](Metrics *m, const std::string &labels) { oss << "chatllm_kv_cache_bytes{" << labels << "} " << m->kv_cache_bytes.load(std::memory_order_relaxed) << "\n"; });
+        family("chatllm_kv_cache_capacity_bytes", "gauge", "Bytes allocated for the KV cache.",
+            [&oss](Metrics *m, const std::string &labels) { oss << "chatllm_kv_cache_capacity_bytes{" << labels << "} " << m->kv_cache_capacity_bytes.load(std::memory_order_relaxed) << "\n"; });
+
+        for (int i = 0; i < Latency::NUM; i++)
+        {
+            family(latency_names[i], "histogram", latency_helps[i],
+                [i, &oss](Metrics *m, const std::string &labels) { m->latency[i].expose(oss, latency_names[i], labels); });
+        }
+        family("chatllm_moe_expert_cache_hits_total", "counter", "Selected experts that are resident.",
+            [&oss](Metrics *m, const std::string &labels) { oss << "chatllm_moe_expert_cache_hits_total{" << labels << "} " << m->expert_cache_hits.load(std::memory_order_relaxed) << "\n"; });
+        family("chatllm_moe_expert_cache_misses_total", "counter", "Selected experts that are loaded on demand.",
+            [&oss](Metrics *m, const std::string &labels) { oss << "chatllm_moe_expert_cache_misses_total{" << labels << "} " << m->expert_cache_misses.load(std::memory_order_relaxed) << "\n"; });
+
+        return oss.str();
+    }
+
     VectorStores::VectorStores(DistanceStrategy vec_cmp, const std::map<std::string, std::vector<std::string>> &vector_stores)
         : def_store(nullptr)
     {
@@ -9,6 +9,8 @@
 #include <vector>
 #include <random>
 #include <chrono>
+#include <atomic>
+#include <mutex>
 #include <cstring>
 #include "basics.h"
 #include "tokenizer.h"
@@ -266,6 +268,8 @@ namespace chatllm
     std::string trim(std::string str, const char *spaces = " \t");
 
     class BaseHistoryEncoder;
+    class ExpertPools;
+    class MoERoutingProfiles;
 
     class BaseTokenizer
     {
@@ -303,7 +307,12 @@ namespace chatllm
         virtual void encode(const std::string &text, std::vector<int> &ids) const;
         std::vector<int> encode(const std::string &text) const;
 
-        virtual void encode_external_text_completion(const std::string &text, std::vector<int> &ids) const;
+        void set_encode_threads(int n_threads);
+
+        // ids are handed over chunk by chunk, so that consumers (e.g. prefilling) can start early.
+        // this is the one to override: the other overload is built on it.
+        virtual void encode_external_text_completion(const std::string &text, const tokenizer::Processor::IdsConsumer &consumer) const;
+        void encode_external_text_completion(const std::string &text, std::vector<int> &ids) const;
 
         virtual void encode_qa(const std::string &q, const std::string &a, std::vector<int> &ids) const;
         virtual void encode_qa(const Content &q, const Content &a, std::vector<int> &ids) const;
@@ -311,6 +320,13 @@ namespace chatllm
 
         virtual std::string decode(const std::vector<int> &ids) const;
 
+        // decode a single id. `decode(ids)` is the concatenation of pieces of `ids`, post-processed as a whole
+        // if post-processing is not local (pieces are returned as is then).
+        std::string decode_piece(int id) const;
+
+        // true if post-processing a text equals post-processing its pieces one by one
+        virtual bool is_postprocess_local(void) const { return true; }
+
         virtual std::vector<int> encode_history(const Messages &history, int max_length,
                                                 const bool incremental = false,
                                                 const bool ai_opening = true,
@@ -321,6 +337,10 @@ namespace chatllm
                                                 const bool reversed_role = false);
         virtual std::vector<int> encode_sys_prompt(void);
 
+        // while set, all ids of the history being encoded are handed over to `consumer` whenever some are appended
+        // (chunk by chunk within long texts), so that they can be prefilled early. see `Pipeline::encode_history_prefilling`.
+        void set_history_consumer(tokenizer::Processor::IdsConsumer consumer);
+
         void set_system_prompt(const std::string &prompt) { sys_prompt = prompt; }
         const std::string &get_system_prompt(void) { return sys_prompt; }
         virtual void set_additional_args(const std::map<std::string, std::string> &args) {}
@@ -355,6 +375,8 @@ namespace chatllm
 
         int load_added_tokens(const json::JSON &config, std::initializer_list<std::pair<std::string, int *>> added_tokens);
 
+        friend class IncrementalDecoder;
+
     public:
         tokenizer::Processor *tp;
         std::vector<MediaAsEmbeddingVector> media_emb;
@@ -368,6 +390,8 @@ namespace chatllm
         bool auto_add_bos;
         std::vector<char> vocab_for_c;
         int vocab_width = -1;
+        tokenizer::Processor::IdsConsumer history_consumer;
+        std::vector<int> *streaming_ids = nullptr;      // ids of the history being encoded, handed over to `history_consumer`
     public:
         const int vocab_size;
         std::set<int> terminate_ids;
@@ -453,6 +477,8 @@ namespace chatllm
         {
             cache_dtype = ctx->cache_dtype;
             dtype = ctx->dtype;
+            expert_pools = ctx->expert_pools;
+            routing_profiles = ctx->routing_profiles;
         }
 
         struct ggml_context *get_ctx() override { return gctx.get(); }
@@ -460,6 +486,8 @@ namespace chatllm
         GGMLContext gctx;
         ggml::type dtype;
         ggml::type cache_dtype;
+        ExpertPools *expert_pools = nullptr;
+        MoERoutingProfiles *routing_profiles = nullptr;
     };
 
     class CacheTypeChanger
@@ -554,6 +582,24 @@ namespace chatllm
         const bool activated;
     };
 
+    // stateful detokenizer for streaming: each id is decoded only once,
+    // and only trailing bytes of incomplete UTF-8 sequences are kept.
+    // if post-processing of the tokenizer is not local, text is kept and post-processed line by line.
+    class IncrementalDecoder
+    {
+    public:
+        // returns text that is ready for output
+        std::string put(const BaseTokenizer *tokenizer, const std::vector<int> &ids);
+
+        // returns all pending bytes, if there are any valid UTF-8 ones
+        std::string flush(const BaseTokenizer *tokenizer);
+
+        void reset(void) { pending.clear(); }
+
+    protected:
+        std::string pending;
+    };
+
     class BaseStreamer;
 
     class ChunkInterceptor
@@ -631,6 +677,9 @@ namespace chatllm
             putln(line, TextType::TOOL_CALLING);
         }
 
+        // tts: PCM samples, as they are synthesized
+        virtual void put_audio(const int16_t *pcm_samples, int sample_num, int sample_rate, int channels) {}
+
         virtual void call_put_chunk(bool first, const std::string &chunk);
     public:
         bool is_prompt;
@@ -638,8 +687,7 @@ namespace chatllm
         int log_level;
     protected:
         bool is_first;
-        size_t print_len;
-        std::vector<int> token_cache;
+        IncrementalDecoder decoder;
         ChunkInterceptor *interceptor; // first interceptor in the chain
     };
 
@@ -679,6 +727,11 @@ namespace chatllm
 
         size_t read_buffer(void *output, size_t len) override;
 
+        const void *get_data(int64_t offset) const { return data + offset; }
+
+        // hint that `[offset, offset + len)` will be accessed soon
+        void prefetch(int64_t offset, size_t len);
+
     protected:
         char *data;
         const char *ptr;
@@ -736,6 +789,7 @@ namespace chatllm
         ModelLoader(const std::string &path)
             : ModelLoader(new SimpleFile(path))
         {
+            file_path = path;
         }
 
         int64_t tell() const
@@ -768,11 +822,19 @@ namespace chatllm
         void read_tensor(const std::string &name,
                         const std::string &layer_prefix, int num, const std::string &suffix,
                         ggml::tensor *tensor) override;
+        void read_tensor(const std::string &name,
+                        const std::vector<std::string> &concat_list, ggml::tensor *tensor) override;
+        void read_tensor_rows(const std::string &name, int64_t row_start, ggml::tensor *tensor) override;
+        void read_tensor_cols(const std::string &name, int64_t col_start, ggml::tensor *tensor) override;
         void read_scaler(const std::string &name, float *value) override;
+        bool locate_tensor(const std::string &name,
+                        const std::string &layer_prefix, int num, const std::string &suffix,
+                        ggml::tensor *tensor, std::string &path, std::vector<size_t> &offsets) override;
 
         void map_tensor_element(ggml::tensor *tensor, std::function<float (float)> f);
 
         bool has_tensor(const std::string &name) const override;
+        ggml::type get_tensor_type(const std::string &name) const override;
 
         void load_all_tensors(void);
 
@@ -781,6 +843,11 @@ namespace chatllm
             return _file.get();
         }
 
+        const std::string &get_file_path(void) const
+        {
+            return file_path;
+        }
+
         void add_tensor_name_translation(const std::string &from_name, const std::string &to_name)
         {
             name_translation.push_back(std::make_pair(from_name, to_name));
@@ -820,6 +887,7 @@ namespace chatllm
         }
 
         std::unique_ptr<tokenizer::DataReader> _file;
+        std::string file_path;
 
     public:
         BaseConfig basic_config;
@@ -918,6 +986,74 @@ namespace chatllm
         }
     };
 
+    // counters & latency histograms of a model (pipeline), exported in Prometheus text exposition format.
+    // recording is lock-free: counters are striped over cache lines, and threads are spread among stripes.
+    class Metrics
+    {
+    public:
+        class Counter
+        {
+        public:
+            void add(uint64_t v = 1);
+            uint64_t get(void) const;
+
+        private:
+            static const int STRIPES = 8;
+            struct alignas(64) Stripe
+            {
+                std::atomic<uint64_t> v {0};
+            };
+            Stripe stripes[STRIPES];
+        };
+
+        class Histogram
+        {
+        public:
+            static const int NUM_BOUNDS = 15;
+            static const double bounds[NUM_BOUNDS];   // in seconds
+
+            void observe(double seconds);
+            void expose(std::ostringstream &oss, const std::string &name, const std::string &labels) const;
+
+        private:
+            Counter buckets[NUM_BOUNDS + 1];
+            Counter sum_us;
+        };
+
+        enum Latency
+        {
+            Tokenize,       // encoding of a request
+            TTFT,           // time to first token
+            InterToken,     // between two generated tokens
+            Request,        // whole request
+            NUM
+        };
+
+        Metrics();
+        ~Metrics();
+
+        void set_model_name(const std::string &name);
+
+        // metrics of all models
+        static std::string expose(void);
+
+    public:
+        Counter requests;
+        Counter prompt_tokens;
+        Counter generated_tokens;
+        Histogram latency[Latency::NUM];
+        std::atomic<int64_t> kv_cache_tokens {0};
+        std::atomic<int64_t> kv_cache_capacity {0};
+        std::atomic<int64_t> kv_cache_bytes {0};            // estimated from `kv_cache_tokens`
+        std::atomic<int64_t> kv_cache_capacity_bytes {0};
+        std::atomic<int64_t> expert_cache_hits {0};
+        std::atomic<int64_t> expert_cache_misses {0};
+
+    protected:
+        std::string model_name;
+        const int id;
+    };
+
     class ModelPerfInfo
     {
     public:
@@ -941,13 +1077,32 @@ namespace chatllm
 
         void Accumulate(Type type, size_t tok_count);
 
-        Performance timings[Type::NUM];
+        // may be called from any thread, e.g. while another one is generating
+        Performance GetTiming(Type type) const;
+
+        // request level events, latencies are recorded into `metrics` (if set)
+        void BeginRequest(void);
+        void PromptEncoded(void);
+        // `n` tokens are generated at once (e.g. a block of diffusion models), the time is shared among them
+        void TokenGenerated(int n = 1);
+        void EndRequest(int kv_cache_tokens, int kv_cache_capacity, size_t kv_cache_bytes);
+
+        Metrics *metrics = nullptr;
 
     private:
+        // written by the generating thread; events below are only called by it, too
+        mutable std::mutex timings_mutex;
+        Performance timings[Type::NUM];
+
         using Clock = std::chrono::steady_clock;
         using MilliSecond = std::chrono::duration<double, std::ratio<1, 1000>>;
 
         std::chrono::time_point<Clock> m_beg { Clock::now() };
+        std::chrono::time_point<Clock> req_beg;
+        std::chrono::time_point<Clock> last_token;
+        bool in_request  = false;
+        bool encoded     = false;
+        bool first_token = false;
     };
 
     class ModelSessionMemory
@@ -975,6 +1130,16 @@ namespace chatllm
         int n_past_offset;
     };
 
+    // counters of on-demand loaded MoE experts (see `ExpertPool`)
+    struct ExpertCacheStats
+    {
+        int64_t hits;
+        int64_t misses;
+        int64_t prefetched;         // loaded ahead of selection
+        int64_t prefetch_hits;      // ... and then selected
+        int64_t loaded_bytes;
+    };
+
     class AbstractModel
     {
     public:
@@ -995,6 +1160,12 @@ namespace chatllm
 
         virtual bool generate_next_token(const std::vector<int> &input_ids, const GenerationConfig &gen_config, std::vector<float> &lm_logits) { return true; };
 
+        // evaluate `input_ids` (in batches), and get logits of the last `last_n` positions (`last_n` x vocab_size)
+        virtual bool score_tokens(const std::vector<int> &input_ids, const GenerationConfig &gen_config, int last_n, std::vector<float> &lm_logits) { return false; };
+
+        // evaluate `input_ids` into the cache without sampling, so that `n_past` is advanced by `input_ids.size()`
+        virtual bool prefill(const std::vector<int> &input_ids, const GenerationConfig &gen_config) { return false; };
+
         virtual void abort_generation(void) = 0;
 
         virtual void embedding(const GenerationConfig &gen_config, const std::vector<int> &input_ids,
@@ -1017,8 +1188,10 @@ namespace chatllm
         virtual void clear_audio_snippets(void) = 0;
 
         // tts
+        // if `streamer` is given, PCM chunks are also passed to `streamer->put_audio` as they are synthesized.
         virtual void speech_synthesis(const GenerationConfig &gen_config, const std::vector<int> &input_ids,
-                                      std::vector<int16_t> &audio, int &sample_rate, int &channels) = 0;
+                                      std::vector<int16_t> &audio, int &sample_rate, int &channels,
+                                      BaseStreamer *streamer = nullptr, ModelPerfInfo *performance = nullptr) = 0;
 
         virtual std::string  type_name()    const = 0;
         virtual std::string  native_name()  const = 0;
@@ -1049,6 +1222,11 @@ namespace chatllm
 
         virtual int64_t get_param_num(bool effective_only) const = 0;
 
+        virtual ExpertCacheStats get_expert_cache_stats(void) const { return ExpertCacheStats(); }
+
+        // bytes allocated for KV caches (and other per-sequence states)
+        virtual size_t get_cache_bytes(void) const { return 0; }
+
         virtual ChunkInterceptor *get_interceptor(void) { return nullptr; }
 
         virtual void set_additional_args(const std::map<std::string, std::string> &args) {}
@@ -1088,6 +1266,16 @@ namespace chatllm
             return model->generate_next_token(input_ids, gen_config, lm_logits);
         }
 
+        bool score_tokens(const std::vector<int> &input_ids, const GenerationConfig &gen_config, int last_n, std::vector<float> &lm_logits) override
+        {
+            return model->score_tokens(input_ids, gen_config, last_n, lm_logits);
+        }
+
+        bool prefill(const std::vector<int> &input_ids, const GenerationConfig &gen_config) override
+        {
+            return model->prefill(input_ids, gen_config);
+        }
+
         void abort_generation(void) override { model->abort_generation(); }
 
         void embedding(const GenerationConfig &gen_config, const std::vector<int> &input_ids,
@@ -1101,9 +1289,10 @@ namespace chatllm
 
 
         void speech_synthesis(const GenerationConfig &gen_config, const std::vector<int> &input_ids,
-                                std::vector<int16_t> &audio, int &sample_rate, int &channels) override
+                                std::vector<int16_t> &audio, int &sample_rate, int &channels,
+                                BaseStreamer *streamer = nullptr, ModelPerfInfo *performance = nullptr) override
         {
-            model->speech_synthesis(gen_config, input_ids, audio, sample_rate, channels);
+            model->speech_synthesis(gen_config, input_ids, audio, sample_rate, channels, streamer, performance);
         }
 
         int get_embedding_dim(void) const override { return model->get_embedding_dim(); }
@@ -1175,6 +1364,10 @@ namespace chatllm
 
         int64_t get_param_num(bool effective_only) const override { return model->get_param_num(effective_only); }
 
+        ExpertCacheStats get_expert_cache_stats(void) const override { return model->get_expert_cache_stats(); }
+
+        size_t get_cache_bytes(void) const override { return model->get_cache_bytes(); }
+
         ChunkInterceptor *get_interceptor(void) override { return model->get_interceptor(); }
 
         LayerAllocatorManager *get_alloc_manager(void) override
@@ -1275,7 +1468,8 @@ namespace chatllm
         }
 
         void speech_synthesis(const GenerationConfig &gen_config, const std::vector<int> &input_ids,
-            std::vector<int16_t> &audio, int &sample_rate, int &channels) override
+            std::vector<int16_t> &audio, int &sample_rate, int &channels,
+            BaseStreamer *streamer = nullptr, ModelPerfInfo *performance = nullptr) override
         {
             CHATLLM_CHECK(false) << "TTS not supported!";
         }
@@ -1443,7 +1637,8 @@ namespace chatllm
         void embedding(const Content &input, const GenerationConfig &gen_config, std::vector<float> &result, BaseTokenizer::EmbeddingPurpose purpose = BaseTokenizer::EmbeddingPurpose::Document);
         float qa_rank(const Content &q, const Content &a, const GenerationConfig &gen_config);
 
-        bool speech_synthesis(const std::string &input, const GenerationConfig &gen_config, std::vector<int16_t> &audio, int &sample_rate, int &channels);
+        bool speech_synthesis(const std::string &input, const GenerationConfig &gen_config, std::vector<int16_t> &audio, int &sample_rate, int &channels,
+                              BaseStreamer *streamer = nullptr);
 
         int get_embedding_dim(void);
 
@@ -1474,6 +1669,7 @@ namespace chatllm
         BaseTokenizer *tokenizer;
         AbstractModel *model;
         ModelPerfInfo performance;
+        Metrics metrics;
 
     protected:
         bool initializing;
@@ -1483,6 +1679,13 @@ namespace chatllm
 
         void add_ai_prefix(std::vector<int> &input_ids, const GenerationConfig &gen_config, BaseStreamer *streamer);
 
+        // evaluate `input_ids` into the cache (counted as prompt), false if the model can't
+        bool prefill(const std::vector<int> &input_ids, const GenerationConfig &gen_config);
+
+        // encode `history` for chatting, and prefill its ids while the rest is still being encoded.
+        // ids left to `generate` are returned, and `prefilled` tells if they continue the prefilled ones.
+        std::vector<int> encode_history_prefilling(const Messages &history, const GenerationConfig &gen_config, const bool continuous, bool &prefilled);
+
         virtual std::string chat_with_ext_completion(Messages &history, const std::string &external, const GenerationConfig &gen_config,
                          BaseStreamer *streamer);
         virtual std::string chat_with_restart(const Messages &history, const GenerationConfig &gen_config,
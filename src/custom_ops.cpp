@@ -6,6 +6,7 @@
 #include <fcntl.h>
 #include <fstream>
 #include <iomanip>
+#include <mutex>
 #include <functional>
 #include <random>
 #include "layers.h"
@@ -76,184 +77,134 @@ static void ggml_compute_forward_mat_scale(ggml::tensor * dst , const ggml::tens
     }
 }
 
-static void ggml_compute_forward_ntk_dynamic_rope_f32(ggml::tensor * dst , const ggml::tensor * a, const ggml::tensor * b, int ith, int nth, void * userdata)
+// sin/cos of rotary angles tabulated by position; layers with the same parameters (the key) and number of
+// positions share a table. Tables are immutable once built, so ops of other models may keep reading them.
+class RoPESinCosTable
 {
-    QWenSelfAttention *data = reinterpret_cast<QWenSelfAttention *>(userdata);
-
-    const ggml::tensor *src0 = a;
-    const ggml::tensor *src1 = b;
-
-    GGML_TENSOR_UNARY_OP_LOCALS
-
-    int n_dims = data->rope_dim;
-
-    const int nr = (int)ggml::nrows(dst);
-
-    GGML_ASSERT(n_dims <= ne0);
-    GGML_ASSERT(n_dims % 2 == 0);
-
-    // rows per thread
-    const int dr = (nr + nth - 1)/nth;
-
-    // row range for this thread
-    const int ir0 = dr*ith;
-    const int ir1 = MIN(ir0 + dr, nr);
-
-    // row index used to determine which thread to use
-    int ir = 0;
+public:
+    // angle of the i-th rotated pair at position `pos`
+    typedef std::function<float (int pos, int i)> theta_func;
 
-    const int32_t * pos = (const int32_t *) src1->data;
-
-    for (int64_t i3 = 0; i3 < ne3; i3++) {
-        for (int64_t i2 = 0; i2 < ne2; i2++) {
-            const auto p = pos[i2];
-            for (int64_t i1 = 0; i1 < ne1; i1++) {
-                if (ir++ < ir0) continue;
-                if (ir   > ir1) break;
-
-                const float ntk_alpha = qwen_get_ntk_alpha(p, data->seq_length);
-                const float base = data->freq_base * powf(ntk_alpha, (float)n_dims / ((float)n_dims - 2.0f));
-                const float inv_freq_scale = powf(base, -2.0f / (float)n_dims);
-                float inv_freq = 1.0f;
-
-                for (int64_t ic = 0; ic < ne0; ic += 2, inv_freq *= inv_freq_scale) {
-                    if (ic < n_dims) {
-                        const int64_t ib = 0;
-
-                        float theta = (float)p * inv_freq;
-                        float cos_theta = cosf(theta);
-                        float sin_theta = sinf(theta);
-
-                        const int64_t i0 = ib*n_dims + ic/2;
-
-                        const float * const src = (float *)((char *) src0->data + i3*nb03 + i2*nb02 + i1*nb01 + i0*nb00);
-                              float * dst_data  = (float *)((char *)  dst->data + i3*nb3  + i2*nb2  + i1*nb1  + i0*nb0);
-
-                        const float x0 = src[0];
-                        const float x1 = src[n_dims/2];
+    RoPESinCosTable(const std::string &key, int n_pairs, theta_func theta, int n_pos)
+        : key(key), n_pairs(n_pairs), n_pos(n_pos), theta(theta)
+    {
+        values.resize((size_t)n_pos * n_pairs * 2);
+        for (int p = 0; p < n_pos; p++)
+            fill(p, values.data() + (size_t)p * n_pairs * 2);
+    }
 
-                        dst_data[0]        = x0*cos_theta - x1*sin_theta;
-                        dst_data[n_dims/2] = x0*sin_theta + x1*cos_theta;
-                    } else {
-                        const int64_t i0 = ic;
+    // get (or create) the table of `key` with positions [0, n_pos) tabulated, replacing `table` when it differs.
+    // `table` is owned by the caller, and must not be used by a running graph.
+    static const RoPESinCosTable *get(std::shared_ptr<RoPESinCosTable> &table, const std::string &key, int n_pairs, theta_func theta, int n_pos)
+    {
+        static std::mutex mutex;
+        static std::map<std::pair<std::string, int>, std::weak_ptr<RoPESinCosTable>> tables;
 
-                        const float * const src = (float *)((char *) src0->data + i3*nb03 + i2*nb02 + i1*nb01 + i0*nb00);
-                              float * dst_data  = (float *)((char *)  dst->data + i3*nb3  + i2*nb2  + i1*nb1  + i0*nb0);
+        std::lock_guard<std::mutex> lock(mutex);
 
-                        dst_data[0] = src[0];
-                        dst_data[1] = src[1];
-                    }
-                }
+        if (!table || (table->key != key) || (table->n_pos != n_pos))
+        {
+            auto &shared = tables[{key, n_pos}];
+            table = shared.lock();
+            if (!table)
+            {
+                table = std::make_shared<RoPESinCosTable>(key, n_pairs, theta, n_pos);
+                shared = table;
             }
         }
+        return table.get();
     }
-}
 
-static void ggml_compute_forward_ntk_dynamic_rope_f16(ggml::tensor * dst , const ggml::tensor * a, const ggml::tensor * b, int ith, int nth, void * userdata)
-{
-    QWenSelfAttention *data = reinterpret_cast<QWenSelfAttention *>(userdata);
-
-    const ggml::tensor *src0 = a;
-    const ggml::tensor *src1 = b;
-
-    GGML_TENSOR_UNARY_OP_LOCALS
-
-    int n_dims = data->rope_dim;
-
-    const int nr = (int)ggml::nrows(dst);
-
-    GGML_ASSERT(n_dims <= ne0);
-    GGML_ASSERT(n_dims % 2 == 0);
-
-    // rows per thread
-    const int dr = (nr + nth - 1)/nth;
-
-    // row range for this thread
-    const int ir0 = dr*ith;
-    const int ir1 = MIN(ir0 + dr, nr);
-
-    // row index used to determine which thread to use
-    int ir = 0;
-
-    const int32_t * pos = (const int32_t *) src1->data;
-
-    for (int64_t i3 = 0; i3 < ne3; i3++) {
-        for (int64_t i2 = 0; i2 < ne2; i2++) {
-            const auto p = pos[i2];
-            for (int64_t i1 = 0; i1 < ne1; i1++) {
-                if (ir++ < ir0) continue;
-                if (ir   > ir1) break;
-
-                const float ntk_alpha = qwen_get_ntk_alpha(p, data->seq_length);
-                const float base = data->freq_base * powf(ntk_alpha, (float)n_dims / ((float)n_dims - 2.0f));
-                const float inv_freq_scale = powf(base, -2.0f / (float)n_dims);
-                float inv_freq = 1.0f;
-
-                for (int64_t ic = 0; ic < ne0; ic += 2, inv_freq *= inv_freq_scale) {
-                    if (ic < n_dims) {
-                        const int64_t ib = 0;
-
-                        float theta = (float)p * inv_freq;
-                        float cos_theta = cosf(theta);
-                        float sin_theta = sinf(theta);
-
-                        const int64_t i0 = ib*n_dims + ic/2;
-
-                        const ggml_fp16_t * const src = (ggml_fp16_t *)((char *) src0->data + i3*nb03 + i2*nb02 + i1*nb01 + i0*nb00);
-                        ggml_fp16_t * dst_data  = (ggml_fp16_t *)((char *)  dst->data + i3*nb3  + i2*nb2  + i1*nb1  + i0*nb0);
-
-                        const float x0 = ggml_fp16_to_fp32(src[0]);
-                        const float x1 = ggml_fp16_to_fp32(src[1]);
+    // `n_pairs` cos values followed by `n_pairs` sin values.
+    // positions that are not tabulated are computed into `buf`.
+    const float *get_cos_sin(int pos, std::vector<float> &buf) const
+    {
+        if ((0 <= pos) && (pos < n_pos))
+            return values.data() + (size_t)pos * n_pairs * 2;
+        buf.resize(n_pairs * 2);
+        fill(pos, buf.data());
+        return buf.data();
+    }
 
-                        dst_data[0] = ggml_fp32_to_fp16(x0*cos_theta - x1*sin_theta);
-                        dst_data[1] = ggml_fp32_to_fp16(x0*sin_theta + x1*cos_theta);
-                    } else {
-                        const int64_t i0 = ic;
+public:
+    const std::string key;
+    const int n_pairs;
+    const int n_pos;
+protected:
+    void fill(int pos, float *cos_sin) const
+    {
+        for (int i = 0; i < n_pairs; i++)
+        {
+            const float t = theta(pos, i);
+            cos_sin[i]           = cosf(t);
+            cos_sin[i + n_pairs] = sinf(t);
+        }
+    }
 
-                        const ggml_fp16_t * const src = (ggml_fp16_t *)((char *) src0->data + i3*nb03 + i2*nb02 + i1*nb01 + i0*nb00);
-                              ggml_fp16_t * dst_data  = (ggml_fp16_t *)((char *)  dst->data + i3*nb3  + i2*nb2  + i1*nb1  + i0*nb0);
+    theta_func theta;
+    std::vector<float> values;  // [n_pos][2][n_pairs]
+};
 
-                        dst_data[0] = src[0];
-                        dst_data[1] = src[1];
-                    }
-                }
-            }
-        }
+// rotate (x[i], x[i + n]) by the i-th angle
+static void rope_rotate_neox(const float *x, float *y, const float *cos_sin, const int n)
+{
+    const float *c = cos_sin;
+    const float *s = cos_sin + n;
+    for (int i = 0; i < n; i++)
+    {
+        const float x0 = x[i];
+        const float x1 = x[i + n];
+        y[i]     = x0 * c[i] - x1 * s[i];
+        y[i + n] = x0 * s[i] + x1 * c[i];
     }
 }
 
-static void ggml_compute_forward_ntk_dynamic_rope(ggml::tensor * dst , const ggml::tensor * a, const ggml::tensor * b, int ith, int nth, void * userdata)
+// rotate (x[2i], x[2i + 1]) by the i-th angle
+static void rope_rotate_interleaved(const float *x, float *y, const float *cos_sin, const int n)
 {
-    switch (a->type)
+    const float *c = cos_sin;
+    const float *s = cos_sin + n;
+    for (int i = 0; i < n; i++)
     {
-    case GGML_TYPE_F16:
-        ggml_compute_forward_ntk_dynamic_rope_f16(dst, a, b, ith, nth, userdata);
-        break;
-    case GGML_TYPE_F32:
-        ggml_compute_forward_ntk_dynamic_rope_f32(dst, a, b, ith, nth, userdata);
-        break;
-    default:
-        GGML_ASSERT(false);
-        break;
+        const float x0 = x[2 * i];
+        const float x1 = x[2 * i + 1];
+        y[2 * i]     = x0 * c[i] - x1 * s[i];
+        y[2 * i + 1] = x0 * s[i] + x1 * c[i];
     }
 }
 
-static void ggml_compute_forward_ntk_mix_rope_f32(ggml::tensor * dst , const ggml::tensor * a, const ggml::tensor * b, int ith, int nth, void * userdata)
+// rows are converted to F32 and rotated out of place (so that loops are vectorized by compilers)
+static void rope_load_row(const ggml::tensor *t, const void *src, float *row, const int64_t n)
 {
-    BlueLMSelfAttention *data = reinterpret_cast<BlueLMSelfAttention *>(userdata);
+    if (t->type == GGML_TYPE_F16)
+        ggml_fp16_to_fp32_row((const ggml_fp16_t *)src, row, n);
+    else
+        memcpy(row, src, n * sizeof(float));
+}
+
+static void rope_store_row(const ggml::tensor *t, const float *row, void *dst, const int64_t n)
+{
+    if (t->type == GGML_TYPE_F16)
+        ggml_fp32_to_fp16_row(row, (ggml_fp16_t *)dst, n);
+    else
+        memcpy(dst, row, n * sizeof(float));
+}
 
+// `rotate(x, y, pos, bufs)` rotates a row at position `pos` (y is a copy of x); `bufs[0]` and `bufs[1]` are scratch
+// buffers of the thread. It is a template parameter, so that the rotation of each mode is inlined into the row loop.
+template <class Rotate> static void ggml_compute_forward_rope_rows(ggml::tensor * dst , const ggml::tensor * a, const ggml::tensor * b, int ith, int nth,
+    const Rotate &rotate)
+{
     const ggml::tensor *src0 = a;
     const ggml::tensor *src1 = b;
 
     GGML_TENSOR_UNARY_OP_LOCALS
 
-    int n_dims = data->rope_dim;
+    GGML_ASSERT((src0->type == GGML_TYPE_F32) || (src0->type == GGML_TYPE_F16));
+    GGML_ASSERT((nb00 == ggml_type_size(src0->type)) && (nb0 == ggml_type_size(dst->type)));
 
     const int nr = (int)ggml::nrows(dst);
 
-    GGML_ASSERT(n_dims <= ne0);
-    GGML_ASSERT(n_dims % 2 == 0);
-
     // rows per thread
     const int dr = (nr + nth - 1)/nth;
 
@@ -266,104 +217,57 @@ static void ggml_compute_forward_ntk_mix_rope_f32(ggml::tensor * dst , const ggm
 
     const int32_t * pos = (const int32_t *) src1->data;
 
+    std::vector<float> x(ne0);
+    std::vector<float> y(ne0);
+    std::vector<float> bufs[2];
+
     for (int64_t i3 = 0; i3 < ne3; i3++) {
         for (int64_t i2 = 0; i2 < ne2; i2++) {
-            const float p = (float)pos[i2];
+            const int p = pos[i2];
             for (int64_t i1 = 0; i1 < ne1; i1++) {
                 if (ir++ < ir0) continue;
                 if (ir   > ir1) break;
 
-                for (int64_t i0 = 0; i0 < ne0; i0 += 2) {
-
-                    float theta = p * data->inv_freq[i0 / 2];
-
-                    float cos_theta = cosf(theta);
-                    float sin_theta = sinf(theta);
-
-                    const float * const src = (float *)((char *) src0->data + i3*nb03 + i2*nb02 + i1*nb01 + i0*nb00);
-                        float * dst_data  = (float *)((char *)  dst->data + i3*nb3  + i2*nb2  + i1*nb1  + i0*nb0);
-
-                    const float x0 = src[0];
-                    const float x1 = src[1];
-
-                    dst_data[0] = x0*cos_theta - x1*sin_theta;
-                    dst_data[1] = x0*sin_theta + x1*cos_theta;
-                }
+                rope_load_row(src0, (const char *)src0->data + i3*nb03 + i2*nb02 + i1*nb01, x.data(), ne0);
+                memcpy(y.data(), x.data(), ne0 * sizeof(float));
+                rotate(x.data(), y.data(), p, bufs);
+                rope_store_row(dst, y.data(), (char *)dst->data + i3*nb3 + i2*nb2 + i1*nb1, ne0);
             }
         }
     }
 }
 
-static void ggml_compute_forward_ntk_mix_rope_f16(ggml::tensor * dst , const ggml::tensor * a, const ggml::tensor * b, int ith, int nth, void * userdata)
+static float qwen_ntk_dynamic_rope_theta(int pos, int i, int n_dims, float freq_base, int seq_length)
 {
-    BlueLMSelfAttention *data = reinterpret_cast<BlueLMSelfAttention *>(userdata);
-
-    const ggml::tensor *src0 = a;
-    const ggml::tensor *src1 = b;
-
-    GGML_TENSOR_UNARY_OP_LOCALS
-
-    int n_dims = data->rope_dim;
+    const float ntk_alpha = qwen_get_ntk_alpha(pos, seq_length);
+    const float base = freq_base * powf(ntk_alpha, (float)n_dims / ((float)n_dims - 2.0f));
+    return (float)pos * powf(base, -2.0f * (float)i / (float)n_dims);
+}
 
-    const int nr = (int)ggml::nrows(dst);
+static void ggml_compute_forward_ntk_dynamic_rope(ggml::tensor * dst , const ggml::tensor * a, const ggml::tensor * b, int ith, int nth, void * userdata)
+{
+    QWenSelfAttention *data = reinterpret_cast<QWenSelfAttention *>(userdata);
+    const RoPESinCosTable *table = data->rope_table.get();
+    const int n_dims = data->rope_dim;
 
-    GGML_ASSERT(n_dims <= ne0);
+    GGML_ASSERT(n_dims <= a->ne[0]);
     GGML_ASSERT(n_dims % 2 == 0);
 
-    // rows per thread
-    const int dr = (nr + nth - 1)/nth;
-
-    // row range for this thread
-    const int ir0 = dr*ith;
-    const int ir1 = MIN(ir0 + dr, nr);
-
-    // row index used to determine which thread to use
-    int ir = 0;
-
-    const int32_t * pos = (const int32_t *) src1->data;
-
-    for (int64_t i3 = 0; i3 < ne3; i3++) {
-        for (int64_t i2 = 0; i2 < ne2; i2++) {
-            const float p = (float)pos[i2];
-            for (int64_t i1 = 0; i1 < ne1; i1++) {
-                if (ir++ < ir0) continue;
-                if (ir   > ir1) break;
-
-                for (int64_t i0 = 0; i0 < ne0; i0 += 2) {
-
-                    float theta = p * data->inv_freq[i0 / 2];
-
-                    float cos_theta = cosf(theta);
-                    float sin_theta = sinf(theta);
-
-                    const ggml_fp16_t * const src = (ggml_fp16_t *)((char *) src0->data + i3*nb03 + i2*nb02 + i1*nb01 + i0*nb00);
-                        ggml_fp16_t * dst_data  = (ggml_fp16_t *)((char *)  dst->data + i3*nb3  + i2*nb2  + i1*nb1  + i0*nb0);
-
-                    const float x0 = ggml_fp16_to_fp32(src[0]);
-                    const float x1 = ggml_fp16_to_fp32(src[1]);
-
-                    dst_data[0] = ggml_fp32_to_fp16(x0*cos_theta - x1*sin_theta);
-                    dst_data[1] = ggml_fp32_to_fp16(x0*sin_theta + x1*cos_theta);
-                }
-            }
-        }
-    }
+    ggml_compute_forward_rope_rows(dst, a, b, ith, nth, [table, n_dims](const float *x, float *y, int pos, std::vector<float> *bufs) {
+        rope_rotate_neox(x, y, table->get_cos_sin(pos, bufs[0]), n_dims / 2);
+    });
 }
 
 static void ggml_compute_forward_ntk_mix_rope(ggml::tensor * dst , const ggml::tensor * a, const ggml::tensor * b, int ith, int nth, void * userdata)
 {
-    switch (a->type)
-    {
-    case GGML_TYPE_F16:
-        ggml_compute_forward_ntk_mix_rope_f16(dst, a, b, ith, nth, userdata);
-        break;
-    case GGML_TYPE_F32:
-        ggml_compute_forward_ntk_mix_rope_f32(dst, a, b, ith, nth, userdata);
-        break;
-    default:
-        GGML_ASSERT(false);
-        break;
-    }
+    BlueLMSelfAttention *data = reinterpret_cast<BlueLMSelfAttention *>(userdata);
+    const RoPESinCosTable *table = data->rope_table.get();
+
+    GGML_ASSERT(table->n_pairs * 2 == a->ne[0]);
+
+    ggml_compute_forward_rope_rows(dst, a, b, ith, nth, [table](const float *x, float *y, int pos, std::vector<float> *bufs) {
+        rope_rotate_interleaved(x, y, table->get_cos_sin(pos, bufs[0]), table->n_pairs);
+    });
 }
 
 static void build_ntk_mixed_inv_freq(int dim, std::vector<float> &inv_freq,
@@ -380,156 +284,23 @@ static void build_ntk_mixed_inv_freq(int dim, std::vector<float> &inv_freq,
 }
 
 
-static void ggml_compute_forward_chatglm1_rope_f16(ggml::tensor * dst , const ggml::tensor * a, const ggml::tensor * b, int ith, int nth, void * userdata)
-{
-    GLMSelfAttention *data = reinterpret_cast<GLMSelfAttention *>(userdata);
-
-    const ggml::tensor *src0 = a;
-    const ggml::tensor *src1 = b;
-
-    GGML_TENSOR_UNARY_OP_LOCALS
-
-    int n_dims = data->rope_dim;
-    int n_ctx  = data->n_ctx;
-
-    const int nr = (int)ggml::nrows(dst);
-
-    GGML_ASSERT(n_dims <= ne0);
-    GGML_ASSERT(n_dims % 2 == 0);
-
-    // rows per thread
-    const int dr = (nr + nth - 1)/nth;
-
-    // row range for this thread
-    const int ir0 = dr*ith;
-    const int ir1 = MIN(ir0 + dr, nr);
-
-    // row index used to determine which thread to use
-    int ir = 0;
-
-    const float theta_scale = powf(data->freq_base, -2.0f/n_dims);
-    const int32_t * pos = (const int32_t *) src1->data;
-
-    for (int64_t i3 = 0; i3 < ne3; i3++) {
-        for (int64_t i2 = 0; i2 < ne2; i2++) {
-            const int64_t p = pos[i2];
-            for (int64_t i1 = 0; i1 < ne1; i1++) {
-                if (ir++ < ir0) continue;
-                if (ir   > ir1) break;
-
-                float theta_base = (float)p;
-
-                theta_base = (float)MIN(p, n_ctx - 2);
-                float block_theta = (float)MAX(p - (n_ctx - 2), 0);
-                for (int64_t i0 = 0; i0 < ne0 / 4; i0++) {
-                    const float cos_theta = cosf(theta_base);
-                    const float sin_theta = sinf(theta_base) ;
-                    const float cos_block_theta = cosf(block_theta);
-                    const float sin_block_theta = sinf(block_theta);
-
-                    theta_base *= theta_scale;
-                    block_theta *= theta_scale;
-
-                    const ggml_fp16_t * const src = (ggml_fp16_t *)((char *) src0->data + i3*nb03 + i2*nb02 + i1*nb01 + i0*nb00);
-                          ggml_fp16_t * dst_data  = (ggml_fp16_t *)((char *)  dst->data +  i3*nb3 + i2*nb2  + i1*nb1  + i0*nb0);
-
-                    const float x0 = ggml_fp16_to_fp32(src[0]);
-                    const float x1 = ggml_fp16_to_fp32(src[n_dims/2]);
-                    const float x2 = ggml_fp16_to_fp32(src[n_dims]);
-                    const float x3 = ggml_fp16_to_fp32(src[n_dims/2*3]);
-
-                    dst_data[0]          = ggml_fp32_to_fp16(x0*cos_theta - x1*sin_theta);
-                    dst_data[n_dims/2]   = ggml_fp32_to_fp16(x0*sin_theta + x1*cos_theta);
-                    dst_data[n_dims]     = ggml_fp32_to_fp16(x2*cos_block_theta - x3*sin_block_theta);
-                    dst_data[n_dims/2*3] = ggml_fp32_to_fp16(x2*sin_block_theta + x3*cos_block_theta);
-                }
-            }
-        }
-    }
-}
-
-static void ggml_compute_forward_chatglm1_rope_f32(ggml::tensor * dst , const ggml::tensor * a, const ggml::tensor * b, int ith, int nth, void * userdata)
+// 2D RoPE: the first half is rotated by position (clamped to `n_ctx - 2`), the second half by block position
+static void ggml_compute_forward_chatglm1_rope(ggml::tensor * dst , const ggml::tensor * a, const ggml::tensor * b, int ith, int nth, void * userdata)
 {
     GLMSelfAttention *data = reinterpret_cast<GLMSelfAttention *>(userdata);
+    const RoPESinCosTable *table = data->rope_table.get();
+    const int n_dims = data->rope_dim;
+    const int n_ctx  = data->n_ctx;
 
-    const ggml::tensor *src0 = a;
-    const ggml::tensor *src1 = b;
-
-    GGML_TENSOR_UNARY_OP_LOCALS
-
-    int n_dims = data->rope_dim;
-    int n_ctx  = data->n_ctx;
-
-    const int nr = (int)ggml::nrows(dst);
-
-    GGML_ASSERT(n_dims <= ne0);
+    GGML_ASSERT(n_dims * 2 <= a->ne[0]);
     GGML_ASSERT(n_dims % 2 == 0);
 
-    // rows per thread
-    const int dr = (nr + nth - 1)/nth;
-
-    // row range for this thread
-    const int ir0 = dr*ith;
-    const int ir1 = MIN(ir0 + dr, nr);
-
-    // row index used to determine which thread to use
-    int ir = 0;
-
-    const float theta_scale = powf(data->freq_base, -2.0f/n_dims);
-    const int32_t * pos = (const int32_t *) src1->data;
-
-    for (int64_t i3 = 0; i3 < ne3; i3++) {
-        for (int64_t i2 = 0; i2 < ne2; i2++) {
-            const int64_t p = pos[i2];
-            for (int64_t i1 = 0; i1 < ne1; i1++) {
-                if (ir++ < ir0) continue;
-                if (ir   > ir1) break;
-
-                float theta_base = (float)p;
-
-                theta_base = (float)MIN(p, n_ctx - 2);
-                float block_theta = (float)MAX(p - (n_ctx - 2), 0);
-                for (int64_t i0 = 0; i0 < ne0 / 4; i0++) {
-                    const float cos_theta = cosf(theta_base);
-                    const float sin_theta = sinf(theta_base) ;
-                    const float cos_block_theta = cosf(block_theta);
-                    const float sin_block_theta = sinf(block_theta);
-
-                    theta_base *= theta_scale;
-                    block_theta *= theta_scale;
-
-                    const float * const src = (float *)((char *) src0->data + i3*nb03 + i2*nb02 + i1*nb01 + i0*nb00);
-                          float * dst_data  = (float *)((char *)  dst->data +  i3*nb3 + i2*nb2  + i1*nb1  + i0*nb0);
-
-                    const float x0 = src[0];
-                    const float x1 = src[n_dims/2];
-                    const float x2 = src[n_dims];
-                    const float x3 = src[n_dims/2*3];
-
-                    dst_data[0]          = x0*cos_theta - x1*sin_theta;
-                    dst_data[n_dims/2]   = x0*sin_theta + x1*cos_theta;
-                    dst_data[n_dims]     = x2*cos_block_theta - x3*sin_block_theta;
-                    dst_data[n_dims/2*3] = x2*sin_block_theta + x3*cos_block_theta;
-                }
-            }
-        }
-    }
-}
-
-static void ggml_compute_forward_chatglm1_rope(ggml::tensor * dst , const ggml::tensor * a, const ggml::tensor * b, int ith, int nth, void * userdata)
-{
-    switch (a->type)
-    {
-    case GGML_TYPE_F16:
-        ggml_compute_forward_chatglm1_rope_f16(dst, a, b, ith, nth, userdata);
-        break;
-    case GGML_TYPE_F32:
-        ggml_compute_forward_chatglm1_rope_f32(dst, a, b, ith, nth, userdata);
-        break;
-    default:
-        GGML_ASSERT(false);
-        break;
-    }
+    ggml_compute_forward_rope_rows(dst, a, b, ith, nth, [table, n_dims, n_ctx](const float *x, float *y, int pos, std::vector<float> *bufs) {
+        const int base_pos  = MIN(pos, n_ctx - 2);
+        const int block_pos = MAX(pos - (n_ctx - 2), 0);
+        rope_rotate_neox(x,          y,          table->get_cos_sin(base_pos,  bufs[0]), n_dims / 2);
+        rope_rotate_neox(x + n_dims, y + n_dims, table->get_cos_sin(block_pos, bufs[1]), n_dims / 2);
+    });
 }
 
 static void ggml_compute_forward_randn_f32(ggml::tensor * dst, int ith, int nth, void * userdata)
@@ -1404,3 +1175,231 @@ static void ggml_custom_logsumexp(struct ggml_tensor * dst , int ith, int nth, v
         break;
     }
 }
+
+// c[M][N] += a[M][K] * b[K][N] (row-major), blocked into 4 x 16 tiles which compilers keep in vector registers
+static void gemm_f32_acc(int M, int N, int K, const float *a, int64_t lda, const float *b, int64_t ldb, float *c, int64_t ldc)
+{
+    int n0 = 0;
+    for (; n0 + 16 <= N; n0 += 16)
+    {
+        int m0 = 0;
+        for (; m0 + 4 <= M; m0 += 4)
+        {
+            float acc0[16] = {}, acc1[16] = {}, acc2[16] = {}, acc3[16] = {};
+            const float *a0 = a + (m0 + 0) * lda;
+            const float *a1 = a + (m0 + 1) * lda;
+            const float *a2 = a + (m0 + 2) * lda;
+            const float *a3 = a + (m0 + 3) * lda;
+            for (int k = 0; k < K; k++)
+            {
+                const float *bk = b + k * ldb + n0;
+                for (int x = 0; x < 16; x++)
+                {
+                    acc0[x] += a0[k] * bk[x];
+                    acc1[x] += a1[k] * bk[x];
+                    acc2[x] += a2[k] * bk[x];
+                    acc3[x] += a3[k] * bk[x];
+                }
+            }
+            for (int x = 0; x < 16; x++)
+            {
+                c[(m0 + 0) * ldc + n0 + x] += acc0[x];
+                c[(m0 + 1) * ldc + n0 + x] += acc1[x];
+                c[(m0 + 2) * ldc + n0 + x] += acc2[x];
+                c[(m0 + 3) * ldc + n0 + x] += acc3[x];
+            }
+        }
+        for (; m0 < M; m0++)
+        {
+            float acc[16] = {};
+            for (int k = 0; k < K; k++)
+            {
+                const float  av = a[m0 * lda + k];
+                const float *bk = b + k * ldb + n0;
+                for (int x = 0; x < 16; x++)
+                    acc[x] += av * bk[x];
+            }
+            for (int x = 0; x < 16; x++)
+                c[m0 * ldc + n0 + x] += acc[x];
+        }
+    }
+    for (int m = 0; (n0 < N) && (m < M); m++)
+    {
+        for (int k = 0; k < K; k++)
+        {
+            const float av = a[m * lda + k];
+            for (int x = n0; x < N; x++)
+                c[m * ldc + x] += av * b[k * ldb + x];
+        }
+    }
+}
+
+struct local_attention_param
+{
+    float scale;
+    float max_bias;     // ALiBi, 0: disabled
+    int   window;       // <= 0: unlimited
+};
+
+// Fused causal attention for sliding-window and ALiBi attentions.
+// Blocks of queries are scored against tiles of keys with online softmax, so the `klen x qlen x heads` scores
+// are never materialized, and tiles out of the window of all queries of a block are skipped.
+// The i-th query is at position `p_i = klen - qlen + i`, and it attends to keys in (p_i - window, p_i],
+// with ALiBi bias `slope * (j - p_i)` (same slopes as ggml_soft_max_ext).
+//
+// q: [head_size, qlen, heads, batch] F32
+// k: [head_size, klen, kv_heads, batch], v: [klen, head_size_v, kv_heads, batch], F32 or F16
+// dst: [head_size_v, heads, qlen, batch]
+static void ggml_custom_local_attention_f32(struct ggml_tensor * dst , int ith, int nth, const local_attention_param &param)
+{
+    const int BQ = 16;
+    const int BK = 64;
+
+    const struct ggml_tensor *q = dst->src[0];
+    const struct ggml_tensor *k = dst->src[1];
+    const struct ggml_tensor *v = dst->src[2];
+
+    const int     D        = (int)q->ne[0];
+    const int     Dv       = (int)v->ne[1];
+    const int64_t qlen     = q->ne[1];
+    const int64_t n_heads  = q->ne[2];
+    const int64_t n_batch  = q->ne[3];
+    const int64_t klen     = k->ne[1];
+    const int64_t n_kv     = k->ne[2];
+    const int64_t q_offset = klen - qlen;
+
+    CHATLLM_CHECK((q->nb[0] == sizeof(float)) && (k->nb[0] == ggml_type_size(k->type)) && (v->nb[0] == ggml_type_size(v->type)));
+    CHATLLM_CHECK((q_offset >= 0) && (v->ne[0] == klen) && (n_heads % n_kv == 0));
+
+    auto load_row = [](const struct ggml_tensor *t, const void *src, float *row, int64_t n) {
+        if (t->type == GGML_TYPE_F16)
+            ggml_fp16_to_fp32_row((const ggml_fp16_t *)src, row, n);
+        else
+            memcpy(row, src, n * sizeof(float));
+    };
+
+    const uint32_t n_head_log2 = 1u << (uint32_t)floorf(log2f((float)n_heads));
+    const float m0 = powf(2.0f, -(param.max_bias       ) / n_head_log2);
+    const float m1 = powf(2.0f, -(param.max_bias / 2.0f) / n_head_log2);
+
+    std::vector<float> Q(BQ * D);           // [BQ][D], scaled
+    std::vector<float> KT(D * BK);          // [D][BK]
+    std::vector<float> V(BK * Dv);          // [BK][Dv]
+    std::vector<float> S(BQ * BK);          // [BQ][BK]
+    std::vector<float> O(BQ * Dv);          // [BQ][Dv]
+    std::vector<float> M(BQ);
+    std::vector<float> L(BQ);
+    std::vector<float> row(MAX(D, BK));
+
+    const int64_t n_blocks = (qlen + BQ - 1) / BQ;
+    const int64_t n_tasks  = n_batch * n_heads * n_blocks;
+
+    // later blocks have more keys, so tasks are interleaved
+    for (int64_t task = ith; task < n_tasks; task += nth)
+    {
+        const int64_t ib = task % n_blocks;
+        const int64_t h  = (task / n_blocks) % n_heads;
+        const int64_t b  = task / n_blocks / n_heads;
+        const int64_t hk = h / (n_heads / n_kv);
+        const int64_t i0 = ib * BQ;
+        const int     nq = (int)MIN((int64_t)BQ, qlen - i0);
+
+        const float slope = param.max_bias > 0.0f ? (h < n_head_log2 ? powf(m0, (float)(h + 1)) : powf(m1, (float)(2 * (h - n_head_log2) + 1)))
+                                                  : 0.0f;
+
+        const char *k_base = (const char *)k->data + hk * k->nb[2] + (b % k->ne[3]) * k->nb[3];
+        const char *v_base = (const char *)v->data + hk * v->nb[2] + (b % v->ne[3]) * v->nb[3];
+
+        for (int r = 0; r < nq; r++)
+        {
+            const float *src = (const float *)((const char *)q->data + (i0 + r) * q->nb[1] + h * q->nb[2] + b * q->nb[3]);
+            for (int d = 0; d < D; d++)
+                Q[r * D + d] = src[d] * param.scale;
+        }
+        std::fill(O.begin(), O.end(), 0.0f);
+        std::fill(M.begin(), M.end(), -INFINITY);
+        std::fill(L.begin(), L.end(), 0.0f);
+
+        const int64_t p0 = q_offset + i0;
+        const int64_t p1 = q_offset + i0 + nq - 1;
+        const int64_t j_lo = param.window > 0 ? MAX((int64_t)0, p0 - param.window + 1) : 0;
+
+        for (int64_t j0 = j_lo; j0 <= p1; j0 += BK)
+        {
+            const int nk = (int)MIN((int64_t)BK, p1 + 1 - j0);
+
+            for (int c = 0; c < nk; c++)
+            {
+                load_row(k, k_base + (j0 + c) * k->nb[1], row.data(), D);
+                for (int d = 0; d < D; d++)
+                    KT[d * BK + c] = row[d];
+            }
+            for (int d = 0; d < Dv; d++)
+            {
+                load_row(v, v_base + d * v->nb[1] + j0 * v->nb[0], row.data(), nk);
+                for (int c = 0; c < nk; c++)
+                    V[c * Dv + d] = row[c];
+            }
+
+            std::fill(S.begin(), S.end(), 0.0f);
+            gemm_f32_acc(nq, nk, D, Q.data(), D, KT.data(), BK, S.data(), BK);
+
+            for (int r = 0; r < nq; r++)
+            {
+                const int64_t p = p0 + r;
+                float *s = S.data() + r * BK;
+                float mx = -INFINITY;
+                for (int c = 0; c < nk; c++)
+                {
+                    const int64_t j = j0 + c;
+                    const bool visible = (j <= p) && ((param.window <= 0) || (j > p - param.window));
+                    s[c] = visible ? s[c] + slope * (float)(j - p) : -INFINITY;
+                    mx = MAX(mx, s[c]);
+                }
+
+                if (mx == -INFINITY)
+                {
+                    std::fill(s, s + nk, 0.0f);
+                    continue;
+                }
+
+                const float m_new = MAX(M[r], mx);
+                const float corr  = expf(M[r] - m_new);
+                float sum = 0.0f;
+                for (int c = 0; c < nk; c++)
+                {
+                    s[c] = expf(s[c] - m_new);
+                    sum += s[c];
+                }
+                L[r] = L[r] * corr + sum;
+                M[r] = m_new;
+                for (int d = 0; d < Dv; d++)
+                    O[r * Dv + d] *= corr;
+            }
+
+            gemm_f32_acc(nq, Dv, nk, S.data(), BK, V.data(), Dv, O.data(), Dv);
+        }
+
+        for (int r = 0; r < nq; r++)
+        {
+            float *out = (float *)((char *)dst->data + h * dst->nb[1] + (i0 + r) * dst->nb[2] + b * dst->nb[3]);
+            const float inv = 1.0f / L[r];
+            for (int d = 0; d < Dv; d++)
+                out[d] = O[r * Dv + d] * inv;
+        }
+    }
+}
+
+static void ggml_custom_local_attention(struct ggml_tensor * dst , int ith, int nth, void * userdata)
+{
+    const local_attention_param *param = (const local_attention_param *)userdata;
+    switch (dst->src[0]->type)
+    {
+    case GGML_TYPE_F32:
+        ggml_custom_local_attention_f32(dst, ith, nth, *param);
+        break;
+    default:
+        GGML_ASSERT(false);
+        break;
+    }
+}
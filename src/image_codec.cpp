@@ -0,0 +1,1307 @@
+#include "image_codec.h"
+#define _USE_MATH_DEFINES // for M_PI
+#include <cmath>
+#include <cstring>
+#include <cstdlib>
+#include <climits>
+#include <cctype>
+#include <algorithm>
+
+namespace vision
+{
+    static uint32_t be32(const uint8_t *p) { return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3]; }
+    static uint16_t be16(const uint8_t *p) { return (uint16_t)((p[0] << 8) | p[1]); }
+    static uint32_t le32(const uint8_t *p) { return ((uint32_t)p[3] << 24) | ((uint32_t)p[2] << 16) | ((uint32_t)p[1] << 8) | p[0]; }
+    static uint32_t le24(const uint8_t *p) { return ((uint32_t)p[2] << 16) | ((uint32_t)p[1] << 8) | p[0]; }
+    static uint16_t le16(const uint8_t *p) { return (uint16_t)((p[1] << 8) | p[0]); }
+
+    // refuse absurd dimensions before allocating anything
+    static bool dimension_ok(int64_t width, int64_t height)
+    {
+        return (width > 0) && (height > 0) && (width < (1 << 16)) && (height < (1 << 16)) && (width * height <= (1 << 28));
+    }
+
+    // ===== DEFLATE (RFC 1951) =====
+
+    // output is capped at `limit` bytes: streams producing more are rejected (decompression bombs).
+    class Inflater
+    {
+    public:
+        Inflater(const uint8_t *data, size_t size, size_t limit) : data(data), size(size), limit(limit) {}
+
+        bool run(std::vector<uint8_t> &out)
+        {
+            uint32_t last = 0;
+            do
+            {
+                last = bits(1);
+                bool r = false;
+                switch (bits(2))
+                {
+                case 0: r = stored(out);    break;
+                case 1: r = fixed(out);     break;
+                case 2: r = dynamic(out);   break;
+                default:                    break;
+                }
+                if (!r) return false;
+            } while (!last);
+            return true;
+        }
+
+    private:
+        static const int FAST_BITS = 9;
+
+        struct Huffman
+        {
+            uint16_t fast[1 << FAST_BITS];  // (length << 9) | symbol, for codes not longer than FAST_BITS
+            uint16_t count[16];             // number of codes of each length
+            uint16_t symbol[288];           // symbols ordered by code
+        };
+
+        void fill(void)
+        {
+            while (bitcnt <= 56)
+            {
+                uint64_t b = pos < size ? data[pos] : 0;
+                pos++;
+                bitbuf |= b << bitcnt;
+                bitcnt += 8;
+            }
+        }
+
+        uint32_t bits(int n)
+        {
+            if (bitcnt < n) fill();
+            uint32_t v = (uint32_t)(bitbuf & ((1ull << n) - 1));
+            bitbuf >>= n;
+            bitcnt -= n;
+            return v;
+        }
+
+        bool overrun(void) const
+        {
+            return pos - bitcnt / 8 > size;
+        }
+
+        static bool build(Huffman &h, const uint8_t *lengths, int n)
+        {
+            memset(h.count, 0, sizeof(h.count));
+            for (int i = 0; i < n; i++) h.count[lengths[i]]++;
+            h.count[0] = 0;
+
+            int left = 1;
+            for (int len = 1; len < 16; len++)
+            {
+                left <<= 1;
+                left -= h.count[len];
+                if (left < 0) return false;
+            }
+
+            uint16_t offs[16] = {0};
+            for (int len = 1; len < 15; len++)
+                offs[len + 1] = offs[len] + h.count[len];
+            for (int i = 0; i < n; i++)
+                if (lengths[i]) h.symbol[offs[lengths[i]]++] = (uint16_t)i;
+
+            // codes are packed starting from the least-significant bit, so they are reversed
+            memset(h.fast, 0, sizeof(h.fast));
+            int code = 0;
+            int k = 0;
+            for (int len = 1; len <= FAST_BITS; len++)
+            {
+                for (int i = 0; i < h.count[len]; i++, k++, code++)
+                {
+                    int rev = 0;
+                    for (int b = 0; b < len; b++)
+                        rev |= ((code >> b) & 1) << (len - 1 - b);
+                    for (int j = rev; j < (1 << FAST_BITS); j += 1 << len)
+                        h.fast[j] = (uint16_t)((len << 9) | h.symbol[k]);
+                }
+                code <<= 1;
+            }
+            return true;
+        }
+
+        int decode(const Huffman &h)
+        {
+            if (bitcnt < 16) fill();
+            const uint16_t e = h.fast[bitbuf & ((1 << FAST_BITS) - 1)];
+            if (e)
+            {
+                const int len = e >> 9;
+                bitbuf >>= len;
+                bitcnt -= len;
+                return e & 511;
+            }
+
+            int code  = 0;
+            int first = 0;
+            int index = 0;
+            for (int len = 1; len < 16; len++)
+            {
+                code |= bits(1);
+                const int count = h.count[len];
+                if (code - count < first)
+                    return h.symbol[index + (code - first)];
+                index += count;
+                first += count;
+                first <<= 1;
+                code  <<= 1;
+            }
+            return -1;
+        }
+
+        bool stored(std::vector<uint8_t> &out)
+        {
+            bits(bitcnt & 7);
+            const uint32_t len  = bits(16);
+            const uint32_t nlen = bits(16);
+            if (len != (~nlen & 0xffff)) return false;
+            if (len > limit - out.size()) return false;
+            for (uint32_t i = 0; i < len; i++)
+                out.push_back((uint8_t)bits(8));
+            return !overrun();
+        }
+
+        bool codes(std::vector<uint8_t> &out, const Huffman &lencode, const Huffman &distcode)
+        {
+            static const uint16_t lbase[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+            static const uint8_t  lext[29]  = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+            static const uint16_t dbase[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+            static const uint8_t  dext[30]  = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+            for (;;)
+            {
+                int sym = decode(lencode);
+                if (sym < 0) return false;
+                if (sym < 256)
+                {
+                    if (out.size() >= limit) return false;
+                    out.push_back((uint8_t)sym);
+                    continue;
+                }
+                if (sym == 256) return !overrun();
+
+                sym -= 257;
+                if (sym >= 29) return false;
+                const size_t len = lbase[sym] + bits(lext[sym]);
+                const int dsym = decode(distcode);
+                if ((dsym < 0) || (dsym >= 30)) return false;
+                const size_t dist = dbase[dsym] + bits(dext[dsym]);
+                if (dist > out.size()) return false;
+                if (len > limit - out.size()) return false;
+
+                const size_t from = out.size() - dist;
+                for (size_t i = 0; i < len; i++)
+                {
+                    const uint8_t c = out[from + i];
+                    out.push_back(c);
+                }
+                if (overrun()) return false;
+            }
+        }
+
+        bool fixed(std::vector<uint8_t> &out)
+        {
+            struct Tables
+            {
+                Huffman lencode;
+                Huffman distcode;
+                Tables()
+                {
+                    uint8_t lengths[288];
+                    int i = 0;
+                    for (; i < 144; i++) lengths[i] = 8;
+                    for (; i < 256; i++) lengths[i] = 9;
+                    for (; i < 280; i++) lengths[i] = 7;
+                    for (; i < 288; i++) lengths[i] = 8;
+                    build(lencode, lengths, 288);
+                    for (i = 0; i < 30; i++) lengths[i] = 5;
+                    build(distcode, lengths, 30);
+                }
+            };
+            static const Tables tables;
+            return codes(out, tables.lencode, tables.distcode);
+        }
+
+        bool dynamic(std::vector<uint8_t> &out)
+        {
+            static const uint8_t order[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+            const int nlen  = bits(5) + 257;
+            const int ndist = bits(5) + 1;
+            const int ncode = bits(4) + 4;
+            if ((nlen > 286) || (ndist > 30)) return false;
+
+            uint8_t lengths[320] = {0};
+            for (int i = 0; i < ncode; i++)
+                lengths[order[i]] = (uint8_t)bits(3);
+
+            Huffman lencode;
+            Huffman distcode;
+            if (!build(lencode, lengths, 19)) return false;
+
+            int index = 0;
+            while (index < nlen + ndist)
+            {
+                const int sym = decode(lencode);
+                if (sym < 0) return false;
+                if (sym < 16)
+                {
+                    lengths[index++] = (uint8_t)sym;
+                    continue;
+                }
+
+                uint8_t len = 0;
+                int rep = 0;
+                if (sym == 16)
+                {
+                    if (index == 0) return false;
+                    len = lengths[index - 1];
+                    rep = 3 + bits(2);
+                }
+                else if (sym == 17)
+                    rep = 3 + bits(3);
+                else
+                    rep = 11 + bits(7);
+                if (index + rep > nlen + ndist) return false;
+                while (rep--) lengths[index++] = len;
+            }
+
+            if (lengths[256] == 0) return false;
+            if (!build(lencode, lengths, nlen)) return false;
+            if (!build(distcode, lengths + nlen, ndist)) return false;
+            return codes(out, lencode, distcode);
+        }
+
+    private:
+        const uint8_t *data;
+        const size_t size;
+        const size_t limit;
+        size_t   pos = 0;
+        uint64_t bitbuf = 0;
+        int      bitcnt = 0;
+    };
+
+    // ===== PNG =====
+
+    static const uint8_t png_signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+
+    static bool png_decode(const uint8_t *data, size_t size, std::vector<uint8_t> &rgb, int &width, int &height)
+    {
+        if ((size < 8) || memcmp(data, png_signature, 8)) return false;
+
+        int64_t w = 0, h = 0;
+        int depth = 0, color = -1, interlace = 0;
+        std::vector<uint8_t> idat;
+        const uint8_t *palette = nullptr;
+        int palette_num = 0;
+
+        for (size_t pos = 8; pos + 12 <= size; )
+        {
+            const uint32_t len = be32(data + pos);
+            const uint8_t *type  = data + pos + 4;
+            const uint8_t *chunk = data + pos + 8;
+            if (len > size - pos - 12) return false;
+
+            if (memcmp(type, "IHDR", 4) == 0)
+            {
+                if (len < 13) return false;
+                w           = be32(chunk);
+                h           = be32(chunk + 4);
+                depth       = chunk[8];
+                color       = chunk[9];
+                interlace   = chunk[12];
+                if ((chunk[10] != 0) || (chunk[11] != 0) || (interlace > 1)) return false;
+            }
+            else if (memcmp(type, "PLTE", 4) == 0)
+            {
+                palette     = chunk;
+                palette_num = (int)(len / 3);
+            }
+            else if (memcmp(type, "IDAT", 4) == 0)
+                idat.insert(idat.end(), chunk, chunk + len);
+            else if (memcmp(type, "IEND", 4) == 0)
+                break;
+
+            pos += 12 + len;
+        }
+
+        if (!dimension_ok(w, h)) return false;
+
+        int channels = 0;
+        switch (color)
+        {
+        case 0: channels = 1; break;
+        case 2: channels = 3; break;
+        case 3: channels = 1; break;
+        case 4: channels = 2; break;
+        case 6: channels = 4; break;
+        default: return false;
+        }
+        if ((depth != 1) && (depth != 2) && (depth != 4) && (depth != 8) && (depth != 16)) return false;
+        if ((color == 3) && ((depth > 8) || (nullptr == palette))) return false;
+        if ((color != 0) && (color != 3) && (depth < 8)) return false;
+
+        // zlib stream
+        if ((idat.size() < 2) || ((idat[0] & 0x0f) != 8) || (idat[1] & 0x20)) return false;
+
+        struct Pass { int x0, y0, dx, dy; };
+        static const Pass adam7[7] = {{0, 0, 8, 8}, {4, 0, 8, 8}, {0, 4, 4, 8}, {2, 0, 4, 4}, {0, 2, 2, 4}, {1, 0, 2, 2}, {0, 1, 1, 2}};
+        static const Pass whole[1] = {{0, 0, 1, 1}};
+        const Pass *passes = interlace ? adam7 : whole;
+        const int pass_num = interlace ? 7 : 1;
+
+        const int bits_per_pixel = channels * depth;
+        const int filter_bpp = std::max(1, bits_per_pixel / 8);
+
+        size_t raw_size = 0;
+        for (int p = 0; p < pass_num; p++)
+        {
+            const int64_t pw = (w - passes[p].x0 + passes[p].dx - 1) / passes[p].dx;
+            const int64_t ph = (h - passes[p].y0 + passes[p].dy - 1) / passes[p].dy;
+            if ((pw > 0) && (ph > 0))
+                raw_size += (size_t)ph * (1 + (pw * bits_per_pixel + 7) / 8);
+        }
+
+        std::vector<uint8_t> raw;
+        raw.reserve(raw_size);
+        Inflater inflater(idat.data() + 2, idat.size() - 2, raw_size);
+        if (!inflater.run(raw) || (raw.size() < raw_size)) return false;
+
+        width  = (int)w;
+        height = (int)h;
+        rgb.resize((size_t)w * h * 3);
+
+        const int max_value = (1 << depth) - 1;
+        auto sample = [depth](const uint8_t *row, int64_t index) -> int
+        {
+            switch (depth)
+            {
+            case 16: return be16(row + index * 2);
+            case 8:  return row[index];
+            default:
+                {
+                    const int64_t bit = index * depth;
+                    return (row[bit / 8] >> (8 - depth - bit % 8)) & ((1 << depth) - 1);
+                }
+            }
+        };
+        auto to8 = [depth, max_value](int v) -> uint8_t
+        {
+            if (depth == 8) return (uint8_t)v;
+            return (uint8_t)((v * 255 + max_value / 2) / max_value);
+        };
+
+        uint8_t *src = raw.data();
+        std::vector<uint8_t> prev;
+        for (int p = 0; p < pass_num; p++)
+        {
+            const Pass &pass = passes[p];
+            const int64_t pw = (w - pass.x0 + pass.dx - 1) / pass.dx;
+            const int64_t ph = (h - pass.y0 + pass.dy - 1) / pass.dy;
+            if ((pw <= 0) || (ph <= 0)) continue;
+
+            const size_t stride = (size_t)(pw * bits_per_pixel + 7) / 8;
+            prev.assign(stride, 0);
+
+            for (int64_t y = 0; y < ph; y++, src += stride + 1)
+            {
+                const int filter = src[0];
+                uint8_t *row = src + 1;
+                switch (filter)
+                {
+                case 0:
+                    break;
+                case 1:
+                    for (size_t i = filter_bpp; i < stride; i++) row[i] += row[i - filter_bpp];
+                    break;
+                case 2:
+                    for (size_t i = 0; i < stride; i++) row[i] += prev[i];
+                    break;
+                case 3:
+                    for (size_t i = 0; i < stride; i++)
+                        row[i] += (uint8_t)(((i >= (size_t)filter_bpp ? row[i - filter_bpp] : 0) + prev[i]) / 2);
+                    break;
+                case 4:
+                    for (size_t i = 0; i < stride; i++)
+                    {
+                        const int a = i >= (size_t)filter_bpp ? row[i - filter_bpp] : 0;
+                        const int b = prev[i];
+                        const int c = i >= (size_t)filter_bpp ? prev[i - filter_bpp] : 0;
+                        const int pa = std::abs(b - c);
+                        const int pb = std::abs(a - c);
+                        const int pc = std::abs(a + b - 2 * c);
+                        row[i] += (uint8_t)((pa <= pb) && (pa <= pc) ? a : pb <= pc ? b : c);
+                    }
+                    break;
+                default:
+                    return false;
+                }
+                memcpy(prev.data(), row, stride);
+
+                uint8_t *dst_row = rgb.data() + ((size_t)(pass.y0 + y * pass.dy) * w + pass.x0) * 3;
+                for (int64_t x = 0; x < pw; x++)
+                {
+                    uint8_t *dst = dst_row + (size_t)x * pass.dx * 3;
+                    const int64_t s = x * channels;
+                    switch (color)
+                    {
+                    case 0:
+                    case 4:
+                        dst[0] = dst[1] = dst[2] = to8(sample(row, s));
+                        break;
+                    case 2:
+                    case 6:
+                        dst[0] = to8(sample(row, s + 0));
+                        dst[1] = to8(sample(row, s + 1));
+                        dst[2] = to8(sample(row, s + 2));
+                        break;
+                    case 3:
+                        {
+                            const int index = sample(row, s);
+                            if (index < palette_num)
+                                memcpy(dst, palette + index * 3, 3);
+                            else
+                                dst[0] = dst[1] = dst[2] = 0;
+                        }
+                        break;
+                    }
+                }
+            }
+        }
+
+        return true;
+    }
+
+    // ===== JPEG (baseline, ITU T.81) =====
+
+    class JpegDecoder
+    {
+    public:
+        JpegDecoder(const uint8_t *data, size_t size) : data(data), size(size) {}
+
+        bool decode(std::vector<uint8_t> &rgb, int &width, int &height)
+        {
+            if ((size < 4) || (data[0] != 0xFF) || (data[1] != 0xD8)) return false;
+
+            bool scanned = false;
+            pos = 2;
+            while (pos + 4 <= size)
+            {
+                if (data[pos] != 0xFF)
+                {
+                    pos++;
+                    continue;
+                }
+                const int marker = data[pos + 1];
+                pos += 2;
+                if (marker == 0xFF)
+                {
+                    pos--;
+                    continue;
+                }
+                if ((marker == 0x01) || ((0xD0 <= marker) && (marker <= 0xD8)))
+                    continue;
+                if (marker == 0xD9)
+                    break;
+
+                const size_t len = be16(data + pos);
+                if ((len < 2) || (pos + len > size)) return false;
+                const uint8_t *seg = data + pos + 2;
+                const size_t seg_len = len - 2;
+
+                switch (marker)
+                {
+                case 0xC4:
+                    if (!read_huffman(seg, seg_len)) return false;
+                    break;
+                case 0xDB:
+                    if (!read_quant(seg, seg_len)) return false;
+                    break;
+                case 0xC0:
+                case 0xC1:
+                    if (!read_frame(seg, seg_len)) return false;
+                    break;
+                case 0xDD:
+                    if (seg_len < 2) return false;
+                    restart_interval = be16(seg);
+                    break;
+                case 0xEE:
+                    if ((seg_len >= 12) && (memcmp(seg, "Adobe", 5) == 0))
+                        adobe_transform = seg[11];
+                    break;
+                case 0xDA:
+                    pos += len;
+                    if (!read_scan(seg, seg_len)) return false;
+                    scanned = true;
+                    continue;
+                default:
+                    // progressive, lossless, arithmetic coding, etc
+                    if ((0xC2 <= marker) && (marker <= 0xCF) && (marker != 0xC4) && (marker != 0xC8) && (marker != 0xCC))
+                        return false;
+                    break;
+                }
+                pos += len;
+            }
+
+            if (!scanned) return false;
+
+            width  = frame_width;
+            height = frame_height;
+            to_rgb(rgb);
+            return true;
+        }
+
+    private:
+        static const int FAST_BITS = 9;
+
+        struct Huffman
+        {
+            uint8_t  fast[1 << FAST_BITS];  // index into `values`, 255 if the code is longer than FAST_BITS
+            uint8_t  sizes[256];
+            uint8_t  values[256];
+            int32_t  maxcode[18];
+            int32_t  valptr[17];
+            int32_t  mincode[17];
+            bool     defined = false;
+        };
+
+        struct Component
+        {
+            int id;
+            int h, v;
+            int tq;
+            int td, ta;
+            int dc_pred;
+            int stride;
+            int rows;
+            std::vector<uint8_t> plane;
+        };
+
+        bool read_huffman(const uint8_t *p, size_t len)
+        {
+            while (len >= 17)
+            {
+                const int tc = p[0] >> 4;
+                const int th = p[0] & 15;
+                if ((tc > 1) || (th > 3)) return false;
+                Huffman &t = huffman[tc][th];
+
+                int counts[17] = {0};
+                int total = 0;
+                for (int i = 1; i <= 16; i++)
+                {
+                    counts[i] = p[i];
+                    total += counts[i];
+                }
+                if ((total > 256) || (len < 17 + (size_t)total)) return false;
+                memcpy(t.values, p + 17, total);
+
+                int k = 0;
+                int code = 0;
+                memset(t.fast, 255, sizeof(t.fast));
+                for (int l = 1; l <= 16; l++)
+                {
+                    t.valptr[l]  = k;
+                    t.mincode[l] = code;
+                    // over-subscribed: codes of this length would not fit into `l` bits
+                    if (code + counts[l] > (1 << l)) return false;
+                    for (int i = 0; i < counts[l]; i++, k++, code++)
+                    {
+                        t.sizes[k] = (uint8_t)l;
+                        if (l <= FAST_BITS)
+                        {
+                            const int first = code << (FAST_BITS - l);
+                            for (int j = 0; j < (1 << (FAST_BITS - l)); j++)
+                                t.fast[first + j] = (uint8_t)k;
+                        }
+                    }
+                    t.maxcode[l] = counts[l] ? code - 1 : -1;
+                    code <<= 1;
+                }
+                t.defined = true;
+
+                p   += 17 + total;
+                len -= 17 + total;
+            }
+            return true;
+        }
+
+        bool read_quant(const uint8_t *p, size_t len)
+        {
+            while (len >= 1)
+            {
+                const int pq = p[0] >> 4;
+                const int tq = p[0] & 15;
+                if (tq > 3) return false;
+                const size_t n = pq ? 129 : 65;
+                if (len < n) return false;
+                for (int i = 0; i < 64; i++)
+                    quant[tq][i] = pq ? be16(p + 1 + i * 2) : p[1 + i];
+                p   += n;
+                len -= n;
+            }
+            return true;
+        }
+
+        bool read_frame(const uint8_t *p, size_t len)
+        {
+            if ((len < 6) || (p[0] != 8)) return false;
+            frame_height = be16(p + 1);
+            frame_width  = be16(p + 3);
+            const int n  = p[5];
+            if (!dimension_ok(frame_width, frame_height)) return false;
+            if (((n != 1) && (n != 3)) || (len < 6 + 3 * (size_t)n)) return false;
+
+            components.resize(n);
+            h_max = v_max = 1;
+            for (int i = 0; i < n; i++)
+            {
+                Component &c = components[i];
+                c.id = p[6 + i * 3];
+                c.h  = p[7 + i * 3] >> 4;
+                c.v  = p[7 + i * 3] & 15;
+                c.tq = p[8 + i * 3];
+                if ((c.h < 1) || (c.h > 4) || (c.v < 1) || (c.v > 4) || (c.tq > 3)) return false;
+                h_max = std::max(h_max, c.h);
+                v_max = std::max(v_max, c.v);
+            }
+
+            mcu_x = (frame_width  + 8 * h_max - 1) / (8 * h_max);
+            mcu_y = (frame_height + 8 * v_max - 1) / (8 * v_max);
+            for (auto &c : components)
+            {
+                c.stride = mcu_x * c.h * 8;
+                c.rows   = mcu_y * c.v * 8;
+                c.plane.assign((size_t)c.stride * c.rows, 0);
+            }
+            return true;
+        }
+
+        void reset_bits(void)
+        {
+            bitbuf = 0;
+            bitcnt = 0;
+            pad_bits = 0;
+            marker_hit = false;
+        }
+
+        // true if bits beyond the entropy-coded data (zeros filled in at a marker or end of file) have been consumed
+        bool exhausted(void) const
+        {
+            return bitcnt < pad_bits;
+        }
+
+        void fill(void)
+        {
+            while (bitcnt <= 24)
+            {
+                uint32_t b = 0;
+                bool padded = true;
+                if (!marker_hit && (pos < size))
+                {
+                    b = data[pos];
+                    if (b == 0xFF)
+                    {
+                        const int next = pos + 1 < size ? data[pos + 1] : 0xD9;
+                        if (next == 0)
+                        {
+                            pos += 2;
+                            padded = false;
+                        }
+                        else
+                        {
+                            marker_hit = true;
+                            b = 0;
+                        }
+                    }
+                    else
+                    {
+                        pos++;
+                        padded = false;
+                    }
+                }
+                if (padded) pad_bits += 8;
+                bitbuf |= b << (24 - bitcnt);
+                bitcnt += 8;
+            }
+        }
+
+        int get_bits(int n)
+        {
+            if (n == 0) return 0;
+            if (bitcnt < n) fill();
+            const int v = (int)(bitbuf >> (32 - n));
+            bitbuf <<= n;
+            bitcnt -= n;
+            return v;
+        }
+
+        int receive_extend(int s)
+        {
+            if (s == 0) return 0;
+            const int v = get_bits(s);
+            return v < (1 << (s - 1)) ? v - (1 << s) + 1 : v;
+        }
+
+        int decode_huffman(const Huffman &t)
+        {
+            if (bitcnt < 16) fill();
+            const int k = t.fast[bitbuf >> (32 - FAST_BITS)];
+            if (k < 255)
+            {
+                const int s = t.sizes[k];
+                bitbuf <<= s;
+                bitcnt -= s;
+                return t.values[k];
+            }
+
+            int code = 0;
+            for (int l = 1; l <= 16; l++)
+            {
+                code = (code << 1) | get_bits(1);
+                if ((t.maxcode[l] >= 0) && (code <= t.maxcode[l]))
+                    return t.values[t.valptr[l] + code - t.mincode[l]];
+            }
+            return -1;
+        }
+
+        static void idct(const float *in, uint8_t *out, int stride)
+        {
+            struct Table
+            {
+                float c[8][8];  // c[u][x] = C(u) / 2 * cos((2x + 1) * u * pi / 16)
+                Table()
+                {
+                    for (int u = 0; u < 8; u++)
+                        for (int x = 0; x < 8; x++)
+                            c[u][x] = (float)((u == 0 ? std::sqrt(0.5) : 1.0) / 2 * std::cos((2 * x + 1) * u * M_PI / 16));
+                }
+            };
+            static const Table t;
+
+            float tmp[8][8];
+            for (int v = 0; v < 8; v++)
+            {
+                const float *row = in + v * 8;
+                for (int x = 0; x < 8; x++)
+                {
+                    float s = 0.0f;
+                    for (int u = 0; u < 8; u++)
+                        s += row[u] * t.c[u][x];
+                    tmp[v][x] = s;
+                }
+            }
+            for (int y = 0; y < 8; y++)
+            {
+                float s[8] = {0};
+                for (int v = 0; v < 8; v++)
+                    for (int x = 0; x < 8; x++)
+                        s[x] += t.c[v][y] * tmp[v][x];
+                for (int x = 0; x < 8; x++)
+                {
+                    const int p = (int)std::lround(s[x] + 128.0f);
+                    out[y * stride + x] = (uint8_t)std::min(255, std::max(0, p));
+                }
+            }
+        }
+
+        bool decode_block(Component &c, int bx, int by)
+        {
+            static const uint8_t zigzag[64] =
+            {
+                 0,  1,  8, 16,  9,  2,  3, 10,
+                17, 24, 32, 25, 18, 11,  4,  5,
+                12, 19, 26, 33, 40, 48, 41, 34,
+                27, 20, 13,  6,  7, 14, 21, 28,
+                35, 42, 49, 56, 57, 50, 43, 36,
+                29, 22, 15, 23, 30, 37, 44, 51,
+                58, 59, 52, 45, 38, 31, 39, 46,
+                53, 60, 61, 54, 47, 55, 62, 63,
+            };
+
+            const Huffman &dc = huffman[0][c.td];
+            const Huffman &ac = huffman[1][c.ta];
+            const uint16_t *q = quant[c.tq];
+            if (!dc.defined || !ac.defined) return false;
+
+            float coef[64] = {0};
+            const int t = decode_huffman(dc);
+            if (t < 0) return false;
+            c.dc_pred += receive_extend(t);
+            coef[0] = (float)(c.dc_pred * q[0]);
+
+            for (int k = 1; k < 64; )
+            {
+                const int rs = decode_huffman(ac);
+                if (rs < 0) return false;
+                const int r = rs >> 4;
+                const int s = rs & 15;
+                if (s == 0)
+                {
+                    if (r != 15) break;
+                    k += 16;
+                    continue;
+                }
+                k += r;
+                if (k > 63) return false;
+                coef[zigzag[k]] = (float)(receive_extend(s) * q[k]);
+                k++;
+            }
+
+            if (exhausted()) return false;
+
+            idct(coef, c.plane.data() + (size_t)by * 8 * c.stride + bx * 8, c.stride);
+            return true;
+        }
+
+        void restart(void)
+        {
+            // skip RSTn (if any)
+            reset_bits();
+            while (pos + 1 < size)
+            {
+                if ((data[pos] == 0xFF) && (data[pos + 1] != 0) && (data[pos + 1] != 0xFF))
+                {
+                    if ((0xD0 <= data[pos + 1]) && (data[pos + 1] <= 0xD7))
+                        pos += 2;
+                    break;
+                }
+                pos++;
+            }
+            for (auto &c : components) c.dc_pred = 0;
+        }
+
+        bool read_scan(const uint8_t *p, size_t len)
+        {
+            if ((len < 1) || components.empty()) return false;
+            const int n = p[0];
+            if ((n < 1) || (n > (int)components.size()) || (len < 1 + 2 * (size_t)n + 3)) return false;
+
+            std::vector<Component *> scan;
+            for (int i = 0; i < n; i++)
+            {
+                Component *c = nullptr;
+                for (auto &comp : components)
+                    if (comp.id == p[1 + i * 2]) c = &comp;
+                if (nullptr == c) return false;
+                c->td = p[2 + i * 2] >> 4;
+                c->ta = p[2 + i * 2] & 15;
+                if ((c->td > 3) || (c->ta > 3)) return false;
+                c->dc_pred = 0;
+                scan.push_back(c);
+            }
+
+            reset_bits();
+
+            int todo = restart_interval > 0 ? restart_interval : INT_MAX;
+            if (n == 1)
+            {
+                Component &c = *scan[0];
+                const int bw = ((frame_width  * c.h + h_max - 1) / h_max + 7) / 8;
+                const int bh = ((frame_height * c.v + v_max - 1) / v_max + 7) / 8;
+                for (int by = 0; by < bh; by++)
+                {
+                    for (int bx = 0; bx < bw; bx++)
+                    {
+                        if (!decode_block(c, bx, by)) return false;
+                        if ((--todo == 0) && restart_interval)
+                        {
+                            restart();
+                            todo = restart_interval;
+                        }
+                    }
+                }
+            }
+            else
+            {
+                for (int my = 0; my < mcu_y; my++)
+                {
+                    for (int mx = 0; mx < mcu_x; mx++)
+                    {
+                        for (auto c : scan)
+                            for (int v = 0; v < c->v; v++)
+                                for (int h = 0; h < c->h; h++)
+                                    if (!decode_block(*c, mx * c->h + h, my * c->v + v)) return false;
+                        if ((--todo == 0) && restart_interval)
+                        {
+                            restart();
+                            todo = restart_interval;
+                        }
+                    }
+                }
+            }
+
+            // skip to the next marker
+            while (pos + 1 < size)
+            {
+                if ((data[pos] == 0xFF) && (data[pos + 1] != 0) && ((data[pos + 1] < 0xD0) || (data[pos + 1] > 0xD7)))
+                    break;
+                pos++;
+            }
+            return true;
+        }
+
+        // chroma planes are upsampled with a triangle filter, like `fancy upsampling` of libjpeg
+        void upsample(const Component &c, std::vector<uint8_t> &out) const
+        {
+            out.resize((size_t)frame_width * frame_height);
+            if ((c.h == h_max) && (c.v == v_max))
+            {
+                for (int y = 0; y < frame_height; y++)
+                    memcpy(out.data() + (size_t)y * frame_width, c.plane.data() + (size_t)y * c.stride, frame_width);
+                return;
+            }
+
+            const int cw = (frame_width  * c.h + h_max - 1) / h_max;
+            const int ch = (frame_height * c.v + v_max - 1) / v_max;
+            std::vector<int>   x0(frame_width), x1(frame_width);
+            std::vector<float> wx(frame_width);
+            for (int x = 0; x < frame_width; x++)
+            {
+                const float sx = std::max(0.0f, (x + 0.5f) * c.h / h_max - 0.5f);
+                x0[x] = std::min((int)sx, cw - 1);
+                x1[x] = std::min(x0[x] + 1, cw - 1);
+                wx[x] = sx - (int)sx;
+            }
+            for (int y = 0; y < frame_height; y++)
+            {
+                const float sy = std::max(0.0f, (y + 0.5f) * c.v / v_max - 0.5f);
+                const int   y0 = std::min((int)sy, ch - 1);
+                const int   y1 = std::min(y0 + 1, ch - 1);
+                const float wy = sy - (int)sy;
+                const uint8_t *r0 = c.plane.data() + (size_t)y0 * c.stride;
+                const uint8_t *r1 = c.plane.data() + (size_t)y1 * c.stride;
+                uint8_t *dst = out.data() + (size_t)y * frame_width;
+                for (int x = 0; x < frame_width; x++)
+                {
+                    const float top    = r0[x0[x]] + (r0[x1[x]] - r0[x0[x]]) * wx[x];
+                    const float bottom = r1[x0[x]] + (r1[x1[x]] - r1[x0[x]]) * wx[x];
+                    dst[x] = (uint8_t)(top + (bottom - top) * wy + 0.5f);
+                }
+            }
+        }
+
+        void to_rgb(std::vector<uint8_t> &rgb) const
+        {
+            const size_t pixels = (size_t)frame_width * frame_height;
+            rgb.resize(pixels * 3);
+
+            if (components.size() == 1)
+            {
+                std::vector<uint8_t> y;
+                upsample(components[0], y);
+                for (size_t i = 0; i < pixels; i++)
+                    rgb[i * 3 + 0] = rgb[i * 3 + 1] = rgb[i * 3 + 2] = y[i];
+                return;
+            }
+
+            std::vector<uint8_t> planes[3];
+            for (int i = 0; i < 3; i++)
+                upsample(components[i], planes[i]);
+
+            const bool is_rgb = (adobe_transform == 0) ||
+                ((components[0].id == 'R') && (components[1].id == 'G') && (components[2].id == 'B'));
+            auto clamp = [](float v) { return (uint8_t)std::min(255.0f, std::max(0.0f, v + 0.5f)); };
+
+            for (size_t i = 0; i < pixels; i++)
+            {
+                if (is_rgb)
+                {
+                    rgb[i * 3 + 0] = planes[0][i];
+                    rgb[i * 3 + 1] = planes[1][i];
+                    rgb[i * 3 + 2] = planes[2][i];
+                    continue;
+                }
+                const float y  = planes[0][i];
+                const float cb = planes[1][i] - 128.0f;
+                const float cr = planes[2][i] - 128.0f;
+                rgb[i * 3 + 0] = clamp(y + 1.402f * cr);
+                rgb[i * 3 + 1] = clamp(y - 0.344136f * cb - 0.714136f * cr);
+                rgb[i * 3 + 2] = clamp(y + 1.772f * cb);
+            }
+        }
+
+    private:
+        const uint8_t *data;
+        const size_t size;
+        size_t pos = 0;
+
+        uint32_t bitbuf = 0;
+        int      bitcnt = 0;
+        int      pad_bits = 0;
+        bool     marker_hit = false;
+
+        Huffman  huffman[2][4];     // [DC/AC][id]
+        uint16_t quant[4][64] = {{0}};
+        std::vector<Component> components;
+        int frame_width = 0;
+        int frame_height = 0;
+        int h_max = 1, v_max = 1;
+        int mcu_x = 0, mcu_y = 0;
+        int restart_interval = 0;
+        int adobe_transform = -1;
+    };
+
+    // ===== BMP =====
+
+    static bool bmp_decode(const uint8_t *data, size_t size, std::vector<uint8_t> &rgb, int &width, int &height)
+    {
+        if ((size < 26) || (data[0] != 'B') || (data[1] != 'M')) return false;
+
+        const uint32_t offset = le32(data + 10);
+        const uint32_t dib    = le32(data + 14);
+        int64_t w = 0, h = 0;
+        int bpp = 0;
+        uint32_t compression = 0;
+        uint32_t colors = 0;
+        int palette_entry = 4;
+        uint32_t masks[3] = {0, 0, 0};
+
+        if (dib == 12)
+        {
+            w   = le16(data + 18);
+            h   = (int16_t)le16(data + 20);
+            bpp = le16(data + 24);
+            palette_entry = 3;
+        }
+        else if ((dib >= 40) && (size >= 14 + (size_t)dib))
+        {
+            w           = (int32_t)le32(data + 18);
+            h           = (int32_t)le32(data + 22);
+            bpp         = le16(data + 28);
+            compression = le32(data + 30);
+            colors      = le32(data + 46);
+            if ((compression == 3) || (compression == 6))
+            {
+                const size_t at = dib >= 52 ? 54 : 14 + dib;
+                if (size < at + 12) return false;
+                for (int i = 0; i < 3; i++) masks[i] = le32(data + at + i * 4);
+            }
+            else if (compression != 0)
+                return false;   // RLE, JPEG/PNG embedded
+        }
+        else
+            return false;
+
+        const bool top_down = h < 0;
+        if (top_down) h = -h;
+        if (!dimension_ok(w, h)) return false;
+
+        if ((bpp == 16) && (compression == 0))
+        {
+            masks[0] = 0x7c00; masks[1] = 0x03e0; masks[2] = 0x001f;
+        }
+        if ((bpp == 32) && (compression == 0))
+        {
+            masks[0] = 0x00ff0000; masks[1] = 0x0000ff00; masks[2] = 0x000000ff;
+        }
+
+        const uint8_t *palette = data + 14 + dib;
+        if (bpp <= 8)
+        {
+            if ((bpp != 1) && (bpp != 4) && (bpp != 8)) return false;
+            if ((colors == 0) || (colors > (1u << bpp))) colors = 1u << bpp;
+            if (14 + dib + (size_t)colors * palette_entry > size) return false;
+        }
+        else if ((bpp != 16) && (bpp != 24) && (bpp != 32))
+            return false;
+
+        const size_t stride = (size_t)((w * bpp + 31) / 32) * 4;
+        if ((offset > size) || (stride * h > size - offset)) return false;
+
+        int shift[3], scale[3];
+        for (int i = 0; i < 3; i++)
+        {
+            shift[i] = 0;
+            scale[i] = 1;
+            if (masks[i] == 0) continue;
+            while (((masks[i] >> shift[i]) & 1) == 0) shift[i]++;
+            scale[i] = (int)(masks[i] >> shift[i]);
+        }
+
+        width  = (int)w;
+        height = (int)h;
+        rgb.resize((size_t)w * h * 3);
+
+        for (int64_t y = 0; y < h; y++)
+        {
+            const uint8_t *row = data + offset + stride * (top_down ? y : h - 1 - y);
+            uint8_t *dst = rgb.data() + (size_t)y * w * 3;
+            for (int64_t x = 0; x < w; x++, dst += 3)
+            {
+                switch (bpp)
+                {
+                case 1:
+                case 4:
+                case 8:
+                    {
+                        const int64_t bit = x * bpp;
+                        uint32_t index = (row[bit / 8] >> (8 - bpp - bit % 8)) & ((1 << bpp) - 1);
+                        if (index >= colors) index = 0;
+                        const uint8_t *c = palette + index * palette_entry;
+                        dst[0] = c[2]; dst[1] = c[1]; dst[2] = c[0];
+                    }
+                    break;
+                case 24:
+                    dst[0] = row[x * 3 + 2]; dst[1] = row[x * 3 + 1]; dst[2] = row[x * 3 + 0];
+                    break;
+                default:
+                    {
+                        const uint32_t v = bpp == 16 ? le16(row + x * 2) : le32(row + x * 4);
+                        for (int i = 0; i < 3; i++)
+                            dst[i] = masks[i] ? (uint8_t)((((v & masks[i]) >> shift[i]) * 255 + scale[i] / 2) / scale[i]) : 0;
+                    }
+                    break;
+                }
+            }
+        }
+        return true;
+    }
+
+    // ===== PPM =====
+
+    // binary (P6) with 8-bit samples. returns offset of pixels, or 0 if invalid
+    static size_t ppm_header(const uint8_t *data, size_t size, int &width, int &height)
+    {
+        if ((size < 2) || (data[0] != 'P') || (data[1] != '6')) return 0;
+
+        int64_t fields[3] = {0};
+        size_t pos = 2;
+        for (int i = 0; i < 3; i++)
+        {
+            while ((pos < size) && ((data[pos] == '#') || isspace(data[pos])))
+            {
+                if (data[pos] == '#')
+                    while ((pos < size) && (data[pos] != '\n')) pos++;
+                pos++;
+            }
+            if ((pos >= size) || !isdigit(data[pos])) return 0;
+            for (; (pos < size) && isdigit(data[pos]); pos++)
+            {
+                fields[i] = fields[i] * 10 + (data[pos] - '0');
+                if (fields[i] > INT_MAX) return 0;
+            }
+        }
+
+        // a single whitespace follows `maxval`
+        if ((pos >= size) || !isspace(data[pos]) || (fields[2] != 255) || !dimension_ok(fields[0], fields[1])) return 0;
+        width  = (int)fields[0];
+        height = (int)fields[1];
+        return pos + 1;
+    }
+
+    static bool ppm_decode(const uint8_t *data, size_t size, std::vector<uint8_t> &rgb, int &width, int &height)
+    {
+        int w = 0, h = 0;
+        const size_t offset = ppm_header(data, size, w, h);
+        if (offset == 0) return false;
+
+        const size_t bytes = (size_t)w * h * 3;
+        if (size - offset < bytes) return false;
+
+        rgb.assign(data + offset, data + offset + bytes);
+        width  = w;
+        height = h;
+        return true;
+    }
+
+    bool image_decode(const uint8_t *data, size_t size, std::vector<uint8_t> &rgb_pixels, int &width, int &height)
+    {
+        width  = -1;
+        height = -1;
+        if ((size >= 8) && (memcmp(data, png_signature, 8) == 0))
+            return png_decode(data, size, rgb_pixels, width, height);
+        if ((size >= 4) && (data[0] == 0xFF) && (data[1] == 0xD8))
+        {
+            JpegDecoder decoder(data, size);
+            return decoder.decode(rgb_pixels, width, height);
+        }
+        if ((size >= 2) && (data[0] == 'B') && (data[1] == 'M'))
+            return bmp_decode(data, size, rgb_pixels, width, height);
+        if ((size >= 2) && (data[0] == 'P') && (data[1] == '6'))
+            return ppm_decode(data, size, rgb_pixels, width, height);
+        return false;
+    }
+
+    bool image_probe(const uint8_t *data, size_t size, int &width, int &height)
+    {
+        width  = -1;
+        height = -1;
+
+        if ((size >= 24) && (memcmp(data, png_signature, 8) == 0) && (memcmp(data + 12, "IHDR", 4) == 0))
+        {
+            width  = (int)be32(data + 16);
+            height = (int)be32(data + 20);
+        }
+        else if ((size >= 4) && (data[0] == 0xFF) && (data[1] == 0xD8))
+        {
+            size_t pos = 2;
+            while (pos + 9 <= size)
+            {
+                if (data[pos] != 0xFF) { pos++; continue; }
+                const int marker = data[pos + 1];
+                if ((marker == 0xFF) || (marker == 0x01) || ((0xD0 <= marker) && (marker <= 0xD8))) { pos += marker == 0xFF ? 1 : 2; continue; }
+                if ((marker == 0xD9) || (marker == 0xDA)) break;
+                if ((0xC0 <= marker) && (marker <= 0xCF) && (marker != 0xC4) && (marker != 0xC8) && (marker != 0xCC))
+                {
+                    height = be16(data + pos + 5);
+                    width  = be16(data + pos + 7);
+                    break;
+                }
+                pos += 2 + be16(data + pos + 2);
+            }
+        }
+        else if ((size >= 26) && (data[0] == 'B') && (data[1] == 'M'))
+        {
+            if (le32(data + 14) == 12)
+            {
+                width  = le16(data + 18);
+                height = std::abs((int16_t)le16(data + 20));
+            }
+            else
+            {
+                width  = (int32_t)le32(data + 18);
+                height = std::abs((int32_t)le32(data + 22));
+            }
+        }
+        else if ((size >= 2) && (data[0] == 'P') && (data[1] == '6'))
+        {
+            if (ppm_header(data, size, width, height) == 0)
+                width = height = -1;
+        }
+        else if ((size >= 10) && (memcmp(data, "GIF8", 4) == 0))
+        {
+            width  = le16(data + 6);
+            height = le16(data + 8);
+        }
+        else if ((size >= 30) && (memcmp(data, "RIFF", 4) == 0) && (memcmp(data + 8, "WEBP", 4) == 0))
+        {
+            if ((memcmp(data + 12, "VP8 ", 4) == 0) && (data[23] == 0x9d) && (data[24] == 0x01) && (data[25] == 0x2a))
+            {
+                width  = le16(data + 26) & 0x3fff;
+                height = le16(data + 28) & 0x3fff;
+            }
+            else if ((memcmp(data + 12, "VP8L", 4) == 0) && (data[20] == 0x2f))
+            {
+                const uint32_t bits = le32(data + 21);
+                width  = (int)(bits & 0x3fff) + 1;
+                height = (int)((bits >> 14) & 0x3fff) + 1;
+            }
+            else if (memcmp(data + 12, "VP8X", 4) == 0)
+            {
+                width  = (int)le24(data + 24) + 1;
+                height = (int)le24(data + 27) + 1;
+            }
+        }
+
+        if (!dimension_ok(width, height))
+        {
+            width  = -1;
+            height = -1;
+            return false;
+        }
+        return true;
+    }
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+namespace vision
+{
+    // In-process decoders. Output is a natural sequence of RGB pixels, 8 bits per channel (alpha is dropped).
+    //
+    // Supported: PNG (all color types & bit depths, interlaced or not), baseline JPEG (gray / YCbCr), BMP (uncompressed),
+    // binary PPM (8-bit).
+    // Returns false for everything else (e.g. progressive JPEG, WebP), so that callers can fall back to external tools.
+    bool image_decode(const uint8_t *data, size_t size, std::vector<uint8_t> &rgb_pixels, int &width, int &height);
+
+    // Get dimension from header. Besides decodable formats, GIF & WebP are also recognized.
+    bool image_probe(const uint8_t *data, size_t size, int &width, int &height);
+}
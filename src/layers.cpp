@@ -1,15 +1,18 @@
 #include "layers.h"
 #include <algorithm>
+#include <climits>
 #include <cmath>
 #include <codecvt>
 #include <cstring>
 #include <fcntl.h>
+#include <filesystem>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <locale>
 #include <random>
 #include <regex>
+#include <set>
 #include <string>
 #include <functional>
 #include "backend.h"
@@ -1474,6 +1477,28 @@ namespace chatllm
             1, ggml::get_dim(a, 1), ggml::get_dim(a, 2), ggml::get_dim(a, 3));
     }
 
+    ggml::tensor *ggml::local_attention(ComputeContext *ctx, ggml::tensor *q, ggml::tensor *k, ggml::tensor *v,
+                                        float scale, int window, float max_bias)
+    {
+        local_attention_param *p = (local_attention_param *)ctx->alloc_temp_param(sizeof(local_attention_param));
+        p->scale    = scale;
+        p->max_bias = max_bias;
+        p->window   = window;
+
+        std::vector<ggml::tensor *> inputs({q, k, v});
+
+        return custom(ctx, ggml_custom_local_attention, GGML_N_TASKS_MAX, p, inputs, ggml::type::GGML_TYPE_F32,
+            ggml::get_dim(v, 1), ggml::get_dim(q, 2), ggml::get_dim(q, 1), ggml::get_dim(q, 3));
+    }
+
+    ggml::tensor *ggml::gated_delta_net(ComputeContext *ctx, ggml::tensor *q, ggml::tensor *k, ggml::tensor *v,
+                                        ggml::tensor *g, ggml::tensor *beta, ggml::tensor *state)
+    {
+        ggml::tensor *tensor = ggml_gated_delta_net(ctx->get_ctx(), q, k, v, g, beta, state);
+        ctx->cb_op_tensor(tensor);
+        return tensor;
+    }
+
     ggml::tensor *ggml::softplus(ComputeContext *ctx, ggml::tensor *a)
     {
         ggml::tensor *tensor = ggml_softplus(ctx->get_ctx(), a);
@@ -1636,6 +1661,14 @@ namespace chatllm
     float       BlockParams::Epsilon::rms_norm = 1e-5f;
     bool        BlockParams::Optimization::speed = true;
     std::vector<std::string> BlockParams::FlashAttention::mode = {"0"};
+    int         BlockParams::KVCacheCompression::budget   = 0;
+    int         BlockParams::KVCacheCompression::recent   = 0;
+    int         BlockParams::KVCacheCompression::slack    = 0;
+    int         BlockParams::KVCacheCompression::capacity = 0;
+    std::vector<bool> BlockParams::KVCacheCompression::enabled = {true};
+    int         BlockParams::MoEExpertCache::slots    = 0;
+    bool        BlockParams::MoEExpertCache::prefetch = true;
+    std::vector<ggml::type> BlockParams::MoEMixedTypes::types;
 
     void BlockParams::set_padded_embedding_num(int num)
     {
@@ -1706,6 +1739,65 @@ namespace chatllm
         return mode.back();
     }
 
+    BlockParams::KVCacheCompression::KVCacheCompression(bool enabled)
+    {
+        push(enabled);
+    }
+
+    void BlockParams::KVCacheCompression::setup(const std::map<std::string, std::string> &args, int batch_size)
+    {
+        budget = utils::get_opt(args, "kv-cache-budget", 0);
+        if (budget <= 0)
+        {
+            budget = 0;
+            return;
+        }
+
+        recent   = std::min(budget, utils::get_opt(args, "kv-cache-recent", budget / 4));
+        slack    = std::max(1,      utils::get_opt(args, "kv-cache-slack",  budget / 8));
+        capacity = budget + slack + std::max(1, batch_size);
+    }
+
+    void BlockParams::KVCacheCompression::push(bool enabled)
+    {
+        KVCacheCompression::enabled.push_back(enabled);
+    }
+
+    void BlockParams::KVCacheCompression::pop(void)
+    {
+        enabled.pop_back();
+    }
+
+    bool BlockParams::KVCacheCompression::is_enabled(void)
+    {
+        return (budget > 0) && enabled.back();
+    }
+
+    int BlockParams::KVCacheCompression::get_cache_length(int cache_length, int max_length)
+    {
+        // only full-length caches are compressed
+        if (!is_enabled() || (cache_length != max_length)) return cache_length;
+        return std::min(cache_length, capacity);
+    }
+
+    void BlockParams::MoEExpertCache::setup(const std::map<std::string, std::string> &args)
+    {
+        slots    = utils::get_opt(args, "moe-expert-cache", 0);
+        prefetch = utils::get_opt(args, "moe-expert-prefetch", true);
+    }
+
+    int BlockParams::MoEExpertCache::get_slots(int num_experts, int experts_per_tok)
+    {
+        if (slots <= 0) return num_experts;
+        return std::min(num_experts, std::max(slots, experts_per_tok));
+    }
+
+    void BlockParams::MoEMixedTypes::setup(const std::vector<ggml::type> &types)
+    {
+        // nothing to be mixed
+        MoEMixedTypes::types = types.size() > 1 ? types : std::vector<ggml::type>();
+    }
+
     bool BlockParams::DisableCache::is_disabled(void)
     {
         return DisableCache::disabled;
@@ -1883,6 +1975,89 @@ namespace chatllm
         return output;
     }
 
+    size_t Block::read_cache_tensors(std::initializer_list<ggml::tensor *> tensors, void *buffer, size_t buffer_size)
+    {
+        size_t r = 0;
+        uint8_t *p = (uint8_t *)buffer;
+        for (auto t : tensors)
+        {
+            if ((nullptr == t) || (r >= buffer_size)) continue;
+            const size_t s = std::min(ggml::nbytes(t), buffer_size - r);
+            Backend::read_tensor_data(t, p + r, 0, s);
+            r += s;
+        }
+        return r;
+    }
+
+    size_t Block::write_cache_tensors(std::initializer_list<ggml::tensor *> tensors, const void *buffer, size_t buffer_size)
+    {
+        size_t r = 0;
+        const uint8_t *p = (const uint8_t *)buffer;
+        for (auto t : tensors)
+        {
+            if ((nullptr == t) || (r >= buffer_size)) continue;
+            const size_t s = std::min(ggml::nbytes(t), buffer_size - r);
+            Backend::write_tensor_data(t, p + r, 0, s);
+            r += s;
+        }
+        return r;
+    }
+
+    CausalConv1D::CausalConv1D(InitContext *ctx, int in_channels, int out_channels, int kernel_size,
+        int dilation, int groups, bool bias, int max_batch)
+      : Conv1D(ctx, in_channels, out_channels, kernel_size, 1, 0, dilation, groups, bias),
+        history((kernel_size - 1) * dilation),
+        state(max_batch > 0 ? ggml::new_tensor_3d(ctx, ggml::type::GGML_TYPE_F32, history, in_channels, max_batch) : nullptr)
+    {
+        CHATLLM_CHECK(history > 0) << "kernel_size must be > 1";
+        if (state) ggml::set_name(state, "conv_state");
+    }
+
+    ggml::tensor *CausalConv1D::forward(ComputeContext *ctx, ggml::tensor *input, int n_past)
+    {
+        if (nullptr == state)
+        {
+            CHATLLM_CHECK(n_past == 0) << "CausalConv1D without state can't continue a sequence";
+            return Conv1D::forward(ctx, ggml::pad(ctx, ggml::cont(ctx, input), history, 0));
+        }
+
+        const int64_t batch = ggml::get_dim(input, 2);
+        CHATLLM_CHECK(batch <= ggml::get_dim(state, 2)) << "batch size " << batch << " exceeds " << ggml::get_dim(state, 2);
+
+        auto past = ggml::view_3d(ctx, state, history, ggml::get_dim(state, 1), batch,
+                        ggml::row_size(state), ggml::row_size(state) * ggml::get_dim(state, 1), 0);
+
+        // a new sequence starts from zeros
+        input = n_past > 0 ? ggml::concat(ctx, past, input, 0) : ggml::pad(ctx, ggml::cont(ctx, input), history, 0);
+
+        auto last = ggml::view_3d(ctx, input, history, ggml::get_dim(input, 1), batch,
+                        ggml::row_size(input), ggml::row_size(input) * ggml::get_dim(input, 1),
+                        ggml::element_size(input) * (ggml::get_dim(input, 0) - history));
+        ggml::build_forward_expand(ctx, ggml::cpy(ctx, last, past));
+
+        return Conv1D::forward(ctx, input);
+    }
+
+    size_t CausalConv1D::get_cache_size(void) const
+    {
+        return state ? ggml::nbytes(state) : 0;
+    }
+
+    void CausalConv1D::set_cache_buffer(BackendBuffer *buffer)
+    {
+        if (state) buffer->assign_to(state);
+    }
+
+    size_t CausalConv1D::read_cache_data(void *buffer, size_t buffer_size) const
+    {
+        return read_cache_tensors({state}, buffer, buffer_size);
+    }
+
+    size_t CausalConv1D::write_cache_data(const void *buffer, size_t buffer_size)
+    {
+        return write_cache_tensors({state}, buffer, buffer_size);
+    }
+
     Conv2D::Conv2D(InitContext *ctx, int in_channels, int out_channels, int kernel_size, int stride, int padding,
         int dilation, int groups, bool bias)
       : Conv2D(ctx, in_channels, out_channels, kernel_size, kernel_size, stride, stride, padding, padding, dilation, dilation,
@@ -2108,6 +2283,82 @@ namespace chatllm
         ln.load(path + "ln.", loader);
     }
 
+    Linear::Linear(InitContext *ctx, int in_features, int out_features, bool use_bias)
+        : weight(ggml::new_tensor_2d(ctx,  ggml::type_fallback(ctx->dtype, in_features), in_features, out_features)),
+          bias(use_bias ? ggml::new_tensor_1d(ctx, GGML_TYPE_F32, out_features) : nullptr)
+    {
+        const int min_rows_per_shard = 128;
+        const int n = ctx->get_shard_count();
+        if ((n < 2) || (out_features < n * min_rows_per_shard)) return;
+
+        // shards are kept in a dedicated context, so that tensor counting of models is not affected
+        shards_ctx.reset(new InitContext(ctx));
+        shards_ctx->gctx = GGMLContext({.mem_size = n * ggml_tensor_overhead(), .mem_buffer = nullptr, .no_alloc = true});
+        for (int i = 0; i < n; i++)
+        {
+            const int rows = out_features / n + (i < out_features % n ? 1 : 0);
+            ctx->backend_shard_override(i);
+            shards.push_back(ggml::new_tensor_2d(shards_ctx.get(), ggml::type_of(weight), in_features, rows));
+        }
+        ctx->backend_shard_override(-1);
+    }
+
+    // split `total` into `n` parts of whole `unit`s, empty if not possible
+    static std::vector<int64_t> split_evenly(int64_t total, int n, int64_t unit)
+    {
+        std::vector<int64_t> r;
+        const int64_t units = total / unit;
+        if ((total % unit != 0) || (units < n)) return r;
+        for (int i = 0; i < n; i++)
+            r.push_back((units / n + (i < units % n ? 1 : 0)) * unit);
+        return r;
+    }
+
+    void Linear::split_by_columns(InitContext *ctx)
+    {
+        const int n = ctx->get_shard_count();
+        const auto cols = split_evenly(in_features(), n, ggml::block_size(weight));
+        if ((n < 2) || (cols.size() < 1)) return;
+
+        shards.clear();
+        shards_ctx.reset(new InitContext(ctx));
+        shards_ctx->gctx = GGMLContext({.mem_size = n * ggml_tensor_overhead(), .mem_buffer = nullptr, .no_alloc = true});
+        for (int i = 0; i < n; i++)
+        {
+            ctx->backend_shard_override(i);
+            shards.push_back(ggml::new_tensor_2d(shards_ctx.get(), ggml::type_of(weight), cols[i], out_features()));
+        }
+        ctx->backend_shard_override(-1);
+        shard_by_columns = true;
+    }
+
+    void Linear::set_shard_rows(const std::vector<int64_t> &rows)
+    {
+        CHATLLM_CHECK(!shard_by_columns && !shards_loaded && (rows.size() == shards.size())) << "shards can't be resized";
+        for (size_t i = 0; i < shards.size(); i++)
+        {
+            shards[i]->ne[1] = rows[i];
+            ggml::change_type(shards[i], ggml::type_of(shards[i]));
+        }
+    }
+
+    void Linear::align_column_shards(ggml::type type)
+    {
+        const auto cols = split_evenly(in_features(), (int)shards.size(), ggml::block_size(type));
+        if (cols.size() < 1)
+        {
+            shards.clear();
+            shard_by_columns = false;
+            return;
+        }
+
+        for (size_t i = 0; i < shards.size(); i++)
+        {
+            shards[i]->ne[0] = cols[i];
+            ggml::change_type(shards[i], type);
+        }
+    }
+
     ggml::tensor *Linear::forward(ComputeContext *ctx, ggml::tensor *input)
     {
         // input: [seqlen, in_features]
@@ -2115,8 +2366,43 @@ namespace chatllm
         {
             input = ggml::clamp(ctx, input, clip_input[0], clip_input[1]);
         }
-        ggml::tensor *output = ggml::mul_mat(ctx, weight, input); // [seqlen, out_features]
-        ggml::mul_mat_set_prec(output, prec);
+        ggml::tensor *output = nullptr;
+        if (shards_loaded && shard_by_columns)
+        {
+            // each device computes with its columns, then results are summed
+            int64_t col = 0;
+            for (int i = 0; i < (int)shards.size(); i++)
+            {
+                ggml::tensor *part = ggml::view_4d(ctx, input, ggml::get_dim(shards[i], 0), ggml::get_dim(input, 1), ggml::get_dim(input, 2), ggml::get_dim(input, 3),
+                                                   input->nb[1], input->nb[2], input->nb[3], col * ggml::element_size(input));
+                col += ggml::get_dim(shards[i], 0);
+
+                ctx->backend_shard_override(i);
+                part = ggml::mul_mat(ctx, shards[i], part);
+                ggml::mul_mat_set_prec(part, prec);
+                ctx->backend_shard_override(-1);
+
+                output = output ? ggml::add(ctx, output, part) : part;
+            }
+        }
+        else if (shards_loaded)
+        {
+            // each device computes its rows, then results are gathered
+            std::vector<ggml::tensor *> parts;
+            for (int i = 0; i < (int)shards.size(); i++)
+            {
+                ctx->backend_shard_override(i);
+                parts.push_back(ggml::mul_mat(ctx, shards[i], input));
+                ggml::mul_mat_set_prec(parts.back(), prec);
+            }
+            ctx->backend_shard_override(-1);
+            output = ggml::concat(ctx, parts, 0);
+        }
+        else
+        {
+            output = ggml::mul_mat(ctx, weight, input); // [seqlen, out_features]
+            ggml::mul_mat_set_prec(output, prec);
+        }
         if (bias)
         {
             output = ggml::add_inplace(ctx, output, bias);
@@ -2130,7 +2416,29 @@ namespace chatllm
 
     void Linear::load(const std::string &path, TensorLoader *loader)
     {
-        loader->read_tensor(path + "weight", weight);
+        if (shard_by_columns)
+            align_column_shards(loader->get_tensor_type(path + "weight"));
+
+        if (shards.size() > 0)
+        {
+            int64_t offset = 0;
+            for (auto shard : shards)
+            {
+                if (shard_by_columns)
+                {
+                    loader->read_tensor_cols(path + "weight", offset, shard);
+                    offset += ggml::get_dim(shard, 0);
+                }
+                else
+                {
+                    loader->read_tensor_rows(path + "weight", offset, shard);
+                    offset += ggml::get_dim(shard, 1);
+                }
+            }
+            shards_loaded = true;
+        }
+        else
+            loader->read_tensor(path + "weight", weight);
         if (bias)
             loader->read_tensor(path + "bias", bias);
         if (do_clip)
@@ -2142,14 +2450,176 @@ namespace chatllm
         }
     }
 
+    // `mul_mat_id` over experts in different types.
+    // src[0]: input [in_features, 1 or n_used, qlen], src[1]: selected [n_used, qlen], src[2...]: groups
+    static void ggml_custom_mul_mat_id_mixed(struct ggml_tensor * dst, int ith, int nth, void * userdata)
+    {
+        const MultiLinear *linear = (const MultiLinear *)userdata;
+        const ggml::tensor *x   = dst->src[0];
+        const ggml::tensor *ids = dst->src[1];
+
+        CHATLLM_CHECK(ggml::type_of(x) == ggml::type::GGML_TYPE_F32);
+        CHATLLM_CHECK(x->nb[0] == sizeof(float));
+
+        const int64_t n_in   = x->ne[0];
+        const int64_t n_out  = dst->ne[0];
+        const int64_t n_used = ids->ne[0];
+
+        // a job: a block of output rows of a selected expert
+        const int64_t block    = 16;
+        const int64_t n_blocks = (n_out + block - 1) / block;
+        const int64_t n_jobs   = n_used * ids->ne[1] * n_blocks;
+        const int64_t job0     = n_jobs * ith / nth;
+        const int64_t job1     = n_jobs * (ith + 1) / nth;
+
+        std::vector<uint8_t> buf;
+        const float *quantized_row  = nullptr;
+        ggml::type   quantized_type = ggml::type::GGML_TYPE_COUNT;
+
+        for (int64_t job = job0; job < job1; job++)
+        {
+            const int64_t row    = job / n_blocks;
+            const int64_t i_used = row % n_used;
+            const int64_t t      = row / n_used;
+            const int expert = *(const int *)((const char *)ids->data + i_used * ids->nb[0] + t * ids->nb[1]);
+
+            const ggml::tensor *w = dst->src[2 + linear->group_of_expert[expert]];
+            const char *w_data = (const char *)w->data + linear->index_in_group[expert] * w->nb[2];
+            const auto *traits = ggml_get_type_traits_cpu(w->type);
+
+            const float *x_row = (const float *)((const char *)x->data + (i_used % x->ne[1]) * x->nb[1] + t * x->nb[2]);
+            const void  *y     = x_row;
+            if (traits->vec_dot_type != ggml::type::GGML_TYPE_F32)
+            {
+                if ((quantized_row != x_row) || (quantized_type != traits->vec_dot_type))
+                {
+                    buf.resize(ggml_row_size(traits->vec_dot_type, n_in));
+                    ggml_get_type_traits_cpu(traits->vec_dot_type)->from_float(x_row, buf.data(), n_in);
+                    quantized_row  = x_row;
+                    quantized_type = traits->vec_dot_type;
+                }
+                y = buf.data();
+            }
+
+            float *out = (float *)((char *)dst->data + i_used * dst->nb[1] + t * dst->nb[2]);
+            const int64_t o0 = (job % n_blocks) * block;
+            const int64_t o1 = std::min(n_out, o0 + block);
+            for (int64_t o = o0; o < o1; o++)
+                traits->vec_dot((int)n_in, out + o, 0, w_data + o * w->nb[1], 0, y, 0, 1);
+        }
+    }
+
+    MultiLinear::MultiLinear(InitContext *ctx, int in_features, int out_features, int multi, bool use_bias, int resident)
+        : weight(ggml::new_tensor_3d(ctx, ggml::type_fallback(ctx->dtype, in_features), in_features, out_features, resident)),
+          bias(use_bias ? ggml::new_tensor_2d(ctx, ggml::type::GGML_TYPE_F32, out_features, multi) : nullptr),
+          multi(multi)
+    {
+        // mixed types are not supported by `ExpertPool`
+        if ((resident < multi) || (BlockParams::MoEMixedTypes::types.size() < 1)) return;
+
+        // candidates are kept in a dedicated context, so that tensor counting of models is not affected
+        groups_ctx.reset(new InitContext(ctx));
+        groups_ctx->gctx = GGMLContext({.mem_size = BlockParams::MoEMixedTypes::types.size() * ggml_tensor_overhead(), .mem_buffer = nullptr, .no_alloc = true});
+        for (auto type : BlockParams::MoEMixedTypes::types)
+        {
+            if (ggml::type_fallback(type, in_features) != type) continue;
+            groups.push_back(ggml::new_tensor_3d(groups_ctx.get(), type, in_features, out_features, multi));
+        }
+    }
+
     ggml::tensor *MultiLinear::forward(ComputeContext *ctx, ggml::tensor *input, ggml::tensor *selected)
     {
-        ggml::tensor *r = ggml::mul_mat_id(ctx, weight, input, selected);
+        return forward(ctx, input, selected, selected);
+    }
+
+    ggml::tensor *MultiLinear::forward(ComputeContext *ctx, ggml::tensor *input, ggml::tensor *resident, ggml::tensor *selected)
+    {
+        ggml::tensor *r = nullptr;
+        if (group_of_expert.size() > 0)
+        {
+            std::vector<ggml::tensor *> inputs = {input, selected};
+            inputs.insert(inputs.end(), groups.begin(), groups.end());
+            r = ggml::custom(ctx, ggml_custom_mul_mat_id_mixed, GGML_N_TASKS_MAX, this, inputs, ggml::type::GGML_TYPE_F32,
+                             ggml::get_dim(groups[0], 1), ggml::get_dim(selected, 0), ggml::get_dim(selected, 1));
+        }
+        else
+            r = ggml::mul_mat_id(ctx, weight, input, resident);
+
         if (bias)
             r = ggml::add_id(ctx, r, bias, selected);
         return r;
     }
 
+    int64_t MultiLinear::get_param_num(bool effective_only) const
+    {
+        int64_t r = 0;
+        if (group_of_expert.size() > 0)
+        {
+            for (auto t : groups)
+                r += ggml::nelements(t);
+        }
+        else
+            r += ggml::nelements(weight) / ggml::get_dim(weight, 2) * multi;
+        r += ggml::nelements(bias);
+        return r;
+    }
+
+    void MultiLinear::load_weight(const std::string &name, const std::string &layer_prefix, const std::string &suffix, TensorLoader *loader)
+    {
+        if ((groups.size() < 1) || loader->has_tensor(name))
+        {
+            loader->read_tensor(name, layer_prefix, multi, suffix, weight);
+            return;
+        }
+
+        std::vector<std::vector<std::string>> names(groups.size());
+        std::vector<int> group(multi);
+        index_in_group.resize(multi);
+        for (int i = 0; i < multi; i++)
+        {
+            const std::string expert = layer_prefix + std::to_string(i) + suffix;
+            const ggml::type type = loader->get_tensor_type(expert);
+            auto it = std::find_if(groups.begin(), groups.end(), [type](ggml::tensor *t) { return ggml::type_of(t) == type; });
+            CHATLLM_CHECK(it != groups.end()) << "unexpected type of " << expert << ": " << ggml::type_to_str(type);
+
+            group[i]          = (int)(it - groups.begin());
+            index_in_group[i] = (int)names[group[i]].size();
+            names[group[i]].push_back(expert);
+        }
+
+        std::vector<ggml::tensor *> used;
+        std::vector<int> group_id(groups.size(), -1);
+        for (size_t g = 0; g < groups.size(); g++)
+        {
+            if (names[g].size() < 1) continue;
+
+            // all in the same type: `mul_mat_id` just works.
+            if ((int)names[g].size() == multi)
+            {
+                weight = groups[g];
+                groups.clear();
+                index_in_group.clear();
+                loader->read_tensor(name, names[g], weight);
+                return;
+            }
+
+            ggml::tensor *t = groups[g];
+            t->ne[2] = (int64_t)names[g].size();
+            ggml::change_type(t, ggml::type_of(t));
+            loader->read_tensor(name + "." + ggml::type_to_str(ggml::type_of(t)), names[g], t);
+            CHATLLM_CHECK(ggml_backend_buffer_is_host(t->buffer)) << "experts in mixed types must be on CPU: " << name;
+
+            group_id[g] = (int)used.size();
+            used.push_back(t);
+        }
+        CHATLLM_CHECK(used.size() + 2 <= GGML_MAX_SRC) << "too many types of experts: " << name;
+
+        groups = used;
+        group_of_expert.resize(multi);
+        for (int i = 0; i < multi; i++)
+            group_of_expert[i] = group_id[group[i]];
+    }
+
     ggml::tensor *GroupNorm::forward(ComputeContext *ctx, ggml::tensor *input)
     {
         ggml::tensor *output = nullptr;
@@ -2373,12 +2843,25 @@ namespace chatllm
         Backend::write_tensor_data(pos, v_pos.data(), 0, qlen * sizeof(v_pos[0]));
     }
 
+    void GLMSelfAttention::prepare_rope_table(void)
+    {
+        const int   n_dims = rope_dim;
+        const float base   = freq_base;
+        std::ostringstream key;
+        key << std::hexfloat << "chatglm1:" << n_dims << ":" << base;
+        RoPESinCosTable::get(rope_table, key.str(), n_dims / 2, [n_dims, base](int pos, int i) {
+                return (float)pos * powf(base, -2.0f * (float)i / (float)n_dims);
+            }, max_length);
+    }
+
     ggml::tensor *GLMSelfAttention::apply_pos_embedding_k(ComputeContext *ctx, ggml::tensor *k, int hidden_size, int qlen, ggml::tensor * past) const
     {
+        const_cast<GLMSelfAttention *>(this)->prepare_rope_table();
         return ggml::map_custom2_inplace(ctx, k, past, ggml_compute_forward_chatglm1_rope, GGML_N_TASKS_MAX, (void *)this);    // [qlen, heads, head_size]
     }
     ggml::tensor *GLMSelfAttention::apply_pos_embedding_q(ComputeContext *ctx, ggml::tensor *q, int hidden_size, int qlen, ggml::tensor * past) const
     {
+        const_cast<GLMSelfAttention *>(this)->prepare_rope_table();
         return ggml::map_custom2_inplace(ctx, q, past, ggml_compute_forward_chatglm1_rope, GGML_N_TASKS_MAX, (void *)this);    // [qlen, heads, head_size]
     }
 
@@ -2474,6 +2957,33 @@ namespace chatllm
 
     ggml::tensor *BaseMLP::forward(ComputeContext *ctx, ggml::tensor *hidden_states)
     {
+        bool paired = down_proj.shard_by_columns && down_proj.is_sharded() && gate_proj.is_sharded() && up_proj.is_sharded()
+                      && !gate_proj.is_clipped() && !up_proj.is_clipped() && !down_proj.is_clipped();
+        for (size_t i = 0; paired && (i < down_proj.shards.size()); i++)
+            paired = (ggml::get_dim(gate_proj.shards[i], 1) == ggml::get_dim(down_proj.shards[i], 0))
+                  && (ggml::get_dim(up_proj.shards[i],   1) == ggml::get_dim(down_proj.shards[i], 0));
+
+        if (paired)
+        {
+            // tensor parallelism: each device computes its part of the intermediate states with rows of gate/up
+            // and the matching columns of down, then outputs are summed (a reduce instead of three gathers).
+            ggml::tensor *output = nullptr;
+            for (int i = 0; i < (int)down_proj.shards.size(); i++)
+            {
+                ctx->backend_shard_override(i);
+                ggml::tensor *act  = ggml::act(ctx, this->act, ggml::mul_mat(ctx, gate_proj.shards[i], hidden_states));
+                ggml::tensor *proj = ggml::mul_mat(ctx, up_proj.shards[i], hidden_states);
+                ggml::tensor *part = ggml::mul_mat(ctx, down_proj.shards[i], ggml::mul_inplace(ctx, act, proj));
+                ggml::mul_mat_set_prec(part, prec);
+                ctx->backend_shard_override(-1);
+
+                output = output ? ggml::add(ctx, output, part) : part;
+            }
+            if (down_proj.bias)
+                output = ggml::add_inplace(ctx, output, down_proj.bias);
+            return output;
+        }
+
         ggml::tensor *act = ggml::act(ctx, this->act, gate_proj.forward(ctx, hidden_states));
         ggml::tensor *proj = up_proj.forward(ctx, hidden_states);
 
@@ -2485,8 +2995,17 @@ namespace chatllm
     void BaseMLP::load(const std::string &path, TensorLoader *loader)
     {
         Block::load(path, loader);
-        up_proj.load(path + "up_proj.", loader);
         down_proj.load(path + "down_proj.", loader);
+        if (down_proj.is_sharded() && down_proj.shard_by_columns)
+        {
+            // rows of gate/up follow columns of down (aligned to blocks of its type)
+            std::vector<int64_t> rows;
+            for (auto t : down_proj.shards)
+                rows.push_back(ggml::get_dim(t, 0));
+            gate_proj.set_shard_rows(rows);
+              up_proj.set_shard_rows(rows);
+        }
+        up_proj.load(path + "up_proj.", loader);
         gate_proj.load(path + "gate_proj.", loader);
     }
 
@@ -2918,7 +3437,7 @@ namespace chatllm
         CoreAttention(ctx, num_attention_heads, num_kv_heads, max_length),
         k_hidden_size(k_hidden_size),
         v_hidden_size(v_hidden_size),
-        cache_length(BlockParams::DisableCache::is_disabled() ? 0 : cache_length),
+        cache_length(BlockParams::DisableCache::is_disabled() ? 0 : BlockParams::KVCacheCompression::get_cache_length(cache_length, max_length)),
         k_cache(nullptr), v_cache(nullptr), raw_k(nullptr), raw_v(nullptr)
     {
         if (cache_length > 0)
@@ -2930,18 +3449,22 @@ namespace chatllm
             }
             else
             {
-                k_cache = ggml::new_tensor_2d(ctx, ggml::type_fallback(ctx->cache_dtype, k_hidden_size / num_kv_heads), k_hidden_size, cache_length);
+                k_cache = ggml::new_tensor_2d(ctx, ggml::type_fallback(ctx->cache_dtype, k_hidden_size / num_kv_heads), k_hidden_size, this->cache_length);
                 switch (v_shape)
                 {
                 case VShapeFromCache::Len_HeadSize_Heads_Batch:
-                    v_cache = ggml::new_tensor_2d(ctx, ggml::type::GGML_TYPE_F16, cache_length, v_hidden_size);
+                    v_cache = ggml::new_tensor_2d(ctx, ggml::type::GGML_TYPE_F16, this->cache_length, v_hidden_size);
                     break;
                 case VShapeFromCache::HeadSize_Len_Heads_Batch:
-                    v_cache = ggml::new_tensor_2d(ctx, ggml::type_fallback(ctx->cache_dtype, v_hidden_size / num_kv_heads), v_hidden_size, cache_length);
+                    v_cache = ggml::new_tensor_2d(ctx, ggml::type_fallback(ctx->cache_dtype, v_hidden_size / num_kv_heads), v_hidden_size, this->cache_length);
                     break;
                 default:
                     break;
                 }
+
+                if (this->cache_length < cache_length)
+                    compressor = std::make_unique<KVCacheCompressor>(num_kv_heads, this->cache_length,
+                        BlockParams::KVCacheCompression::budget, BlockParams::KVCacheCompression::recent, BlockParams::KVCacheCompression::slack);
             }
 
             ggml::set_name(k_cache, "k_cache");
@@ -2952,44 +3475,15 @@ namespace chatllm
 
     size_t KVCacheAttention::read_cache_data(void *buffer, size_t buffer_size) const
     {
-        size_t r = 0;
-        uint8_t *p = (uint8_t *)buffer;
-        if (k_cache)
-        {
-            size_t s = ggml::nbytes(k_cache) <= buffer_size ? ggml::nbytes(k_cache) : buffer_size;
-            Backend::read_tensor_data(k_cache, p, 0, s);
-            r += s;
-            buffer_size -= s;
-            p += s;
-        }
-        if (v_cache && (buffer_size > 0))
-        {
-            size_t s = ggml::nbytes(v_cache) <= buffer_size ? ggml::nbytes(v_cache) : buffer_size;
-            Backend::read_tensor_data(v_cache, p, 0, s);
-            r += s;
-        }
-        return r;
+        // slots of a compressed cache are meaningless without the state of the compressor
+        CHATLLM_CHECK(nullptr == compressor) << "KV cache compression: sessions are not supported";
+        return read_cache_tensors({k_cache, v_cache}, buffer, buffer_size);
     }
 
     size_t KVCacheAttention::write_cache_data(const void *buffer, size_t buffer_size)
     {
-        size_t r = 0;
-        const uint8_t *p = (const uint8_t *)buffer;
-        if (k_cache)
-        {
-            size_t s = ggml::nbytes(k_cache) <= buffer_size ? ggml::nbytes(k_cache) : buffer_size;
-            Backend::write_tensor_data(k_cache, p, 0, s);
-            r += s;
-            buffer_size -= s;
-            p += s;
-        }
-        if (v_cache && (buffer_size > 0))
-        {
-            size_t s = ggml::nbytes(v_cache) <= buffer_size ? ggml::nbytes(v_cache) : buffer_size;
-            Backend::write_tensor_data(v_cache, p, 0, s);
-            r += s;
-        }
-        return r;
+        CHATLLM_CHECK(nullptr == compressor) << "KV cache compression: sessions are not supported";
+        return write_cache_tensors({k_cache, v_cache}, buffer, buffer_size);
     }
 
     void KVCacheAttention::before_forward(ComputeContext *ctx, const int n_past, const int qlen)
@@ -2997,6 +3491,25 @@ namespace chatllm
         CoreAttention::before_forward(ctx, n_past, qlen);
 
         // shift cache
+        if (compressor && (shift_pending.shift > 0))
+        {
+            std::vector<int> keep;
+            int kept = compressor->select_shifted(shift_pending.shift, shift_pending.total, keep);
+            if (kept > 0)
+                compact_cache(compressor.get(), k_cache, v_cache, keep, kept);
+            shift_pending.clear();
+        }
+
+        // rewind: slots of tokens at or after `n_past` are released. tokens evicted before are not restored,
+        // so the result is the same as if the sequence had been compressed up to `n_past` (with the scores seen so far).
+        if (compressor && (n_past > 0) && (n_past < compressor->n_total))
+        {
+            std::vector<int> keep;
+            int kept = compressor->select_rewound(n_past, keep);
+            if (kept > 0)
+                compact_cache(compressor.get(), k_cache, v_cache, keep, kept);
+        }
+
         if (shift_pending.shift > 0)
         {
             int remain = shift_pending.total - shift_pending.shift;
@@ -3024,6 +3537,7 @@ namespace chatllm
     void KVCacheAttention::before_eval(ComputeContext *ctx)
     {
         CoreAttention::before_eval(ctx);
+
         if (nullptr == rt_kv_pos) return;
 
         const int qlen = (int)ggml::get_dim(rt_kv_pos, 0);
@@ -3054,8 +3568,8 @@ namespace chatllm
             return;
         }
 
-        // do a favor for MROPE
-        if (ggml::get_dim(pos, 0) != qlen)
+        // do a favor for MROPE (and compressed caches, where slot != position)
+        if (compressor || (ggml::get_dim(pos, 0) != qlen))
         {
             rt_n_past = n_past;
             rt_kv_pos = ggml::new_tensor_2d(ctx, ggml::type::GGML_TYPE_I32, qlen, ggml::get_dim(pos, 1));
@@ -3201,24 +3715,391 @@ namespace chatllm
         }
     }
 
-    void BaseAttention::set_prec(ggml::prec prec)
+    ggml::tensor *KVCacheAttention::cross_attention_after_pe(ComputeContext *ctx, const int hidden_size, const int n_past, const int qlen,
+                                             ggml::tensor *query_layer, ggml::tensor *key_layer, ggml::tensor *v)
     {
-        KVCacheAttention::set_prec(prec);
-        q_proj.set_prec(prec);
-        k_proj.set_prec(prec);
-        v_proj.set_prec(prec);
+        rt_attn_mass = nullptr;
+        if (nullptr == compressor)
+            return CoreAttention::cross_attention_after_pe(ctx, hidden_size, n_past, qlen, query_layer, key_layer, v);
+
+        // all following cache operations are based on the cache, not the sequence
+        const int cache_n_past = compressor->get_cache_n_past(n_past, qlen);
+        ggml::tensor *r = CoreAttention::cross_attention_after_pe(ctx, hidden_size, cache_n_past, qlen, query_layer, key_layer, v);
+
+        // models may run the graph by their own code, so the compressor follows it through callbacks of `ctx`.
+        // caches and the compressor are captured now, since they may be swapped out after building (e.g. looped layers).
+        KVCacheCompressor *c = compressor.get();
+        ggml::tensor *k_cache = this->k_cache;
+        ggml::tensor *v_cache = this->v_cache;
+        ggml::tensor *mass    = rt_attn_mass;
+        rt_attn_mass = nullptr;
+        ctx->register_eval_callbacks(
+            [this, c, n_past, cache_n_past, qlen]() {
+                CHATLLM_CHECK(batch_size == 1) << "KV cache compression: batch size must be 1";
+                c->commit(n_past, cache_n_past, qlen);
+            },
+            [this, c, k_cache, v_cache, mass]() {
+                if (mass)
+                {
+                    std::vector<float> m(ggml::nelements(mass));
+                    Backend::read_tensor_data(mass, m.data());
+                    c->accumulate(m.data(), (int)ggml::get_dim(mass, 0));
+                }
+
+                std::vector<int> keep;
+                int kept = c->select_evicted(keep);
+                if (kept > 0)
+                    compact_cache(c, k_cache, v_cache, keep, kept);
+            });
+        return r;
     }
 
-    ggml::tensor *BaseAttention::forward(ComputeContext *ctx, ggml::tensor *hidden_states, int n_past)
+    ggml::tensor *KVCacheAttention::attn_scores_to_probs(ComputeContext *ctx, int hidden_size, const int n_past, const int qlen,
+        ggml::tensor *attn_scores)
     {
-        const int hidden_size = o_proj.in_features();
-        const int qlen = (int)hidden_states->ne[1];
+        ggml::tensor *attn_probs = CoreAttention::attn_scores_to_probs(ctx, hidden_size, n_past, qlen, attn_scores);
+        if ((nullptr == compressor) || (ggml::get_dim(attn_probs, 3) != 1))
+            return attn_probs;
 
-        before_forward(ctx, n_past, qlen);
+        // attention mass received by each key, summed over queries and heads of a group
+        // [klen, qlen, heads] -> [klen, kv_heads]
+        const int64_t klen = ggml::get_dim(attn_probs, 0);
+        ggml::tensor *mass = ggml::sum(ctx, attn_probs, 1);
+        mass = ggml::reshape_3d(ctx, mass, klen, num_attention_heads / num_kv_heads, num_kv_heads);
+        mass = ggml::sum(ctx, mass, 1);
+        ggml::set_output(mass);
+        ggml::build_forward_expand(ctx, mass);
+        rt_attn_mass = mass;
 
-        ggml::tensor *tmpq = q_proj.forward(ctx, hidden_states);
-        ggml::tensor *tmpk = k_proj.forward(ctx, hidden_states);
-        ggml::tensor *tmpv = v_proj.forward(ctx, hidden_states);
+        return attn_probs;
+    }
+
+    void KVCacheAttention::swap_runtime_state(RuntimeState &state)
+    {
+        std::swap(compressor,    state.compressor);
+        std::swap(rt_kv_pos,     state.rt_kv_pos);
+        std::swap(rt_n_past,     state.rt_n_past);
+    }
+
+    std::unique_ptr<KVCacheCompressor> KVCacheAttention::new_compressor(void) const
+    {
+        if (nullptr == compressor) return nullptr;
+        return std::make_unique<KVCacheCompressor>(compressor->num_kv_heads, compressor->capacity,
+            compressor->budget, compressor->recent, compressor->slack);
+    }
+
+    void KVCacheAttention::compact_cache(KVCacheCompressor *compressor, ggml::tensor *k_cache, ggml::tensor *v_cache,
+                                         const std::vector<int> &keep, int kept) const
+    {
+        // only slots in use are read, and only kept ones are written
+        const int used = compressor->used;
+        std::vector<uint8_t> src;
+        std::vector<uint8_t> dst;
+
+        // k_cache: [cache_length, num_kv_heads, head_size]
+        {
+            const size_t row_size  = ggml::row_size(k_cache);
+            const size_t head_size = ggml::row_size(ggml::type_of(k_cache), k_hidden_size / num_kv_heads);
+            src.resize(used * row_size);
+            dst.resize(kept * row_size);
+            Backend::read_tensor_data(k_cache, src.data(), 0, src.size());
+            for (int h = 0; h < num_kv_heads; h++)
+            {
+                const int *slots = keep.data() + h * kept;
+                for (int i = 0; i < kept; i++)
+                    memcpy(dst.data() + i * row_size + h * head_size, src.data() + slots[i] * row_size + h * head_size, head_size);
+            }
+            Backend::write_tensor_data(k_cache, dst.data(), 0, dst.size());
+        }
+
+        switch (v_shape)
+        {
+        case VShapeFromCache::Len_HeadSize_Heads_Batch:
+            {
+                // v_cache: [v_hidden_size, cache_length]
+                const int    head_size = v_hidden_size / num_kv_heads;
+                const size_t elem_size = ggml::element_size(v_cache);
+                src.resize(used * elem_size);
+                dst.resize(kept * elem_size);
+                for (int d = 0; d < v_hidden_size; d++)
+                {
+                    const int *slots = keep.data() + (d / head_size) * kept;
+                    const size_t offset = d * cache_length * elem_size;
+                    Backend::read_tensor_data(v_cache, src.data(), offset, src.size());
+                    for (int i = 0; i < kept; i++)
+                        memcpy(dst.data() + i * elem_size, src.data() + slots[i] * elem_size, elem_size);
+                    Backend::write_tensor_data(v_cache, dst.data(), offset, dst.size());
+                }
+            }
+            break;
+        case VShapeFromCache::HeadSize_Len_Heads_Batch:
+            {
+                // v_cache: [num_kv_heads, cache_length, head_size]
+                const size_t row_size = ggml::row_size(ggml::type_of(v_cache), v_hidden_size / num_kv_heads);
+                src.resize(used * row_size);
+                dst.resize(kept * row_size);
+                for (int h = 0; h < num_kv_heads; h++)
+                {
+                    const int *slots = keep.data() + h * kept;
+                    const size_t offset = h * cache_length * row_size;
+                    Backend::read_tensor_data(v_cache, src.data(), offset, src.size());
+                    for (int i = 0; i < kept; i++)
+                        memcpy(dst.data() + i * row_size, src.data() + slots[i] * row_size, row_size);
+                    Backend::write_tensor_data(v_cache, dst.data(), offset, dst.size());
+                }
+            }
+            break;
+        default:
+            CHATLLM_CHECK(false);
+            break;
+        }
+
+        compressor->compact(keep, kept);
+    }
+
+    KVCacheCompressor::KVCacheCompressor(int num_kv_heads, int capacity, int budget, int recent, int slack)
+        : num_kv_heads(num_kv_heads), capacity(capacity), budget(budget), recent(recent), slack(slack),
+          used(0), n_total(0)
+    {
+        CHATLLM_CHECK(budget + slack < capacity) << "KV cache compression: capacity is too small";
+        score.resize(num_kv_heads * capacity);
+        position.resize(num_kv_heads * capacity);
+    }
+
+    void KVCacheCompressor::reset(void)
+    {
+        used    = 0;
+        n_total = 0;
+    }
+
+    int KVCacheCompressor::get_cache_n_past(int n_past, int qlen) const
+    {
+        if (n_past == 0) return 0;
+
+        int r = n_past - (n_total - used);
+
+        // patch n_past for memory estimation
+        if (r + qlen > capacity) r = capacity - qlen;
+        return r > 0 ? r : 0;
+    }
+
+    void KVCacheCompressor::commit(int n_past, int cache_n_past, int qlen)
+    {
+        if (n_past == 0) reset();
+
+        CHATLLM_CHECK(cache_n_past + qlen <= capacity) << "KV cache compression: capacity exceeded (" << cache_n_past + qlen << " > " << capacity << ")";
+
+        for (int h = 0; h < num_kv_heads; h++)
+        {
+            for (int j = 0; j < qlen; j++)
+            {
+                score   [h * capacity + cache_n_past + j] = 0.0f;
+                position[h * capacity + cache_n_past + j] = n_past + j;
+            }
+        }
+
+        used    = cache_n_past + qlen;
+        n_total = n_past + qlen;
+    }
+
+    void KVCacheCompressor::accumulate(const float *mass, int klen)
+    {
+        if (klen > used) klen = used;
+        for (int h = 0; h < num_kv_heads; h++, mass += klen)
+        {
+            float *s = score.data() + h * capacity;
+            for (int i = 0; i < klen; i++)
+                s[i] += mass[i];
+        }
+    }
+
+    int KVCacheCompressor::select_evicted(std::vector<int> &keep) const
+    {
+        if (used <= budget + slack) return 0;
+
+        const int evict_num = used - budget;
+        std::vector<int> candidates;
+        std::vector<bool> evicted;
+        keep.clear();
+
+        for (int h = 0; h < num_kv_heads; h++)
+        {
+            const float *s = score.data()    + h * capacity;
+            const int   *p = position.data() + h * capacity;
+
+            candidates.clear();
+            for (int i = 0; i < used; i++)
+            {
+                if (p[i] < n_total - recent)
+                    candidates.push_back(i);
+            }
+
+            // the least attended ones go first; ties (e.g. scores are not observed with flash attention)
+            // are broken by evicting the later ones, which degenerates into "attention sinks + recent window".
+            std::nth_element(candidates.begin(), candidates.begin() + evict_num - 1, candidates.end(),
+                [s, p](int a, int b) {
+                    return s[a] != s[b] ? s[a] < s[b] : p[a] > p[b];
+                });
+
+            evicted.assign(used, false);
+            for (int i = 0; i < evict_num; i++)
+                evicted[candidates[i]] = true;
+
+            for (int i = 0; i < used; i++)
+            {
+                if (!evicted[i])
+                    keep.push_back(i);
+            }
+        }
+
+        return budget;
+    }
+
+    int KVCacheCompressor::select_shifted(int shift, int total, std::vector<int> &keep)
+    {
+        // positions are relative to the new beginning, but RoPE-ed keys are not touched (like the full cache).
+        for (auto &p : position)
+            p -= shift;
+        n_total = total - shift;
+
+        // drop the ones that are shifted out (the oldest ones, since slots are kept in order).
+        // all heads must keep the same number of slots, so heads that evicted fewer entries than the others
+        // lose some valid survivors (the oldest ones) too.
+        int kept = used;
+        for (int h = 0; h < num_kv_heads; h++)
+        {
+            const int *p = position.data() + h * capacity;
+            int n = 0;
+            for (int i = 0; i < used; i++)
+                if (p[i] >= 0) n++;
+            kept = std::min(kept, n);
+        }
+
+        if (kept >= used) return 0;
+
+        // nothing survives: no need to move any data
+        if (kept == 0)
+        {
+            used = 0;
+            return 0;
+        }
+
+        keep.clear();
+        for (int h = 0; h < num_kv_heads; h++)
+        {
+            for (int i = used - kept; i < used; i++)
+                keep.push_back(i);
+        }
+        return kept;
+    }
+
+    int KVCacheCompressor::select_rewound(int n_past, std::vector<int> &keep)
+    {
+        n_total = n_past;
+
+        // slots are in chronological order, so survivors of each head are the first ones.
+        // all heads must keep the same number of slots, so heads that kept more tokens before `n_past`
+        // evict the extra ones by the policy of `select_evicted`.
+        std::vector<int> survivors(num_kv_heads);
+        int kept = used;
+        for (int h = 0; h < num_kv_heads; h++)
+        {
+            const int *p = position.data() + h * capacity;
+            int n = 0;
+            while ((n < used) && (p[n] < n_past)) n++;
+            survivors[h] = n;
+            kept = std::min(kept, n);
+        }
+
+        if (kept == 0)
+        {
+            used = 0;
+            return 0;
+        }
+
+        bool aligned = true;
+        for (int h = 0; h < num_kv_heads; h++)
+            aligned = aligned && (survivors[h] == kept);
+
+        // no need to move any data
+        if (aligned)
+        {
+            used = kept;
+            return 0;
+        }
+
+        std::vector<int> candidates;
+        std::vector<bool> evicted;
+        keep.clear();
+        for (int h = 0; h < num_kv_heads; h++)
+        {
+            const float *s = score.data()    + h * capacity;
+            const int   *p = position.data() + h * capacity;
+            const int evict_num = survivors[h] - kept;
+
+            candidates.clear();
+            for (int i = 0; i < survivors[h]; i++)
+                if (p[i] < n_past - recent)
+                    candidates.push_back(i);
+            if ((int)candidates.size() < evict_num)
+            {
+                candidates.resize(survivors[h]);
+                for (int i = 0; i < survivors[h]; i++) candidates[i] = i;
+            }
+
+            if (evict_num > 0)
+                std::nth_element(candidates.begin(), candidates.begin() + evict_num - 1, candidates.end(),
+                    [s, p](int a, int b) {
+                        return s[a] != s[b] ? s[a] < s[b] : p[a] > p[b];
+                    });
+
+            evicted.assign(survivors[h], false);
+            for (int i = 0; i < evict_num; i++)
+                evicted[candidates[i]] = true;
+
+            for (int i = 0; i < survivors[h]; i++)
+                if (!evicted[i])
+                    keep.push_back(i);
+        }
+        return kept;
+    }
+
+    void KVCacheCompressor::compact(const std::vector<int> &keep, int kept)
+    {
+        for (int h = 0; h < num_kv_heads; h++)
+        {
+            const int *slots = keep.data() + h * kept;
+            float *s = score.data()    + h * capacity;
+            int   *p = position.data() + h * capacity;
+
+            // slots are in ascending order, so it can be done in place
+            for (int i = 0; i < kept; i++)
+            {
+                s[i] = s[slots[i]];
+                p[i] = p[slots[i]];
+            }
+        }
+        used = kept;
+    }
+
+    void BaseAttention::set_prec(ggml::prec prec)
+    {
+        KVCacheAttention::set_prec(prec);
+        q_proj.set_prec(prec);
+        k_proj.set_prec(prec);
+        v_proj.set_prec(prec);
+    }
+
+    ggml::tensor *BaseAttention::forward(ComputeContext *ctx, ggml::tensor *hidden_states, int n_past)
+    {
+        const int hidden_size = o_proj.in_features();
+        const int qlen = (int)hidden_states->ne[1];
+
+        before_forward(ctx, n_past, qlen);
+
+        ggml::tensor *tmpq = q_proj.forward(ctx, hidden_states);
+        ggml::tensor *tmpk = k_proj.forward(ctx, hidden_states);
+        ggml::tensor *tmpv = v_proj.forward(ctx, hidden_states);
 
         ggml::tensor *scores = cross_attention(ctx, hidden_size, n_past, qlen, tmpq, tmpk, tmpv);
 
@@ -3267,12 +4148,14 @@ namespace chatllm
     BaseBaseSlidingWindowAttentionPartialCache::BaseBaseSlidingWindowAttentionPartialCache(InitContext *ctx, int sliding_window_len, int extra_len,
         int hidden_size, int num_attention_heads, int num_kv_heads, int head_dim, int max_length, bool qkv_bias, bool o_bias):
         BlockParams::FlashAttention("0"),
+        BlockParams::KVCacheCompression(false),
         BaseAttention(ctx, hidden_size, num_attention_heads, num_kv_heads, head_dim, max_length, qkv_bias, o_bias, sliding_window_len + extra_len),
         sliding_window_len(sliding_window_len), extra_len(extra_len),
         indices(ggml::new_tensor_1d(ctx, GGML_TYPE_I32, 1)), // to ensure number of tensors are the same
         cache_offset(0)
     {
         BlockParams::FlashAttention::pop();
+        BlockParams::KVCacheCompression::pop();
     }
 
     void BaseBaseSlidingWindowAttentionPartialCache::before_forward(ComputeContext *ctx, const int n_past, const int qlen)
@@ -3410,6 +4293,51 @@ namespace chatllm
     }
 
 
+    // the fused kernel (CPU only) never materializes the `klen x qlen x heads` scores,
+    // returns nullptr when it can't be used.
+    static ggml::tensor *fused_local_attention(ComputeContext *ctx, int hidden_size, ggml::tensor *key_layer, ggml::tensor *query_layer, ggml::tensor *value_layer,
+        float scale, int window, float max_bias)
+    {
+        auto supported = [](ggml::tensor *t) {
+            return (ggml::type_of(t) == ggml::type::GGML_TYPE_F32) || (ggml::type_of(t) == ggml::type::GGML_TYPE_F16);
+        };
+
+        if (!ctx->get_backend()->is_cpu() || (ggml::type_of(query_layer) != ggml::type::GGML_TYPE_F32)
+            || !supported(key_layer) || !supported(value_layer)
+            || (ggml::get_dim(key_layer, 1) < ggml::get_dim(query_layer, 1)))
+            return nullptr;
+
+        ggml::tensor *r = ggml::local_attention(ctx, query_layer, key_layer, value_layer, scale, window, max_bias);
+
+        // [head_size, heads, qlen, batch] -> [hidden_size, qlen, batch]
+        return ggml::reshape_3d(ctx, r, hidden_size, ggml::get_dim(r, 2), ggml::get_dim(r, 3));
+    }
+
+    ggml::tensor *BaseBaseSlidingWindowAttentionPartialCache::calc_attn_scores(ComputeContext *ctx, int hidden_size, const int n_past, const int qlen,
+        ggml::tensor *key_layer, ggml::tensor *query_layer, ggml::tensor *value_layer)
+    {
+        const int head_size = hidden_size / num_attention_heads;
+
+        if (causal && (nullptr == mask) && (nullptr == rt_mask) && (nullptr == attn_scores_pp) && (nullptr == sinks))
+        {
+            float scale = 1.0f;
+            if (attn_scaling)
+                scale = attn_scaling_factor > 0 ? attn_scaling_factor : 1.f / sqrtf((float)head_size);
+
+            ggml::tensor *r = fused_local_attention(ctx, hidden_size, key_layer, query_layer, value_layer, scale, sliding_window_len, 0.0f);
+            if (r)
+            {
+                last_attn_scores = r;
+                return r;
+            }
+        }
+
+        // once the window is full, keys are fewer than `n_past + qlen`: as in the fused kernel,
+        // the i-th query is at position `klen - qlen + i` of the keys.
+        const int n_past_in_window = (int)ggml::get_dim(key_layer, 1) - qlen;
+        return BaseAttention::calc_attn_scores(ctx, hidden_size, n_past_in_window, qlen, key_layer, query_layer, value_layer);
+    }
+
     ALiBiSelfAttention::ALiBiSelfAttention(InitContext *ctx, int hidden_size, int num_attention_heads, int num_kv_heads, int max_length)
         : BaseAttention(ctx, hidden_size, num_attention_heads, num_kv_heads, max_length, false, false)
     {
@@ -3437,10 +4365,25 @@ namespace chatllm
         Backend::write_tensor_data(mask, data);
     }
 
+    ggml::tensor *ALiBiSelfAttention::calc_attn_scores(ComputeContext *ctx, int hidden_size, const int n_past, const int qlen,
+        ggml::tensor *key_layer, ggml::tensor *query_layer, ggml::tensor *value_layer)
+    {
+        ggml::tensor *r = fused_local_attention(ctx, hidden_size, key_layer, query_layer, value_layer, scale, 0, bias_max);
+        if (r)
+        {
+            last_attn_scores = r;
+            return r;
+        }
+
+        return BaseAttention::calc_attn_scores(ctx, hidden_size, n_past, qlen, key_layer, query_layer, value_layer);
+    }
+
     ggml::tensor *ALiBiSelfAttention::attn_scores_to_probs(ComputeContext *ctx, int hidden_size, const int n_past, const int qlen,
         ggml::tensor *attn_scores)
     {
-        ggml::tensor *sub_mask = ggml::view_2d(ctx, mask, n_past + qlen, qlen, max_length * ggml::element_size(mask), n_past * max_length * ggml::element_size(mask));
+        // the i-th query is at position `klen - qlen + i` (same as the fused kernel)
+        const int64_t klen = ggml::get_dim(attn_scores, 0);
+        ggml::tensor *sub_mask = ggml::view_2d(ctx, mask, klen, qlen, max_length * ggml::element_size(mask), (klen - qlen) * max_length * ggml::element_size(mask));
         sub_mask = ggml::cont(ctx, sub_mask);
 
         ggml::tensor *attn_probs = ggml::soft_max_ext(ctx, attn_scores, sub_mask, scale, bias_max);
@@ -3476,14 +4419,28 @@ namespace chatllm
         }
     }
 
+    void QWenSelfAttention::prepare_rope_table(void)
+    {
+        const int   n_dims     = rope_dim;
+        const float base       = freq_base;
+        const int   seq_length = this->seq_length;
+        std::ostringstream key;
+        key << std::hexfloat << "qwen-ntk:" << n_dims << ":" << base << ":" << seq_length;
+        RoPESinCosTable::get(rope_table, key.str(), n_dims / 2, [n_dims, base, seq_length](int pos, int i) {
+                return qwen_ntk_dynamic_rope_theta(pos, i, n_dims, base, seq_length);
+            }, max_length);
+    }
+
     ggml::tensor *QWenSelfAttention::apply_pos_embedding_k(ComputeContext *ctx, ggml::tensor *k, int hidden_size, int qlen, ggml::tensor * past) const
     {
+        const_cast<QWenSelfAttention *>(this)->prepare_rope_table();
         // [qlen, heads, head_size]
         return ggml::map_custom2(ctx, k, past, ggml_compute_forward_ntk_dynamic_rope, GGML_N_TASKS_MAX, const_cast<QWenSelfAttention *>(this));
     }
 
     ggml::tensor *QWenSelfAttention::apply_pos_embedding_q(ComputeContext *ctx, ggml::tensor *q, int hidden_size, int qlen, ggml::tensor * past) const
     {
+        const_cast<QWenSelfAttention *>(this)->prepare_rope_table();
         // [qlen, heads, head_size];
         ggml::tensor *r = ggml::map_custom2(ctx, q, past, ggml_compute_forward_ntk_dynamic_rope, GGML_N_TASKS_MAX, const_cast<QWenSelfAttention *>(this));
         if (use_logn_attn)
@@ -3513,6 +4470,13 @@ namespace chatllm
             cached_hidden_size = hidden_size;
             build_ntk_mixed_inv_freq(rope_dim, inv_freq, (int)((float)max_length / rope_scaling_factor), freq_base, rope_scaling_factor, rope_scaling_power);
         }
+
+        std::ostringstream key;
+        key << std::hexfloat << "ntk-mix:" << rope_dim << ":" << max_length << ":" << freq_base << ":" << rope_scaling_factor << ":" << rope_scaling_power;
+        const std::vector<float> &inv_freq = this->inv_freq;
+        RoPESinCosTable::get(rope_table, key.str(), (int)inv_freq.size(), [inv_freq](int pos, int i) {
+                return (float)pos * inv_freq[i];
+            }, max_length);
     }
 
     ggml::tensor *BlueLMSelfAttention::apply_pos_embedding_k(ComputeContext *ctx, ggml::tensor *k, int hidden_size, int qlen, ggml::tensor * past) const
@@ -3661,14 +4625,370 @@ namespace chatllm
         mlp2->load(path + "mlp2.", loader);
     }
 
+    static void ggml_custom_fetch_experts(struct ggml_tensor * dst , const struct ggml_tensor * src0, int ith, int nth, void * userdata)
+    {
+        ExpertPool *pool = (ExpertPool *)userdata;
+        pool->fetch(dst, src0);
+    }
+
+    static void ggml_custom_copy_experts(struct ggml_tensor * dst , const struct ggml_tensor * src0, int ith, int nth, void * userdata)
+    {
+        ExpertPool *pool = (ExpertPool *)userdata;
+        pool->copy_pending(ith, nth);
+    }
+
+    ExpertPool::ExpertPool(ExpertPools *group, int num_experts, int num_slots, int experts_per_tok)
+        : num_experts(num_experts), num_slots(num_slots), experts_per_tok(experts_per_tok),
+          group(group), slot_of_expert(num_experts, -1), expert_of_slot(num_slots, -1), last_used(num_slots, 0),
+          preloaded(num_slots, false), tick(0), prev(nullptr), next(nullptr)
+    {
+        CHATLLM_CHECK(num_slots >= experts_per_tok) << "too few resident experts: " << num_slots;
+        if (group) group->add(this);
+    }
+
+    ExpertPool::~ExpertPool()
+    {
+        wait_preload();
+        if (group) group->remove(this);
+    }
+
+    void ExpertPool::add_source(ggml::tensor *resident, const std::string &path, const std::vector<size_t> &offsets)
+    {
+        // experts are copied by the CPU into the buffer, and the layout of weights must be that of the file
+        // (i.e. not repacked, which buffers of extra types do, nor pinned host memory of a GPU)
+        ggml_backend_dev_t dev = ggml_backend_buft_get_device(ggml_backend_buffer_get_type(resident->buffer));
+        CHATLLM_CHECK(ggml_backend_buffer_is_host(resident->buffer) && dev && (ggml_backend_dev_type(dev) == GGML_BACKEND_DEVICE_TYPE_CPU))
+            << "resident experts must be in a buffer of the CPU backend: " << resident->name;
+        CHATLLM_CHECK(ggml::get_dim(resident, 2) == num_slots);
+        CHATLLM_CHECK((int)offsets.size() == num_experts);
+
+        auto file = group ? group->map_file(path) : std::make_shared<MappedFile>(path);
+        sources.push_back(Source{resident, file, offsets});
+    }
+
+    ExpertPool::Stats ExpertPool::get_stats(void) const
+    {
+        Stats r;
+        r.hits          = stats.hits.load(std::memory_order_relaxed);
+        r.misses        = stats.misses.load(std::memory_order_relaxed);
+        r.prefetched    = stats.prefetched.load(std::memory_order_relaxed);
+        r.prefetch_hits = stats.prefetch_hits.load(std::memory_order_relaxed);
+        r.loaded_bytes  = stats.loaded_bytes.load(std::memory_order_relaxed);
+        return r;
+    }
+
+    ggml::tensor *ExpertPool::fetch(ComputeContext *ctx, ggml::tensor *selected)
+    {
+        // slots are assigned by a single task, then missing experts are copied by all threads
+        ggml::tensor *slots = ggml::map_custom1(ctx, selected, ggml_custom_fetch_experts, 1, this);
+        return ggml::map_custom1_inplace(ctx, slots, ggml_custom_copy_experts, GGML_N_TASKS_MAX, this);
+    }
+
+    void ExpertPool::fetch(ggml::tensor *slots, const ggml::tensor *selected)
+    {
+        CHATLLM_CHECK(ggml::type_of(selected) == ggml::type::GGML_TYPE_I32);
+
+        const ggml::tensor *src0 = selected;
+        ggml::tensor       *dst  = slots;
+        GGML_TENSOR_UNARY_OP_LOCALS
+
+        auto id_at = [=](int64_t i0, int64_t i1, int64_t i2, int64_t i3) -> int & {
+            return *(int *)((char *)src0->data + i0*nb00 + i1*nb01 + i2*nb02 + i3*nb03);
+        };
+        auto slot_at = [=](int64_t i0, int64_t i1, int64_t i2, int64_t i3) -> int & {
+            return *(int *)((char *)dst->data + i0*nb0 + i1*nb1 + i2*nb2 + i3*nb3);
+        };
+
+        wait_preload();
+
+        tick++;
+
+        pending.clear();
+        std::vector<int> missing;
+        last_selected.clear();
+        for (int64_t i3 = 0; i3 < ne03; i3++)
+        for (int64_t i2 = 0; i2 < ne02; i2++)
+        for (int64_t i1 = 0; i1 < ne01; i1++)
+        for (int64_t i0 = 0; i0 < ne00; i0++)
+        {
+            const int expert = id_at(i0, i1, i2, i3);
+            CHATLLM_CHECK((0 <= expert) && (expert < num_experts)) << "invalid expert id: " << expert;
+
+            const int slot = slot_of_expert[expert];
+            if (slot >= 0)
+            {
+                if (last_used[slot] == tick) continue;
+                last_used[slot] = tick;
+                stats.hits++;
+                if (preloaded[slot])
+                {
+                    preloaded[slot] = false;
+                    stats.prefetch_hits++;
+                }
+            }
+            else
+            {
+                if (std::find(missing.begin(), missing.end(), expert) != missing.end()) continue;
+                missing.push_back(expert);
+                stats.misses++;
+            }
+            last_selected.push_back(expert);
+        }
+        single_token = ne01 * ne02 * ne03 == 1;
+
+        for (int expert : missing)
+        {
+            // evict the least recently used one, but never those selected by this batch
+            int slot = -1;
+            for (int i = 0; i < num_slots; i++)
+            {
+                if (last_used[i] == tick) continue;
+                if ((slot < 0) || (last_used[i] < last_used[slot])) slot = i;
+            }
+            CHATLLM_CHECK(slot >= 0) << "too many experts (" << last_selected.size() << ") selected by a batch, "
+                                     << "increase `moe-expert-cache` or reduce batch size";
+            assign(expert, slot);
+            pending.push_back(std::make_pair(expert, slot));
+        }
+
+        for (int64_t i3 = 0; i3 < ne03; i3++)
+        for (int64_t i2 = 0; i2 < ne02; i2++)
+        for (int64_t i1 = 0; i1 < ne01; i1++)
+        for (int64_t i0 = 0; i0 < ne00; i0++)
+            slot_at(i0, i1, i2, i3) = slot_of_expert[id_at(i0, i1, i2, i3)];
+
+        if (!BlockParams::MoEExpertCache::prefetch) return;
+
+        learn_from_prev();
+
+        if (nullptr == next) return;
+
+        // while this layer is being computed, predicted experts of the next one are loaded
+        auto predicted = predict_next();
+        if (predicted.size() < 1) return;
+
+        {
+            std::lock_guard<std::mutex> lock(next->preload_mutex);
+            next->preloading = true;
+        }
+        ExpertPool *target = next;
+        group->run_async([target, predicted]() {
+            target->preload(predicted);
+            {
+                std::lock_guard<std::mutex> lock(target->preload_mutex);
+                target->preloading = false;
+            }
+            target->preload_cv.notify_all();
+        });
+    }
+
+    void ExpertPool::learn_from_prev(void)
+    {
+        // only single tokens tell which experts are selected together
+        if ((nullptr == prev) || !single_token || !prev->single_token) return;
+
+        if (prev->co_selected.size() < 1)
+            prev->co_selected.resize((size_t)prev->num_experts * num_experts, 0);
+
+        for (int e : prev->last_selected)
+        {
+            uint32_t *row = prev->co_selected.data() + (size_t)e * num_experts;
+            for (int n : last_selected)
+                row[n]++;
+        }
+    }
+
+    std::vector<int> ExpertPool::predict_next(void) const
+    {
+        std::vector<int> r;
+        if (!single_token || (co_selected.size() < 1)) return r;
+
+        std::vector<uint64_t> scores(next->num_experts, 0);
+        for (int e : last_selected)
+        {
+            const uint32_t *row = co_selected.data() + (size_t)e * next->num_experts;
+            for (int n = 0; n < next->num_experts; n++)
+                scores[n] += row[n];
+        }
+
+        std::vector<int> order(next->num_experts);
+        for (int i = 0; i < next->num_experts; i++) order[i] = i;
+        const int k = std::min(next->experts_per_tok, next->num_experts);
+        std::partial_sort(order.begin(), order.begin() + k, order.end(),
+            [&scores](int a, int b) { return scores[a] > scores[b]; });
+
+        for (int i = 0; i < k; i++)
+        {
+            if (scores[order[i]] == 0) break;
+            r.push_back(order[i]);
+        }
+        return r;
+    }
+
+    void ExpertPool::preload(const std::vector<int> &experts)
+    {
+        for (int expert : experts)
+        {
+            if (slot_of_expert[expert] >= 0) continue;
+
+            // experts selected by the latest batch are kept
+            int slot = -1;
+            for (int i = 0; i < num_slots; i++)
+            {
+                if (last_used[i] == tick) continue;
+                if ((slot < 0) || (last_used[i] < last_used[slot])) slot = i;
+            }
+            if (slot < 0) break;
+
+            load(expert, slot);
+            last_used[slot] = tick - 1;
+            preloaded[slot] = true;
+            stats.prefetched++;
+        }
+    }
+
+    void ExpertPool::wait_preload(void)
+    {
+        std::unique_lock<std::mutex> lock(preload_mutex);
+        preload_cv.wait(lock, [this] { return !preloading; });
+    }
+
+    void ExpertPool::assign(int expert, int slot)
+    {
+        if (expert_of_slot[slot] >= 0)
+            slot_of_expert[expert_of_slot[slot]] = -1;
+
+        expert_of_slot[slot]   = expert;
+        slot_of_expert[expert] = slot;
+        last_used[slot]        = tick;
+        preloaded[slot]        = false;
+    }
+
+    void ExpertPool::load(int expert, int slot)
+    {
+        assign(expert, slot);
+
+        for (auto &src : sources)
+        {
+            const size_t size = src.resident->nb[2];
+            memcpy((char *)src.resident->data + slot * size, src.file->get_data(src.offsets[expert]), size);
+            stats.loaded_bytes += size;
+        }
+    }
+
+    void ExpertPool::copy_pending(int ith, int nth)
+    {
+        // all (expert, source) pairs are concatenated, and each thread copies a contiguous range of bytes
+        size_t total = 0;
+        for (auto &src : sources)
+            total += src.resident->nb[2] * pending.size();
+        if (total < 1) return;
+
+        const size_t per_thread = (total + nth - 1) / nth;
+        const size_t begin = std::min(total, per_thread * ith);
+        const size_t end   = std::min(total, begin + per_thread);
+
+        size_t offset = 0;
+        for (auto &p : pending)
+        {
+            for (auto &src : sources)
+            {
+                const size_t size = src.resident->nb[2];
+                const size_t b = std::max(begin, offset);
+                const size_t e = std::min(end, offset + size);
+                if (b < e)
+                {
+                    memcpy((char *)src.resident->data + p.second * size + (b - offset),
+                           (const char *)src.file->get_data(src.offsets[p.first]) + (b - offset), e - b);
+                }
+                offset += size;
+            }
+        }
+
+        if (ith == 0)
+            stats.loaded_bytes += total;
+    }
+
+    ExpertPools::ExpertPools()
+    {
+    }
+
+    ExpertPools::~ExpertPools()
+    {
+        loader.reset();
+    }
+
+    void ExpertPools::add(ExpertPool *pool)
+    {
+        if (pools.size() > 0)
+        {
+            pools.back()->next = pool;
+            pool->prev = pools.back();
+        }
+        pools.push_back(pool);
+    }
+
+    void ExpertPools::remove(ExpertPool *pool)
+    {
+        if (pool->prev) pool->prev->next = pool->next;
+        if (pool->next) pool->next->prev = pool->prev;
+        pools.erase(std::find(pools.begin(), pools.end(), pool));
+    }
+
+    ExpertCacheStats ExpertPools::get_stats(void) const
+    {
+        ExpertCacheStats r = {};
+        for (auto p : pools)
+        {
+            auto s = p->get_stats();
+            r.hits          += s.hits;
+            r.misses        += s.misses;
+            r.prefetched    += s.prefetched;
+            r.prefetch_hits += s.prefetch_hits;
+            r.loaded_bytes  += s.loaded_bytes;
+        }
+        return r;
+    }
+
+    int ExpertPools::get_max_batch_size(void) const
+    {
+        int r = INT_MAX;
+        for (auto p : pools)
+            r = std::min(r, p->num_slots / p->experts_per_tok);
+        return r;
+    }
+
+    std::shared_ptr<MappedFile> ExpertPools::map_file(const std::string &path)
+    {
+        auto &file = files[path];
+        if (!file)
+            file = std::make_shared<MappedFile>(path);
+        return file;
+    }
+
+    void ExpertPools::run_async(std::function<void (void)> task)
+    {
+        if (!loader)
+            loader = std::make_unique<tokenizer::WorkerPool>(1);
+        loader->submit(task);
+    }
+
     MultiMLP::MultiMLP(InitContext *ctx, int hidden_size, int intermediate_size, int num_local_experts, int num_experts_per_tok,
                 ActFunc act, bool use_bias, int group_size)
         :
-        gate(ctx, hidden_size, intermediate_size, num_local_experts, use_bias),
-        down(ctx, intermediate_size, hidden_size, num_local_experts, use_bias),
-        up  (ctx, hidden_size, intermediate_size, num_local_experts, use_bias),
+        gate(ctx, hidden_size, intermediate_size, num_local_experts, use_bias, BlockParams::MoEExpertCache::get_slots(num_local_experts, num_experts_per_tok)),
+        down(ctx, intermediate_size, hidden_size, num_local_experts, use_bias, BlockParams::MoEExpertCache::get_slots(num_local_experts, num_experts_per_tok)),
+        up  (ctx, hidden_size, intermediate_size, num_local_experts, use_bias, BlockParams::MoEExpertCache::get_slots(num_local_experts, num_experts_per_tok)),
         act(act), num_local_experts(num_local_experts), num_experts_per_tok(num_experts_per_tok), group_size(group_size)
     {
+        const int slots = (int)ggml::get_dim(gate.weight, 2);
+        if (slots < num_local_experts)
+        {
+            pool = std::make_unique<ExpertPool>(ctx->expert_pools, num_local_experts, slots, num_experts_per_tok);
+            ctx->get_allocator()->alloc(gate.weight);
+            ctx->get_allocator()->alloc(down.weight);
+            ctx->get_allocator()->alloc(up.weight);
+        }
     }
 
     ggml::tensor *MultiMLP::forward(ComputeContext *ctx, ggml::tensor *hidden_states,
@@ -3677,13 +4997,15 @@ namespace chatllm
         if (group_size > 1)
             selected_experts = ggml::int_div(ctx, selected_experts, group_size);
 
-        ggml::tensor *gated = gate.forward(ctx, hidden_states, selected_experts); // [n_ff, num_experts_per_tok, qlen]
+        ggml::tensor *resident = pool ? pool->fetch(ctx, selected_experts) : selected_experts;
+
+        ggml::tensor *gated = gate.forward(ctx, hidden_states, resident, selected_experts); // [n_ff, num_experts_per_tok, qlen]
         ggml::tensor *act = ggml::act(ctx, this->act, gated);
-        ggml::tensor *upped = up.forward(ctx, hidden_states, selected_experts); // [n_ff, num_experts_per_tok, qlen]
+        ggml::tensor *upped = up.forward(ctx, hidden_states, resident, selected_experts); // [n_ff, num_experts_per_tok, qlen]
 
         ggml::tensor *par = ggml::mul_inplace(ctx, upped, act); // [n_ff, num_experts_per_tok, qlen]
 
-        ggml::tensor * experts = down.forward(ctx, par, selected_experts); // [hidden_size, num_experts_per_tok, qlen]
+        ggml::tensor * experts = down.forward(ctx, par, resident, selected_experts); // [hidden_size, num_experts_per_tok, qlen]
         return experts;
     }
 
@@ -3703,9 +5025,26 @@ namespace chatllm
 
     void MultiMLP::load(const std::string &path, TensorLoader *loader)
     {
-        loader->read_tensor(path + "experts_down.weight", path, num_local_experts, ".down_proj.weight", down.weight);
-        loader->read_tensor(path + "experts_gate.weight", path, num_local_experts, ".gate_proj.weight", gate.weight);
-        loader->read_tensor(path + "experts_up.weight",   path, num_local_experts, ".up_proj.weight",   up.weight);
+        if (pool)
+        {
+            auto locate = [this, &path, loader](const std::string &name, const std::string &suffix, ggml::tensor *tensor) {
+                std::string fn;
+                std::vector<size_t> offsets;
+                CHATLLM_CHECK(loader->locate_tensor(path + name, path, num_local_experts, suffix, tensor, fn, offsets))
+                    << "experts can't be loaded on demand: " << path + name;
+                ggml::set_name(tensor, (path + name).c_str());
+                pool->add_source(tensor, fn, offsets);
+            };
+            locate("experts_down.weight", ".down_proj.weight", down.weight);
+            locate("experts_gate.weight", ".gate_proj.weight", gate.weight);
+            locate("experts_up.weight",   ".up_proj.weight",   up.weight);
+        }
+        else
+        {
+            down.load_weight(path + "experts_down.weight", path, ".down_proj.weight", loader);
+            gate.load_weight(path + "experts_gate.weight", path, ".gate_proj.weight", loader);
+            up.load_weight(  path + "experts_up.weight",   path, ".up_proj.weight",   loader);
+        }
         if (down.bias)
         {
             loader->read_tensor(path + "experts_down.bias", path, num_local_experts, ".down_proj.bias", down.bias);
@@ -3728,7 +5067,8 @@ namespace chatllm
             routed_scaling_factor(-1.0f),
             always_scaling(false),
             pre_weighting(false),
-            p_experts(nullptr)
+            p_experts(nullptr),
+            profiler(ctx->routing_profiles && ctx->routing_profiles->is_enabled() ? new MoERoutingProfiler(ctx->routing_profiles, num_local_experts) : nullptr)
     {
         delete mover;
         mover = nullptr;
@@ -3784,6 +5124,9 @@ namespace chatllm
         // select experts
         ggml::tensor * selected_experts = select_experts(ctx, corrected_score);
 
+        if (profiler)
+            ggml::build_forward_expand(ctx, profiler->record(ctx, selected_experts));
+
         if (router_scale)
         {
             probs = ggml::mul(ctx, probs, router_scale);
@@ -3919,6 +5262,12 @@ namespace chatllm
         {
             loader->read_tensor(path + "router_scale", router_scale);
         }
+
+        if (profiler)
+        {
+            profiler->path       = path;
+            profiler->group_size = get_routing_group_size();
+        }
     }
 
     void GenericSparseMLP::set_experts(MultiMLP *experts)
@@ -3926,6 +5275,196 @@ namespace chatllm
         p_experts = experts;
     }
 
+    int GenericSparseMLP::get_routing_group_size(void) const
+    {
+        // a selected id is mapped to a group of experts
+        if (p_experts && (p_experts->group_size > 1)) return 1;
+        return group_indices ? num_local_experts / num_experts_per_tok : num_local_experts;
+    }
+
+    int GenericGroupedSparseMoE::get_routing_group_size(void) const
+    {
+        const int r = GenericSparseMLP::get_routing_group_size();
+        return n_group > 0 ? std::min(r, num_local_experts / n_group) : r;
+    }
+
+    static void ggml_custom_record_routing(struct ggml_tensor * dst , const struct ggml_tensor * src0, int ith, int nth, void * userdata)
+    {
+        MoERoutingProfiler *profiler = (MoERoutingProfiler *)userdata;
+        profiler->record(src0);
+    }
+
+    MoERoutingProfiler::MoERoutingProfiler(MoERoutingProfiles *group, int num_experts)
+        : num_experts(num_experts), group_size(num_experts), num_tokens(0),
+          histogram(num_experts, 0), co_activation((size_t)num_experts * num_experts, 0), group(group)
+    {
+        group->add(this);
+    }
+
+    MoERoutingProfiler::~MoERoutingProfiler()
+    {
+        group->remove(this);
+    }
+
+    ggml::tensor *MoERoutingProfiler::record(ComputeContext *ctx, ggml::tensor *selected)
+    {
+        return ggml::map_custom1(ctx, selected, ggml_custom_record_routing, 1, this);
+    }
+
+    void MoERoutingProfiler::record(const ggml::tensor *selected)
+    {
+        CHATLLM_CHECK(ggml::type_of(selected) == ggml::type::GGML_TYPE_I32);
+
+        const ggml::tensor *src0 = selected;
+        GGML_TENSOR_LOCALS(int64_t, ne0, src0, ne)
+        GGML_TENSOR_LOCALS(size_t,  nb0, src0, nb)
+
+        std::lock_guard<std::mutex> lock(group->mutex);
+
+        std::vector<int> ids(ne00);
+        for (int64_t i3 = 0; i3 < ne03; i3++)
+        for (int64_t i2 = 0; i2 < ne02; i2++)
+        for (int64_t i1 = 0; i1 < ne01; i1++)
+        {
+            for (int64_t i0 = 0; i0 < ne00; i0++)
+            {
+                ids[i0] = *(const int *)((const char *)src0->data + i0*nb00 + i1*nb01 + i2*nb02 + i3*nb03);
+                CHATLLM_CHECK((0 <= ids[i0]) && (ids[i0] < num_experts)) << "invalid expert id: " << ids[i0];
+                histogram[ids[i0]]++;
+            }
+
+            for (int64_t i = 0; i < ne00; i++)
+            {
+                for (int64_t j = i + 1; j < ne00; j++)
+                {
+                    co_activation[(size_t)ids[i] * num_experts + ids[j]]++;
+                    co_activation[(size_t)ids[j] * num_experts + ids[i]]++;
+                }
+            }
+            num_tokens++;
+        }
+
+        group->dirty = true;
+    }
+
+    // files claimed by models of this process, and models to be saved on `exit()`
+    static std::mutex                           routing_profiles_mutex;
+    static std::set<std::string>                routing_profile_files;
+    static std::set<MoERoutingProfiles *>       live_routing_profiles;
+
+    static void save_routing_profiles_on_exit(void)
+    {
+        std::lock_guard<std::mutex> lock(routing_profiles_mutex);
+        for (auto p : live_routing_profiles)
+            p->save();
+    }
+
+    MoERoutingProfiles::MoERoutingProfiles(const std::string &file)
+        : file(file)
+    {
+        if (!is_enabled()) return;
+
+        static std::once_flag flag;
+        std::call_once(flag, [] { std::atexit(save_routing_profiles_on_exit); });
+
+        std::lock_guard<std::mutex> lock(routing_profiles_mutex);
+        live_routing_profiles.insert(this);
+    }
+
+    MoERoutingProfiles::~MoERoutingProfiles()
+    {
+        if (!is_enabled()) return;
+
+        save();
+
+        std::lock_guard<std::mutex> lock(routing_profiles_mutex);
+        live_routing_profiles.erase(this);
+        if (saved_file.size() > 0)
+            routing_profile_files.erase(saved_file);
+    }
+
+    bool MoERoutingProfiles::is_enabled(void) const
+    {
+        return file.size() > 0;
+    }
+
+    void MoERoutingProfiles::add(MoERoutingProfiler *profiler)
+    {
+        // the file is claimed by the first MoE layer, so that models without any do not take it
+        {
+            std::lock_guard<std::mutex> lock(routing_profiles_mutex);
+            if (saved_file.size() < 1)
+            {
+                saved_file = file;
+                for (int i = 1; !routing_profile_files.insert(saved_file).second; i++)
+                {
+                    const std::filesystem::path path(file);
+                    saved_file = (path.parent_path() / (path.stem().string() + "." + std::to_string(i) + path.extension().string())).string();
+                }
+                if (saved_file != file)
+                    ggml::log(GGML_LOG_LEVEL_INFO, "MoE routing profile of another model is saved to %s\n", saved_file.c_str());
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        profilers.push_back(profiler);
+    }
+
+    void MoERoutingProfiles::remove(MoERoutingProfiler *profiler)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        // keep what is recorded by the layer
+        if (dirty)
+            save_locked();
+        profilers.erase(std::find(profilers.begin(), profilers.end(), profiler));
+    }
+
+    void MoERoutingProfiles::save(void)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (dirty)
+            save_locked();
+    }
+
+    void MoERoutingProfiles::save_locked(void)
+    {
+        std::ofstream f(saved_file);
+        if (!f.is_open())
+        {
+            ggml::log(GGML_LOG_LEVEL_ERROR, "failed to save MoE routing profile to %s", saved_file.c_str());
+            return;
+        }
+
+        auto write_list = [&f](const int64_t *values, int n) {
+            f << "[";
+            for (int i = 0; i < n; i++)
+                f << (i > 0 ? ", " : "") << values[i];
+            f << "]";
+        };
+
+        f << "{\n\"layers\": [\n";
+        for (size_t i = 0; i < profilers.size(); i++)
+        {
+            auto p = profilers[i];
+            f << "  {\"path\": \"" << p->path << "\", \"num_experts\": " << p->num_experts
+              << ", \"group_size\": " << p->group_size << ", \"num_tokens\": " << p->num_tokens << ",\n";
+            f << "   \"histogram\": ";
+            write_list(p->histogram.data(), p->num_experts);
+            f << ",\n   \"co_activation\": [\n";
+            for (int j = 0; j < p->num_experts; j++)
+            {
+                f << "    ";
+                write_list(p->co_activation.data() + (size_t)j * p->num_experts, p->num_experts);
+                f << (j + 1 < p->num_experts ? ",\n" : "\n");
+            }
+            f << "   ]}" << (i + 1 < profilers.size() ? ",\n" : "\n");
+        }
+        f << "]\n}\n";
+
+        dirty = false;
+    }
+
     ggml::tensor *GenericGroupedSparseMoE::select_experts(ComputeContext *ctx, ggml::tensor *corrected_score)
     {
         const int n_expert = num_local_experts;
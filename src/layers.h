@@ -19,6 +19,8 @@ namespace chatllm
     void inspect_tensor(ggml::tensor *tensor, const char *format, ...);
     void clear_inspected_tensors(void);
 
+    class RoPESinCosTable;
+
     struct alibi_ctx
     {
         int    n_past;
@@ -246,8 +248,23 @@ namespace chatllm
                 bool swapped = false);
 
         ggml::tensor *logsumexp(ComputeContext *ctx, ggml::tensor *a);
+
+        // gated delta rule (linear attention) by ggml, dk == dv
+        // q, k: [dk, heads, qlen], v: [dv, heads, qlen], g (log of decay), beta: [1, heads, qlen]
+        // state: [dv, dk, heads], F32
+        // returns [dv * heads, qlen + dk]: outputs ([dv, heads, qlen]) followed by the new state
+        ggml::tensor *gated_delta_net(ComputeContext *ctx, ggml::tensor *q, ggml::tensor *k, ggml::tensor *v,
+                                      ggml::tensor *g, ggml::tensor *beta, ggml::tensor *state);
         ggml::tensor *softplus(ComputeContext *ctx, ggml::tensor *a);
 
+        // causal attention within a sliding window and/or with ALiBi, by a fused (tiled, online softmax) CPU kernel
+        // q: [head_size, qlen, heads, batch] F32
+        // k: [head_size, klen, kv_heads, batch], v: [klen, head_size_v, kv_heads, batch], F32 or F16
+        // the i-th query is at position `klen - qlen + i`, and attends to keys in (pos - window, pos] (window <= 0: unlimited)
+        // returns [head_size_v, heads, qlen, batch]
+        ggml::tensor *local_attention(ComputeContext *ctx, ggml::tensor *q, ggml::tensor *k, ggml::tensor *v,
+                                      float scale, int window = 0, float max_bias = 0.0f);
+
         // accept either probs or logits, but not both
         ggml::tensor *categorical_entropy(ComputeContext *ctx, ggml::tensor *probs, ggml::tensor *logits);
 
@@ -357,6 +374,54 @@ namespace chatllm
             static std::vector<std::string> mode;
         };
 
+        // attention-importance based KV cache compression (H2O):
+        // only `budget` positions (heavy hitters + a recent window) are kept per KV head.
+        class KVCacheCompression
+        {
+        public:
+            KVCacheCompression(bool enabled);
+
+            static void setup(const std::map<std::string, std::string> &args, int batch_size);
+            static void push(bool enabled);
+            static void pop(void);
+            static bool is_enabled(void);
+
+            // number of cache slots to be allocated for a cache of `cache_length`
+            static int get_cache_length(int cache_length, int max_length);
+        public:
+            static int budget;
+            static int recent;
+            static int slack;
+            static int capacity;
+        protected:
+            static std::vector<bool> enabled;
+        };
+
+        // on-demand loading of MoE experts (`MultiMLP`): only `slots` experts of each layer are resident,
+        // others stay in the memory mapped model file until selected.
+        class MoEExpertCache
+        {
+        public:
+            static void setup(const std::map<std::string, std::string> &args);
+
+            // number of resident experts of a layer, `num_experts` if disabled
+            static int get_slots(int num_experts, int experts_per_tok);
+        public:
+            static int  slots;
+            static bool prefetch;
+        };
+
+        // experts of MoE layers stored in different types in the model file (e.g. hot experts in higher precision).
+        // experts of each type are loaded into a group, and no re-quantization is performed.
+        class MoEMixedTypes
+        {
+        public:
+            // `types`: all types of experts in the model file
+            static void setup(const std::vector<ggml::type> &types);
+        public:
+            static std::vector<ggml::type> types;
+        };
+
         class CoreAttentionUseSinks
         {
         public:
@@ -434,6 +499,7 @@ namespace chatllm
         virtual void before_forward(ComputeContext *ctx, ggml::tensor *input, int n_past) {}
         virtual void before_forward(ComputeContext *ctx, const int n_past, const int qlen) {}
         virtual void before_eval(ComputeContext *ctx) {}
+        virtual void after_eval(ComputeContext *ctx) {}
 
         virtual void set_ctx(int n_ctx) { }
         virtual void shift_cache(int shift, int total) { }
@@ -475,6 +541,12 @@ namespace chatllm
 
         virtual void load(const std::string &path, TensorLoader *loader) { }
 
+    protected:
+        // cache data made of `tensors` one after another (null ones are skipped), clipped to `buffer_size`.
+        // returns the number of bytes read/written.
+        static size_t read_cache_tensors(std::initializer_list<ggml::tensor *> tensors, void *buffer, size_t buffer_size);
+        static size_t write_cache_tensors(std::initializer_list<ggml::tensor *> tensors, const void *buffer, size_t buffer_size);
+
     protected:
         ggml::prec prec;
         int id;
@@ -593,6 +665,29 @@ namespace chatllm
         const int output_padding;
     };
 
+    // Causal Conv1D (stride = 1) for incremental decoding.
+    // The last `(kernel_size - 1) * dilation` frames of each sequence are kept in `state`, which is
+    // a cache (saved/restored like KV cache), so each step only feeds new frames.
+    // input: [qlen, in_channels, batch]
+    class CausalConv1D : public Conv1D
+    {
+    public:
+        CausalConv1D(InitContext *ctx, int in_channels, int out_channels, int kernel_size,
+               int dilation = 1, int groups = 1, bool bias = true, int max_batch = 1);
+
+        ggml::tensor *forward(ComputeContext *ctx, ggml::tensor *input, int n_past) override;
+        // a whole sequence
+        ggml::tensor *forward(ComputeContext *ctx, ggml::tensor *input) override { return forward(ctx, input, 0); }
+
+        size_t get_cache_size(void) const override;
+        void   set_cache_buffer(BackendBuffer *buffer) override;
+        size_t read_cache_data(void *buffer, size_t buffer_size) const override;
+        size_t write_cache_data(const void *buffer, size_t buffer_size) override;
+    public:
+        const int history;
+        ggml::tensor *state;    // [history, in_channels, max_batch], null if `max_batch` is 0 (no state kept)
+    };
+
     class Conv2D: public ConvBase
     {
     public:
@@ -717,9 +812,7 @@ namespace chatllm
     {
     public:
         Linear() : weight(nullptr), bias(nullptr) {}
-        Linear(InitContext *ctx, int in_features, int out_features, bool use_bias = true)
-            : weight(ggml::new_tensor_2d(ctx,  ggml::type_fallback(ctx->dtype, in_features), in_features, out_features)),
-              bias(use_bias ? ggml::new_tensor_1d(ctx, GGML_TYPE_F32, out_features) : nullptr) {}
+        Linear(InitContext *ctx, int in_features, int out_features, bool use_bias = true);
 
         Linear(InitContext *ctx, int in_features, int out_features, ggml::tensor *weight, bool use_bias = true)
             : weight(weight != NULL ? weight : ggml::new_tensor_2d(ctx, ggml::type_fallback(ctx->dtype, in_features), in_features, out_features)),
@@ -746,45 +839,73 @@ namespace chatllm
             do_clip = true;
         }
 
+        // split `weight` by columns (input features) instead of rows, outputs of shards are summed. call before `load`.
+        void split_by_columns(InitContext *ctx);
+        // change number of rows of each shard. call before `load`.
+        void set_shard_rows(const std::vector<int64_t> &rows);
+
+        bool is_sharded(void) const { return shards_loaded; }
+        bool is_clipped(void) const { return do_clip; }
+
     public:
         ggml::tensor *weight; // [out_features, in_features]
         ggml::tensor *bias;   // [out_features]
+
+        // tensor parallelism: rows (or columns, see `split_by_columns`) of `weight` are split across devices, and `weight` is not allocated.
+        // shards are loaded (and used) only by `load`; when `weight` is read directly by a model loader, it is used as is.
+        std::vector<ggml::tensor *> shards;
+        bool shard_by_columns = false;
+    protected:
+        // columns of shards must be aligned to blocks of `type`, shards are dropped if not possible
+        void align_column_shards(ggml::type type);
     protected:
         float clip_input[2]  = {0.0f, 0.0f};
         float clip_output[2] = {0.0f, 0.0f};
         bool  do_clip = false;
+        bool  shards_loaded = false;
+        std::unique_ptr<InitContext> shards_ctx;
     };
 
     class MultiLinear : public Block
     {
     public:
-        MultiLinear() : weight(nullptr) {}
+        MultiLinear() : weight(nullptr), multi(0) {}
         MultiLinear(InitContext *ctx, int in_features, int out_features, int multi)
             : MultiLinear(ctx, in_features, out_features, multi, false)
         {}
 
         MultiLinear(InitContext *ctx, int in_features, int out_features, int multi, bool use_bias)
-            : weight(ggml::new_tensor_3d(ctx, ggml::type_fallback(ctx->dtype, in_features), in_features, out_features, multi)),
-              bias(use_bias ? ggml::new_tensor_2d(ctx, ggml::type::GGML_TYPE_F32, out_features, multi) : nullptr)
-        {
-        }
+            : MultiLinear(ctx, in_features, out_features, multi, use_bias, multi)
+        {}
+
+        // only `resident` of `multi` weights are allocated (see `ExpertPool`)
+        MultiLinear(InitContext *ctx, int in_features, int out_features, int multi, bool use_bias, int resident);
 
         using Block::forward;
         ggml::tensor *forward(ComputeContext *ctx, ggml::tensor *input) override { return nullptr; }
 
         virtual ggml::tensor *forward(ComputeContext *ctx, ggml::tensor *input, ggml::tensor *selected);
 
-        int64_t get_param_num(bool effective_only) const override
-        {
-            int64_t r = 0;
-            r += ggml::nelements(weight);
-            r += ggml::nelements(bias);
-            return r;
-        }
+        // `resident`: indices into `weight`, `selected`: indices into `bias`
+        ggml::tensor *forward(ComputeContext *ctx, ggml::tensor *input, ggml::tensor *resident, ggml::tensor *selected);
+
+        int64_t get_param_num(bool effective_only) const override;
+
+        // load weights of all experts from `layer_prefix + i + suffix` (or `name` if exists)
+        void load_weight(const std::string &name, const std::string &layer_prefix, const std::string &suffix, TensorLoader *loader);
 
     public:
         ggml::tensor *weight; // [in_features, out_features, multi]
         ggml::tensor *bias;   // [out_features, multi]
+        const int multi;
+
+        // when experts are in different types (`BlockParams::MoEMixedTypes`), `weight` is not used,
+        // and experts are loaded into groups by type.
+        std::vector<ggml::tensor *> groups;  // [in_features, out_features, number of experts in a group]
+        std::vector<int> group_of_expert;
+        std::vector<int> index_in_group;
+    protected:
+        std::unique_ptr<InitContext> groups_ctx;
     };
 
     class GroupNorm : public Block
@@ -1206,6 +1327,11 @@ namespace chatllm
             attention.before_eval(ctx);
         }
 
+        void after_eval(ComputeContext *ctx) override
+        {
+            attention.after_eval(ctx);
+        }
+
     public:
         AttentionBlock attention;
     };
@@ -1708,6 +1834,50 @@ namespace chatllm
 
     };
 
+    // book-keeping of KV cache compression (host side).
+    // cache slots are always kept in chronological order, so causal masking still works.
+    class KVCacheCompressor
+    {
+    public:
+        KVCacheCompressor(int num_kv_heads, int capacity, int budget, int recent, int slack);
+
+        void reset(void);
+
+        // map `n_past` of the sequence to `n_past` of the cache
+        int get_cache_n_past(int n_past, int qlen) const;
+
+        // new `qlen` tokens are to be saved into slots starting at `cache_n_past`
+        void commit(int n_past, int cache_n_past, int qlen);
+
+        // mass: [num_kv_heads, klen]
+        void accumulate(const float *mass, int klen);
+
+        // select slots to be kept (`keep`: [num_kv_heads, kept]). return number of kept slots per head,
+        // or 0 if nothing should be evicted.
+        int select_evicted(std::vector<int> &keep) const;
+        // same as above, for slots surviving a context shift. if none survives, all slots are released and 0 is returned.
+        int select_shifted(int shift, int total, std::vector<int> &keep);
+        // same as above, for slots of tokens before `n_past` when the sequence is rewound (e.g. regenerating, editing the history).
+        int select_rewound(int n_past, std::vector<int> &keep);
+
+        void compact(const std::vector<int> &keep, int kept);
+
+        // positions of tokens in (`used`) slots of head `h`
+        const int *get_positions(int h) const { return position.data() + h * capacity; }
+
+    public:
+        const int num_kv_heads;
+        const int capacity;
+        const int budget;
+        const int recent;
+        const int slack;
+        int used;
+        int n_total;
+    protected:
+        std::vector<float> score;
+        std::vector<int>   position;
+    };
+
     class KVCacheAttention : public CoreAttention
     {
     public:
@@ -1745,9 +1915,29 @@ namespace chatllm
 
         void before_eval(ComputeContext *ctx) override;
 
+        // runtime states bound to a KV cache. Layers that run this attention against caches of their own
+        // (e.g. looped layers) keep one, and swap it in together with their caches.
+        struct RuntimeState
+        {
+            std::unique_ptr<KVCacheCompressor> compressor;
+            ggml::tensor *rt_kv_pos     = nullptr;
+            int           rt_n_past     = 0;
+        };
+
+        void swap_runtime_state(RuntimeState &state);
+
+        // a new (empty) compressor of the same settings, or nullptr if compression is disabled
+        std::unique_ptr<KVCacheCompressor> new_compressor(void) const;
+
     protected:
         void before_forward(ComputeContext *ctx, const int n_past, const int qlen) override;
 
+        ggml::tensor *attn_scores_to_probs(ComputeContext *ctx, int hidden_size, const int n_past, const int qlen,
+                                            ggml::tensor *attn_scores) override;
+
+        ggml::tensor *cross_attention_after_pe(ComputeContext *ctx, const int hidden_size, const int n_past, const int qlen,
+                                             ggml::tensor *query_layer, ggml::tensor *key_layer, ggml::tensor *v) override;
+
         // k: [batch, qlen, heads, head_size]
         // v: [batch, qlen, hidden_size]
         void save_to_cache(ComputeContext *ctx, const int n_past, const int qlen, ggml::tensor *k, ggml::tensor *v) override;
@@ -1756,6 +1946,10 @@ namespace chatllm
 
         ggml::tensor *get_v_from_cache(ComputeContext *ctx, const int hidden_size, const int n_past, const int qlen) override;
 
+        // keep: [num_kv_heads, kept]
+        void compact_cache(KVCacheCompressor *compressor, ggml::tensor *k_cache, ggml::tensor *v_cache,
+                           const std::vector<int> &keep, int kept) const;
+
     public:
         const int k_hidden_size;
         const int v_hidden_size;
@@ -1763,11 +1957,14 @@ namespace chatllm
         ggml::tensor *k_cache;
         ggml::tensor *v_cache;
         int batch_size = 1;
+    protected:
+        std::unique_ptr<KVCacheCompressor> compressor;
     private:
         ggml::tensor *raw_k;
         ggml::tensor *raw_v;
         ggml::tensor *rt_kv_pos = nullptr;
         int           rt_n_past;
+        ggml::tensor *rt_attn_mass = nullptr;
     };
 
     class BaseConsolidatedQKVAttention : public KVCacheAttention
@@ -1970,7 +2167,7 @@ namespace chatllm
     void fill_pos_vector(ComputeContext *ctx, std::vector<int> &v_pos, ggml::tensor *pos, int n_past, int qlen);
     void fill_pos_vector(ComputeContext *ctx, std::vector<float> &v_pos, ggml::tensor *pos, int n_past, int qlen);
 
-    class BaseBaseSlidingWindowAttentionPartialCache : public BlockParams::FlashAttention, public BaseAttention
+    class BaseBaseSlidingWindowAttentionPartialCache : public BlockParams::FlashAttention, public BlockParams::KVCacheCompression, public BaseAttention
     {
     public:
         BaseBaseSlidingWindowAttentionPartialCache(InitContext *ctx, int sliding_window_len, int extra_len,
@@ -1984,6 +2181,9 @@ namespace chatllm
         void save_to_cache(ComputeContext *ctx, const int n_past, const int qlen, ggml::tensor *k, ggml::tensor *v) override;
         ggml::tensor *get_k_from_cache(ComputeContext *ctx, const int hidden_size, const int n_past, const int qlen) override;
         ggml::tensor *get_v_from_cache(ComputeContext *ctx, const int hidden_size, const int n_past, const int qlen) override;
+
+        ggml::tensor *calc_attn_scores(ComputeContext *ctx, int hidden_size, const int n_past, const int qlen,
+                                       ggml::tensor *key_layer, ggml::tensor *query_layer, ggml::tensor *value_layer) override;
     private:
         const int sliding_window_len;
         const int extra_len;
@@ -2124,10 +2324,15 @@ namespace chatllm
             rope_dim = (hidden_size / num_attention_heads) / 2;
         }
 
+    public:
+        std::shared_ptr<RoPESinCosTable> rope_table;
+
     protected:
         // input & output: [qlen, heads, head_size]
         ggml::tensor *apply_pos_embedding_k(ComputeContext *ctx, ggml::tensor *k, int hidden_size, int qlen, ggml::tensor * past) const override;
         ggml::tensor *apply_pos_embedding_q(ComputeContext *ctx, ggml::tensor *q, int hidden_size, int qlen, ggml::tensor * past) const override;
+
+        void prepare_rope_table(void);
     };
 
     class GLMBlock : public Block
@@ -2222,7 +2427,11 @@ namespace chatllm
               down_proj(ctx, intermediate_size, hidden_size, down_use_bias),
                 up_proj(ctx, hidden_size, intermediate_size, up_use_bias),
               act(act)
-        {}
+        {
+            // tensor parallelism: pair rows of gate/up with columns of down
+            if ((gate_proj.shards.size() > 0) && (up_proj.shards.size() == gate_proj.shards.size()) && !gate_use_bias && !up_use_bias)
+                down_proj.split_by_columns(ctx);
+        }
 
         using Block::forward;
         ggml::tensor *forward(ComputeContext *ctx, ggml::tensor *hidden_states) override;
@@ -2348,6 +2557,112 @@ namespace chatllm
         MLP2 &mlp2;
     };
 
+    // resident pool of experts of a MoE layer.
+    // weights of experts stay in the memory mapped model file, and are copied into `num_slots` resident slots
+    // when selected (LRU). pools of a model are chained in the order of layers (see `ExpertPools`):
+    // when a token is served by a layer, experts of the next layer are predicted from how often they were
+    // selected together with the current ones, and are loaded in the background.
+    class ExpertPool
+    {
+    public:
+        typedef ExpertCacheStats Stats;
+
+        ExpertPool(ExpertPools *group, int num_experts, int num_slots, int experts_per_tok);
+        ~ExpertPool();
+
+        // `resident`: [..., ..., num_slots], data of the `i`-th expert locates at `offsets[i]` of `path`
+        void add_source(ggml::tensor *resident, const std::string &path, const std::vector<size_t> &offsets);
+
+        // selected: expert ids; slots: resident slot of each selected expert
+        ggml::tensor *fetch(ComputeContext *ctx, ggml::tensor *selected);
+
+        // assigns slots to missing experts, which are then copied by `copy_pending`
+        void fetch(ggml::tensor *slots, const ggml::tensor *selected);
+
+        // copy the `ith` of `nth` parts of experts that are missing from the latest `fetch`
+        void copy_pending(int ith, int nth);
+
+        Stats get_stats(void) const;
+
+    protected:
+        void assign(int expert, int slot);
+        void load(int expert, int slot);
+
+        // experts of the next pool that are likely to be selected by this token
+        std::vector<int> predict_next(void) const;
+        void learn_from_prev(void);
+        void preload(const std::vector<int> &experts);
+        void wait_preload(void);
+
+        struct Source
+        {
+            ggml::tensor *resident;
+            std::shared_ptr<MappedFile> file;
+            std::vector<size_t> offsets;
+        };
+
+        // updated by both the compute thread and the preloading worker
+        struct Counters
+        {
+            std::atomic<int64_t> hits {0};
+            std::atomic<int64_t> misses {0};
+            std::atomic<int64_t> prefetched {0};
+            std::atomic<int64_t> prefetch_hits {0};
+            std::atomic<int64_t> loaded_bytes {0};
+        };
+
+    public:
+        const int num_experts;
+        const int num_slots;
+        const int experts_per_tok;
+    protected:
+        friend class ExpertPools;
+        ExpertPools *group;
+        std::vector<Source> sources;
+        std::vector<int> slot_of_expert;
+        std::vector<int> expert_of_slot;
+        std::vector<int64_t> last_used;
+        std::vector<bool> preloaded;        // loaded by prediction, and not selected yet
+        std::vector<int> last_selected;
+        std::vector<std::pair<int, int>> pending;  // (expert, slot) to be copied
+        bool single_token = false;          // `last_selected` is of a single token
+        std::vector<uint32_t> co_selected;  // [num_experts of this][num_experts of next]
+        int64_t tick;
+        ExpertPool *prev;
+        ExpertPool *next;
+        Counters stats;
+        std::mutex preload_mutex;
+        std::condition_variable preload_cv;
+        bool preloading = false;
+    };
+
+    // expert pools of a model, chained in the order of creation (i.e. layers).
+    // experts are preloaded on a single background thread.
+    class ExpertPools
+    {
+    public:
+        ExpertPools();
+        ~ExpertPools();
+
+        void add(ExpertPool *pool);
+        void remove(ExpertPool *pool);
+
+        ExpertCacheStats get_stats(void) const;
+
+        // max number of tokens in a batch, so that all selected experts of each layer can be resident
+        int get_max_batch_size(void) const;
+
+        void run_async(std::function<void (void)> task);
+
+        // all layers share a single mapping of a model file
+        std::shared_ptr<MappedFile> map_file(const std::string &path);
+
+    protected:
+        std::vector<ExpertPool *> pools;
+        std::map<std::string, std::shared_ptr<MappedFile>> files;
+        std::unique_ptr<tokenizer::WorkerPool> loader;
+    };
+
     class MultiMLP : public Block
     {
     public:
@@ -2368,6 +2683,63 @@ namespace chatllm
         const int num_local_experts;
         const int num_experts_per_tok;
         const int group_size;
+        std::unique_ptr<ExpertPool> pool;
+    };
+
+    class MoERoutingProfiles;
+
+    // accumulates expert selection histogram & co-activation counts of a MoE layer.
+    // results are saved with other layers of the model (see `MoERoutingProfiles`).
+    class MoERoutingProfiler
+    {
+    public:
+        MoERoutingProfiler(MoERoutingProfiles *group, int num_experts);
+        ~MoERoutingProfiler();
+
+        ggml::tensor *record(ComputeContext *ctx, ggml::tensor *selected);
+
+        // selected: [experts_per_tok, qlen]
+        void record(const ggml::tensor *selected);
+
+    public:
+        const int num_experts;
+        std::string path;
+        int group_size;           // experts can only be reordered within a group
+        int64_t num_tokens;
+        std::vector<int64_t> histogram;
+        std::vector<int64_t> co_activation;  // [num_experts, num_experts]
+    protected:
+        MoERoutingProfiles *group;
+    };
+
+    // routing profilers of a model. results of all layers are saved as JSON, which can be used by `scripts/reorder_experts.py`.
+    // the first model with MoE layers saves to `file`, others (e.g. a draft model) to `file` with a numbered suffix.
+    // profiles are saved when the model is destroyed, or on `exit()`.
+    class MoERoutingProfiles
+    {
+    public:
+        // `file`: empty to disable profiling
+        MoERoutingProfiles(const std::string &file);
+        ~MoERoutingProfiles();
+
+        bool is_enabled(void) const;
+
+        void add(MoERoutingProfiler *profiler);
+        void remove(MoERoutingProfiler *profiler);
+
+        // saves all layers, if anything has been recorded since the last save
+        void save(void);
+
+    protected:
+        friend class MoERoutingProfiler;
+        void save_locked(void);
+
+        const std::string file;
+        std::string saved_file;     // `file`, or one with a suffix
+        std::vector<MoERoutingProfiler *> profilers;
+        bool dirty = false;
+        // recording (by the compute thread) and saving (e.g. on `exit()`) are serialized
+        std::mutex mutex;
     };
 
     class GenericSparseMLP : public Block
@@ -2422,8 +2794,12 @@ namespace chatllm
             ggml::tensor *weights);
         virtual ggml::tensor *calc_experts_outputs(ComputeContext *ctx, ggml::tensor *hidden_states,
             ggml::tensor *selected_experts);
+
+        // experts are routed within groups of this size
+        virtual int get_routing_group_size(void) const;
     protected:
         MultiMLP *p_experts;    // shared pointer, not owned!
+        std::unique_ptr<MoERoutingProfiler> profiler;
     };
 
     class GenericGroupedSparseMoE : public GenericSparseMLP
@@ -2437,8 +2813,10 @@ namespace chatllm
             score_func = ScoreFunc::Sigmoid;
             always_scaling = true;
         }
+
     protected:
         ggml::tensor *select_experts(ComputeContext *ctx, ggml::tensor *corrected_score) override;
+        int get_routing_group_size(void) const override;
 
     public:
         int n_group;
@@ -2892,6 +3270,9 @@ namespace chatllm
         ALiBiSelfAttention(InitContext *ctx, int hidden_size, int num_attention_heads, int num_kv_heads, int max_length);
 
     protected:
+        ggml::tensor *calc_attn_scores(ComputeContext *ctx, int hidden_size, const int n_past, const int qlen,
+            ggml::tensor *key_layer, ggml::tensor *query_layer, ggml::tensor *value_layer) override;
+
         ggml::tensor *attn_scores_to_probs(ComputeContext *ctx, int hidden_size, const int n_past, const int qlen,
             ggml::tensor *attn_scores) override;
 
@@ -2924,10 +3305,13 @@ namespace chatllm
         ggml::tensor *apply_pos_embedding_k(ComputeContext *ctx, ggml::tensor *k, int hidden_size, int qlen, ggml::tensor * past) const override;
         ggml::tensor *apply_pos_embedding_q(ComputeContext *ctx, ggml::tensor *q, int hidden_size, int qlen, ggml::tensor * past) const override;
 
+        void prepare_rope_table(void);
+
     public:
         int seq_length;
         bool use_dynamic_ntk;
         bool use_logn_attn;
+        std::shared_ptr<RoPESinCosTable> rope_table;
     protected:
         ggml::tensor *logn_list;
         std::vector<float> logn_list_data;
@@ -2993,6 +3377,7 @@ namespace chatllm
 
         // length: rope_dim/2
         std::vector<float> inv_freq;
+        std::shared_ptr<RoPESinCosTable> rope_table;
 
     protected:
         // input & output: [qlen, heads, head_size]
@@ -13,6 +13,8 @@
 #include <map>
 #include <set>
 #include <filesystem>
+#include <sstream>
+#include <cmath>
 
 #include "vectorstore.h"
 #include "vision_process.h"
@@ -20,9 +22,15 @@
 #include "models.h"
 
 #if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
 #include <fcntl.h>
 #include <io.h>
 #include <windows.h>
+#include <psapi.h>
+#elif !defined(__linux__)
+#include <sys/resource.h>
 #endif
 
 static chatllm::ThoughtChunkInterceptor thought_interceptor;
@@ -52,6 +60,7 @@ struct Args
     std::string emb_rank_query_sep;
     std::map<std::string, std::vector<std::string>> vector_stores;
     std::string rpc_endpoints;
+    std::string numa;
     std::string serve_rpc;
     std::string ggml_dir;
     std::string cache_dtype = "f16";
@@ -104,6 +113,22 @@ struct Args
     bool single_turn = false;
     bool opt_speed   = true;
     std::string flash_attention = "";
+    std::string profile;
+    std::string bench;
+    std::string bench_prompt;
+    std::string bench_gen;
+    std::string bench_batch;
+    std::string bench_threads;
+    std::string bench_cache_dtype;
+    std::string bench_fa;
+    int bench_reps = 5;
+    int bench_warmup = 1;
+    std::string perplexity;
+    int ppl_ctx = 512;
+    int ppl_stride = 0;
+    std::string ppl_logprobs;
+    std::string ppl_save_logits;
+    std::string ppl_kld;
 };
 
 #define MULTI_LINE_END_MARKER_W  L"\\."
@@ -183,6 +208,11 @@ void usage(const std::string &prog)
               << "  +single_turn            single-turn (i.e. restart on each turn) (default: OFF)                                  [*]\n"
               << "Performance options:\n"
               << "  -n, --threads N         number of threads for inference (default: number of cores)\n"
+              << "  --numa MODE             NUMA awareness for multi-socket CPUs (default: disabled)                                   [#]\n"
+              << "                          MODE ::= distribute | isolate | numactl\n"
+              << "                          distribute: threads spread over all nodes, weights interleaved across nodes\n"
+              << "                          isolate   : threads and weights kept on the current node\n"
+              << "                          numactl   : threads pinned to the CPU set given by `numactl`\n"
               << "  -ngl, --n_gpu_layers N  number of the main model layers to offload to a backend device (GPU) (default: GPU not used)\n"
               << "                          N ::= one_spec;...\n"
               << "                          one_spec ::= [id:]spec, where spec ::= [n|epilog|prolog|all]\n"
@@ -281,12 +311,44 @@ void usage(const std::string &prog)
               << "  --dump_dot FILE         dump sched splits to a DOT file, and exit with -1\n"
               << "  --dump_tensor NAME      dump data of tensor then quit. repeat this option to dump multiple tensors.                 [*]\n"
               << "  --log_level             log level. (default: 4 - ERROR)\n"
+              << "  --profile FILE          time each op (much slower), show time by op/layer/backend on exit, and save a Chrome trace to FILE\n"
               << "  --serve_rpc [H:]P[@id]  as a RPC server on host:port (optional: host default to 127.0.0.1, id defaults to 0)        [#]\n"
               << "  --ggml_dir DIR          specify directory of GGML\n"
               << "  --set KEY VALUE         set a pair of additional args.\n"
+              << "Benchmark:\n"
+              << "  --bench FILE            benchmark prompt & generation throughput, save results to FILE and quit                     [*]\n"
+              << "                          FILE ::= *.csv | *.json | - (JSON to stdout)\n"
+              << "                          each of the following LIST is comma separated, all combinations are swept.\n"
+              << "  --bench_prompt LIST     numbers of prompt tokens (default: 512)\n"
+              << "  --bench_gen LIST        numbers of generated tokens (default: 128)\n"
+              << "  --bench_batch LIST      batch sizes (default: `--batch_size`)\n"
+              << "  --bench_threads LIST    numbers of threads (default: `--threads`)\n"
+              << "  --bench_cache_dtype LIST\n"
+              << "                          cache data types (default: `--cache_dtype`)\n"
+              << "  --bench_fa LIST         flash attention modes (default: `--flash_attn`)\n"
+              << "  --bench_reps N          repetitions of each test (default: 5)\n"
+              << "  --bench_warmup N        warm-up runs of each test, not counted (default: 1)\n"
+              << "Evaluation:\n"
+              << "  --perplexity FILE       compute perplexity of the text in FILE, then quit                                           [*]\n"
+              << "  --ppl_ctx N             tokens in each window (default: 512)\n"
+              << "  --ppl_stride N          start a new window every N tokens (default: `--ppl_ctx`). with N < ctx, windows overlap,\n"
+              << "                          and each token is scored with at least (ctx - N) tokens of context\n"
+              << "  --ppl_logprobs FILE     save log-probabilities of all scored tokens to FILE (TSV)\n"
+              << "  --ppl_save_logits FILE  save log-probabilities (fp16) over the whole vocabulary to FILE, as a baseline for `--ppl_kld`\n"
+              << "  --ppl_kld FILE          compute KL-divergence & top-1 agreement against the baseline saved in FILE\n"
               << "Additional key-value args:\n"
               << "  --kv                    start of additional args. all following options are interpreted as k-v pairs\n"
               << "  key value               a key-value pair of args\n"
+              << "  kv-cache-budget N       compress KV cache to keep N tokens, evicting the least attended ones (default: 0 - disabled)\n"
+              << "                          tokens evicted before a rewind (e.g. regenerating) are not restored; sessions (and beam search) are not supported\n"
+              << "  kv-cache-recent N       always keep the most recent N tokens (default: budget / 4)\n"
+              << "  kv-cache-slack N        evict only when N tokens are beyond the budget (default: budget / 8)\n"
+              << "  moe-expert-cache N      keep only N experts per MoE layer in memory, load others on demand from the model file (default: 0 - disabled)\n"
+              << "  moe-expert-prefetch 0|1 prefetch experts likely to be selected by the next layer (default: 1)\n"
+              << "  moe-profile FILE        save expert selection histograms & co-activation counts of MoE layers to FILE (JSON)\n"
+              << "                          other models with MoE layers (e.g. a draft model) save to FILE with a suffix, e.g. profile.1.json\n"
+              << "  pipeline-micro-batch N  split prompts into micro-batches of N tokens that flow through layer stages (backends) concurrently (default: 0 - disabled)\n"
+              << "  tensor-parallel IDS     split weights of Linear layers in hidden layers by rows across devices IDS (e.g. 0,1), computed in parallel\n"
               << "\n------------------------\n"
               << "*: implemented by front end (i.e. `main.cpp` or apps using bindings)\n"
               << "#: implemented by front end & backend\n"
@@ -531,6 +593,7 @@ static size_t parse_args(Args &args, const std::vector<std::string> &argv)
             handle_para0("--beam_size",                   beam_size,            std::stoi)
             handle_para0("--log_level",                   log_level,            std::stoi)
             handle_para0("--rpc_endpoints",               rpc_endpoints,        std::string)
+            handle_para0("--numa",                        numa,                 std::string)
             handle_para0("--serve_rpc",                   serve_rpc,            std::string)
             handle_para0("--ggml_dir",                    ggml_dir,             std::string)
             handle_para0("--cache_dtype",                 cache_dtype,          std::string)
@@ -539,6 +602,22 @@ static size_t parse_args(Args &args, const std::vector<std::string> &argv)
             handle_para0("--re_quantize",                 re_quantize,          std::string)
             handle_para0("--max_new_tokens",              max_new_tokens,       std::stoi)
             handle_param("--flash_attn",      "-fa",      flash_attention,           std::string)
+            handle_para0("--profile",                     profile,              std::string)
+            handle_para0("--bench",                       bench,                std::string)
+            handle_para0("--bench_prompt",                bench_prompt,         std::string)
+            handle_para0("--bench_gen",                   bench_gen,            std::string)
+            handle_para0("--bench_batch",                 bench_batch,          std::string)
+            handle_para0("--bench_threads",               bench_threads,        std::string)
+            handle_para0("--bench_cache_dtype",           bench_cache_dtype,    std::string)
+            handle_para0("--bench_fa",                    bench_fa,             std::string)
+            handle_para0("--bench_reps",                  bench_reps,           std::stoi)
+            handle_para0("--bench_warmup",                bench_warmup,         std::stoi)
+            handle_para0("--perplexity",                  perplexity,           std::string)
+            handle_para0("--ppl_ctx",                     ppl_ctx,              std::stoi)
+            handle_para0("--ppl_stride",                  ppl_stride,           std::stoi)
+            handle_para0("--ppl_logprobs",                ppl_logprobs,         std::string)
+            handle_para0("--ppl_save_logits",             ppl_save_logits,      std::string)
+            handle_para0("--ppl_kld",                     ppl_kld,              std::string)
             else
                 break;
 
@@ -696,18 +775,28 @@ static void show_stat(chatllm::Pipeline &pipeline, chatllm::BaseStreamer &stream
 {
     streamer.putln("");
 
-    chatllm::ModelPerfInfo *perf = &pipeline.performance;
+    const auto prompt     = pipeline.performance.GetTiming(chatllm::ModelPerfInfo::Type::Prompt);
+    const auto generation = pipeline.performance.GetTiming(chatllm::ModelPerfInfo::Type::Generation);
     char str[1024];
-    print_timing(str, "timings: prompt eval time", perf->timings[chatllm::ModelPerfInfo::Type::Prompt].tok_count, perf->timings[chatllm::ModelPerfInfo::Type::Prompt].duration_ms);
+    print_timing(str, "timings: prompt eval time", prompt.tok_count, prompt.duration_ms);
     streamer.putln(str);
 
-    print_timing(str, "timings:        eval time", perf->timings[chatllm::ModelPerfInfo::Type::Generation].tok_count, perf->timings[chatllm::ModelPerfInfo::Type::Generation].duration_ms);
+    print_timing(str, "timings:        eval time", generation.tok_count, generation.duration_ms);
     streamer.putln(str);
 
     sprintf(str,      "timings:       total time = %12.2f ms / %5zd tokens",
-        (perf->timings[chatllm::ModelPerfInfo::Type::Generation].duration_ms + perf->timings[chatllm::ModelPerfInfo::Type::Prompt].duration_ms),
-        perf->timings[chatllm::ModelPerfInfo::Type::Generation].tok_count    + perf->timings[chatllm::ModelPerfInfo::Type::Prompt].tok_count);
+        generation.duration_ms + prompt.duration_ms,
+        generation.tok_count   + prompt.tok_count);
     streamer.putln(str);
+
+    auto experts = pipeline.model->get_expert_cache_stats();
+    if (experts.hits + experts.misses > 0)
+    {
+        sprintf(str,  "experts:  hits = %lld, misses = %lld (%.2f%% hit), prefetched = %lld (%lld used), loaded = %.2f MiB",
+            (long long)experts.hits, (long long)experts.misses, experts.hits * 100.0 / (experts.hits + experts.misses),
+            (long long)experts.prefetched, (long long)experts.prefetch_hits, experts.loaded_bytes / 1024.0 / 1024.0);
+        streamer.putln(str);
+    }
 }
 
 static void run_file(Args &args, chatllm::Pipeline &pipeline, TextStreamer &streamer, const chatllm::GenerationConfig &gen_config)
@@ -1250,6 +1339,14 @@ static void prepare_rpc_devices(const Args &args)
     }
 }
 
+static void prepare_numa(const Args &args)
+{
+    if (!chatllm::ComputeManager::numa_init(args.numa))
+    {
+        chatllm::ggml::log(GGML_LOG_LEVEL_ERROR, "Failed to initialize NUMA");
+    }
+}
+
 #if defined(_WIN32)
 std::string wstr_to_utf8(const wchar_t* wstr)
 {
@@ -1323,6 +1420,434 @@ static int merge_vector_store(Args &args)
     return 0;
 }
 
+static std::vector<std::string> bench_items(const std::string &s, const std::string &def)
+{
+    std::vector<std::string> items;
+    utils::split(s.size() > 0 ? s : def, ",", items);
+    return items;
+}
+
+static std::vector<int> bench_ints(const std::string &s, const std::string &def)
+{
+    std::vector<int> values;
+    for (auto &item : bench_items(s, def))
+        values.push_back(std::stoi(item));
+    return values;
+}
+
+static void bench_stat(const std::vector<double> &values, double &mean, double &stddev)
+{
+    mean = stddev = 0.0;
+    if (values.size() < 1) return;
+    mean = std::accumulate(values.begin(), values.end(), 0.0) / values.size();
+    if (values.size() < 2) return;
+    double sum = 0.0;
+    for (auto v : values) sum += (v - mean) * (v - mean);
+    stddev = std::sqrt(sum / (values.size() - 1));
+}
+
+// peak resident memory of the process. On Linux, it can be reset between configurations (see `clear_refs` in proc(5)).
+static size_t bench_peak_memory(bool reset = false)
+{
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS pmc;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))) return 0;
+    return pmc.PeakWorkingSetSize;
+#elif defined(__linux__)
+    if (reset)
+    {
+        std::ofstream f("/proc/self/clear_refs");
+        f << "5";
+    }
+    std::ifstream f("/proc/self/status");
+    std::string line;
+    while (std::getline(f, line))
+    {
+        if (line.rfind("VmHWM:", 0) == 0)
+            return (size_t)std::stoull(line.substr(6)) * 1024;
+    }
+    return 0;
+#else
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (size_t)usage.ru_maxrss;
+#endif
+}
+
+static json::JSON bench_json_stat(const std::vector<double> &values)
+{
+    json::JSON o;
+    double mean, stddev;
+    bench_stat(values, mean, stddev);
+    o["mean"]   = mean;
+    o["stddev"] = stddev;
+    return o;
+}
+
+static void save_profile(const std::string &file_name)
+{
+    std::cout << std::endl << chatllm::OpProfiler::summary();
+    if (chatllm::OpProfiler::save_trace(file_name))
+        std::cout << "trace saved to: " << file_name << std::endl;
+    else
+        std::cerr << "failed to save trace to: " << file_name << std::endl;
+}
+
+// baseline logits file of `--perplexity`: header, ids of all tokens, then log-probs (fp16) of each scored token
+struct PerplexityLogitsHeader
+{
+    char magic[4];
+    int32_t version;
+    int32_t n_vocab;
+    int32_t n_ctx;
+    int32_t stride;
+    int32_t n_tokens;
+};
+
+static void log_softmax(const float *logits, int n_vocab, std::vector<float> &log_probs)
+{
+    log_probs.resize(n_vocab);
+    const float max_logit = *std::max_element(logits, logits + n_vocab);
+    double sum = 0.0;
+    for (int i = 0; i < n_vocab; i++)
+        sum += std::exp((double)logits[i] - max_logit);
+    const float log_sum = (float)std::log(sum) + max_logit;
+    for (int i = 0; i < n_vocab; i++)
+        log_probs[i] = logits[i] - log_sum;
+}
+
+static int run_perplexity(Args &args)
+{
+    std::ifstream f(args.perplexity, std::ios::binary);
+    CHATLLM_CHECK(f.is_open()) << "cannot open file: " << args.perplexity;
+    const std::string text((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+
+    const int n_ctx  = args.ppl_ctx;
+    const int stride = args.ppl_stride > 0 ? args.ppl_stride : n_ctx;
+    CHATLLM_CHECK((n_ctx >= 2) && (stride <= n_ctx)) << "invalid context length or stride: " << n_ctx << ", " << stride;
+
+    Args a(args);
+    a.max_length = std::max(args.max_length, n_ctx + 1);
+    DEF_ExtraArgs(pipe_args, a);
+    chatllm::Pipeline pipeline(a.model_path, pipe_args);
+    CHATLLM_CHECK(pipeline.is_loaded()) << "failed to load model: " << a.model_path;
+    DEF_GenerationConfig(gen_config, a);
+
+    chatllm::AbstractModel *model = pipeline.model;
+    const int bos = pipeline.tokenizer->bos_token_id;
+
+    std::vector<int> tokens;
+    pipeline.tokenizer->encode(text, tokens);
+    const int n_tokens = (int)tokens.size();
+    CHATLLM_CHECK(n_tokens >= 2) << "too few tokens: " << n_tokens;
+
+    int n_vocab = pipeline.tokenizer->get_vocab_size();
+    PerplexityLogitsHeader header = {{'P', 'P', 'L', 'L'}, 1, 0, n_ctx, stride, n_tokens};
+
+    std::ofstream save_file;
+    std::ifstream base_file;
+    if (args.ppl_save_logits.size() > 0)
+    {
+        save_file.open(args.ppl_save_logits, std::ios::binary);
+        CHATLLM_CHECK(save_file.is_open()) << "cannot open file: " << args.ppl_save_logits;
+    }
+    if (args.ppl_kld.size() > 0)
+    {
+        base_file.open(args.ppl_kld, std::ios::binary);
+        CHATLLM_CHECK(base_file.is_open()) << "cannot open file: " << args.ppl_kld;
+        PerplexityLogitsHeader base;
+        std::vector<int> base_tokens(n_tokens);
+        base_file.read((char *)&base, sizeof(base));
+        CHATLLM_CHECK((memcmp(base.magic, header.magic, sizeof(header.magic)) == 0) && (base.version == header.version))
+            << "not a logits file: " << args.ppl_kld;
+        CHATLLM_CHECK((base.n_ctx == n_ctx) && (base.stride == stride) && (base.n_tokens == n_tokens))
+            << "logits file is saved with different context length/stride or text";
+        base_file.read((char *)base_tokens.data(), sizeof(base_tokens[0]) * n_tokens);
+        CHATLLM_CHECK(base_tokens == tokens) << "logits file is saved with a different tokenizer or text";
+        n_vocab = base.n_vocab;
+    }
+
+    std::ofstream logprobs_file;
+    if (args.ppl_logprobs.size() > 0)
+    {
+        logprobs_file.open(args.ppl_logprobs);
+        CHATLLM_CHECK(logprobs_file.is_open()) << "cannot open file: " << args.ppl_logprobs;
+        logprobs_file << "pos\ttoken\tlogprob\n";
+    }
+
+    double nll_sum = 0.0, nll2_sum = 0.0;
+    double kld_sum = 0.0, kld2_sum = 0.0, base_nll_sum = 0.0;
+    int    top1_same = 0;
+    int    n_scored = 0;
+    int    n_evaluated = 0;
+    double eval_ms = 0.0;
+
+    std::vector<int>        input;
+    std::vector<float>      logits;
+    std::vector<float>      log_probs;
+    std::vector<float>      base_log_probs;
+    std::vector<ggml_fp16_t> fp16;
+
+    // windows of `n_ctx` tokens, starting every `stride` tokens. tokens already scored by the previous window
+    // serve as context only, so each token is scored once, with at least `n_ctx - stride` tokens of context.
+    int prev_end = 0;
+    for (int begin = 0; prev_end < n_tokens; begin += stride)
+    {
+        const int end   = std::min(begin + n_ctx, n_tokens);
+        const int first = std::max(prev_end, bos >= 0 ? begin : begin + 1);
+        const int n_score = end - first;
+        if (n_score < 1) break;
+
+        // the last token is only a target
+        input.clear();
+        if (bos >= 0) input.push_back(bos);
+        input.insert(input.end(), tokens.begin() + begin, tokens.begin() + end - 1);
+
+        model->set_ctx((int)input.size());
+        model->set_n_past(0);
+
+        const auto t0 = std::chrono::steady_clock::now();
+        CHATLLM_CHECK(model->score_tokens(input, gen_config, n_score, logits)) << "model does not support scoring, or out of memory";
+        eval_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+        n_evaluated += (int)input.size();
+
+        const int model_vocab = (int)(logits.size() / n_score);
+        if (header.n_vocab == 0)
+        {
+            header.n_vocab = model_vocab;
+            if (save_file.is_open())
+            {
+                save_file.write((const char *)&header, sizeof(header));
+                save_file.write((const char *)tokens.data(), sizeof(tokens[0]) * n_tokens);
+            }
+            CHATLLM_CHECK(!base_file.is_open() || (n_vocab == model_vocab)) << "vocabulary size mismatch: " << n_vocab << " vs " << model_vocab;
+        }
+
+        for (int i = 0; i < n_score; i++)
+        {
+            const int pos    = first + i;
+            const int target = tokens[pos];
+            log_softmax(logits.data() + (size_t)i * model_vocab, model_vocab, log_probs);
+
+            const double nll = -log_probs[target];
+            nll_sum  += nll;
+            nll2_sum += nll * nll;
+
+            if (logprobs_file.is_open())
+                logprobs_file << pos << "\t" << target << "\t" << log_probs[target] << "\n";
+
+            if (save_file.is_open())
+            {
+                fp16.resize(model_vocab);
+                ggml_fp32_to_fp16_row(log_probs.data(), fp16.data(), model_vocab);
+                save_file.write((const char *)fp16.data(), sizeof(fp16[0]) * model_vocab);
+            }
+
+            if (base_file.is_open())
+            {
+                fp16.resize(model_vocab);
+                base_log_probs.resize(model_vocab);
+                base_file.read((char *)fp16.data(), sizeof(fp16[0]) * model_vocab);
+                CHATLLM_CHECK(base_file.good()) << "logits file is truncated";
+                ggml_fp16_to_fp32_row(fp16.data(), base_log_probs.data(), model_vocab);
+
+                double kld = 0.0;
+                for (int j = 0; j < model_vocab; j++)
+                    kld += std::exp((double)base_log_probs[j]) * ((double)base_log_probs[j] - log_probs[j]);
+                kld_sum  += kld;
+                kld2_sum += kld * kld;
+                base_nll_sum -= base_log_probs[target];
+
+                const auto top1      = std::max_element(log_probs.begin(), log_probs.end()) - log_probs.begin();
+                const auto base_top1 = std::max_element(base_log_probs.begin(), base_log_probs.end()) - base_log_probs.begin();
+                if (top1 == base_top1) top1_same++;
+            }
+        }
+
+        n_scored += n_score;
+        prev_end  = end;
+
+        printf("[%d/%d] PPL = %.4f\n", end, n_tokens, std::exp(nll_sum / n_scored));
+        fflush(stdout);
+    }
+
+    if (n_scored < 1)
+    {
+        fprintf(stderr, "no tokens are scored\n");
+        return 1;
+    }
+
+    // uncertainties are standard errors of means
+    auto std_err = [n_scored](double sum, double sum2)
+    {
+        if (n_scored < 2) return 0.0;
+        const double mean = sum / n_scored;
+        return std::sqrt(std::max(0.0, sum2 / n_scored - mean * mean) / (n_scored - 1));
+    };
+
+    const double nll = nll_sum / n_scored;
+    printf("\ntokens          : %d (scored), %d (evaluated)\n", n_scored, n_evaluated);
+    printf("PPL             : %.4f ± %.4f\n", std::exp(nll), std::exp(nll) * std_err(nll_sum, nll2_sum));
+    if (base_file.is_open())
+    {
+        printf("PPL (baseline)  : %.4f\n", std::exp(base_nll_sum / n_scored));
+        printf("KL-divergence   : %.6f ± %.6f\n", kld_sum / n_scored, std_err(kld_sum, kld2_sum));
+        printf("top-1 agreement : %.2f%%\n", 100.0 * top1_same / n_scored);
+    }
+    printf("throughput      : %.2f tok/s\n", n_evaluated / eval_ms * 1000);
+
+    if ((save_file.is_open() && !save_file.good()) || (logprobs_file.is_open() && !logprobs_file.good()))
+    {
+        fprintf(stderr, "failed to write output files\n");
+        return 1;
+    }
+    return 0;
+}
+
+static int run_bench(Args &args)
+{
+    const auto prompts  = bench_ints(args.bench_prompt, "512");
+    const auto gens     = bench_ints(args.bench_gen, "128");
+    const auto batches  = bench_ints(args.bench_batch, std::to_string(args.batch_size));
+    const auto threads  = bench_ints(args.bench_threads, std::to_string(args.num_threads));
+    const auto caches   = bench_items(args.bench_cache_dtype, args.cache_dtype);
+    const auto fas      = bench_items(args.bench_fa, args.flash_attention.size() > 0 ? args.flash_attention : "0");
+    const int  max_len  = *std::max_element(prompts.begin(), prompts.end()) + *std::max_element(gens.begin(), gens.end()) + 1;
+
+    std::mt19937 rng(args.seed >= 0 ? args.seed : 0);
+
+    json::JSON report;
+    json::JSON results = json::Array();
+    std::ostringstream csv;
+    csv << "batch_size,threads,cache_dtype,flash_attn,n_prompt,n_gen,reps,"
+           "prompt_tps,prompt_tps_stddev,gen_tps,gen_tps_stddev,ttft_ms,ttft_ms_stddev,peak_mem_mib\n";
+
+    report["model"] = args.model_path;
+    std::vector<chatllm::ComputeManager::DeviceInfo> devs;
+    chatllm::ComputeManager::get_devices_info(devs);
+    json::JSON devices = json::Array();
+    for (auto &dev : devs)
+        devices.append(dev.backend_name + " - " + dev.description);
+    report["devices"] = devices;
+
+    for (auto batch_size : batches)
+    for (auto n_threads : threads)
+    for (auto &cache_dtype : caches)
+    for (auto &fa : fas)
+    {
+        bench_peak_memory(true);
+
+        // each configuration is a fresh load, since these are fixed once a model is loaded
+        Args a(args);
+        a.batch_size        = batch_size;
+        a.num_threads       = n_threads;
+        a.cache_dtype       = cache_dtype;
+        a.flash_attention   = fa;
+        a.max_length        = std::max(args.max_length, max_len);
+
+        DEF_ExtraArgs(pipe_args, a);
+        chatllm::Pipeline pipeline(a.model_path, pipe_args);
+        CHATLLM_CHECK(pipeline.is_loaded()) << "failed to load model: " << a.model_path;
+        DEF_GenerationConfig(gen_config, a);
+
+        chatllm::AbstractModel *model = pipeline.model;
+        report["model_type"] = model->type_name();
+        report["param_num"]  = model->get_param_num(false);
+
+        std::uniform_int_distribution<int> random_token(0, pipeline.tokenizer->get_vocab_size() - 1);
+
+        for (auto n_prompt : prompts)
+        for (auto n_gen : gens)
+        {
+            std::vector<double> prompt_tps;
+            std::vector<double> gen_tps;
+            std::vector<double> ttft;
+            for (int rep = -args.bench_warmup; rep < args.bench_reps; rep++)
+            {
+                // random tokens, so that nothing (e.g. EOS) stops generation early
+                std::vector<int> ids(n_prompt);
+                for (auto &id : ids) id = random_token(rng);
+
+                chatllm::ModelPerfInfo perf;
+                std::vector<float> logits;
+
+                model->set_ctx(std::max(n_prompt, 1));
+                model->set_n_past(0);
+                perf.Reset();
+                if (n_prompt > 0)
+                {
+                    CHATLLM_CHECK(model->generate_next_token(ids, gen_config, logits)) << "prompt evaluation failed";
+                    perf.Accumulate(chatllm::ModelPerfInfo::Type::Prompt, n_prompt);
+                }
+
+                for (int i = 0; i < n_gen; i++)
+                {
+                    model->set_n_past(n_prompt + i);
+                    CHATLLM_CHECK(model->generate_next_token({random_token(rng)}, gen_config, logits)) << "generation failed";
+                }
+                perf.Accumulate(chatllm::ModelPerfInfo::Type::Generation, n_gen);
+
+                if (rep < 0) continue;
+
+                const auto p = perf.GetTiming(chatllm::ModelPerfInfo::Type::Prompt);
+                const auto g = perf.GetTiming(chatllm::ModelPerfInfo::Type::Generation);
+                if (p.tok_count > 0)
+                {
+                    prompt_tps.push_back(p.tok_count / p.duration_ms * 1000);
+                    ttft.push_back(p.duration_ms);
+                }
+                if (g.tok_count > 0)
+                    gen_tps.push_back(g.tok_count / g.duration_ms * 1000);
+            }
+
+            const double peak_mem_mib = bench_peak_memory() / 1024.0 / 1024.0;
+
+            json::JSON r;
+            r["batch_size"]     = batch_size;
+            r["threads"]        = n_threads;
+            r["cache_dtype"]    = cache_dtype;
+            r["flash_attn"]     = fa;
+            r["n_prompt"]       = n_prompt;
+            r["n_gen"]          = n_gen;
+            r["reps"]           = args.bench_reps;
+            r["prompt_tps"]     = bench_json_stat(prompt_tps);
+            r["gen_tps"]        = bench_json_stat(gen_tps);
+            r["ttft_ms"]        = bench_json_stat(ttft);
+            r["peak_mem_mib"]   = peak_mem_mib;
+            results.append(r);
+
+            double m[3], sd[3];
+            bench_stat(prompt_tps, m[0], sd[0]);
+            bench_stat(gen_tps,    m[1], sd[1]);
+            bench_stat(ttft,       m[2], sd[2]);
+            csv << batch_size << "," << n_threads << "," << cache_dtype << "," << fa << ","
+                << n_prompt << "," << n_gen << "," << args.bench_reps << ","
+                << m[0] << "," << sd[0] << "," << m[1] << "," << sd[1] << "," << m[2] << "," << sd[2] << ","
+                << peak_mem_mib << "\n";
+
+            fprintf(stderr, "batch %5d, threads %3d, cache %5s, fa %3s, pp %5d: %9.2f ± %7.2f tok/s, tg %5d: %9.2f ± %7.2f tok/s, ttft %9.2f ms, peak %9.2f MiB\n",
+                batch_size, n_threads, cache_dtype.c_str(), fa.c_str(),
+                n_prompt, m[0], sd[0], n_gen, m[1], sd[1], m[2], peak_mem_mib);
+        }
+    }
+
+    report["results"] = results;
+
+    const bool to_csv = (args.bench.size() > 4) && (utils::to_lower(args.bench.substr(args.bench.size() - 4)) == ".csv");
+    const std::string output = to_csv ? csv.str() : report.dump();
+    if (args.bench == "-")
+    {
+        std::cout << output << std::endl;
+    }
+    else
+    {
+        std::ofstream f(args.bench);
+        CHATLLM_CHECK(f.is_open()) << "cannot open file: " << args.bench;
+        f << output << std::endl;
+    }
+    return 0;
+}
+
 static void show_devices(void)
 {
     std::vector<chatllm::ComputeManager::DeviceInfo> devs;
@@ -1335,6 +1860,18 @@ static void show_devices(void)
         printf("    memory total: %zd B\n", dev.total_memory);
         printf("    memory free : %zd B\n", dev.free_memory);
     }
+
+    std::vector<chatllm::ComputeManager::NumaNodeInfo> nodes;
+    chatllm::ComputeManager::get_numa_nodes(nodes);
+    if (nodes.size() < 1) return;
+
+    printf("NUMA: %zd node(s), mode: %s\n", nodes.size(), chatllm::ComputeManager::numa_mode_to_str(chatllm::ComputeManager::get_numa_mode()).c_str());
+    for (auto &node : nodes)
+    {
+        printf("  node #%d: CPUs %s\n", node.id, node.cpus.c_str());
+        printf("    memory total: %zd B\n", node.total_memory);
+        printf("    memory free : %zd B\n", node.free_memory);
+    }
 }
 
 #if defined(_WIN32)
@@ -1407,6 +1944,7 @@ int main(int argc, const char **argv)
 
     chatllm::ComputeManager::init(args.ggml_dir);
     prepare_rpc_devices(args);
+    prepare_numa(args);
 
     if (args.show_devices)
     {
@@ -1426,11 +1964,24 @@ int main(int argc, const char **argv)
         return 0;
     }
 
+    if (args.profile.size() > 0)
+        chatllm::OpProfiler::enable(true);
+
+    int ret = 0;
+
     try
     {
         DEF_ExtraArgs(pipe_args, args);
 
-        if (args.embedding_model_path.size() < 1)
+        if (args.bench.size() > 0)
+        {
+            ret = run_bench(args);
+        }
+        else if (args.perplexity.size() > 0)
+        {
+            ret = run_perplexity(args);
+        }
+        else if (args.embedding_model_path.size() < 1)
         {
             if (args.beam_size < 1)
             {
@@ -1469,7 +2020,10 @@ int main(int argc, const char **argv)
         exit(EXIT_FAILURE);
     }
 
-    return 0;
+    if (args.profile.size() > 0)
+        save_profile(args.profile);
+
+    return ret;
 }
 
 #else // CHATLLM_SHARED_LIB
@@ -1518,6 +2072,7 @@ static int chatllm_do_init(const std::vector<std::string> *p_obj_params = nullpt
 
     chatllm::ComputeManager::init(init_args.ggml_dir);
     prepare_rpc_devices(init_args);
+    prepare_numa(init_args);
 
     return 0;
 }
@@ -1621,11 +2176,19 @@ public:
         chatllm::BaseStreamer::end();
     }
 
+    void put_audio(const int16_t *pcm_samples, int sample_num, int sample_rate, int channels) override
+    {
+        if (f_audio)
+            f_audio(audio_user_data, pcm_samples, sample_num, sample_rate, channels);
+    }
+
 public:
     f_chatllm_print f_print;
     f_chatllm_end f_end;
     void *user_data;
     int ref_count;
+    f_chatllm_audio_callback f_audio = nullptr;
+    void *audio_user_data = nullptr;
 };
 
 static std::vector<std::unique_ptr<Chat>> chat_objects;
@@ -1706,6 +2269,31 @@ int chatllm_multimedia_msg_append(struct chatllm_obj *obj, const char *type, con
     return 0;
 }
 
+int chatllm_append_audio_snippet(struct chatllm_obj *obj, const short *pcm_samples, int sample_rate, int sample_num, int channel_num)
+{
+    DEF_CHAT_STREAMER();
+    if (chat->is_async_busy) return -1;
+    if (!chat->pipeline->is_loaded()) return -2;
+
+    try
+    {
+        return chat->pipeline->model->append_audio_snippet(pcm_samples, sample_rate, sample_num, channel_num);
+    }
+    catch (std::exception &e)
+    {
+        streamer->putln(e.what(), chatllm::BaseStreamer::TextType::ERR);
+        return -3;
+    }
+}
+
+void chatllm_clear_audio_snippets(struct chatllm_obj *obj)
+{
+    DEF_CHAT();
+    if (chat->is_async_busy || !chat->pipeline->is_loaded()) return;
+
+    chat->pipeline->model->clear_audio_snippets();
+}
+
 static void emit_model_info(Chat *chat, const Args &args, chatllm::Pipeline &pipeline)
 {
     auto o = json::JSON::Make(json::JSON::Class::Object);
@@ -1796,6 +2384,8 @@ int chatllm_start(struct chatllm_obj *obj, f_chatllm_print f_print, f_chatllm_en
     if (args.num_threads <= 0)
         args.num_threads = get_num_physical_cores();
 
+    prepare_numa(args);
+
     args.interactive = true;
     chat->streamer = std::unique_ptr<chatllm::BaseStreamer>(new FFIStreamer(nullptr, f_print, f_end, user_data));
     chat->streamer->log_level = init_args.log_level;
@@ -1981,6 +2571,42 @@ int chatllm_async_user_input_multimedia_msg(struct chatllm_obj *obj)
     ASYNC_FUN_BODY(chatllm_user_input_multimedia_msg(obj));
 }
 
+int chatllm_speech_synthesis(struct chatllm_obj *obj, const char *utf8_str, f_chatllm_audio_callback f_audio, void *user_data)
+{
+    DEF_CHAT_STREAMER();
+
+    if (!streamer->is_prompt) return -1;
+
+    if (!chat->pipeline->is_loaded()) return -2;
+
+    if (chat->pipeline->model->get_purpose() != chatllm::ModelPurpose::TTS)
+        return -3;
+
+    if (f_audio == nullptr) return -4;
+
+    std::vector<int16_t> audio;
+    int sample_rate = 0;
+    int channels = 0;
+    int r = 0;
+
+    streamer->f_audio           = f_audio;
+    streamer->audio_user_data   = user_data;
+    try
+    {
+        chat->pipeline->speech_synthesis(utf8_str, chat->gen_config, audio, sample_rate, channels, streamer);
+    }
+    catch (std::exception &e)
+    {
+        streamer->putln(e.what(), chatllm::BaseStreamer::TextType::ERR);
+        r = -5;
+    }
+    streamer->f_audio           = nullptr;
+    streamer->audio_user_data   = nullptr;
+
+    f_audio(user_data, nullptr, 0, sample_rate, channels);
+    return r;
+}
+
 int chatllm_ai_continue(struct chatllm_obj *obj, const char *utf8_str)
 {
     int r = 0;
@@ -2293,6 +2919,13 @@ void chatllm_set_lens_callback(struct chatllm_obj *obj, f_chatllm_lens_callback
     chat->pipeline->model->set_lens_callback(_lib_lens_callback, obj);
 }
 
+const char *chatllm_get_metrics(void)
+{
+    static thread_local std::string metrics;
+    metrics = chatllm::Metrics::expose();
+    return metrics.c_str();
+}
+
 const char *chatllm_inspect_model(const char *model_path)
 {
     static std::string info;
@@ -15,8 +15,12 @@
 #include <typeinfo>
 #include <type_traits>
 #include <utility>
+#include <tuple>
 #include <numbers>
 #include <unordered_map>
+#include <filesystem>
+#include <thread>
+#include <atomic>
 
 #include "layers.h"
 #include "JSON.h"
@@ -903,10 +907,14 @@ namespace chatllm
             transformer(nullptr),
             GRAPH_SIZE(GRAPH_SIZE),
             batch_input(runtime_config.batch_input_size), logit_scale(-1.0f),
+            routing_profiles(utils::get_opt(runtime_config.additional, "moe-profile", "")),
             w_ctx_(&backend_context),
-            config_(config)
+            config_(config),
+            pipeline_micro_batch(utils::get_opt(runtime_config.additional, "pipeline-micro-batch", 0))
     {
         w_ctx_.cache_dtype = runtime_config.cache_type;
+        w_ctx_.expert_pools = &expert_pools;
+        w_ctx_.routing_profiles = &routing_profiles;
         prepare(runtime_config);
         for (int i = 0; i < config.num_hidden_layers; i++)
             layer_ids.push_back(i);
@@ -982,7 +990,10 @@ namespace chatllm
             streamer->put(auto_output_prefix);
 
         if (performance)
+        {
+            performance->PromptEncoded();
             performance->Reset();
+        }
 
         before_generate(gen_config);
 
@@ -1041,6 +1052,8 @@ namespace chatllm
                 }
 
                 curr_input_ids.push_back(next_token_id);
+                if (performance)
+                    performance->TokenGenerated();
 
                 int pop_output = 0;
                 int keep_idx = 0;
@@ -1107,7 +1120,13 @@ namespace chatllm
 
     bool BaseModelForConditionalGeneration::generate_next_token(const std::vector<int> &input_ids, const GenerationConfig &gen_config, std::vector<float> &lm_logits)
     {
-        int batch = batch_input > 1 ? batch_input : 1;
+        int batch = get_input_batch_size();
+
+        // pipeline parallelism: while a micro-batch is being computed by later stages (backends),
+        // the next one is fed into the first stage. only the last one is waited for.
+        const bool pipelined = (pipeline_micro_batch > 0) && (backend_context.get_stage_count() > 1);
+        if (pipelined)
+            batch = std::min(batch, pipeline_micro_batch);
 
         const int *p = input_ids.data();
         int remain = (int)input_ids.size();
@@ -1115,13 +1134,80 @@ namespace chatllm
 
         for (; (remain > batch) && !aborted; p += batch, remain -= batch, past += batch)
         {
-            if (!run_model(p, batch, gen_config, past, lm_logits, 1))
-                return false;
+            deferred_output = pipelined;
+            bool r = run_model(p, batch, gen_config, past, lm_logits, 1);
+            deferred_output = false;
+            if (!r) return false;
         }
 
         return run_model(p, remain, gen_config,past, lm_logits, 1);
     }
 
+    int BaseModelForConditionalGeneration::get_input_batch_size(void) const
+    {
+        int batch = batch_input > 1 ? batch_input : 1;
+        // all experts selected by a batch must be resident
+        return std::min(batch, expert_pools.get_max_batch_size());
+    }
+
+    ExpertCacheStats BaseModelForConditionalGeneration::get_expert_cache_stats(void) const
+    {
+        return expert_pools.get_stats();
+    }
+
+    size_t BaseModelForConditionalGeneration::get_cache_bytes(void) const
+    {
+        return transformer ? transformer->get_cache_size() : 0;
+    }
+
+    bool BaseModelForConditionalGeneration::prefill(const std::vector<int> &input_ids, const GenerationConfig &gen_config)
+    {
+        if (n_past + (int)input_ids.size() >= gen_config.max_length) return false;
+
+        aborted = false;
+        std::vector<float> lm_logits;
+        if (!generate_next_token(input_ids, gen_config, lm_logits) || aborted) return false;
+
+        n_past += (int)input_ids.size();
+        return true;
+    }
+
+    bool BaseModelForConditionalGeneration::score_tokens(const std::vector<int> &input_ids, const GenerationConfig &gen_config, int last_n, std::vector<float> &lm_logits)
+    {
+        auto final_steps = dynamic_cast<LMFinalSteps *>(transformer->get_final_steps());
+        if ((nullptr == final_steps) || (last_n < 1) || (last_n > (int)input_ids.size())) return false;
+
+        int batch = get_input_batch_size();
+
+        const int saved_last_n = final_steps->get_read_last_n();
+        std::vector<float> logits;
+        lm_logits.clear();
+
+        const int *p = input_ids.data();
+        int remain = (int)input_ids.size();
+        int past = n_past + n_past_offset;
+        bool r = true;
+
+        while ((remain > 0) && r && !aborted)
+        {
+            // positions to be scored are at the tail, so they are also at the tail of a batch.
+            const int n = std::min(batch, remain);
+            const int to_read = std::min(n, last_n - (remain - n));
+
+            final_steps->set_read_last_n(to_read);
+            r = run_model(p, n, gen_config, past, logits, 1);
+            if (r && (to_read > 0))
+                lm_logits.insert(lm_logits.end(), logits.begin(), logits.end());
+
+            p += n;
+            remain -= n;
+            past += n;
+        }
+
+        final_steps->set_read_last_n(saved_last_n);
+        return r && (remain == 0);
+    }
+
     int BaseModelForConditionalGeneration::save_session(FILE *f) const
     {
         int r = BaseModel::save_session(f);
@@ -1155,6 +1241,8 @@ namespace chatllm
     void BaseModelForConditionalGeneration::prepare(const RuntimeConfig &rt_config)
     {
         w_ctx_.user_options.moe_on_cpu = rt_config.moe_on_cpu;
+        backend_context.set_tensor_parallel(utils::get_opt(rt_config.additional, "tensor-parallel", ""));
+        backend_context.set_pipeline_micro_batch(pipeline_micro_batch);
         backend_context.init(rt_config.model_gpu_layers, "main", config_.num_hidden_layers, GRAPH_SIZE, rt_config.n_threads);
     }
 
@@ -1241,6 +1329,11 @@ namespace chatllm
         transformer->before_eval(ctx);
     }
 
+    void BaseModelForConditionalGeneration::after_eval_model(ComputeContext *ctx)
+    {
+        transformer->after_eval(ctx);
+    }
+
     bool BaseModelForConditionalGeneration::run_model(const int *input_ids, const int ids_count,
                             const GenerationConfig &gen_config,
                             int past,
@@ -1301,10 +1394,20 @@ namespace chatllm
             exit(-1);
         }
 
+        OpProfiler::set_phase(ids_count > 1 ? OpProfiler::Phase::Prefill : OpProfiler::Phase::Decode);
+
         before_eval_model(&ctx);
-        ctx.compute();
+        if (deferred_output)
+        {
+            ctx.compute_async();
+        }
+        else
+        {
+            ctx.compute();
+            Backend::read_tensor_data(r, output.data());
+        }
 
-        Backend::read_tensor_data(r, output.data());
+        after_eval_model(&ctx);
 
         ctx.reset();
 
@@ -1431,6 +1534,14 @@ namespace chatllm
         }
     }
 
+    void HeterogeneousModel::after_eval(ComputeContext *ctx)
+    {
+        for (auto &layer : layers)
+        {
+            layer->after_eval(ctx);
+        }
+    }
+
     void HeterogeneousModel::set_ctx(int n_ctx)
     {
         for (auto &layer : layers)
@@ -1788,6 +1899,11 @@ namespace chatllm
         last_n = n >= 1 ? n : 1;
     }
 
+    int LMFinalSteps::get_read_last_n(void) const
+    {
+        return last_n;
+    }
+
     void LMFinalSteps::set_do_orderring(bool flag)
     {
         do_orderring = flag;
@@ -1915,19 +2031,213 @@ namespace chatllm
         return true;
     }
 
+    MediaEmbeddingCache::MediaEmbeddingCache(size_t budget, const std::string &dir)
+        : budget(budget), dir(dir), used(0)
+    {
+        if (dir.size() > 0)
+            std::filesystem::create_directories(dir);
+    }
+
+    std::string MediaEmbeddingCache::model_identity(const std::string &model_file)
+    {
+        std::error_code ec;
+        const auto path  = std::filesystem::absolute(model_file, ec);
+        if (ec) return "";
+        const auto size  = std::filesystem::file_size(path, ec);
+        if (ec) return "";
+        const auto mtime = std::filesystem::last_write_time(path, ec);
+        if (ec) return "";
+
+        return path.string() + "|" + std::to_string(size) + "|" + std::to_string(mtime.time_since_epoch().count());
+    }
+
+    std::string MediaEmbeddingCache::make_key(const BaseTokenizer::MediaAsEmbeddingVector &media, ggml::type dtype, const std::string &model_id) const
+    {
+        const int64_t shape[] = {media.type, media.width, media.height, media.grid_width, media.grid_height, media.patch_size,
+                                 media.emb_vec_number, (int64_t)media.data.size(), (int64_t)dtype};
+
+        // entries are shared across requests (and processes, on disk), so the address is a cryptographic digest
+        sha256::Context sha;
+        sha.update(shape, sizeof(shape));
+        sha.update(model_id.data(), model_id.size());
+        sha.update(media.data.data(), media.data.size() * sizeof(media.data[0]));
+        return sha.hex_digest();
+    }
+
+    bool MediaEmbeddingCache::get(const std::string &key, std::vector<uint8_t> &buf)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = index.find(key);
+            if (it != index.end())
+            {
+                items.splice(items.begin(), items, it->second);
+                const auto &cached = it->second->second;
+                buf.insert(buf.end(), cached.begin(), cached.end());
+                return true;
+            }
+        }
+
+        if (dir.size() < 1) return false;
+
+        // file: header, then embedding of `header.size` bytes
+        const auto path = std::filesystem::path(dir) / (key + ".emb");
+        std::error_code ec;
+        const auto file_size = std::filesystem::file_size(path, ec);
+        if (ec || (file_size <= sizeof(file_header))) return false;
+
+        std::ifstream f(path, std::ios::binary);
+        if (!f.is_open()) return false;
+
+        file_header header;
+        if (!f.read((char *)&header, sizeof(header))) return false;
+        if ((header.magic != file_magic) || (header.size != file_size - sizeof(header))) return false;
+
+        std::vector<uint8_t> data(header.size);
+        if (!f.read((char *)data.data(), data.size())) return false;
+
+        buf.insert(buf.end(), data.begin(), data.end());
+        insert(key, std::move(data));
+        return true;
+    }
+
+    void MediaEmbeddingCache::put(const std::string &key, const uint8_t *data, size_t size)
+    {
+        if (size < 1) return;
+
+        if (dir.size() > 0)
+        {
+            // written to a unique temporary file and then renamed, so readers never see a partial entry
+            static std::atomic<uint64_t> serial(0);
+            const auto path = std::filesystem::path(dir) / (key + ".emb");
+            auto tmp_path = path;
+            tmp_path += "." + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())) + "." + std::to_string(serial++) + ".tmp";
+
+            bool ok = false;
+            {
+                std::ofstream f(tmp_path, std::ios::binary);
+                const file_header header = {file_magic, 0, (uint64_t)size};
+                f.write((const char *)&header, sizeof(header));
+                f.write((const char *)data, size);
+                f.close();
+                ok = !f.fail();
+            }
+
+            std::error_code ec;
+            if (ok)
+                std::filesystem::rename(tmp_path, path, ec);
+            if (!ok || ec)
+                std::filesystem::remove(tmp_path, ec);
+        }
+
+        insert(key, std::vector<uint8_t>(data, data + size));
+    }
+
+    void MediaEmbeddingCache::insert(const std::string &key, std::vector<uint8_t> &&data)
+    {
+        if (data.size() > budget) return;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (index.find(key) != index.end()) return;
+
+        while (used + data.size() > budget)
+        {
+            used -= items.back().second.size();
+            index.erase(items.back().first);
+            items.pop_back();
+        }
+
+        used += data.size();
+        items.emplace_front(key, std::move(data));
+        index.emplace(key, items.begin());
+    }
+
+    static std::atomic<int> media_cache_bound_count(0);
+
+    MediaEmbeddingCacheBinding::MediaEmbeddingCacheBinding(const RuntimeConfig &runtime_config)
+    {
+        if (!is_requested(runtime_config.additional)) return;
+
+        const size_t cache_budget = (size_t)utils::get_opt(runtime_config.additional, "media-cache", 0) << 20;
+        const std::string cache_dir = utils::get_opt(runtime_config.additional, "media-cache-dir", "");
+        cache.reset(new MediaEmbeddingCache(cache_budget, cache_dir));
+    }
+
+    bool MediaEmbeddingCacheBinding::is_requested(const std::map<std::string, std::string> &additional)
+    {
+        return (utils::get_opt(additional, "media-cache", 0) > 0) || (utils::get_opt(additional, "media-cache-dir", "").size() > 0);
+    }
+
+    int MediaEmbeddingCacheBinding::get_bound_count(void)
+    {
+        return media_cache_bound_count.load();
+    }
+
+    void MediaEmbeddingCacheBinding::bind(ModelLoader &loader)
+    {
+        if (!cache) return;
+
+        model_id = MediaEmbeddingCache::model_identity(loader.get_file_path());
+        if (model_id.size() < 1)
+        {
+            ggml::log(GGML_LOG_LEVEL_WARN, "media embedding cache disabled: model file can't be identified");
+            cache.reset();
+            return;
+        }
+        media_cache_bound_count++;
+    }
+
+    std::string MediaEmbeddingCacheBinding::make_key(const BaseTokenizer::MediaAsEmbeddingVector &media, ggml::type dtype) const
+    {
+        return cache->make_key(media, dtype, model_id);
+    }
+
+    bool MediaEmbeddingCacheBinding::get(const std::string &key, std::vector<uint8_t> &buf)
+    {
+        return cache->get(key, buf);
+    }
+
+    void MediaEmbeddingCacheBinding::put(const std::string &key, const std::vector<uint8_t> &data)
+    {
+        cache->put(key, data.data(), data.size());
+    }
+
+    bool MediaEmbeddingCacheBinding::encode(const BaseTokenizer::MediaAsEmbeddingVector &media, ggml::type dtype, std::vector<uint8_t> &buf,
+        std::function<bool(std::vector<uint8_t> &buf)> encode)
+    {
+        if (!is_enabled()) return encode(buf);
+
+        const std::string key = make_key(media, dtype);
+        if (get(key, buf)) return true;
+
+        std::vector<uint8_t> output;
+        if (!encode(output)) return false;
+        put(key, output);
+        buf.insert(buf.end(), output.begin(), output.end());
+        return true;
+    }
+
     BaseMediaProjectedEmbeddingGeneration::BaseMediaProjectedEmbeddingGeneration(const RuntimeConfig &runtime_config, size_t GRAPH_SIZE)
         : GRAPH_SIZE(GRAPH_SIZE), _ctx(&backend_context),
         n_threads(runtime_config.n_threads),
-        max_embedding_num(-1)
+        max_embedding_num(-1),
+        max_batch_size(utils::get_opt(runtime_config.additional, "media-batch", 8)),
+        cache(runtime_config)
     {
     }
 
     bool BaseMediaProjectedEmbeddingGeneration::load(ModelLoader &loader)
     {
+        bind_cache(loader);
         if (model.get()) model->load("vision_model.", &loader);
         return true;
     }
 
+    void BaseMediaProjectedEmbeddingGeneration::bind_cache(ModelLoader &loader)
+    {
+        cache.bind(loader);
+    }
+
     bool BaseMediaProjectedEmbeddingGeneration::load_more(ggml::type dtype, int lm_hidden_size, const json::JSON &config)
     {
         return true;
@@ -1938,10 +2248,90 @@ namespace chatllm
         if ((model.get() == nullptr) || (tok->media_emb.size() < 1)) return;
         if (!model->is_loaded()) return;
 
-        for (auto &media : tok->media_emb)
+        const size_t n_media = tok->media_emb.size();
+        std::vector<std::vector<uint8_t>> outputs(n_media);
+        std::vector<std::string> keys(n_media);
+
+        // media to be encoded: those not found in cache
+        const bool use_cache = cache.is_enabled();
+        std::vector<size_t> pending;
+        for (size_t i = 0; i < n_media; i++)
+        {
+            if (use_cache)
+            {
+                keys[i] = cache.make_key(tok->media_emb[i], dtype);
+                if (cache.get(keys[i], outputs[i])) continue;
+            }
+            pending.push_back(i);
+        }
+
+        std::vector<bool> encoded(n_media, false);
+        const int batch_size = support_batch() ? std::max(1, max_batch_size) : 1;
+        if (batch_size <= 1)
         {
-            run_model(gen_config, tok, dtype, media, buf);
+            for (auto i : pending)
+            {
+                encoded[i] = run_model(gen_config, tok, dtype, tok->media_emb[i], outputs[i]);
+            }
         }
+        else
+        {
+            // group media (tiles, frames, ...) by shape, and encode each group in batches.
+            std::map<std::tuple<int, int, size_t>, std::vector<size_t>> buckets;
+            for (auto i : pending)
+            {
+                const auto &media = tok->media_emb[i];
+                buckets[{media.width, media.height, media.data.size()}].push_back(i);
+            }
+
+            std::vector<uint8_t> batch_buf;
+            MediaBatch batch;
+            for (const auto &bucket : buckets)
+            {
+                const auto &ids = bucket.second;
+                for (size_t start = 0; start < ids.size(); start += batch_size)
+                {
+                    const size_t n = std::min(ids.size() - start, (size_t)batch_size);
+                    batch.clear();
+                    for (size_t j = 0; j < n; j++)
+                        batch.push_back(&tok->media_emb[ids[start + j]]);
+
+                    batch_buf.clear();
+                    if ((n > 1) && run_batch(gen_config, tok, dtype, batch, batch_buf)
+                        && (batch_buf.size() > 0) && (batch_buf.size() % n == 0))
+                    {
+                        const size_t size = batch_buf.size() / n;
+                        for (size_t j = 0; j < n; j++)
+                        {
+                            outputs[ids[start + j]].assign(batch_buf.begin() + j * size, batch_buf.begin() + (j + 1) * size);
+                            encoded[ids[start + j]] = true;
+                        }
+                        continue;
+                    }
+
+                    if (n > 1)
+                        ggml::log(GGML_LOG_LEVEL_WARN, "batched media encoding failed, fall back to one by one");
+
+                    for (size_t j = 0; j < n; j++)
+                    {
+                        auto &output = outputs[ids[start + j]];
+                        output.clear();
+                        encoded[ids[start + j]] = run_model(gen_config, tok, dtype, *batch[j], output);
+                    }
+                }
+            }
+        }
+
+        for (auto i : pending)
+        {
+            CHATLLM_CHECK(encoded[i]) << "failed to encode media #" << i;
+            if (use_cache)
+                cache.put(keys[i], outputs[i]);
+        }
+
+        // outputs are put back in the original order
+        for (const auto &output : outputs)
+            buf.insert(buf.end(), output.begin(), output.end());
     }
 
     void BaseMediaProjectedEmbeddingGeneration::write_media_tensor(ggml::tensor *media_emb, const BaseTokenizer::MediaAsEmbeddingVector &media)
@@ -1949,14 +2339,45 @@ namespace chatllm
         Backend::write_tensor_data(media_emb, media.data.data(), 0, media.data.size() * sizeof(media.data[0]));
     }
 
+    ggml::tensor *BaseMediaProjectedEmbeddingGeneration::make_batch_tensor(ComputeContext *ctx, const MediaBatch &batch)
+    {
+        ggml::tensor *t = make_media_tensor(ctx, *batch[0]);
+        if (batch.size() == 1) return t;
+
+        CHATLLM_CHECK(ggml::get_dim(t, 3) == 1) << "media tensor is already 4D";
+        return ggml::new_tensor_4d(ctx, ggml::type_of(t), ggml::get_dim(t, 0), ggml::get_dim(t, 1), ggml::get_dim(t, 2), (int64_t)batch.size());
+    }
+
+    void BaseMediaProjectedEmbeddingGeneration::write_batch_tensor(ggml::tensor *media_emb, const MediaBatch &batch)
+    {
+        if (batch.size() == 1)
+        {
+            write_media_tensor(media_emb, *batch[0]);
+            return;
+        }
+
+        size_t offset = 0;
+        for (auto media : batch)
+        {
+            const size_t size = media->data.size() * sizeof(media->data[0]);
+            Backend::write_tensor_data(media_emb, media->data.data(), offset, size);
+            offset += size;
+        }
+    }
+
     bool BaseMediaProjectedEmbeddingGeneration::run_model(const GenerationConfig &gen_config, BaseTokenizer *tok, ggml::type dtype, const BaseTokenizer::MediaAsEmbeddingVector &media, std::vector<uint8_t> &buf)
+    {
+        return run_batch(gen_config, tok, dtype, {&media}, buf);
+    }
+
+    bool BaseMediaProjectedEmbeddingGeneration::run_batch(const GenerationConfig &gen_config, BaseTokenizer *tok, ggml::type dtype, const MediaBatch &batch, std::vector<uint8_t> &buf)
     {
         ForwardContext ctx(&backend_context);
         ctx.gctx = GGMLContext({.mem_size = backend_context.buf_compute_meta.size(), .mem_buffer = backend_context.buf_compute_meta.data(), .no_alloc = true});
         ctx.gf = ggml::new_graph_custom(&ctx, GRAPH_SIZE, false);
 
         ctx.move_to_layer(LayerAllocatorManager::MiscLayer::Prolog);
-        ggml::tensor *media_emb = make_media_tensor(&ctx, media);
+        ggml::tensor *media_emb = make_batch_tensor(&ctx, batch);
 
         set_dbg_ctx(&ctx);
 
@@ -1980,7 +2401,7 @@ namespace chatllm
             exit(-1);
         }
 
-        write_media_tensor(media_emb, media);
+        write_batch_tensor(media_emb, batch);
 
         model->before_eval(&ctx);
         ctx.compute();
@@ -2171,7 +2592,35 @@ namespace chatllm
     bool ModelFactory::load(int model_type, int version, ModelLoader &loader, Result &result, const ModelObject::extra_args &args)
     {
         auto _loader = get_loader(model_type, version);
-        return _loader->load_model(loader, result, args);
+        const int media_cache_bound = MediaEmbeddingCacheBinding::get_bound_count();
+        const bool r = _loader->load_model(loader, result, args);
+
+        // encoders that use the cache bind it while loading
+        if (r && MediaEmbeddingCacheBinding::is_requested(args.additional)
+            && (MediaEmbeddingCacheBinding::get_bound_count() == media_cache_bound))
+            ggml::log(GGML_LOG_LEVEL_WARN, "media embedding cache is not supported by this model, `media-cache` ignored");
+
+        return r;
+    }
+
+    void detect_mixed_expert_types(ModelLoader &loader, const ModelObject::extra_args &args)
+    {
+        std::vector<ggml::type> types;
+
+        // everything is re-quantized
+        if (args.re_quantize < 0)
+        {
+            static const std::regex pattern(R"(\.experts\.\d+\.\w+\.weight$)");
+            for (auto &kv : loader.tensor_dict)
+            {
+                if (!std::regex_search(kv.first, pattern)) continue;
+                const ggml::type type = ggml::type_of(&kv.second.tensor);
+                if (std::find(types.begin(), types.end(), type) == types.end())
+                    types.push_back(type);
+            }
+        }
+
+        BlockParams::MoEMixedTypes::setup(types);
     }
 
     void load_tensors_only(ModelLoader &loader)
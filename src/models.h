@@ -63,12 +63,15 @@ namespace chatllm
 
         ggml::tensor *forward(ComputeContext *ctx, ggml::tensor *input_ids, int n_past) override;
         void before_eval(ComputeContext *ctx) override;
+        void after_eval(ComputeContext *ctx) override;
         void set_ctx(int n_ctx) override;
 
         void shift_cache(int shift, int total) override;
 
         int64_t get_param_num(bool effective_only) const override;
 
+        size_t get_cache_size(void) const override { return cache_size; }
+
         Block *get_layer(int index);
         int    get_layer_num(void) const;
 
@@ -139,6 +142,7 @@ namespace chatllm
         friend LMFinalStepsDisabler;
         ggml::tensor *forward(HeterogeneousModel *model, ComputeContext *ctx, ggml::tensor *input_ids, ggml::tensor *hidden_states) override;
         void set_read_last_n(int n);
+        int  get_read_last_n(void) const;
         void set_do_orderring(bool flag);   // descending
         ggml::tensor *get_orderring_result(void);
     protected:
@@ -1,6 +1,8 @@
 #pragma once
 
 #include <stdint.h>
+#include <list>
+#include <mutex>
 #include "chat.h"
 
 namespace chatllm
@@ -291,6 +293,7 @@ namespace chatllm
     }
 
     void load_tensors_only(ModelLoader &loader);
+    void detect_mixed_expert_types(ModelLoader &loader, const ModelObject::extra_args &args);
 
     template <class Config, class ConditionalGeneration>
     ConditionalGeneration *load_model(ModelLoader &loader, Config &config, const ModelObject::extra_args &args)
@@ -356,12 +359,16 @@ namespace chatllm
         // assign some global parameters
         BlockParams::Optimization::speed = args.opt_speed;
         BlockParams::FlashAttention::push(args.flash_attention);
+        BlockParams::KVCacheCompression::setup(args.additional, args.batch_size);
+        BlockParams::MoEExpertCache::setup(args.additional);
         BlockParams::set_padded_embedding_num(args.max_proj_length);
 
         load_config<Config>(loader, config, args);
 
         // load tokenizer
         result.tokenizer = std::unique_ptr<BaseTokenizer>(load_tokenizer<Config, Tokenizer>(loader, config));
+        result.tokenizer->set_encode_threads(args.n_threads);
+        detect_mixed_expert_types(loader, args);
 
 #if (0)
         // test tokenizer
@@ -467,6 +474,11 @@ namespace chatllm
                                     std::vector<float> &embedding) override;
         float qa_rank(const GenerationConfig &gen_config, const std::vector<int> &input_ids) override;
         bool generate_next_token(const std::vector<int> &input_ids, const GenerationConfig &gen_config, std::vector<float> &lm_logits) override;
+        bool score_tokens(const std::vector<int> &input_ids, const GenerationConfig &gen_config, int last_n, std::vector<float> &lm_logits) override;
+        bool prefill(const std::vector<int> &input_ids, const GenerationConfig &gen_config) override;
+        ExpertCacheStats get_expert_cache_stats(void) const override;
+
+        size_t get_cache_bytes(void) const override;
         int save_session(FILE *f) const override;
         int load_session(FILE *f) override;
         int save_session(ModelSessionMemory &session) const override;
@@ -498,6 +510,7 @@ namespace chatllm
                                const GenerationConfig &gen_config,
                                int past);
         virtual void before_eval_model(ComputeContext *ctx);
+        virtual void after_eval_model(ComputeContext *ctx);
         virtual bool run_model(const int *input_ids, const int ids_count,
                                const GenerationConfig &gen_config,
                                int past,
@@ -507,6 +520,9 @@ namespace chatllm
 
         virtual bool is_output_terminated(const std::vector<int> &output_ids, int &keep_idx, int &pop_output);
 
+        // max number of tokens of a batch when evaluating prompts
+        int get_input_batch_size(void) const;
+
         bool match_output_sequence(const std::vector<int> &output_ids, const std::vector<int> &pattern);
 
         template <class T> T *get_typed_transformer(void) const
@@ -521,10 +537,16 @@ namespace chatllm
         float logit_scale;
         std::vector<int> layer_ids;
         BackendContext backend_context;
+        ExpertPools expert_pools;
+        MoERoutingProfiles routing_profiles;
         InitContext w_ctx_; // weight context
         BaseConfig config_;
         bool initial_run = false;
         std::vector<int> auto_output_prefix;
+        // pipeline parallelism: size of micro-batches (0: disabled)
+        int pipeline_micro_batch;
+        // when set, `run_model` does not wait for the completion of computation, and output is not read
+        bool deferred_output = false;
     };
 
     template <class Config, class Embedding, class FinalNorm, class LayerBlock, typename... _Types> class Model :
@@ -651,6 +673,74 @@ namespace chatllm
         const int n_threads;
     };
 
+    // content-addressed cache of projected media embeddings, shared by turns & requests.
+    // the key is a hash of the preprocessed media (pixels and shape, which reflect all preprocessing parameters),
+    // the model file (path, size and modification time) and the output type.
+    // least recently used ones are evicted beyond the byte budget.
+    // entries can also be persisted in a directory (one file per entry, written atomically).
+    class MediaEmbeddingCache
+    {
+    public:
+        MediaEmbeddingCache(size_t budget, const std::string &dir);
+
+        // identity of a model file, empty if it can't be determined
+        static std::string model_identity(const std::string &model_file);
+
+        std::string make_key(const BaseTokenizer::MediaAsEmbeddingVector &media, ggml::type dtype, const std::string &model_id) const;
+
+        // on hit, embedding is appended to `buf`
+        bool get(const std::string &key, std::vector<uint8_t> &buf);
+
+        void put(const std::string &key, const uint8_t *data, size_t size);
+
+    public:
+        const size_t budget;
+        const std::string dir;
+    protected:
+        struct file_header
+        {
+            uint32_t magic;
+            uint32_t reserved;
+            uint64_t size;
+        };
+        static const uint32_t file_magic = 0x424d4543; // "CEMB"
+
+        void insert(const std::string &key, std::vector<uint8_t> &&data);
+        typedef std::list<std::pair<std::string, std::vector<uint8_t>>> item_list;
+        item_list items;
+        std::unordered_map<std::string, item_list::iterator> index;
+        size_t used;
+        std::mutex mutex;
+    };
+
+    // the media embedding cache of an encoder (`--set media-cache N`, `--set media-cache-dir DIR`),
+    // bound to the model file the encoder is loaded from.
+    class MediaEmbeddingCacheBinding
+    {
+    public:
+        MediaEmbeddingCacheBinding(const RuntimeConfig &runtime_config);
+
+        void bind(ModelLoader &loader);
+
+        bool is_enabled(void) const { return cache && (model_id.size() > 0); }
+
+        std::string make_key(const BaseTokenizer::MediaAsEmbeddingVector &media, ggml::type dtype) const;
+        bool get(const std::string &key, std::vector<uint8_t> &buf);
+        void put(const std::string &key, const std::vector<uint8_t> &data);
+
+        // appends the embedding of `media` to `buf`: the cached one, or the one appended by `encode` (then cached)
+        bool encode(const BaseTokenizer::MediaAsEmbeddingVector &media, ggml::type dtype, std::vector<uint8_t> &buf,
+                    std::function<bool(std::vector<uint8_t> &buf)> encode);
+
+        static bool is_requested(const std::map<std::string, std::string> &additional);
+
+        // number of encoders bound so far, to find out models that ignore the cache
+        static int get_bound_count(void);
+    protected:
+        std::unique_ptr<MediaEmbeddingCache> cache;
+        std::string model_id;
+    };
+
     class BaseMediaProjectedEmbeddingGeneration
     {
     public:
@@ -659,9 +749,22 @@ namespace chatllm
         virtual bool load_more(ggml::type dtype, int lm_hidden_size, const json::JSON &config);
         virtual void generate(const GenerationConfig &gen_config, BaseTokenizer *tok, ggml::type dtype, std::vector<uint8_t> &buf);
     protected:
+        typedef std::vector<const BaseTokenizer::MediaAsEmbeddingVector *> MediaBatch;
+
+        // encode a single media. default: a batch of one
         virtual bool run_model(const GenerationConfig &gen_config, BaseTokenizer *tok, ggml::type dtype, const BaseTokenizer::MediaAsEmbeddingVector &media, std::vector<uint8_t> &buf);
+        // encode media (more than one) of the same shape in a single graph, outputs are appended to `buf` in order.
+        // encoders overriding `run_model` should also override this one if `support_batch()`.
+        virtual bool run_batch(const GenerationConfig &gen_config, BaseTokenizer *tok, ggml::type dtype, const MediaBatch &batch, std::vector<uint8_t> &buf);
         virtual ggml::tensor *make_media_tensor(ComputeContext *ctx, const BaseTokenizer::MediaAsEmbeddingVector &media) = 0;
         virtual void write_media_tensor(ggml::tensor *media_emb, const BaseTokenizer::MediaAsEmbeddingVector &media);
+        // default: tensor of the first one with the batch as the last dimension
+        virtual ggml::tensor *make_batch_tensor(ComputeContext *ctx, const MediaBatch &batch);
+        virtual void write_batch_tensor(ggml::tensor *media_emb, const MediaBatch &batch);
+        // can `model` take a batch of media (the last dimension of its input)?
+        virtual bool support_batch(void) const { return false; }
+        // cached embeddings are bound to the model file loaded by `loader`
+        void bind_cache(ModelLoader &loader);
     protected:
         std::unique_ptr<DynamicBlock> model;
         BackendContext backend_context;
@@ -671,6 +774,8 @@ namespace chatllm
         const int n_threads;
     protected:
         int max_embedding_num;
+        const int max_batch_size;
+        MediaEmbeddingCacheBinding cache;
     };
 
     class LogitsPenalty
@@ -2,9 +2,11 @@
 
 #include <queue>
 #include <memory>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
 #include <cstring>
 #include <limits>
-#include <regex>
 #include <iostream>
 
 #include "unicode.h"
@@ -227,6 +229,13 @@ int Processor::Encode(const std::string &input, std::vector<std::string> *pieces
 }
 
 int Processor::Encode(const std::string &input, std::vector<int> *ids) const
+{
+    return EncodeStream(input, [ids](const std::vector<int> &chunk) {
+        ids->insert(ids->end(), chunk.begin(), chunk.end());
+    });
+}
+
+int Processor::EncodeStream(const std::string &input, const IdsConsumer &consumer) const
 {
     std::string s = input;
     for (auto & p : pp)
@@ -254,14 +263,81 @@ int Processor::Encode(const std::string &input, std::vector<int> *ids) const
             break;
 
         std::string part = s.substr(0, special_pos);
-        DoEncode(part, ids);
+        DoEncodeStream(part, consumer);
 
         s = s.substr(special_pos + special_tok_len);
-        ids->push_back(special_id);
+        consumer({special_id});
+    }
+
+    DoEncodeStream(s, consumer);
+
+    return 0;
+}
+
+WorkerPool::WorkerPool(int n_threads)
+{
+    for (int i = 0; i < n_threads; i++)
+        threads.emplace_back(&WorkerPool::run, this);
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    cv.notify_all();
+    for (auto &t : threads)
+        t.join();
+}
+
+void WorkerPool::submit(std::function<void (void)> task)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        tasks.push_back(std::move(task));
+    }
+    cv.notify_one();
+}
+
+void WorkerPool::run(void)
+{
+    while (true)
+    {
+        std::function<void (void)> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this] { return stopping || (tasks.size() > 0); });
+            if (tasks.size() < 1) break;
+            task = std::move(tasks.front());
+            tasks.pop_front();
+        }
+        task();
     }
+}
+
+void Processor::SetEncodeThreads(int n)
+{
+    std::lock_guard<std::mutex> lock(workers_mutex);
+    if (n == encode_threads) return;
+    encode_threads = n;
+    workers.reset();
+}
 
-    DoEncode(s, ids);
+WorkerPool *Processor::GetWorkers(void) const
+{
+    std::lock_guard<std::mutex> lock(workers_mutex);
+    if (!workers)
+        workers = std::make_unique<WorkerPool>(std::max(encode_threads, 1));
+    return workers.get();
+}
 
+int Processor::DoEncodeStream(const std::string &input, const IdsConsumer &consumer) const
+{
+    std::vector<int> ids;
+    DoEncode(input, &ids);
+    if (ids.size() > 0)
+        consumer(ids);
     return 0;
 }
 
@@ -381,10 +457,57 @@ static int load_vocab_list(_vocab &vocab, Reader &reader, bool has_score, bool h
     return count;
 }
 
+void BPEMergeTable::clear(void)
+{
+    keys.clear();
+    values.clear();
+    count = 0;
+}
+
+void BPEMergeTable::rehash(size_t capacity)
+{
+    std::vector<uint64_t> old_keys(capacity, EMPTY);
+    std::vector<Merge>    old_values(capacity);
+    old_keys.swap(keys);
+    old_values.swap(values);
+
+    for (size_t j = 0; j < old_keys.size(); j++)
+    {
+        if (old_keys[j] == EMPTY) continue;
+
+        size_t i = hash(old_keys[j]) & (keys.size() - 1);
+        while (keys[i] != EMPTY)
+            i = (i + 1) & (keys.size() - 1);
+        keys[i]   = old_keys[j];
+        values[i] = old_values[j];
+    }
+}
+
+void BPEMergeTable::insert(int left, int right, int rank, int id)
+{
+    // keep load factor <= 0.5
+    if ((count + 1) * 2 > keys.size())
+        rehash(keys.size() > 0 ? keys.size() * 2 : 1024);
+
+    const uint64_t key = make_key(left, right);
+    size_t i = hash(key) & (keys.size() - 1);
+    for (; keys[i] != EMPTY; i = (i + 1) & (keys.size() - 1))
+    {
+        if (keys[i] == key) return;
+    }
+
+    keys[i]   = key;
+    values[i] = Merge{rank, id};
+    count++;
+}
+
 static int load_vocab_merges(_vocab &vocab, Reader &reader)
 {
     int count = 0;
 
+    vocab.bpe_merges.clear();
+    vocab.bpe_ranks.clear();
+
     while (true)
     {
         int len = reader.read_i32();
@@ -404,7 +527,12 @@ static int load_vocab_merges(_vocab &vocab, Reader &reader)
             second = word.substr(pos + 1);
         }
 
-        vocab.bpe_ranks.emplace(std::make_pair(first, second), count);
+        const int left  = vocab.find_token_id(first);
+        const int right = vocab.find_token_id(second);
+        if ((left >= 0) && (right >= 0))
+            vocab.bpe_merges.insert(left, right, count, vocab.find_token_id(first + second));
+        else
+            vocab.bpe_ranks.emplace(std::make_pair(first, second), count);
 
         count++;
     }
@@ -470,6 +598,7 @@ BPEProcessor2::BPEProcessor2(std::vector<std::string> regex_exprs):
 void BPEProcessor2::SetDecoderType(DecoderType dec_type)
 {
     this->dec_type = dec_type;
+    word_cache.clear();
 }
 
 size_t BPEProcessor2::Load(DataReader *data_reader, int n_vocab)
@@ -484,6 +613,7 @@ size_t BPEProcessor2::Load(DataReader *data_reader, int n_vocab)
     load_vocab_merges(vocab_, reader);
     build_special_token_cache(vocab_);
     searcher.rebuild(vocab_.special_tokens_cache);
+    word_cache.clear();
 
     return reader.get_total_size();
 }
@@ -494,6 +624,7 @@ struct llm_symbol {
     index next;
     const char * text;
     size_t n;
+    _vocab::id id;
 };
 
 struct llm_bigram_bpe {
@@ -507,7 +638,7 @@ struct llm_bigram_bpe {
     using queue = std::priority_queue<llm_bigram_bpe, queue_storage, comparator>;
     llm_symbol::index left;
     llm_symbol::index right;
-    std::string text;
+    _vocab::id id;
     int rank;
     size_t size;
 };
@@ -515,102 +646,76 @@ struct llm_bigram_bpe {
 struct llm_bpe_tokenizer {
     llm_bpe_tokenizer(const _vocab & vocab): vocab(vocab) {}
 
-    void tokenize(std::vector<_vocab::id> & output, const std::vector<std::string> &word_collection) {
-        int final_prev_index = -1;
+    void tokenize(const std::string & word, std::vector<_vocab::id> & output) {
+        work_queue = llm_bigram_bpe::queue();
+        symbols.clear();
 
-        symbols_final.clear();
+        int index = 0;
+        size_t offset = 0;
 
-        for (auto & word : word_collection) {
-            work_queue = llm_bigram_bpe::queue();
-            symbols.clear();
+        while (offset < word.size()) {
+            llm_symbol sym;
+            size_t char_len = std::min(word.size() - offset, (size_t) ::utf8_len(word[offset]));
+            sym.text = word.c_str() + offset;
+            sym.n = char_len;
+            sym.id = vocab.find_token_id(std::string(sym.text, sym.n));
+            offset += sym.n;
+            sym.prev = index - 1;
+            sym.next = offset == word.size() ? -1 : index + 1;
+            index++;
+            symbols.emplace_back(sym);
+        }
+        for (int i = 1; i < (int)symbols.size(); ++i) {
+            add_new_bigram(i - 1, i);
+        }
 
-            int index = 0;
-            size_t offset = 0;
+        // build token(s)
+        while (!work_queue.empty()) {
+            auto bigram = work_queue.top();
+            work_queue.pop();
 
-            while (offset < word.size()) {
-                llm_symbol sym;
-                size_t char_len = std::min(word.size() - offset, (size_t) ::utf8_len(word[offset]));
-                sym.text = word.c_str() + offset;
-                sym.n = char_len;
-                offset += sym.n;
-                sym.prev = index - 1;
-                sym.next = offset == word.size() ? -1 : index + 1;
-                index++;
-                symbols.emplace_back(sym);
+            auto & left_symbol = symbols[bigram.left];
+            auto & right_symbol = symbols[bigram.right];
+
+            if (left_symbol.n == 0 || right_symbol.n == 0) {
+                continue;
             }
-            for (int i = 1; i < (int)symbols.size(); ++i) {
-                add_new_bigram(i - 1, i);
+            // symbols never move, so the bigram is outdated iff its length changed
+            if (left_symbol.n + right_symbol.n != bigram.size) {
+                continue;
             }
 
-            // build token(s)
-            while (!work_queue.empty()) {
-                auto bigram = work_queue.top();
-                work_queue.pop();
-
-                auto & left_symbol = symbols[bigram.left];
-                auto & right_symbol = symbols[bigram.right];
-
-                if (left_symbol.n == 0 || right_symbol.n == 0) {
-                    continue;
-                }
-                std::string left_token = std::string(left_symbol.text, left_symbol.n);
-                std::string right_token = std::string(right_symbol.text, right_symbol.n);
-                if (left_token + right_token != bigram.text) {
-                    continue;  // Skip this bigram if it's outdated
-                }
-
-                // merge the right sym into the left one
-                left_symbol.n += right_symbol.n;
-                right_symbol.n = 0;
-
-                // remove the right sym from the chain
-                left_symbol.next = right_symbol.next;
-                if (right_symbol.next >= 0) {
-                    symbols[right_symbol.next].prev = bigram.left;
-                }
+            // merge the right sym into the left one
+            left_symbol.n += right_symbol.n;
+            left_symbol.id = bigram.id;
+            right_symbol.n = 0;
 
-                add_new_bigram(left_symbol.prev, bigram.left);  // left side of current symbol
-                add_new_bigram(bigram.left, left_symbol.next);  // right side of current symbol
+            // remove the right sym from the chain
+            left_symbol.next = right_symbol.next;
+            if (right_symbol.next >= 0) {
+                symbols[right_symbol.next].prev = bigram.left;
             }
 
-            // add the fnished tokens to the final list keeping correct order for next and prev
-            for (auto & sym : symbols) {
-                if (sym.n > 0) {
-                    sym.prev = final_prev_index;
-                    sym.next = -1;
-                    if (final_prev_index != -1) {
-                        symbols_final[final_prev_index].next = (llm_symbol::index)symbols_final.size();
-                    }
-                    symbols_final.emplace_back(sym);
-                    final_prev_index = (int)symbols_final.size() - 1;
-                }
-            }
+            add_new_bigram(left_symbol.prev, bigram.left);  // left side of current symbol
+            add_new_bigram(bigram.left, left_symbol.next);  // right side of current symbol
         }
 
-        symbols = symbols_final;
+        for (auto & symbol : symbols) {
+            if (symbol.n == 0) {
+                continue;
+            }
 
-        if (!symbols.empty()) {
-            for (int i = 0; i != -1; i = symbols[i].next) {
-                auto & symbol = symbols[i];
-                if (symbol.n == 0) {
-                    continue;
-                }
+            if (symbol.id >= 0) {
+                output.push_back(symbol.id);
+                continue;
+            }
 
-                const std::string str = std::string(symbol.text, symbol.n);
-                const auto token = vocab.token_to_id.find(str);
-
-                if (token == vocab.token_to_id.end()) {
-                    for (auto j = str.begin(); j != str.end(); ++j) {
-                        std::string byte_str(1, *j);
-                        auto token_multibyte = vocab.token_to_id.find(byte_str);
-                        if (token_multibyte == vocab.token_to_id.end()) {
-                            throw std::runtime_error("ERROR: byte not found in vocab");
-                        }
-                        output.push_back((*token_multibyte).second);
-                    }
-                } else {
-                    output.push_back((*token).second);
+            for (size_t j = 0; j < symbol.n; j++) {
+                auto token_multibyte = vocab.token_to_id.find(std::string(1, symbol.text[j]));
+                if (token_multibyte == vocab.token_to_id.end()) {
+                    throw std::runtime_error("ERROR: byte not found in vocab");
                 }
+                output.push_back((*token_multibyte).second);
             }
         }
     }
@@ -621,12 +726,25 @@ private:
             return;
         }
 
-        std::string left_token  = std::string(symbols[left].text,  symbols[left].n);
-        std::string right_token = std::string(symbols[right].text, symbols[right].n);
+        const auto & left_symbol  = symbols[left];
+        const auto & right_symbol = symbols[right];
 
         int rank_found = -1;
+        _vocab::id id  = -1;
 
-        rank_found = vocab.find_bpe_rank(left_token, right_token);
+        if ((left_symbol.id >= 0) && (right_symbol.id >= 0)) {
+            auto merge = vocab.bpe_merges.find(left_symbol.id, right_symbol.id);
+            if (merge) {
+                rank_found = merge->rank;
+                id         = merge->id;
+            }
+        } else if (vocab.bpe_ranks.size() > 0) {
+            std::string left_token  = std::string(left_symbol.text,  left_symbol.n);
+            std::string right_token = std::string(right_symbol.text, right_symbol.n);
+            rank_found = vocab.find_bpe_rank(left_token, right_token);
+            if (rank_found >= 0)
+                id = vocab.find_token_id(left_token + right_token);
+        }
 
         if (rank_found < 0) {
             return;
@@ -636,8 +754,8 @@ private:
 
         bigram.left  = left;
         bigram.right = right;
-        bigram.text  = left_token + right_token;
-        bigram.size  = left_token.size() + right_token.size();
+        bigram.id    = id;
+        bigram.size  = left_symbol.n + right_symbol.n;
         bigram.rank  = rank_found;
 
         work_queue.push(bigram);
@@ -646,22 +764,213 @@ private:
     const _vocab & vocab;
 
     std::vector<llm_symbol> symbols;
-    std::vector<llm_symbol> symbols_final;
 
     llm_bigram_bpe::queue work_queue;
 };
 
-int BPEProcessor2::DoEncode2(const std::string &input,
-        std::vector<int> *ids) const
+BPEWordCache::BPEWordCache(size_t capacity, size_t max_word_len, int shard_num)
+    : capacity(capacity), max_word_len(max_word_len),
+      shard_capacity((capacity + std::max(shard_num, 1) - 1) / std::max(shard_num, 1))
 {
-    if (input.size() < 1) return 0;
+    for (int i = 0; i < std::max(shard_num, 1); i++)
+        shards.push_back(std::make_unique<Shard>());
+}
+
+BPEWordCache::Shard &BPEWordCache::get_shard(const std::string &word)
+{
+    return *shards[std::hash<std::string>{}(word) % shards.size()];
+}
+
+bool BPEWordCache::get(const std::string &word, std::vector<int> &ids)
+{
+    if ((shard_capacity < 1) || (word.size() > max_word_len)) return false;
+
+    auto &shard = get_shard(word);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.index.find(word);
+    if (it == shard.index.end()) return false;
+
+    shard.items.splice(shard.items.begin(), shard.items, it->second);
+    const auto &cached = it->second->second;
+    ids.insert(ids.end(), cached.begin(), cached.end());
+    return true;
+}
+
+void BPEWordCache::put(const std::string &word, const int *ids, size_t count)
+{
+    if ((shard_capacity < 1) || (word.size() > max_word_len)) return;
+
+    auto &shard = get_shard(word);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (shard.index.find(word) != shard.index.end()) return;
+
+    if (shard.items.size() >= shard_capacity)
+    {
+        shard.index.erase(shard.items.back().first);
+        shard.items.pop_back();
+    }
 
-    std::vector<std::string> bpe_encoded_words = unicode_regex_split(input, regex_exprs);
-    if (dec_type == DecoderType::ByteLevel)
-        bpe_encoded_words = unicode_byte_encoding_process(bpe_encoded_words);
+    shard.items.emplace_front(word, std::vector<int>(ids, ids + count));
+    shard.index.emplace(word, shard.items.begin());
+}
 
+void BPEWordCache::clear(void)
+{
+    for (auto &shard : shards)
+    {
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        shard->items.clear();
+        shard->index.clear();
+    }
+}
+
+void BPEProcessor2::EncodeWords(const std::vector<std::string> &words, size_t begin, size_t end, std::vector<int> &ids) const
+{
     llm_bpe_tokenizer tokenizer(vocab_);
-    tokenizer.tokenize(*ids, bpe_encoded_words);
+    for (size_t i = begin; i < end; i++)
+    {
+        const auto &word = words[i];
+        if (word_cache.get(word, ids)) continue;
+
+        const size_t start = ids.size();
+        if (dec_type == DecoderType::ByteLevel)
+            tokenizer.tokenize(unicode_byte_encoding_process(word), ids);
+        else
+            tokenizer.tokenize(word, ids);
+        word_cache.put(word, ids.data() + start, ids.size() - start);
+    }
+}
+
+int BPEProcessor2::DoEncode2(const std::string &input, const IdsConsumer &consumer) const
+{
+    // words are encoded independently, so chunks split at word boundaries
+    // give exactly the same result as encoding serially.
+    const size_t CHUNK_WORDS = 4096;
+
+    if (input.size() < 1) return 0;
+
+    std::vector<std::string> words = unicode_regex_split(input, regex_exprs);
+
+    const size_t chunk_num = (words.size() + CHUNK_WORDS - 1) / CHUNK_WORDS;
+    const int    n_threads = (int)std::min((size_t)std::max(encode_threads, 1), chunk_num);
+
+    if (n_threads <= 1)
+    {
+        std::vector<int> ids;
+        for (size_t i = 0; i < chunk_num; i++)
+        {
+            ids.clear();
+            EncodeWords(words, i * CHUNK_WORDS, std::min((i + 1) * CHUNK_WORDS, words.size()), ids);
+            consumer(ids);
+        }
+        return 0;
+    }
+
+    struct Chunk
+    {
+        std::vector<int> ids;
+        std::exception_ptr error;
+        bool ready = false;
+    };
+
+    std::vector<Chunk> chunks(chunk_num);
+    std::atomic<size_t> next_chunk(0);
+    int running = n_threads;
+    // while the consumer runs (e.g. prefilling on all compute threads), only the first worker keeps on encoding
+    bool consuming = false;
+    std::mutex mutex;
+    std::condition_variable cv;
+
+    auto worker = [&](int index) {
+        while (true)
+        {
+            if (index > 0)
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [&] { return !consuming || (next_chunk >= chunk_num); });
+            }
+
+            const size_t i = next_chunk.fetch_add(1);
+            if (i >= chunk_num) break;
+
+            auto &chunk = chunks[i];
+            try
+            {
+                EncodeWords(words, i * CHUNK_WORDS, std::min((i + 1) * CHUNK_WORDS, words.size()), chunk.ids);
+            }
+            catch (...)
+            {
+                chunk.error = std::current_exception();
+            }
+
+            // notified under the lock: once the caller sees the update, this task no longer touches
+            // `mutex` or `cv`, which are locals of the caller
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                chunk.ready = true;
+                cv.notify_all();
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        running--;
+        cv.notify_all();
+    };
+
+    auto pool = GetWorkers();
+    for (int i = 0; i < n_threads; i++)
+        pool->submit([&worker, i] { worker(i); });
+
+    // hand over chunks in order, while later ones are still being encoded
+    std::exception_ptr error;
+    for (size_t i = 0; i < chunk_num; i++)
+    {
+        auto &chunk = chunks[i];
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [&chunk] { return chunk.ready; });
+        }
+
+        if (chunk.error)
+        {
+            error = chunk.error;
+            next_chunk = chunk_num;
+            break;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            consuming = true;
+        }
+
+        try
+        {
+            consumer(chunk.ids);
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+            next_chunk = chunk_num;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            consuming = false;
+            cv.notify_all();
+        }
+
+        if (error) break;
+        chunk.ids = std::vector<int>();
+    }
+
+    // tasks refer to locals of this call
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&running] { return running == 0; });
+    }
+
+    if (error)
+        std::rethrow_exception(error);
 
     return 0;
 }
@@ -671,15 +980,16 @@ BPEProcessor3::BPEProcessor3(std::vector<std::string> regex_exprs)
 {
 }
 
-int BPEProcessor3::DoEncode2(const std::string &input,
-        std::vector<int> *ids) const
+int BPEProcessor3::DoEncode2(const std::string &input, const IdsConsumer &consumer) const
 {
     if (input.size() < 1) return 0;
 
     // TODO: split by regexpr
 
+    std::vector<int> ids;
     llama_sp_tokenizer tokenizer(vocab_);
-    tokenizer.tokenize(input, *ids);
+    tokenizer.tokenize(input, ids);
+    consumer(ids);
     return 0;
 }
 
@@ -819,15 +1129,22 @@ std::string NearestKeywordSearcher::search(std::string &input, int &kw_id) const
 
 int BPEProcessor2::DoEncode(const std::string &input,
         std::vector<int> *ids) const
+{
+    return DoEncodeStream(input, [ids](const std::vector<int> &chunk) {
+        ids->insert(ids->end(), chunk.begin(), chunk.end());
+    });
+}
+
+int BPEProcessor2::DoEncodeStream(const std::string &input, const IdsConsumer &consumer) const
 {
     std::string text(input);
     int sp_tok_id = -1;
     while (text.size() > 0)
     {
         auto leading = searcher.search(text, sp_tok_id);
-        DoEncode2(leading, ids);
+        DoEncode2(leading, consumer);
         if (sp_tok_id < 0) break;
-        ids->push_back(sp_tok_id);
+        consumer({sp_tok_id});
     }
 
     return 0;
@@ -1041,10 +1358,32 @@ std::string TextTrim::transform(const std::string &s0)
     return s.substr(size);
 }
 
+// replace each run of chars in `chars` with a single space
+static std::string replace_runs_with_space(const std::string &s, const char *chars)
+{
+    std::string r;
+    r.reserve(s.size());
+    for (size_t i = 0; i < s.size(); )
+    {
+        if (nullptr == strchr(chars, s[i]) || (s[i] == '\0'))
+        {
+            r.push_back(s[i++]);
+            continue;
+        }
+
+        r.push_back(' ');
+        while ((i < s.size()) && (s[i] != '\0') && strchr(chars, s[i]))
+            i++;
+    }
+    return r;
+}
+
 std::string TextPrepDeleteMultiSpaces::transform(const std::string &s)
 {
-    const static std::regex r(R""( {2,})"");
-    return std::regex_replace(s, r, " ");
+    if (s.find("  ") == std::string::npos) return s;
+
+    // ` {2,}` -> ` `
+    return replace_runs_with_space(s, " ");
 }
 
 std::string TextPrepAddLeadingSpace::transform(const std::string &s)
@@ -1055,8 +1394,8 @@ std::string TextPrepAddLeadingSpace::transform(const std::string &s)
 
 std::string TextPrepNewlineToSpaces::transform(const std::string &s)
 {
-    const static std::regex r(R""([\r\n]+)"");
-    return std::regex_replace(s, r, " ");
+    // `[\r\n]+` -> ` `
+    return replace_runs_with_space(s, "\r\n");
 }
 
 size_t tokenizer::get_end_of_valid_utf8(const std::string &utf8, const size_t offset)
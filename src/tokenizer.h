@@ -4,7 +4,13 @@
 #include <vector>
 #include <unordered_map>
 #include <map>
+#include <list>
+#include <mutex>
 #include <memory>
+#include <functional>
+#include <deque>
+#include <thread>
+#include <condition_variable>
 
 namespace tokenizer
 {
@@ -20,6 +26,57 @@ enum token_type
     BYTE         = 6,
 };
 
+// open-addressing hash table of BPE merges, keyed by (left id, right id)
+class BPEMergeTable
+{
+public:
+    struct Merge
+    {
+        int rank;
+        int id;     // id of the merged token, -1 if not in vocab
+    };
+
+    void clear(void);
+
+    // the first one is kept if (left, right) already exists
+    void insert(int left, int right, int rank, int id);
+
+    const Merge *find(int left, int right) const
+    {
+        if (keys.size() < 1) return nullptr;
+
+        const uint64_t key = make_key(left, right);
+        for (size_t i = hash(key) & (keys.size() - 1); ; i = (i + 1) & (keys.size() - 1))
+        {
+            if (keys[i] == key)   return &values[i];
+            if (keys[i] == EMPTY) return nullptr;
+        }
+    }
+
+    size_t size(void) const { return count; }
+
+protected:
+    static uint64_t make_key(int left, int right)
+    {
+        return ((uint64_t)(uint32_t)left << 32) | (uint32_t)right;
+    }
+
+    static size_t hash(uint64_t key)
+    {
+        key ^= key >> 33;
+        key *= 0xff51afd7ed558ccdULL;
+        key ^= key >> 33;
+        return (size_t)key;
+    }
+
+    void rehash(size_t capacity);
+
+    static const uint64_t EMPTY = ~(uint64_t)0;
+    std::vector<uint64_t> keys;
+    std::vector<Merge>    values;
+    size_t count = 0;
+};
+
 struct _vocab
 {
     using id    = int32_t;
@@ -35,11 +92,13 @@ struct _vocab
     std::vector<token_score> id_to_token;
 
     std::unordered_map<id, token> special_tokens_cache;
+    BPEMergeTable bpe_merges;
+    // merges that can't be put into `bpe_merges` (either side is not in vocab)
     std::map<std::pair<std::string, std::string>, int> bpe_ranks;
     int byte_fallback_tok_ids[256];
     bool byte_fallback_ready;
 
-    int find_bpe_rank(std::string token_left, std::string token_right) const
+    int find_bpe_rank(const std::string &token_left, const std::string &token_right) const
     {
         auto it = bpe_ranks.find(std::make_pair(token_left, token_right));
         if (it == bpe_ranks.end()) {
@@ -49,6 +108,12 @@ struct _vocab
         return it->second;
     }
 
+    id find_token_id(const std::string &tok) const
+    {
+        auto it = token_to_id.find(tok);
+        return it != token_to_id.end() ? it->second : -1;
+    }
+
     bool is_token_of_type(id id, token_type t) const
     {
         if ((id < 0) || (id >= (int)id_to_token.size())) return false;
@@ -122,6 +187,27 @@ protected:
     int64_t _size;
 };
 
+// fixed-size pool of threads running submitted tasks in FIFO order
+class WorkerPool
+{
+public:
+    WorkerPool(int n_threads);
+    ~WorkerPool();
+
+    void submit(std::function<void (void)> task);
+
+    int get_thread_num(void) const { return (int)threads.size(); }
+
+private:
+    void run(void);
+
+    std::vector<std::thread> threads;
+    std::deque<std::function<void (void)>> tasks;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stopping = false;
+};
+
 class Processor
 {
 public:
@@ -149,6 +235,11 @@ public:
     virtual int Encode(const std::string &input,
             std::vector<int> *ids) const;
 
+    // Same as `Encode`, but ids are handed to `consumer` chunk by chunk (in order) as soon as they are ready.
+    // `consumer` is always called on the calling thread.
+    typedef std::function<void (const std::vector<int> &ids)> IdsConsumer;
+    virtual int EncodeStream(const std::string &input, const IdsConsumer &consumer) const;
+
     // Given a sequence of ids, decodes it into a detokenized output.
     virtual int Decode(const std::vector<int> &ids,
             std::string *detokenized) const;
@@ -167,9 +258,16 @@ public:
 
     void AddAddedToken(const std::string &tok, int id);
 
+    void SetEncodeThreads(int n);
+
 protected:
     virtual int DoEncode(const std::string &input, std::vector<int> *ids) const = 0;
 
+    virtual int DoEncodeStream(const std::string &input, const IdsConsumer &consumer) const;
+
+    // workers are created on first use, and kept until `encode_threads` is changed
+    WorkerPool *GetWorkers(void) const;
+
 protected:
     _vocab vocab_;
     int piece_size;
@@ -179,6 +277,10 @@ protected:
     std::vector<std::unique_ptr<TextPreprocessor>> pp;
     std::map<int, std::string> token_override;
     std::vector<TokenId> added_tokens;
+    int encode_threads = 1;
+private:
+    mutable std::unique_ptr<WorkerPool> workers;
+    mutable std::mutex workers_mutex;
 };
 
 class BPEProcessor1: public Processor
@@ -223,6 +325,38 @@ protected:
     std::unique_ptr<Node> root;
 };
 
+// LRU cache of encoded pre-tokenized words.
+// It is split into shards by the hash of words, each with its own lock, so that encoding threads rarely wait for each other.
+class BPEWordCache
+{
+public:
+    BPEWordCache(size_t capacity = 16384, size_t max_word_len = 128, int shard_num = 16);
+
+    // on hit, ids are appended to `ids`
+    bool get(const std::string &word, std::vector<int> &ids);
+
+    void put(const std::string &word, const int *ids, size_t count);
+
+    void clear(void);
+
+public:
+    const size_t capacity;
+    const size_t max_word_len;
+protected:
+    typedef std::list<std::pair<std::string, std::vector<int>>> item_list;
+    struct Shard
+    {
+        item_list items;
+        std::unordered_map<std::string, item_list::iterator> index;
+        std::mutex mutex;
+    };
+
+    Shard &get_shard(const std::string &word);
+
+    const size_t shard_capacity;
+    std::vector<std::unique_ptr<Shard>> shards;
+};
+
 class BPEProcessor2: public Processor
 {
 public:
@@ -246,12 +380,16 @@ protected:
     int DoEncode(const std::string &input,
             std::vector<int> *ids) const override;
 
-    virtual int DoEncode2(const std::string &input,
-            std::vector<int> *ids) const;
+    int DoEncodeStream(const std::string &input, const IdsConsumer &consumer) const override;
+
+    virtual int DoEncode2(const std::string &input, const IdsConsumer &consumer) const;
+
+    void EncodeWords(const std::vector<std::string> &words, size_t begin, size_t end, std::vector<int> &ids) const;
 
     std::vector<std::string> regex_exprs;
     NearestKeywordSearcher searcher;
     DecoderType dec_type = DecoderType::ByteLevel;
+    mutable BPEWordCache word_cache;
 };
 
 class BPEProcessor3: public BPEProcessor2
@@ -261,8 +399,7 @@ public:
 
     const std::string IdToPiece(int id) const override;
 protected:
-    int DoEncode2(const std::string &input,
-            std::vector<int> *ids) const override;
+    int DoEncode2(const std::string &input, const IdsConsumer &consumer) const override;
 };
 
 class UnigramProcessor: public Processor
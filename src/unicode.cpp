@@ -153,31 +153,33 @@ static inline std::wstring unicode_wstring_from_utf8(const std::string & s) {
     return conv.from_bytes(s);
 }
 
+std::string unicode_byte_encoding_process(const std::string & bpe_word) {
+    std::string text_utf;
+    auto utf_word =  unicode_cpts_from_utf8(bpe_word);
+    for (size_t i = 0; i < utf_word.size(); ++i) {
+        text_utf += unicode_cpt_to_utf8(utf_word[i]);
+    }
+
+    std::string encoded_token;
+    for (char & c : text_utf) {
+        encoded_token += unicode_byte_to_utf8(c);
+    }
+    return encoded_token;
+}
+
 std::vector<std::string> unicode_byte_encoding_process(const std::vector<std::string> & bpe_words) {
     std::vector<std::string> bpe_encoded_words;
     for (const auto & word : bpe_words) {
-        std::string text_utf;
-        auto utf_word =  unicode_cpts_from_utf8(word);
-        for (size_t i = 0; i < utf_word.size(); ++i) {
-            text_utf += unicode_cpt_to_utf8(utf_word[i]);
-        }
-
-        std::string encoded_token;
-        for (char & c : text_utf) {
-            encoded_token += unicode_byte_to_utf8(c);
-        }
-        bpe_encoded_words.emplace_back(encoded_token);
+        bpe_encoded_words.emplace_back(unicode_byte_encoding_process(word));
     }
     return bpe_encoded_words;
 }
 
 // GPT2 system regex:  's|'t|'re|'ve|'m|'ll|'d| ?\p{L}+| ?\p{N}+| ?[^\s\p{L}\p{N}]+|\s+(?!\S)|\s+
-static std::vector<size_t> unicode_regex_split_custom_gpt2(const std::string & text, const std::vector<size_t> & offsets) {
+static std::vector<size_t> unicode_regex_split_custom_gpt2(const std::vector<uint32_t> & cpts, const std::vector<size_t> & offsets) {
     std::vector<size_t> bpe_offsets; // store the offset of each word
     bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
 
-    const auto cpts = unicode_cpts_from_utf8(text);
-
     size_t start = 0;
     for (auto offset : offsets) {
         const size_t offset_ini = start;
@@ -291,12 +293,11 @@ static std::vector<size_t> unicode_regex_split_custom_gpt2(const std::string & t
 }
 
 // LLAMA3 system regex: "(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\r\n\p{L}\p{N}]?\p{L}+|\p{N}{1,3}| ?[^\s\p{L}\p{N}]+[\r\n]*|\s*[\r\n]+|\s+(?!\S)|\s+"
-static std::vector<size_t> unicode_regex_split_custom_llama3(const std::string & text, const std::vector<size_t> & offsets) {
+// QWEN2 is the same except \p{N} (i.e. `max_digits` = 1)
+static std::vector<size_t> unicode_regex_split_custom_llama3(const std::vector<uint32_t> & cpts, const std::vector<size_t> & offsets, const size_t max_digits) {
     std::vector<size_t> bpe_offsets; // store the offset of each word
     bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
 
-    const auto cpts = unicode_cpts_from_utf8(text);
-
     size_t start = 0;
     for (auto offset : offsets) {
         const size_t offset_ini = start;
@@ -369,7 +370,7 @@ static std::vector<size_t> unicode_regex_split_custom_llama3(const std::string &
             if (flags.is_number) {
                 size_t ini = pos;
                 while (_get_flags(pos).is_number) {
-                    if (++pos - ini >= 3 ) {
+                    if (++pos - ini >= max_digits) {
                         _add_token(pos);
                         ini = pos;
                     }
@@ -492,16 +493,67 @@ static std::vector<size_t> unicode_regex_split_stl(const std::string & text, con
     return bpe_offsets;
 }
 
-static std::vector<size_t> unicode_regex_split_custom(const std::string & text, const std::string & regex_expr, const std::vector<size_t> & offsets) {
+// regex: \p{N}{1,max_digits}, used to split numbers out of words
+static std::vector<size_t> unicode_regex_split_custom_digits(const std::vector<uint32_t> & cpts, const std::vector<size_t> & offsets, const size_t max_digits) {
+    std::vector<size_t> bpe_offsets; // store the offset of each word
+    bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
+
+    size_t start = 0;
+    for (auto offset : offsets) {
+        const size_t offset_end = start + offset;
+        assert(offset_end <= cpts.size());
+
+        size_t prev_end = start;
+        for (size_t pos = start; pos < offset_end; ) {
+            if (!unicode_cpt_flags(cpts[pos]).is_number) {
+                pos++;
+                continue;
+            }
+
+            if (pos > prev_end) {
+                bpe_offsets.push_back(pos - prev_end);
+            }
+
+            const size_t ini = pos;
+            while ((pos < offset_end) && (pos - ini < max_digits) && unicode_cpt_flags(cpts[pos]).is_number) {
+                pos++;
+            }
+            bpe_offsets.push_back(pos - ini);
+            prev_end = pos;
+        }
+
+        if (offset_end > prev_end) {
+            bpe_offsets.push_back(offset_end - prev_end);
+        }
+        start = offset_end;
+    }
+
+    return bpe_offsets;
+}
+
+static std::vector<size_t> unicode_regex_split_custom(const std::vector<uint32_t> & cpts, const std::string & regex_expr, const std::vector<size_t> & offsets) {
+    static const size_t UNLIMITED = (size_t)-1;
+    static const std::map<std::string, size_t> llama3_family = {
+        { "(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+", 3 },
+        { "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+", 3 },
+        { "(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+", 1 },
+        { "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+", 1 },
+    };
+    static const std::map<std::string, size_t> digits = {
+        { "\\p{N}",       1 },
+        { "\\p{N}{1}",    1 },
+        { "\\p{N}{1,3}",  3 },
+        { "\\p{N}+",      UNLIMITED },
+    };
+
     std::vector<size_t> bpe_offsets;
 
     if (regex_expr == "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)") {
-        bpe_offsets = unicode_regex_split_custom_gpt2(text, offsets);
-    } else if (
-            regex_expr == "(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+" ||
-            regex_expr == "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+") {
-
-        bpe_offsets = unicode_regex_split_custom_llama3(text, offsets);
+        bpe_offsets = unicode_regex_split_custom_gpt2(cpts, offsets);
+    } else if (auto it = llama3_family.find(regex_expr); it != llama3_family.end()) {
+        bpe_offsets = unicode_regex_split_custom_llama3(cpts, offsets, it->second);
+    } else if (auto it = digits.find(regex_expr); it != digits.end()) {
+        bpe_offsets = unicode_regex_split_custom_digits(cpts, offsets, it->second);
     }
 
     return bpe_offsets;
@@ -593,7 +645,7 @@ uint32_t unicode_tolower(uint32_t cp) {
     return it == unicode_map_lowercase.end() ? cp : it->second;
 }
 
-std::vector<std::string> unicode_regex_split(const std::string & text, const std::vector<std::string> & regex_exprs) {
+std::vector<std::string> unicode_regex_split(const std::string & text, const std::vector<std::string> & regex_exprs, bool use_custom) {
     // unicode categories
     static const std::map<std::string, int> k_ucat_enum = {
         { "\\p{N}", codepoint_flags::NUMBER },
@@ -613,26 +665,15 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
         { codepoint_flags::PUNCTUATION,   "\x21-\x23\x25-\x2A\x2C-\x2F\x3A-\x3B\x3F-\x40\\\x5B-\\\x5D\x5F\\\x7B\\\x7D" }, // !-#%-*,-/:-;?-@\[-\]_\{\}
     };
 
-    // compute collapsed codepoints only if needed by at least one regex
-    bool need_collapse = false;
-    for (auto & regex_expr : regex_exprs) {
-        // search for unicode categories
-        for (const auto & ucat : k_ucat_enum) {
-            if (std::string::npos != regex_expr.find(ucat.first)) {
-                need_collapse = true;
-                break;
-            }
-        }
-        if (need_collapse)
-            break;
-    }
-
     const auto cpts = unicode_cpts_from_utf8(text);
 
     // generate a "collapsed" representation of the text, where all codepoints are replaced by a single byte
     // ref: https://github.com/ggerganov/llama.cpp/pull/6920#issuecomment-2081479935
+    // computed only if needed by a regex which has no custom implementation
     std::string text_collapsed;
-    if (need_collapse) {
+    auto collapse = [&]() {
+        if (text_collapsed.size() == cpts.size()) return;
+
         // collapse all unicode categories
         text_collapsed.resize(cpts.size());
 
@@ -655,13 +696,13 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
                 text_collapsed[i] = (char) 0xD0; // fallback
             }
         }
-    }
+    };
 
     std::vector<size_t> bpe_offsets = { cpts.size() };
 
     for (auto & regex_expr : regex_exprs) {
         // first, see if we have an efficient custom regex implementation
-        auto tmp = unicode_regex_split_custom(text, regex_expr, bpe_offsets);
+        auto tmp = use_custom ? unicode_regex_split_custom(cpts, regex_expr, bpe_offsets) : std::vector<size_t>();
 
         if (!tmp.empty()) {
             bpe_offsets = std::move(tmp);
@@ -729,6 +770,8 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
                     regex_expr_collapsed += regex_expr[i];
                 }
 
+                collapse();
+
                 //printf("text_collapsed: %s\n", text_collapsed.c_str());
                 //printf("regex_expr_collapsed: %s\n", regex_expr_collapsed.c_str());
                 bpe_offsets = unicode_regex_split_stl(text_collapsed, regex_expr_collapsed, bpe_offsets);
@@ -65,5 +65,7 @@ uint8_t unicode_utf8_to_byte(const std::string & utf8);
 
 uint32_t unicode_tolower(uint32_t cp);
 
-std::vector<std::string> unicode_regex_split(const std::string & text, const std::vector<std::string> & regex_exprs);
-std::vector<std::string> unicode_byte_encoding_process(const std::vector<std::string> & bpe_words);
\ No newline at end of file
+// `use_custom`: use hand-written splitters for known patterns (false: always std::regex, for testing)
+std::vector<std::string> unicode_regex_split(const std::string & text, const std::vector<std::string> & regex_exprs, bool use_custom = true);
+std::vector<std::string> unicode_byte_encoding_process(const std::vector<std::string> & bpe_words);
+std::string unicode_byte_encoding_process(const std::string & bpe_word);
\ No newline at end of file
@@ -1,9 +1,16 @@
 #include "vision_process.h"
 #include <regex>
 #include <sstream>
+#include <fstream>
 #include <cmath>
+#include <cstring>
 #include <filesystem>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <numbers>
 #include "basics.h"
+#include "image_codec.h"
 
 namespace vision
 {
@@ -26,6 +33,8 @@ namespace vision
 
         int64_t min_pixels;
         int64_t max_pixels;
+
+        ResampleFilter filter;
     };
 
     static Params params {
@@ -42,6 +51,8 @@ namespace vision
 
         .min_pixels         = 0,
         .max_pixels         = 0,
+
+        .filter             = ResampleFilter::Auto,
     };
 
     MaxGridWidth::MaxGridWidth(int value)
@@ -128,6 +139,16 @@ namespace vision
         params.max_pixels  = 0;
     }
 
+    Resample::Resample(ResampleFilter filter)
+    {
+        params.filter = filter;
+    }
+
+    Resample::~Resample()
+    {
+        params.filter = ResampleFilter::Auto;
+    }
+
     bool PreMaxImageSize::PreScale(int &width, int &height)
     {
         double ratio = (double)width / height;
@@ -167,7 +188,34 @@ namespace vision
     #define POPEN_MODE_WRITE        "w"
 #endif
 
-    void image_dimension(const char *fn, int &width, int &height)
+    struct Image
+    {
+        int width  = 0;
+        int height = 0;
+        image_pixels_t pixels;
+    };
+
+    // in-memory video frames of live `VideoLoader`s, which are looked up before files.
+    // they are named by paths in the private directory of their loader, so they never shadow other files.
+    static std::mutex mem_images_mutex;
+    static std::map<std::string, std::shared_ptr<const Image>> mem_images;
+
+    static std::shared_ptr<const Image> mem_image_find(const char *fn)
+    {
+        std::lock_guard<std::mutex> lock(mem_images_mutex);
+        auto it = mem_images.find(fn);
+        return it != mem_images.end() ? it->second : nullptr;
+    }
+
+    static bool read_file(const char *fn, std::vector<uint8_t> &content)
+    {
+        std::ifstream f(fn, std::ios::binary);
+        if (!f.is_open()) return false;
+        content.assign(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+        return content.size() > 0;
+    }
+
+    static void magick_dimension(const char *fn, int &width, int &height)
     {
         width  = -1;
         height = -1;
@@ -196,18 +244,31 @@ namespace vision
         pclose(pp);
     }
 
+    void image_dimension(const char *fn, int &width, int &height)
+    {
+        auto mem = mem_image_find(fn);
+        if (mem)
+        {
+            width  = mem->width;
+            height = mem->height;
+            return;
+        }
+
+        std::vector<uint8_t> content;
+        if (read_file(fn, content) && image_probe(content.data(), content.size(), width, height))
+            return;
+        magick_dimension(fn, width, height);
+    }
+
     static void run_cmd(std::ostringstream &oss, image_pixels_t &image)
     {
         oss << " rgb:-";
-        // oss << " rgb:c:\\tmp\\img.raw";
-
-        //printf("%s\n", oss.str().c_str());
 
         FILE* pp = popen(oss.str().c_str(), POPEN_MODE_READ);
 
         while (!feof(pp))
         {
-            uint8_t buffer[1024];
+            uint8_t buffer[64 * 1024];
             size_t cnt = fread(buffer, 1, sizeof(buffer), pp);
             if (cnt > 0)
                 image.insert(image.end(), buffer, buffer + cnt);
@@ -216,21 +277,286 @@ namespace vision
         pclose(pp);
     }
 
+    // decode in-process; other formats (WebP, progressive JPEG, GIF, ...) are decoded by ImageMagick
+    static bool image_read(const char *fn, Image &image)
+    {
+        auto mem = mem_image_find(fn);
+        if (mem)
+        {
+            image = *mem;
+            return true;
+        }
+
+        std::vector<uint8_t> content;
+        if (!read_file(fn, content)) return false;
+        if (image_decode(content.data(), content.size(), image.pixels, image.width, image.height))
+            return true;
+
+        if (!image_probe(content.data(), content.size(), image.width, image.height))
+            magick_dimension(fn, image.width, image.height);
+        if (image.width <= 0) return false;
+
+        std::ostringstream oss;
+        oss << MAGICK_CONVERT_CMD << " -depth 8 \"" << std::string(fn) << "[0]\"";
+        image.pixels.clear();
+        image.pixels.reserve((size_t)image.width * image.height * 3);
+        run_cmd(oss, image.pixels);
+        return image.pixels.size() == (size_t)image.width * image.height * 3;
+    }
+
+    // weights of a separable resampling filter (anti-aliased when shrinking), sampled like ImageMagick and PIL
+    struct ResampleWeights
+    {
+        int                max_taps;
+        std::vector<int>   start;
+        std::vector<int>   taps;
+        std::vector<float> weights;     // [out_size][max_taps]
+    };
+
+    enum class ResampleKernel
+    {
+        Lanczos,
+        Mitchell,
+        Bicubic,
+        Bilinear,
+    };
+
+    static double sinc(double x)
+    {
+        if (x == 0.0) return 1.0;
+        x *= std::numbers::pi;
+        return std::sin(x) / x;
+    }
+
+    static void resample_weights(const int in_size, const int out_size, const ResampleKernel kernel, ResampleWeights &r)
+    {
+        double filter_support = 2.0;
+        switch (kernel)
+        {
+        case ResampleKernel::Lanczos:   filter_support = 3.0; break;
+        case ResampleKernel::Bilinear:  filter_support = 1.0; break;
+        default:                                              break;
+        }
+
+        auto filter = [kernel](double x) -> double
+        {
+            x = std::abs(x);
+            switch (kernel)
+            {
+            case ResampleKernel::Lanczos:
+                return x < 3.0 ? sinc(x) * sinc(x / 3.0) : 0.0;
+            case ResampleKernel::Mitchell:
+                {
+                    // Mitchell-Netravali, B = C = 1/3
+                    const double B = 1.0 / 3.0;
+                    const double C = 1.0 / 3.0;
+                    if (x < 1.0) return ((12.0 - 9.0 * B - 6.0 * C) * x * x * x + (-18.0 + 12.0 * B + 6.0 * C) * x * x + (6.0 - 2.0 * B)) / 6.0;
+                    if (x < 2.0) return ((-B - 6.0 * C) * x * x * x + (6.0 * B + 30.0 * C) * x * x + (-12.0 * B - 48.0 * C) * x + (8.0 * B + 24.0 * C)) / 6.0;
+                    return 0.0;
+                }
+            case ResampleKernel::Bicubic:
+                {
+                    const double a = -0.5;
+                    if (x < 1.0) return ((a + 2.0) * x - (a + 3.0)) * x * x + 1.0;
+                    if (x < 2.0) return (((x - 5.0) * x + 8.0) * x - 4.0) * a;
+                    return 0.0;
+                }
+            default:
+                return x < 1.0 ? 1.0 - x : 0.0;
+            }
+        };
+
+        const double scale   = (double)in_size / out_size;
+        const double fscale  = std::max(scale, 1.0);
+        const double support = filter_support * fscale;
+
+        r.max_taps = (int)std::ceil(support) * 2 + 1;
+        r.start.resize(out_size);
+        r.taps.resize(out_size);
+        r.weights.assign((size_t)out_size * r.max_taps, 0.0f);
+
+        std::vector<double> w(r.max_taps);
+        for (int i = 0; i < out_size; i++)
+        {
+            const double center = (i + 0.5) * scale;
+            const int x0 = std::max((int)(center - support + 0.5), 0);
+            const int x1 = std::min((int)(center + support + 0.5), in_size);
+            const int n  = std::min(x1 - x0, r.max_taps);
+
+            double total = 0.0;
+            for (int j = 0; j < n; j++)
+            {
+                w[j] = filter((j + x0 - center + 0.5) / fscale);
+                total += w[j];
+            }
+            for (int j = 0; j < n; j++)
+                r.weights[(size_t)i * r.max_taps + j] = (float)(total != 0.0 ? w[j] / total : 0.0);
+            r.start[i] = x0;
+            r.taps[i]  = n;
+        }
+    }
+
+    static uint8_t to_pixel(float v)
+    {
+        return (uint8_t)std::min(255.0f, std::max(0.0f, v + 0.5f));
+    }
+
+    // `-resize WxH!`: horizontal pass, then vertical pass over whole rows (vectorized by compilers)
+    static void image_resize(const Image &src, Image &dst, const int width, const int height)
+    {
+        if ((width == src.width) && (height == src.height))
+        {
+            if (&dst != &src) dst = src;
+            return;
+        }
+
+        // like ImageMagick, one filter is chosen for both directions by the change of area
+        ResampleKernel kernel = ResampleKernel::Bicubic;
+        switch (params.filter)
+        {
+        case ResampleFilter::Auto:
+            kernel = (double)width * height > (double)src.width * src.height ? ResampleKernel::Mitchell : ResampleKernel::Lanczos;
+            break;
+        case ResampleFilter::Bilinear:
+            kernel = ResampleKernel::Bilinear;
+            break;
+        default:
+            break;
+        }
+
+        ResampleWeights wx, wy;
+        resample_weights(src.width,  width,  kernel, wx);
+        resample_weights(src.height, height, kernel, wy);
+
+        const size_t row = (size_t)width * 3;
+        std::vector<float> tmp((size_t)src.height * row);
+        for (int y = 0; y < src.height; y++)
+        {
+            const uint8_t *s = src.pixels.data() + (size_t)y * src.width * 3;
+            float *d = tmp.data() + y * row;
+            for (int x = 0; x < width; x++)
+            {
+                const float *w = wx.weights.data() + (size_t)x * wx.max_taps;
+                const uint8_t *p = s + (size_t)wx.start[x] * 3;
+                float r = 0.0f, g = 0.0f, b = 0.0f;
+                for (int k = 0; k < wx.taps[x]; k++, p += 3)
+                {
+                    r += w[k] * p[0];
+                    g += w[k] * p[1];
+                    b += w[k] * p[2];
+                }
+                d[x * 3 + 0] = r;
+                d[x * 3 + 1] = g;
+                d[x * 3 + 2] = b;
+            }
+        }
+
+        image_pixels_t out((size_t)height * row);
+        std::vector<float> acc(row);
+        for (int y = 0; y < height; y++)
+        {
+            const float *w = wy.weights.data() + (size_t)y * wy.max_taps;
+            std::fill(acc.begin(), acc.end(), 0.0f);
+            for (int k = 0; k < wy.taps[y]; k++)
+            {
+                const float *s = tmp.data() + (size_t)(wy.start[y] + k) * row;
+                const float wk = w[k];
+                float *a = acc.data();
+                for (size_t i = 0; i < row; i++)
+                    a[i] += wk * s[i];
+            }
+            uint8_t *d = out.data() + y * row;
+            for (size_t i = 0; i < row; i++)
+                d[i] = to_pixel(acc[i]);
+        }
+
+        dst.width  = width;
+        dst.height = height;
+        dst.pixels = std::move(out);
+    }
+
+    // `-resize WxH>`: shrink (if larger) to fit in the box, keeping aspect ratio
+    static void image_shrink_to_fit(const Image &src, Image &dst, const int width, const int height)
+    {
+        if ((src.width <= width) && (src.height <= height))
+        {
+            if (&dst != &src) dst = src;
+            return;
+        }
+        const double scale = std::min((double)width / src.width, (double)height / src.height);
+        image_resize(src, dst, std::max(1, (int)std::floor(src.width * scale + 0.5)), std::max(1, (int)std::floor(src.height * scale + 0.5)));
+    }
+
+    // `-crop WxH+X+Y`: the region is clipped to the image
+    static void image_crop(const Image &src, Image &dst, int x, int y, int width, int height)
+    {
+        const int x1 = std::min(src.width,  x + width);
+        const int y1 = std::min(src.height, y + height);
+        x = std::max(0, x);
+        y = std::max(0, y);
+        width  = std::max(0, x1 - x);
+        height = std::max(0, y1 - y);
+
+        image_pixels_t out((size_t)width * height * 3);
+        for (int r = 0; r < height; r++)
+            memcpy(out.data() + (size_t)r * width * 3, src.pixels.data() + ((size_t)(y + r) * src.width + x) * 3, (size_t)width * 3);
+
+        dst.width  = width;
+        dst.height = height;
+        dst.pixels = std::move(out);
+    }
+
+    static void parse_color(const std::string &color, uint8_t rgb[3])
+    {
+        rgb[0] = rgb[1] = rgb[2] = 0;
+        if (color == "white")
+            rgb[0] = rgb[1] = rgb[2] = 255;
+        else if ((color.size() == 7) && (color[0] == '#'))
+        {
+            for (int i = 0; i < 3; i++)
+                rgb[i] = (uint8_t)std::stoi(color.substr(1 + i * 2, 2), nullptr, 16);
+        }
+    }
+
+    // `-gravity northwest -background COLOR -extent WxH`
+    static void image_extent(const Image &src, Image &dst, const int width, const int height, const std::string &background)
+    {
+        uint8_t color[3];
+        parse_color(background, color);
+
+        image_pixels_t out((size_t)width * height * 3);
+        for (size_t i = 0; i < out.size(); i += 3)
+            memcpy(out.data() + i, color, 3);
+
+        const int w = std::min(width,  src.width);
+        const int h = std::min(height, src.height);
+        for (int r = 0; r < h; r++)
+            memcpy(out.data() + (size_t)r * width * 3, src.pixels.data() + (size_t)r * src.width * 3, (size_t)w * 3);
+
+        dst.width  = width;
+        dst.height = height;
+        dst.pixels = std::move(out);
+    }
+
     void image_load_split(const char *fn, std::vector<image_pixels_t> &splits, bool do_split, const int split_width, const int split_height, int &splits_cols_num, int &splits_rows_num)
     {
         splits.clear();
         splits_cols_num = 0;
         splits_rows_num = 0;
 
-        int width = -1;
-        int height = -1;
-        image_dimension(fn, width, height);
-        if (width <= 0) return;
+        Image image;
+        if (!image_read(fn, image)) return;
+
+        int width  = image.width;
+        int height = image.height;
 
-        std::ostringstream base;
-        base << MAGICK_CONVERT_CMD << " -depth 8 \"" << std::string(fn) << "\"";
+        Image scaled;
+        const Image *base = &image;
         if (PreMaxImageSize::PreScale(width, height))
-            base << " -resize " << width << "x" << height << "!";
+        {
+            image_resize(image, scaled, width, height);
+            base = &scaled;
+        }
 
         splits_rows_num =(height + split_height - 1) / split_height;
         splits_cols_num =(width  + split_width  - 1) / split_width;
@@ -246,13 +572,9 @@ namespace vision
                     const int start_x = c * optimal_width;
                     const int start_y = r * optimal_height;
 
-                    std::ostringstream oss;
-                    oss << base.str();
-                    oss << " -crop " << optimal_width << "x" << optimal_height << "+" << start_x << "+" << start_y;
-
-                    splits.emplace_back(image_pixels_t());
-                    auto &image = splits.back();
-                    run_cmd(oss, image);
+                    Image split;
+                    image_crop(*base, split, start_x, start_y, optimal_width, optimal_height);
+                    splits.emplace_back(std::move(split.pixels));
                 }
             }
         }
@@ -263,12 +585,9 @@ namespace vision
         }
 
         // resize the global one
-        std::ostringstream oss;
-        oss << MAGICK_CONVERT_CMD << " -depth 8 \"" << std::string(fn) << "\"";
-        oss << " -resize " << split_width << "x" << split_height << "!";
-        splits.emplace_back(image_pixels_t());
-        auto &image = splits.back();
-        run_cmd(oss, image);
+        Image global;
+        image_resize(image, global, split_width, split_height);
+        splits.emplace_back(std::move(global.pixels));
     }
 
     void image_load_pan_and_scan(const char *fn, std::vector<image_pixels_t> &crops, bool do_pas,
@@ -278,19 +597,17 @@ namespace vision
     {
         crops.clear();
 
-        int width = -1;
-        int height = -1;
-        image_dimension(fn, width, height);
-        if (width <= 0) return;
+        Image image;
+        if (!image_read(fn, image)) return;
+
+        const int width  = image.width;
+        const int height = image.height;
 
         // whole image
         {
-            std::ostringstream oss;
-            oss << MAGICK_CONVERT_CMD << " -depth 8 \"" << std::string(fn) << "\"";
-            oss << " -resize " << crop_width << "x" << crop_height << "!";
-            crops.emplace_back(image_pixels_t());
-            auto &image = crops.back();
-            run_cmd(oss, image);
+            Image resized;
+            image_resize(image, resized, crop_width, crop_height);
+            crops.emplace_back(std::move(resized.pixels));
         }
 
         int num_crops_w = 1;
@@ -337,14 +654,10 @@ namespace vision
             {
                 const int start_x = c * crop_size_w;
 
-                std::ostringstream oss;
-                oss << MAGICK_CONVERT_CMD << " -depth 8 \"" << std::string(fn) << "\"";
-                oss << " -crop " << crop_size_w << "x" << crop_size_h << "+" << start_x << "+" << start_y;
-                oss << " -resize " << crop_width << "x" << crop_height << "!";
-
-                crops.emplace_back(image_pixels_t());
-                auto &image = crops.back();
-                run_cmd(oss, image);
+                Image crop;
+                image_crop(image, crop, start_x, start_y, crop_size_w, crop_size_h);
+                image_resize(crop, crop, crop_width, crop_height);
+                crops.emplace_back(std::move(crop.pixels));
             }
         }
     }
@@ -359,10 +672,11 @@ namespace vision
         crops_per_row = 0;
         num_crop_rows = 0;
 
-        int width = -1;
-        int height = -1;
-        image_dimension(fn, width, height);
-        if (width <= 0) return;
+        Image image;
+        if (!image_read(fn, image)) return;
+
+        const int width  = image.width;
+        const int height = image.height;
 
         auto find_closest_aspect_ratio = [min_num_crops, max_num_crops](const int img_width, const int img_height, const int crop_size, int &crops_per_row, int &num_crop_rows)
         {
@@ -422,29 +736,23 @@ namespace vision
         const int resized_width = crops_per_row * crop_size;
         const int resized_height = num_crop_rows * crop_size;
 
+        Image resized;
+        image_resize(image, resized, resized_width, resized_height);
+
         for (auto b : windows)
         {
-            std::ostringstream oss;
-            oss << MAGICK_CONVERT_CMD << " -depth 8 \"" << std::string(fn) << "\"";
-            oss << " -resize " << resized_width << "x" << resized_height << "!";
-            oss << " -crop " << b.w << "x" << b.h << "+" << b.x << "+" << b.y;
-            oss << " -resize " << crop_size << "x" << crop_size << "!";
-
-            crops.emplace_back(image_pixels_t());
-            auto &image = crops.back();
-            run_cmd(oss, image);
+            Image crop;
+            image_crop(resized, crop, b.x, b.y, b.w, b.h);
+            image_resize(crop, crop, crop_size, crop_size);
+            crops.emplace_back(std::move(crop.pixels));
         }
 
         // whole image
         if (use_thumbnail && (windows.size() > 1))
         {
-            std::ostringstream oss;
-            oss << MAGICK_CONVERT_CMD << " -depth 8 \"" << std::string(fn) << "\"";
-            oss << " -resize " << crop_size << "x" << crop_size << "!";
-
-            crops.emplace_back(image_pixels_t());
-            auto &image = crops.back();
-            run_cmd(oss, image);
+            Image thumbnail;
+            image_resize(image, thumbnail, crop_size, crop_size);
+            crops.emplace_back(std::move(thumbnail.pixels));
         }
     }
 
@@ -455,10 +763,11 @@ namespace vision
         crops.clear();
         crops_per_row = 0;
 
-        int width = -1;
-        int height = -1;
-        image_dimension(fn, width, height);
-        if (width <= 0) return;
+        Image image;
+        if (!image_read(fn, image)) return;
+
+        int width  = image.width;
+        int height = image.height;
 
         auto get_image_size_for_padding = [](int img_width, int img_height)
         {
@@ -579,57 +888,38 @@ namespace vision
             slide_window(width, height, crop_size, crop_size, crop_size, crop_size, crops_per_row, windows);
         }
 
+        if (square_padded_size > 0)
+            image_extent(image, image, square_padded_size, square_padded_size, PaddingMode::Black);
+
         // whole image
         {
-            std::ostringstream oss;
-            oss << MAGICK_CONVERT_CMD << " -depth 8 \"" << std::string(fn) << "\"";
-            if (square_padded_size > 0)
-            {
-                oss << " -compose Copy -gravity northwest";
-                oss << " -background back";
-                oss << " -extent " << square_padded_size << "x" << square_padded_size;
-            }
-            oss << " -resize " << image_size << "x" << image_size << "!";
-
-            crops.emplace_back(image_pixels_t());
-            auto &image = crops.back();
-            run_cmd(oss, image);
+            Image resized;
+            image_resize(image, resized, image_size, image_size);
+            crops.emplace_back(std::move(resized.pixels));
         }
 
+        if (resized_width > 0)
+            image_resize(image, image, resized_width, resized_height);
+
         for (auto b : windows)
         {
-            std::ostringstream oss;
-            oss << MAGICK_CONVERT_CMD << " -depth 8 \"" << std::string(fn) << "\"";
-            if (square_padded_size > 0)
-            {
-                oss << " -compose Copy -gravity northwest";
-                oss << " -background back";
-                oss << " -extent " << square_padded_size << "x" << square_padded_size;
-            }
-            if (resized_width > 0)
-            {
-                oss << " -resize " << resized_width << "x" << resized_height << "!";
-            }
-            oss << " -crop " << b.w << "x" << b.h << "+" << b.x << "+" << b.y;
-            oss << " -resize " << crop_size << "x" << crop_size << "!";
-
-            crops.emplace_back(image_pixels_t());
-            auto &image = crops.back();
-            run_cmd(oss, image);
+            Image crop;
+            image_crop(image, crop, b.x, b.y, b.w, b.h);
+            image_resize(crop, crop, crop_size, crop_size);
+            crops.emplace_back(std::move(crop.pixels));
         }
     }
 
     void image_load(const char *fn, std::vector<uint8_t> &rgb_pixels, int &width, int &height, int patch_size, const std::string &pad)
     {
-        // magick -depth 8 demo.jpeg -resize 100x100 rgb:"aaa.raw"
         rgb_pixels.clear();
         width  = -1;
         height = -1;
-        image_dimension(fn, width, height);
-        if (width <= 0) return;
 
-        std::ostringstream oss;
-        oss << MAGICK_CONVERT_CMD << " -depth 8 \"" << std::string(fn) << "\"";
+        Image image;
+        if (!image_read(fn, image)) return;
+        width  = image.width;
+        height = image.height;
 
         if (params.do_resize)
         {
@@ -671,7 +961,7 @@ namespace vision
             }
         }
 
-        oss << " -resize \"" << width << "x" << height << ">\"";
+        image_shrink_to_fit(image, image, width, height);
 
         int aligned_width  = 0;
         int aligned_height = 0;
@@ -700,9 +990,7 @@ namespace vision
             aligned_width  = width;
             aligned_height = height;
 
-            oss << " -compose Copy -gravity northwest";
-            oss << " -background " << (pad != PaddingMode::No ? pad : "white");
-            oss << " -extent " << aligned_width << "x" << aligned_height;
+            image_extent(image, image, aligned_width, aligned_height, pad != PaddingMode::No ? pad : PaddingMode::White);
         }
         else if (pad != PaddingMode::No)
         {
@@ -711,9 +999,7 @@ namespace vision
 
             apply_max_patch_num();
 
-            oss << " -compose Copy -gravity northwest";
-            oss << " -background " << pad;
-            oss << " -extent " << aligned_width << "x" << aligned_height;
+            image_extent(image, image, aligned_width, aligned_height, pad);
         }
         else
         {
@@ -722,10 +1008,10 @@ namespace vision
 
             apply_max_patch_num();
 
-            oss << " -crop " << aligned_width << "x" << aligned_height << "+" << (width - aligned_width) / 2 << "+" << (height - aligned_height) / 2;
+            image_crop(image, image, (width - aligned_width) / 2, (height - aligned_height) / 2, aligned_width, aligned_height);
         }
 
-        run_cmd(oss, rgb_pixels);
+        rgb_pixels = std::move(image.pixels);
 
         width  = aligned_width;
         height = aligned_height;
@@ -750,17 +1036,15 @@ namespace vision
         }
     }
 
-    void image_arrange(const std::vector<float> &rgb_pixels, const int width, const int patch_size,
-        std::vector<float> &arranged, const PatchesFormat fmt)
+    // `pixel(pixel_id, c)` gives value of channel `c` of a pixel. returns number of values written to `arranged`.
+    template <class Pixel> static int64_t arrange(const int width, const int height, const int patch_size,
+        float *arranged, const PatchesFormat fmt, Pixel pixel)
     {
-        const size_t pixels_num = rgb_pixels.size() / 3;
-        const int height = (int)(pixels_num / width);
-        arranged.resize(rgb_pixels.size(), 0);
+        int64_t idx = 0;
         switch (fmt)
         {
         case PatchesFormat::PatchesLeftRightDown_ChannelsRGB_PixelsLeftRightDown:
             {
-                int64_t idx = 0;
                 for (int i = 0; i < height - patch_size + 1; i += patch_size)
                 {
                     for (int j = 0; j < width - patch_size + 1; j += patch_size)
@@ -772,7 +1056,7 @@ namespace vision
                                 for (int l = 0; l < patch_size; l++)
                                 {
                                     int pixel_id = (i + k) * width + (j + l);
-                                    arranged[idx++] = rgb_pixels[pixel_id * 3 + c];
+                                    arranged[idx++] = pixel(pixel_id, c);
                                 }
                             }
                         }
@@ -783,7 +1067,6 @@ namespace vision
         case PatchesFormat::PatchesLeftRightDown_MergeN_ChannelsRGB_PixelsLeftRightDown:
             {
                 CHATLLM_CHECK((params.merge_kernel_size[0] > 1) || (params.merge_kernel_size[1] > 1));
-                int64_t idx = 0;
                 for (int i = 0; i <= height - patch_size * params.merge_kernel_size[1]; i += patch_size * params.merge_kernel_size[1])
                 {
                     for (int j = 0; j <= width - patch_size * params.merge_kernel_size[0]; j += patch_size * params.merge_kernel_size[0])
@@ -801,7 +1084,7 @@ namespace vision
                                         for (int l = 0; l < patch_size; l++)
                                         {
                                             int pixel_id = (i_m + k) * width + (j_m + l);
-                                            arranged[idx++] = rgb_pixels[pixel_id * 3 + c];
+                                            arranged[idx++] = pixel(pixel_id, c);
                                         }
                                     }
                                 }
@@ -814,7 +1097,6 @@ namespace vision
         case PatchesFormat::PatchesLeftRightDown_MergeN_PixelsLeftRightDown_ChannelsRGB:
             {
                 CHATLLM_CHECK((params.merge_kernel_size[0] > 1) || (params.merge_kernel_size[1] > 1));
-                int64_t idx = 0;
                 for (int i = 0; i <= height - patch_size * params.merge_kernel_size[1]; i += patch_size * params.merge_kernel_size[1])
                 {
                     for (int j = 0; j <= width - patch_size * params.merge_kernel_size[0]; j += patch_size * params.merge_kernel_size[0])
@@ -833,7 +1115,7 @@ namespace vision
                                         for (int c = 0; c < 3; c++)
                                         {
                                             int pixel_id = (i_m + k) * width + (j_m + l);
-                                            arranged[idx++] = rgb_pixels[pixel_id * 3 + c];
+                                            arranged[idx++] = pixel(pixel_id, c);
                                         }
                                     }
                                 }
@@ -845,7 +1127,6 @@ namespace vision
             break;
         case PatchesLeftRightDown_PixelsLeftRightDown_ChannelsRGB:
             {
-                int64_t idx = 0;
                 for (int i = 0; i < height - patch_size + 1; i += patch_size)
                 {
                     for (int j = 0; j < width - patch_size + 1; j += patch_size)
@@ -858,7 +1139,7 @@ namespace vision
 
                                 for (int c = 0; c < 3; c++)
                                 {
-                                    arranged[idx++] = rgb_pixels[pixel_id * 3 + c];
+                                    arranged[idx++] = pixel(pixel_id, c);
                                 }
                             }
                         }
@@ -868,7 +1149,6 @@ namespace vision
             break;
         case ChannelsRGB_PatchesLeftRightDown_PixelsLeftRightDown:
             {
-                int64_t idx = 0;
                 for (int c = 0; c < 3; c++)
                 {
                     for (int i = 0; i < height - patch_size + 1; i += patch_size)
@@ -880,7 +1160,7 @@ namespace vision
                                 for (int l = 0; l < patch_size; l++)
                                 {
                                     const int pixel_id = (i + k) * width + (j + l);
-                                    arranged[idx++] = rgb_pixels[pixel_id * 3 + c];
+                                    arranged[idx++] = pixel(pixel_id, c);
                                 }
                             }
                         }
@@ -890,7 +1170,6 @@ namespace vision
             break;
         case ChannelsRGB_PixelsLeftRightDown:
             {
-                int64_t idx = 0;
                 for (int c = 0; c < 3; c++)
                 {
                     for (int i = 0; i < height; i++)
@@ -898,7 +1177,7 @@ namespace vision
                         for (int j = 0; j < width; j++)
                         {
                             const int pixel_id = i * width + j;
-                            arranged[idx++] = rgb_pixels[pixel_id * 3 + c];
+                            arranged[idx++] = pixel(pixel_id, c);
                         }
                     }
                 }
@@ -907,6 +1186,69 @@ namespace vision
         default:
             throw new std::invalid_argument("invalid format");
         }
+        return idx;
+    }
+
+    void image_arrange(const std::vector<float> &rgb_pixels, const int width, const int patch_size,
+        std::vector<float> &arranged, const PatchesFormat fmt)
+    {
+        const int height = (int)(rgb_pixels.size() / 3 / width);
+        arranged.resize(rgb_pixels.size(), 0);
+        arrange(width, height, patch_size, arranged.data(), fmt,
+            [&rgb_pixels](int64_t pixel_id, int c) { return rgb_pixels[pixel_id * 3 + c]; });
+    }
+
+    void image_to_patches(const image_pixels_t &rgb_pixels, const int width, const int patch_size,
+        const float *mean, const float *std_d, float *arranged, const PatchesFormat fmt, float scale_factor)
+    {
+        // all possible values of each channel, computed just like `image_rescale` + `image_normalize`
+        float lut[3][256];
+        for (int c = 0; c < 3; c++)
+            for (int i = 0; i < 256; i++)
+                lut[c][i] = (scale_factor * i - mean[c]) / std_d[c];
+
+        const int height = (int)(rgb_pixels.size() / 3 / width);
+        const uint8_t *pixels = rgb_pixels.data();
+        const int64_t n = arrange(width, height, patch_size, arranged, fmt,
+            [pixels, &lut](int64_t pixel_id, int c) { return lut[c][pixels[pixel_id * 3 + c]]; });
+        std::fill(arranged + n, arranged + rgb_pixels.size(), 0.0f);
+    }
+
+    void image_to_patches(const image_pixels_t &rgb_pixels, const int width, const int patch_size,
+        const float *mean, const float *std_d, std::vector<float> &arranged, const PatchesFormat fmt, float scale_factor)
+    {
+        arranged.resize(rgb_pixels.size());
+        image_to_patches(rgb_pixels, width, patch_size, mean, std_d, arranged.data(), fmt, scale_factor);
+    }
+
+    // a binary PPM (P6) image, as written by `ffmpeg -c:v ppm`
+    static bool read_ppm(FILE *pp, Image &image)
+    {
+        int fields[3] = {0};
+        int c = fgetc(pp);
+        if ((c != 'P') || (fgetc(pp) != '6')) return false;
+
+        for (int i = 0; i < 3; i++)
+        {
+            c = fgetc(pp);
+            while ((c == '#') || isspace(c))
+            {
+                if (c == '#')
+                    while ((c != EOF) && (c != '\n')) c = fgetc(pp);
+                c = fgetc(pp);
+            }
+            for (; isdigit(c); c = fgetc(pp))
+                fields[i] = fields[i] * 10 + (c - '0');
+            if (c == EOF) return false;
+        }
+
+        // a single whitespace has been consumed after `maxval`
+        if ((fields[0] <= 0) || (fields[1] <= 0) || (fields[2] != 255)) return false;
+
+        image.width  = fields[0];
+        image.height = fields[1];
+        image.pixels.resize((size_t)image.width * image.height * 3);
+        return fread(image.pixels.data(), 1, image.pixels.size(), pp) == image.pixels.size();
     }
 
     VideoLoader::VideoLoader(const char *fn, float fps, const int max_frames, const int resize_width, const int resize_height)
@@ -914,37 +1256,75 @@ namespace vision
         if (!fs::exists(fn))
             return;
 
-        tmp_dir = utils::tmpname();
-        fs::create_directories(tmp_dir);
-
+        // frames are decoded & sampled by a single `ffmpeg` process, and piped in as PPM images
         char cmd[1024];
-        if ((resize_height <= 0) || (resize_height <= 0))
+        if ((resize_width <= 0) || (resize_height <= 0))
         {
-            sprintf(cmd, "ffmpeg -loglevel error -i \"%s\" -vf \"fps=%f\" -frames:v %d \"%s\"",
-                fn, fps, max_frames, (fs::path(tmp_dir) / "%04d.jpg").string().c_str());
+            snprintf(cmd, sizeof(cmd), "ffmpeg -loglevel error -i \"%s\" -vf \"fps=%f\" -frames:v %d -f image2pipe -c:v ppm -",
+                fn, fps, max_frames);
         }
         else
         {
-            sprintf(cmd, "ffmpeg -loglevel error -i \"%s\" -vf \"scale=w=%d:h=%d:force_original_aspect_ratio=1,pad=%d:%d:(ow-iw)/2:(oh-ih)/2,fps=%f\" -frames:v %d \"%s\"",
+            snprintf(cmd, sizeof(cmd), "ffmpeg -loglevel error -i \"%s\" -vf \"scale=w=%d:h=%d:force_original_aspect_ratio=1,pad=%d:%d:(ow-iw)/2:(oh-ih)/2,fps=%f\" -frames:v %d -f image2pipe -c:v ppm -",
                 fn, resize_width, resize_height, resize_width, resize_height,
-                fps, max_frames, (fs::path(tmp_dir) / "%04d.jpg").string().c_str());
+                fps, max_frames);
         }
 
-        (void)std::system(cmd);
+        FILE *pp = popen(cmd, POPEN_MODE_READ);
+        if (nullptr == pp) return;
+
+        tmp_dir = utils::tmpname();
 
-        for (const auto &entry : fs::directory_iterator(tmp_dir))
+        size_t resident = 0;
+        while ((int)frames.size() < max_frames)
         {
-            if (entry.path().extension() == ".jpg") {
-                frames.push_back(entry.path().string());
+            auto frame = std::make_shared<Image>();
+            if (!read_ppm(pp, *frame)) break;
+
+            char name[16];
+            snprintf(name, sizeof(name), "%04d.ppm", (int)frames.size() + 1);
+            const std::string path = (fs::path(tmp_dir) / name).string();
+
+            if (resident + frame->pixels.size() <= MAX_RESIDENT_BYTES)
+            {
+                resident += frame->pixels.size();
+                std::lock_guard<std::mutex> lock(mem_images_mutex);
+                mem_images[path] = frame;
             }
+            else if (!write_ppm(path, *frame))
+                break;
+
+            frames.push_back(path);
         }
 
-        std::sort(frames.begin(), frames.end());
+        pclose(pp);
+    }
+
+    bool VideoLoader::write_ppm(const std::string &path, const Image &image)
+    {
+        std::error_code ec;
+        fs::create_directories(tmp_dir, ec);
+
+        std::ofstream f(path, std::ios::binary);
+        f << "P6\n" << image.width << " " << image.height << "\n255\n";
+        f.write((const char *)image.pixels.data(), image.pixels.size());
+        f.close();
+        return !f.fail();
     }
 
     VideoLoader::~VideoLoader()
     {
-        fs::remove_all(tmp_dir);
+        {
+            std::lock_guard<std::mutex> lock(mem_images_mutex);
+            for (const auto &frame : frames)
+                mem_images.erase(frame);
+        }
+
+        if (tmp_dir.size() > 0)
+        {
+            std::error_code ec;
+            fs::remove_all(tmp_dir, ec);
+        }
     }
 
     static void print_data(const std::vector<float> &pixels, const int group_size = 10, int max_elem = 100)
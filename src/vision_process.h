@@ -104,6 +104,21 @@ namespace vision
         static bool PreScale(int &width, int &height);
     };
 
+    enum ResampleFilter
+    {
+        Auto,       // like `magick -resize`: Lanczos (3 lobes) when shrinking, Mitchell when enlarging
+        Bicubic,    // like PIL
+        Bilinear,
+    };
+
+    // filter used when resizing images (default: Auto)
+    class Resample
+    {
+    public:
+        Resample(ResampleFilter filter);
+        ~Resample();
+    };
+
     enum PanScanDir
     {
         Horizontal,
@@ -134,14 +149,29 @@ namespace vision
     void image_rescale(const std::vector<uint8_t> &rgb_pixels, std::vector<float> &scaled_rgb_pixels, float scale_factor = 1/255.0f);
     void image_normalize(std::vector<float> &rgb_pixels, const float *mean, const float *std_d);
 
+    // `image_rescale`, `image_normalize` and `image_arrange` fused into a single pass.
+    // `arranged` shall have room for `rgb_pixels.size()` floats.
+    void image_to_patches(const image_pixels_t &rgb_pixels, const int width, const int patch_size,
+        const float *mean, const float *std_d, float *arranged, const PatchesFormat fmt, float scale_factor = 1/255.0f);
+    void image_to_patches(const image_pixels_t &rgb_pixels, const int width, const int patch_size,
+        const float *mean, const float *std_d, std::vector<float> &arranged, const PatchesFormat fmt, float scale_factor = 1/255.0f);
+
+    struct Image;
+
+    // sample frames of a video with `ffmpeg`. `frames` are paths in a private directory of the loader, which can be used
+    // by image functions (`image_load`, etc) during the lifetime of the loader.
+    // frames are kept in memory up to `MAX_RESIDENT_BYTES`, and the rest are written to the directory.
     class VideoLoader
     {
     public:
         VideoLoader(const char *fn, float fps = 1.0f, const int max_frames = 10, const int resize_width = -1, const int resize_height = -1);
         ~VideoLoader();
+
+        static const size_t MAX_RESIDENT_BYTES = 256 * 1024 * 1024;
     public:
         std::vector<std::string> frames;
     private:
+        bool write_ppm(const std::string &path, const Image &image);
         std::string tmp_dir;
     };
 
@@ -0,0 +1,113 @@
+// Micro-benchmark of pre-tokenizer splitting: hand-written splitters vs std::regex,
+// on patterns that std::regex can parse. Outputs of both are also compared.
+//
+// usage: bench-pretokenize [-n iterations] [text files ...]
+
+#include "unicode.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+static const char *builtin_text =
+    "The quick brown fox jumps over the lazy dog. It's 2024, and we've got 1234567 reasons to test.\n"
+    "  Indentation matters;\tso do tabs.\n\n"
+    "int main(int argc, char **argv) { return argc > 1 ? 0 : -1; }\n"
+    "Numbers: 3.14159, 2.71828, 1e-9, 0x7fffffff, 12,345,678.\n"
+    "Unicode: 你好，世界！ こんにちは 안녕하세요 Привет мир ÀÉÎÕÜ ñ ß 😀👍🏽 ∑∫√\n"
+    "URLs like https://example.com/path?query=1&b=2 and emails a.b@c.de.\n"
+    "I'll, you'd, they're, she's, we'll, I'm, it'd.\n";
+
+struct Pattern
+{
+    const char *name;
+    std::vector<std::string> regex_exprs;
+};
+
+static std::string random_text(std::mt19937 &rng, size_t len)
+{
+    static const char *pieces[] = {
+        " ", "  ", "\n", "\t", "a", "e", "th", "ing", "The", "0", "7", "42", "1000", ".", ",", "'s", "'LL", "!", "?",
+        "你", "好", "世界", "é", "ß", "Ж", "ω", "😀", "∑", "\r\n", "-", "_", "(", ")", "=", "==",
+    };
+    std::uniform_int_distribution<size_t> pick(0, sizeof(pieces) / sizeof(pieces[0]) - 1);
+    std::string s;
+    while (s.size() < len)
+        s += pieces[pick(rng)];
+    return s;
+}
+
+template <class F> static double measure(int iterations, F f)
+{
+    auto t0 = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++)
+        f();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count() / iterations;
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = 3;
+    std::string text;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if ((strcmp(argv[i], "-n") == 0) && (i + 1 < argc))
+        {
+            iterations = std::max(1, atoi(argv[++i]));
+            continue;
+        }
+
+        std::ifstream f(argv[i], std::ios::binary);
+        if (!f) continue;
+        std::stringstream ss;
+        ss << f.rdbuf();
+        text += ss.str();
+    }
+
+    std::mt19937 rng(42);
+    text += builtin_text;
+    text += random_text(rng, 20000);
+
+    const std::vector<Pattern> patterns = {
+        { "gpt2", {
+            "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)",
+        } },
+        { "llama3", {
+            "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
+        } },
+        { "qwen2", {
+            "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
+        } },
+        { "digits", {
+            "\\p{N}{1,3}",
+        } },
+    };
+
+    printf("%zu bytes, %d iteration(s)\n", text.size(), iterations);
+    printf("%-8s %10s %10s %8s %s\n", "pattern", "std::regex", "custom", "speedup", "output");
+
+    int failed = 0;
+    for (auto &p : patterns)
+    {
+        std::vector<std::string> words_regex;
+        std::vector<std::string> words_custom;
+
+        const double t_regex  = measure(iterations, [&]() { words_regex  = unicode_regex_split(text, p.regex_exprs, false); });
+        const double t_custom = measure(iterations, [&]() { words_custom = unicode_regex_split(text, p.regex_exprs, true); });
+
+        const bool same = words_regex == words_custom;
+        if (!same) failed++;
+
+        printf("%-8s %9.2fms %9.2fms %7.1fx %s\n", p.name, t_regex * 1000, t_custom * 1000, t_regex / t_custom,
+               same ? "same" : "DIFFERENT");
+    }
+
+    return failed > 0 ? 1 : 0;
+}
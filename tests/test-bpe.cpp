@@ -0,0 +1,418 @@
+// Differential test of BPE encoding: `BPEProcessor2` (id-keyed merge table + word cache) against
+// the previous string-keyed implementation, on a synthetic byte-level vocab.
+//
+// usage: test-bpe [text files ...]
+//   text files (e.g. docs/*.md) are used both for learning merges and as test input.
+
+#include "tokenizer.h"
+#include "unicode.h"
+
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <queue>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+
+using namespace tokenizer;
+
+static const char *builtin_text =
+    "The quick brown fox jumps over the lazy dog. It's 2024, and we've got 1234567 reasons to test.\n"
+    "  Indentation matters;\tso do tabs.\n\n"
+    "int main(int argc, char **argv) { return argc > 1 ? 0 : -1; }\n"
+    "Numbers: 3.14159, 2.71828, 1e-9, 0x7fffffff, 12,345,678.\n"
+    "Unicode: 你好，世界！ こんにちは 안녕하세요 Привет мир ÀÉÎÕÜ ñ ß 😀👍🏽 ∑∫√\n"
+    "URLs like https://example.com/path?query=1&b=2 and emails a.b@c.de.\n"
+    "I'll, you'd, they're, she's, we'll, I'm, it'd.\n";
+
+class MemReader : public DataReader
+{
+public:
+    MemReader(const std::string &data) : data(data), pos(0) { _size = (int64_t)data.size(); }
+
+    int64_t tell() override { return pos; }
+
+    void seek(int64_t offset, int whence) override
+    {
+        if (whence == SEEK_SET)
+            pos = offset;
+        else if (whence == SEEK_CUR)
+            pos += offset;
+        else
+            pos = _size + offset;
+    }
+
+    size_t read_buffer(void *output, size_t len) override
+    {
+        if (pos + (int64_t)len > _size) len = (size_t)(_size - pos);
+        memcpy(output, data.data() + pos, len);
+        pos += len;
+        return len;
+    }
+
+private:
+    const std::string &data;
+    int64_t pos;
+};
+
+typedef std::map<std::pair<std::string, std::string>, int> rank_map;
+
+// the previous implementation: merges are looked up by strings, bigrams are validated by text
+class ReferenceBPE
+{
+public:
+    ReferenceBPE(const std::unordered_map<std::string, int> &token_to_id, const rank_map &ranks)
+        : token_to_id(token_to_id), ranks(ranks)
+    {}
+
+    void tokenize(const std::string &word, std::vector<int> &output)
+    {
+        struct symbol
+        {
+            int prev;
+            int next;
+            const char *text;
+            size_t n;
+        };
+
+        struct bigram
+        {
+            int left;
+            int right;
+            std::string text;
+            int rank;
+        };
+
+        struct comparator
+        {
+            bool operator()(const bigram &l, const bigram &r) const
+            {
+                return l.rank > r.rank || (l.rank == r.rank && l.left > r.left);
+            }
+        };
+
+        std::vector<symbol> symbols;
+        std::priority_queue<bigram, std::vector<bigram>, comparator> work_queue;
+
+        auto add_new_bigram = [&](int left, int right) {
+            if (left == -1 || right == -1) return;
+            std::string left_token  = std::string(symbols[left].text,  symbols[left].n);
+            std::string right_token = std::string(symbols[right].text, symbols[right].n);
+            auto it = ranks.find(std::make_pair(left_token, right_token));
+            if (it == ranks.end()) return;
+            work_queue.push(bigram{left, right, left_token + right_token, it->second});
+        };
+
+        size_t offset = 0;
+        int index = 0;
+        while (offset < word.size())
+        {
+            size_t char_len = std::min(word.size() - offset, (size_t)utf8_len(word[offset]));
+            symbol sym;
+            sym.text = word.c_str() + offset;
+            sym.n = char_len;
+            offset += char_len;
+            sym.prev = index - 1;
+            sym.next = offset == word.size() ? -1 : index + 1;
+            index++;
+            symbols.push_back(sym);
+        }
+        for (int i = 1; i < (int)symbols.size(); i++)
+            add_new_bigram(i - 1, i);
+
+        while (!work_queue.empty())
+        {
+            auto top = work_queue.top();
+            work_queue.pop();
+
+            auto &left_symbol  = symbols[top.left];
+            auto &right_symbol = symbols[top.right];
+            if (left_symbol.n == 0 || right_symbol.n == 0) continue;
+            if (std::string(left_symbol.text, left_symbol.n) + std::string(right_symbol.text, right_symbol.n) != top.text) continue;
+
+            left_symbol.n += right_symbol.n;
+            right_symbol.n = 0;
+            left_symbol.next = right_symbol.next;
+            if (right_symbol.next >= 0)
+                symbols[right_symbol.next].prev = top.left;
+
+            add_new_bigram(left_symbol.prev, top.left);
+            add_new_bigram(top.left, left_symbol.next);
+        }
+
+        for (auto &sym : symbols)
+        {
+            if (sym.n == 0) continue;
+            const std::string str(sym.text, sym.n);
+            auto it = token_to_id.find(str);
+            if (it != token_to_id.end())
+            {
+                output.push_back(it->second);
+                continue;
+            }
+            for (char c : str)
+                output.push_back(token_to_id.at(std::string(1, c)));
+        }
+    }
+
+    std::vector<int> encode(const std::string &text, const std::vector<std::string> &regex_exprs)
+    {
+        std::vector<int> ids;
+        for (auto &word : unicode_regex_split(text, regex_exprs))
+            tokenize(unicode_byte_encoding_process(word), ids);
+        return ids;
+    }
+
+private:
+    static size_t utf8_len(char src)
+    {
+        const size_t lookup[] = { 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 3, 4 };
+        uint8_t highbits = static_cast<uint8_t>(src) >> 4;
+        return lookup[highbits];
+    }
+
+    const std::unordered_map<std::string, int> &token_to_id;
+    const rank_map &ranks;
+};
+
+// a byte-level vocab, with merges learned from `corpus`
+struct SyntheticVocab
+{
+    std::vector<std::string> tokens;
+    std::vector<std::pair<std::string, std::string>> merges;
+
+    void learn(const std::string &corpus, const std::vector<std::string> &regex_exprs, int n_merges)
+    {
+        for (int b = 0; b < 256; b++)
+            tokens.push_back(unicode_byte_to_utf8((uint8_t)b));
+
+        std::map<std::string, int> word_freq;
+        for (auto &w : unicode_regex_split(corpus, regex_exprs))
+            word_freq[unicode_byte_encoding_process(w)]++;
+
+        std::vector<std::pair<std::vector<std::string>, int>> words;
+        for (auto &wf : word_freq)
+        {
+            std::vector<std::string> syms;
+            for (size_t i = 0; i < wf.first.size(); )
+            {
+                size_t n = 1;
+                const uint8_t c = (uint8_t)wf.first[i];
+                if (c >= 0xF0) n = 4; else if (c >= 0xE0) n = 3; else if (c >= 0xC0) n = 2;
+                syms.push_back(wf.first.substr(i, n));
+                i += n;
+            }
+            words.emplace_back(syms, wf.second);
+        }
+
+        for (int m = 0; m < n_merges; m++)
+        {
+            std::map<std::pair<std::string, std::string>, int> pair_freq;
+            for (auto &w : words)
+                for (size_t i = 0; i + 1 < w.first.size(); i++)
+                    pair_freq[std::make_pair(w.first[i], w.first[i + 1])] += w.second;
+            if (pair_freq.empty()) break;
+
+            auto best = pair_freq.begin();
+            for (auto it = pair_freq.begin(); it != pair_freq.end(); ++it)
+                if (it->second > best->second) best = it;
+
+            const auto merge = best->first;
+            const std::string merged = merge.first + merge.second;
+            merges.push_back(merge);
+            tokens.push_back(merged);
+
+            for (auto &w : words)
+            {
+                auto &s = w.first;
+                for (size_t i = 0; i + 1 < s.size(); i++)
+                {
+                    if ((s[i] == merge.first) && (s[i + 1] == merge.second))
+                    {
+                        s[i] = merged;
+                        s.erase(s.begin() + i + 1);
+                    }
+                }
+            }
+        }
+    }
+
+    // model file layout of the vocab: tokens then merges, each list terminated by -1
+    std::string serialize(void) const
+    {
+        std::string r;
+        auto put_i32 = [&r](int32_t v) { r.append((const char *)&v, sizeof(v)); };
+        for (auto &t : tokens)
+        {
+            put_i32((int32_t)t.size());
+            r += t;
+            r.push_back((char)token_type::NORMAL);
+        }
+        put_i32(-1);
+        for (auto &m : merges)
+        {
+            const std::string s = m.first + " " + m.second;
+            put_i32((int32_t)s.size());
+            r += s;
+        }
+        put_i32(-1);
+        return r;
+    }
+};
+
+static std::string random_text(std::mt19937 &rng, size_t len)
+{
+    static const char *pieces[] = {
+        " ", "  ", "\n", "\t", "a", "e", "th", "ing", "The", "0", "7", "42", "1000", ".", ",", "'s", "'ll", "!", "?",
+        "你", "好", "世界", "é", "ß", "Ж", "ω", "😀", "🏽", "∑", "\r\n", "-", "_", "(", ")", "{", "}", "=", "==",
+    };
+    std::uniform_int_distribution<size_t> pick(0, sizeof(pieces) / sizeof(pieces[0]) - 1);
+    std::string s;
+    while (s.size() < len)
+        s += pieces[pick(rng)];
+    return s;
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point t0)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+}
+
+static int run(const char *name, BPEProcessor2 &proc, const std::vector<std::string> &regex_exprs,
+               const std::string &corpus, const std::vector<std::string> &inputs)
+{
+    SyntheticVocab synth;
+    synth.learn(corpus, regex_exprs, 1000);
+
+    // drop some merged tokens, so that a few merges can't be keyed by ids.
+    // only printable ASCII ones are dropped, so that they can fall back to single byte tokens.
+    auto is_printable = [](const std::string &t) {
+        for (char c : t)
+            if ((c < '!') || (c > '~')) return false;
+        return true;
+    };
+    std::vector<std::string> kept;
+    for (size_t i = 0; i < synth.tokens.size(); i++)
+        if ((i < 256) || (i % 7 != 0) || !is_printable(synth.tokens[i])) kept.push_back(synth.tokens[i]);
+    synth.tokens = kept;
+
+    const std::string data = synth.serialize();
+    MemReader reader(data);
+    proc.Load(&reader, (int)synth.tokens.size());
+
+    std::unordered_map<std::string, int> token_to_id;
+    for (size_t i = 0; i < synth.tokens.size(); i++)
+        token_to_id.emplace(synth.tokens[i], (int)i);
+    rank_map ranks;
+    for (size_t i = 0; i < synth.merges.size(); i++)
+        ranks.emplace(synth.merges[i], (int)i);
+    ReferenceBPE reference(token_to_id, ranks);
+
+    int failed = 0;
+    double t_ref = 0, t_new = 0;
+    for (int round = 0; round < 2; round++)     // the 2nd round hits the word cache
+    {
+        for (size_t i = 0; i < inputs.size(); i++)
+        {
+            auto t0 = std::chrono::steady_clock::now();
+            auto expected = reference.encode(inputs[i], regex_exprs);
+            t_ref += seconds_since(t0);
+
+            std::vector<int> ids;
+            t0 = std::chrono::steady_clock::now();
+            proc.Encode(inputs[i], &ids);
+            t_new += seconds_since(t0);
+
+            if (ids != expected)
+            {
+                printf("%s: input #%zu (round %d) MISMATCH: %zu vs %zu ids\n", name, i, round, ids.size(), expected.size());
+                failed++;
+            }
+        }
+    }
+
+    // a slow consumer (e.g. prefilling) holds back all encoding threads but one, chunks still come in order
+    for (size_t i = 0; i < inputs.size(); i++)
+    {
+        if (inputs[i].size() < 100000) continue;
+
+        std::vector<int> ids;
+        std::vector<int> streamed;
+        proc.Encode(inputs[i], &ids);
+        proc.EncodeStream(inputs[i], [&streamed](const std::vector<int> &chunk) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+            streamed.insert(streamed.end(), chunk.begin(), chunk.end());
+        });
+        if (streamed != ids)
+        {
+            printf("%s: input #%zu streamed to a slow consumer MISMATCH: %zu vs %zu ids\n", name, i, streamed.size(), ids.size());
+            failed++;
+        }
+    }
+
+    printf("%s: %zu merges, %zu inputs, reference %.3fs, new %.3fs, %s\n", name, synth.merges.size(), inputs.size(),
+           t_ref, t_new, failed ? "FAILED" : "OK");
+    return failed;
+}
+
+int main(int argc, char **argv)
+{
+    std::string corpus = builtin_text;
+    std::vector<std::string> inputs = { "", " ", "a", builtin_text };
+
+    for (int i = 1; i < argc; i++)
+    {
+        std::ifstream f(argv[i], std::ios::binary);
+        if (!f) continue;
+        std::stringstream ss;
+        ss << f.rdbuf();
+        corpus += ss.str();
+        inputs.push_back(ss.str());
+    }
+
+    // long enough to be split into chunks encoded by several threads
+    std::string large;
+    while (large.size() < 200000)
+        large += corpus;
+    inputs.push_back(large);
+
+    std::mt19937 rng(42);
+    for (int i = 0; i < 200; i++)
+        inputs.push_back(random_text(rng, 1 + i * 5));
+
+    int failed = 0;
+
+    {
+        BPEProcessor2 proc;
+        failed += run("gpt2-split", proc, {
+            "[\\p{P}\\$\\+<=>\\^~\\|]+",
+            "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)",
+            "\\p{N}+",
+            "[0-9][0-9][0-9]",
+        }, corpus, inputs);
+    }
+
+    {
+        std::vector<std::string> regex_exprs = {
+            "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
+        };
+        BPEProcessor2 proc(regex_exprs);
+        failed += run("qwen2", proc, regex_exprs, corpus, inputs);
+    }
+
+    {
+        std::vector<std::string> regex_exprs = {
+            "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
+        };
+        BPEProcessor2 proc(regex_exprs);
+        proc.SetEncodeThreads(3);
+        failed += run("llama3 (3 threads)", proc, regex_exprs, corpus, inputs);
+    }
+
+    return failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,173 @@
+// Tests of `CausalConv1D`, as used by short convolutions of hybrid models:
+//
+// * a sequence in one call matches a reference computed on the host (zeros before the first step);
+// * the same sequence split over several calls (`n_past > 0` continues from the state) gives the same outputs;
+// * `n_past == 0` starts a new sequence, whatever the state holds;
+// * the state saved by `read_cache_data` and restored by `write_cache_data` continues the saved sequence.
+//
+// all cases use a batch of 1: neither `ggml::conv_1d` nor `ggml::conv_1d_depthwise` keeps batches apart.
+//
+// usage: test-causal-conv1d
+
+#include "test-common.h"
+
+using namespace chatllm;
+using namespace chatllm::test;
+
+struct Case
+{
+    int channels;
+    int kernel_size;
+    int dilation;
+    int groups;     // 1 or `channels` (depthwise)
+    int batch;
+    std::vector<int> splits;
+};
+
+class TestConv
+{
+public:
+    TestConv(BackendContext *backend_context, const Case &c, std::mt19937 &rng)
+        : init(backend_context)
+    {
+        // convolutions go through an F16 `im2col`, which takes F16 weights
+        init.dtype = ggml::type::GGML_TYPE_F16;
+        init.gctx = GGMLContext({.mem_size = 8 * ggml_tensor_overhead(), .mem_buffer = nullptr, .no_alloc = true});
+        init.move_to_layer(0);
+        conv.reset(new CausalConv1D(&init, c.channels, c.channels, c.kernel_size, c.dilation, c.groups, true, c.batch));
+
+        weight = random_vector(rng, ggml::nelements(conv->weight));
+        bias   = random_vector(rng, ggml::nelements(conv->bias));
+        for (auto t : {conv->weight, conv->bias})
+            CHATLLM_CHECK(init.get_allocator()->alloc(t)) << "failed to allocate tensor";
+        std::vector<ggml_fp16_t> w16(weight.size());
+        for (size_t i = 0; i < weight.size(); i++)
+        {
+            w16[i]    = ggml_fp32_to_fp16(weight[i]);
+            weight[i] = ggml_fp16_to_fp32(w16[i]);
+        }
+        Backend::write_tensor_data(conv->weight, w16.data());
+        Backend::write_tensor_data(conv->bias, bias.data());
+
+        conv->set_cache_buffer(init.get_allocator()->alloc(conv->get_cache_size(), BackendBufAllocator::Usage::Matrix));
+    }
+
+    // x: [len, channels, batch] -> [len, channels, batch]
+    std::vector<float> forward(BackendContext *backend_context, const Case &c, const std::vector<float> &x, int len, int n_past)
+    {
+        TestContext ctx(backend_context);
+        auto input = ggml::new_tensor_3d(&ctx, ggml::type::GGML_TYPE_F32, len, c.channels, c.batch);
+        ctx.move_to_layer(0);
+        auto r = conv->forward(&ctx, input, n_past);
+        ctx.build(r);
+        ctx.set_input(input, x.data());
+        ctx.compute();
+        return ctx.get_output(r);
+    }
+
+public:
+    InitContext init;
+    std::unique_ptr<CausalConv1D> conv;
+    std::vector<float> weight;
+    std::vector<float> bias;
+};
+
+// out[t, o, b] = bias[o] + sum_{k, i} w[k, i, o] * x[t - history + k * dilation, i, b], zeros before t = 0
+static std::vector<float> reference(const Case &c, const TestConv &conv, const std::vector<float> &x, int len)
+{
+    const int history = (c.kernel_size - 1) * c.dilation;
+    const int in_per_group = c.groups == 1 ? c.channels : 1;
+    std::vector<float> r((size_t)len * c.channels * c.batch);
+    for (int b = 0; b < c.batch; b++)
+        for (int o = 0; o < c.channels; o++)
+            for (int t = 0; t < len; t++)
+            {
+                float s = conv.bias[o];
+                for (int k = 0; k < c.kernel_size; k++)
+                {
+                    const int src = t - history + k * c.dilation;
+                    if (src < 0) continue;
+                    for (int j = 0; j < in_per_group; j++)
+                    {
+                        const int i = c.groups == 1 ? j : o;
+                        s += conv.weight[((size_t)o * in_per_group + j) * c.kernel_size + k] * x[((size_t)b * c.channels + i) * len + src];
+                    }
+                }
+                r[((size_t)b * c.channels + o) * len + t] = s;
+            }
+    return r;
+}
+
+// time steps [start, start + n) of x: [len, channels, batch]
+static std::vector<float> slice(const Case &c, const std::vector<float> &x, int len, int start, int n)
+{
+    std::vector<float> r((size_t)n * c.channels * c.batch);
+    for (int row = 0; row < c.channels * c.batch; row++)
+        std::copy(x.begin() + (size_t)row * len + start, x.begin() + (size_t)row * len + start + n, r.begin() + (size_t)row * n);
+    return r;
+}
+
+static void test_case(BackendContext &backend_context, const Case &c, std::mt19937 &rng)
+{
+    const std::string name = format("channels=%d kernel=%d dilation=%d groups=%d batch=%d",
+                                    c.channels, c.kernel_size, c.dilation, c.groups, c.batch);
+    TestConv conv(&backend_context, c, rng);
+
+    int len = 0;
+    for (auto n : c.splits) len += n;
+
+    const auto x     = random_vector(rng, (size_t)len * c.channels * c.batch);
+    const auto other = random_vector(rng, (size_t)len * c.channels * c.batch);
+
+    // inputs are rounded to F16 by `im2col`
+    const float tolerance = 1e-2f;
+    const auto whole = conv.forward(&backend_context, c, x, len, 0);
+    check_error(max_abs_diff(whole, reference(c, conv, x, len)), tolerance, "one call vs reference:     " + name);
+
+    // split over several calls, with another sequence in between (its state saved & restored)
+    const auto other_whole = conv.forward(&backend_context, c, other, len, 0);
+
+    std::vector<float> diff_split;
+    std::vector<float> diff_reset;
+    std::vector<uint8_t> state(conv.conv->get_cache_size());
+    bool cache_io = true;
+    int n_past = 0;
+    for (auto n : c.splits)
+    {
+        const auto r = conv.forward(&backend_context, c, slice(c, x, len, n_past, n), n, n_past);
+        diff_split.push_back(max_abs_diff(r, slice(c, whole, len, n_past, n)));
+        n_past += n;
+
+        if (n_past >= len) break;
+
+        cache_io = cache_io && (conv.conv->read_cache_data(state.data(), state.size()) == state.size());
+
+        const auto r_other = conv.forward(&backend_context, c, slice(c, other, len, 0, n), n, 0);
+        diff_reset.push_back(max_abs_diff(r_other, slice(c, other_whole, len, 0, n)));
+
+        cache_io = cache_io && (conv.conv->write_cache_data(state.data(), state.size()) == state.size());
+    }
+
+    check(cache_io, "cache data read & written: " + name);
+    check_error(*std::max_element(diff_split.begin(), diff_split.end()), 1e-5f, "split vs one call:         " + name);
+    check_error(*std::max_element(diff_reset.begin(), diff_reset.end()), 1e-5f, "n_past = 0 resets:         " + name);
+}
+
+int main(int argc, char **argv)
+{
+    BackendContext backend_context;
+    backend_context.init("", 1, 4096, 1);
+
+    std::mt19937 rng(11);
+
+    const Case cases[] = {
+        {8,  4, 1, 8, 1, {5, 1, 1, 7, 2}},     // depthwise, as short convolutions
+        {6,  3, 2, 6, 1, {1, 3, 9, 4}},        // dilated, shorter calls than the history
+        {5,  3, 1, 1, 1, {4, 2, 6}},           // dense
+    };
+
+    for (const auto &c : cases)
+        test_case(backend_context, c, rng);
+
+    return result();
+}
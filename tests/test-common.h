@@ -0,0 +1,126 @@
+// Helpers shared by op tests: a compute context for graphs built by hand, comparison of outputs and reporting.
+//
+// Each test executable includes this header from exactly one translation unit.
+
+#pragma once
+
+#include "layers.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdarg>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+void log_internal(int level, const char *text)
+{
+    if (level >= GGML_LOG_LEVEL_WARN) fputs(text, stderr);
+}
+
+namespace chatllm::test
+{
+    // a graph allocated from the compute buffers of `backend_context`, inputs in the prolog layer
+    class TestContext : public ComputeContext
+    {
+    public:
+        TestContext(BackendContext *backend_context, int graph_size = 4096)
+            : ComputeContext(backend_context),
+              gctx({.mem_size = backend_context->buf_compute_meta.size(), .mem_buffer = backend_context->buf_compute_meta.data(), .no_alloc = true})
+        {
+            gf = ggml::new_graph_custom(this, graph_size, false);
+            move_to_layer(LayerAllocatorManager::MiscLayer::Prolog);
+        }
+
+        ~TestContext() { reset(); }
+
+        struct ggml_context *get_ctx() override { return gctx.get(); }
+        ggml_cgraph *get_cgraph(void) override { return gf; }
+
+        // marks `output` and allocates the graph
+        void build(ggml::tensor *output)
+        {
+            ggml::set_output(output);
+            ggml::build_forward_expand(this, output);
+            CHATLLM_CHECK(allocate()) << "failed to allocate memory";
+        }
+
+        void set_input(ggml::tensor *tensor, const void *data)
+        {
+            Backend::write_tensor_data(tensor, data);
+        }
+
+        std::vector<float> get_output(ggml::tensor *output)
+        {
+            std::vector<float> r(ggml::nelements(output));
+            Backend::read_tensor_data(output, r.data());
+            return r;
+        }
+
+    public:
+        GGMLContext gctx;
+        ggml_cgraph *gf = nullptr;
+    };
+
+    inline std::vector<float> random_vector(std::mt19937 &rng, size_t n, float stddev = 1.0f)
+    {
+        std::normal_distribution<float> dist(0.0f, stddev);
+        std::vector<float> r(n);
+        for (auto &x : r) x = dist(rng);
+        return r;
+    }
+
+    inline float max_abs_diff(const std::vector<float> &a, const std::vector<float> &b)
+    {
+        if ((a.size() != b.size()) || (a.size() < 1)) return INFINITY;
+        float r = 0.0f;
+        for (size_t i = 0; i < a.size(); i++)
+            r = std::max(r, fabsf(a[i] - b[i]));
+        return r;
+    }
+
+    // relative to `b`, but not below 1
+    inline float max_rel_diff(const std::vector<float> &a, const std::vector<float> &b)
+    {
+        if ((a.size() != b.size()) || (a.size() < 1)) return INFINITY;
+        float r = 0.0f;
+        for (size_t i = 0; i < a.size(); i++)
+            r = std::max(r, fabsf(a[i] - b[i]) / std::max(1.0f, fabsf(b[i])));
+        return r;
+    }
+
+    inline std::string format(const char *fmt, ...)
+    {
+        char buf[256];
+        va_list args;
+        va_start(args, fmt);
+        vsnprintf(buf, sizeof(buf), fmt, args);
+        va_end(args);
+        return buf;
+    }
+
+    inline int &failures(void)
+    {
+        static int n = 0;
+        return n;
+    }
+
+    inline void check(bool ok, const std::string &name)
+    {
+        printf("%-60s %s\n", name.c_str(), ok ? "ok" : "FAILED");
+        if (!ok) failures()++;
+    }
+
+    inline void check_error(float err, float tolerance, const std::string &name)
+    {
+        printf("%-60s max error %-10.3g %s\n", name.c_str(), err, err < tolerance ? "ok" : "FAILED");
+        if (!(err < tolerance)) failures()++;
+    }
+
+    // exit code of `main`
+    inline int result(void)
+    {
+        return failures() > 0 ? 1 : 0;
+    }
+}
@@ -0,0 +1,297 @@
+// Tests of the gated delta rule (`ggml::gated_delta_net`, ggml's op used by Qwen3.5) against the naive per-token recurrence:
+//   S_t = exp(g_t) S_{t-1} + k_t u_t^T,  u_t = beta_t (v_t - exp(g_t) S_{t-1}^T k_t),  o_t = S_t^T q_t / sqrt(dk)
+//
+// With `bench`, prefill throughput of the op is compared with that of full causal attention (flash attention over
+// a F16 KV cache) of the same heads, both fed by batches of `BATCH` tokens.
+//
+// usage: test-gated-delta-rule [bench [N_TOKENS [N_HEADS [HEAD_DIM [BATCH [N_THREADS]]]]]]
+
+#include "test-common.h"
+
+#include <chrono>
+
+using namespace chatllm;
+using namespace chatllm::test;
+
+struct Case
+{
+    int dk;
+    int dv;
+    int heads;
+    int qlen;
+};
+
+struct Inputs
+{
+    std::vector<float> q;       // [dk, heads, qlen]
+    std::vector<float> k;       // [dk, heads, qlen]
+    std::vector<float> v;       // [dv, heads, qlen]
+    std::vector<float> g;       // [heads, qlen]
+    std::vector<float> beta;    // [heads, qlen]
+    std::vector<float> state;   // [dv, dk, heads]
+};
+
+static void fill_normalized(std::mt19937 &rng, std::vector<float> &x, int dim)
+{
+    std::normal_distribution<float> dist;
+    for (size_t i = 0; i < x.size(); i += dim)
+    {
+        float s = 0.0f;
+        for (int j = 0; j < dim; j++)
+        {
+            x[i + j] = dist(rng);
+            s += x[i + j] * x[i + j];
+        }
+        s = 1.0f / sqrtf(s);
+        for (int j = 0; j < dim; j++)
+            x[i + j] *= s;
+    }
+}
+
+static Inputs make_inputs(const Case &c, unsigned seed)
+{
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+    std::normal_distribution<float> normal(0.0f, 0.1f);
+
+    Inputs in;
+    in.q.resize((size_t)c.dk * c.heads * c.qlen);
+    in.k.resize(in.q.size());
+    in.v.resize((size_t)c.dv * c.heads * c.qlen);
+    in.g.resize((size_t)c.heads * c.qlen);
+    in.beta.resize(in.g.size());
+    in.state.resize((size_t)c.dv * c.dk * c.heads);
+
+    fill_normalized(rng, in.q, c.dk);
+    fill_normalized(rng, in.k, c.dk);
+    for (auto &x : in.v)     x = normal(rng) * 10.0f;
+    for (auto &x : in.g)     x = logf(0.8f + 0.2f * uniform(rng));
+    for (auto &x : in.beta)  x = uniform(rng);
+    for (auto &x : in.state) x = normal(rng);
+    return in;
+}
+
+// outputs ([dv, heads, qlen]) followed by the new state ([dv, dk, heads])
+static std::vector<float> reference(const Case &c, const Inputs &in, float q_scale)
+{
+    std::vector<float> r((size_t)c.dv * c.heads * c.qlen + in.state.size());
+    float *out_state = r.data() + (size_t)c.dv * c.heads * c.qlen;
+    std::vector<float> u(c.dv);
+
+    for (int h = 0; h < c.heads; h++)
+    {
+        float *S = out_state + (size_t)h * c.dk * c.dv;     // [dk][dv]
+        std::copy(in.state.begin() + (size_t)h * c.dk * c.dv, in.state.begin() + (size_t)(h + 1) * c.dk * c.dv, S);
+
+        for (int t = 0; t < c.qlen; t++)
+        {
+            const float *q = in.q.data() + ((size_t)t * c.heads + h) * c.dk;
+            const float *k = in.k.data() + ((size_t)t * c.heads + h) * c.dk;
+            const float *v = in.v.data() + ((size_t)t * c.heads + h) * c.dv;
+            const float decay = expf(in.g[(size_t)t * c.heads + h]);
+            const float beta  = in.beta[(size_t)t * c.heads + h];
+
+            for (int j = 0; j < c.dk * c.dv; j++)
+                S[j] *= decay;
+
+            for (int i = 0; i < c.dv; i++)
+            {
+                float kv = 0.0f;
+                for (int j = 0; j < c.dk; j++)
+                    kv += S[j * c.dv + i] * k[j];
+                u[i] = beta * (v[i] - kv);
+            }
+
+            for (int j = 0; j < c.dk; j++)
+                for (int i = 0; i < c.dv; i++)
+                    S[j * c.dv + i] += k[j] * u[i];
+
+            float *o = r.data() + ((size_t)t * c.heads + h) * c.dv;
+            for (int i = 0; i < c.dv; i++)
+            {
+                float acc = 0.0f;
+                for (int j = 0; j < c.dk; j++)
+                    acc += S[j * c.dv + i] * q[j];
+                o[i] = acc * q_scale;
+            }
+        }
+    }
+    return r;
+}
+
+static std::vector<float> run(BackendContext &backend_context, const Case &c, const Inputs &in)
+{
+    TestContext ctx(&backend_context);
+
+    auto q     = ggml::new_tensor_3d(&ctx, ggml::type::GGML_TYPE_F32, c.dk, c.heads, c.qlen);
+    auto k     = ggml::new_tensor_3d(&ctx, ggml::type::GGML_TYPE_F32, c.dk, c.heads, c.qlen);
+    auto v     = ggml::new_tensor_3d(&ctx, ggml::type::GGML_TYPE_F32, c.dv, c.heads, c.qlen);
+    auto g     = ggml::new_tensor_2d(&ctx, ggml::type::GGML_TYPE_F32, c.heads, c.qlen);
+    auto beta  = ggml::new_tensor_2d(&ctx, ggml::type::GGML_TYPE_F32, c.heads, c.qlen);
+    auto state = ggml::new_tensor_3d(&ctx, ggml::type::GGML_TYPE_F32, c.dv, c.dk, c.heads);
+
+    auto r = ggml::gated_delta_net(&ctx, q, k, v, ggml::reshape(&ctx, g, 1, c.heads, c.qlen), ggml::reshape(&ctx, beta, 1, c.heads, c.qlen), state);
+
+    ctx.build(r);
+    ctx.set_input(q,     in.q.data());
+    ctx.set_input(k,     in.k.data());
+    ctx.set_input(v,     in.v.data());
+    ctx.set_input(g,     in.g.data());
+    ctx.set_input(beta,  in.beta.data());
+    ctx.set_input(state, in.state.data());
+    ctx.compute();
+    return ctx.get_output(r);
+}
+
+// feeds `n_tokens` by batches through the op, carrying the state. returns tokens per second (of compute).
+static double bench_gated_delta_net(BackendContext &backend_context, const Case &c, const Inputs &in, int n_tokens)
+{
+    std::vector<float> state(in.state);
+    double seconds = 0.0;
+
+    for (int done = 0; done < n_tokens; done += c.qlen)
+    {
+        TestContext ctx(&backend_context, 256);
+
+        auto q     = ggml::new_tensor_3d(&ctx, ggml::type::GGML_TYPE_F32, c.dk, c.heads, c.qlen);
+        auto k     = ggml::new_tensor_3d(&ctx, ggml::type::GGML_TYPE_F32, c.dk, c.heads, c.qlen);
+        auto v     = ggml::new_tensor_3d(&ctx, ggml::type::GGML_TYPE_F32, c.dv, c.heads, c.qlen);
+        auto g     = ggml::new_tensor_2d(&ctx, ggml::type::GGML_TYPE_F32, c.heads, c.qlen);
+        auto beta  = ggml::new_tensor_2d(&ctx, ggml::type::GGML_TYPE_F32, c.heads, c.qlen);
+        auto s     = ggml::new_tensor_3d(&ctx, ggml::type::GGML_TYPE_F32, c.dv, c.dk, c.heads);
+
+        auto r = ggml::gated_delta_net(&ctx, q, k, v, ggml::reshape(&ctx, g, 1, c.heads, c.qlen), ggml::reshape(&ctx, beta, 1, c.heads, c.qlen), s);
+
+        ctx.build(r);
+        ctx.set_input(q,     in.q.data());
+        ctx.set_input(k,     in.k.data());
+        ctx.set_input(v,     in.v.data());
+        ctx.set_input(g,     in.g.data());
+        ctx.set_input(beta,  in.beta.data());
+        ctx.set_input(s,     state.data());
+
+        auto t0 = std::chrono::steady_clock::now();
+        ctx.compute();
+        seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+        auto output = ctx.get_output(r);
+        std::copy(output.end() - state.size(), output.end(), state.begin());
+    }
+
+    return n_tokens / seconds;
+}
+
+// feeds `n_tokens` by batches through causal flash attention, each batch attending to all tokens so far
+// (the KV cache, F16). returns tokens per second (of compute).
+static double bench_full_attention(BackendContext &backend_context, const Case &c, int n_tokens)
+{
+    std::mt19937 rng(2);
+    std::normal_distribution<float> normal;
+
+    // K & V of all tokens: [head_dim, n_tokens, heads]
+    std::vector<ggml_fp16_t> kv((size_t)c.dk * n_tokens * c.heads);
+    for (auto &x : kv) x = ggml_fp32_to_fp16(normal(rng));
+    std::vector<float> q((size_t)c.dk * c.qlen * c.heads);
+    for (auto &x : q) x = normal(rng);
+
+    std::vector<ggml_fp16_t> mask;
+    double seconds = 0.0;
+
+    for (int n_past = 0; n_past < n_tokens; n_past += c.qlen)
+    {
+        const int klen = n_past + c.qlen;
+        TestContext ctx(&backend_context, 256);
+
+        auto tq   = ggml::new_tensor_3d(&ctx, ggml::type::GGML_TYPE_F32, c.dk, c.qlen, c.heads);
+        auto tk   = ggml::new_tensor_3d(&ctx, ggml::type::GGML_TYPE_F16, c.dk, klen,   c.heads);
+        auto tv   = ggml::new_tensor_3d(&ctx, ggml::type::GGML_TYPE_F16, c.dv, klen,   c.heads);
+        auto mask_t = ggml::new_tensor_2d(&ctx, ggml::type::GGML_TYPE_F16, klen, c.qlen);
+
+        auto r = ggml::flash_attention(&ctx, tq, tk, tv, mask_t, 1.0f / sqrtf((float)c.dk));
+
+        ctx.build(r);
+        ctx.set_input(tq, q.data());
+
+        // the first `klen` tokens of each head
+        std::vector<ggml_fp16_t> head_kv((size_t)c.dk * klen * c.heads);
+        for (int h = 0; h < c.heads; h++)
+            std::copy(kv.begin() + (size_t)h * c.dk * n_tokens, kv.begin() + (size_t)h * c.dk * n_tokens + (size_t)c.dk * klen,
+                      head_kv.begin() + (size_t)h * c.dk * klen);
+        ctx.set_input(tk, head_kv.data());
+        ctx.set_input(tv, head_kv.data());
+
+        mask.resize((size_t)klen * c.qlen);
+        for (int i = 0; i < c.qlen; i++)
+            for (int j = 0; j < klen; j++)
+                mask[(size_t)i * klen + j] = ggml_fp32_to_fp16(j <= n_past + i ? 0.0f : -INFINITY);
+        ctx.set_input(mask_t, mask.data());
+
+        auto t0 = std::chrono::steady_clock::now();
+        ctx.compute();
+        seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    }
+
+    return n_tokens / seconds;
+}
+
+static int bench(int argc, char **argv)
+{
+    const int n_tokens  = argc > 2 ? atoi(argv[2]) : 32768;
+    const int heads     = argc > 3 ? atoi(argv[3]) : 16;
+    const int head_dim  = argc > 4 ? atoi(argv[4]) : 128;
+    const int batch     = argc > 5 ? atoi(argv[5]) : 512;
+    const int n_threads = argc > 6 ? atoi(argv[6]) : 1;
+
+    BackendContext backend_context;
+    backend_context.init("", 1, 4096, n_threads);
+
+    const Case c = {head_dim, head_dim, heads, batch};
+    const auto in = make_inputs(c, 1);
+
+    printf("prefill of %d tokens, %d heads of %d, batch %d, %d thread(s)\n", n_tokens, heads, head_dim, batch, n_threads);
+
+    const double tps_net  = bench_gated_delta_net(backend_context, c, in, n_tokens);
+    printf("  %-28s %10.1f tok/s\n", "gated_delta_net (ggml)", tps_net);
+    const double tps_attn = bench_full_attention(backend_context, c, n_tokens);
+    printf("  %-28s %10.1f tok/s\n", "full attention (flash)", tps_attn);
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if ((argc > 1) && (std::string(argv[1]) == "bench"))
+        return bench(argc, argv);
+
+    BackendContext backend_context;
+    backend_context.init("", 1, 4096, 2);
+
+    const float tolerance = 1e-4f;
+
+    const Case cases[] = {
+        {16, 16, 3, 37},
+        {32, 32, 2, 70},
+        {16, 16, 4,  1},        // a single token (decoding)
+    };
+
+    for (const auto &c : cases)
+    {
+        const auto in = make_inputs(c, (unsigned)(c.dk * 1000 + c.qlen));
+
+        // the op scales query by 1/sqrt(dk), but not the state
+        const auto expected        = reference(c, in, 1.0f);
+        const auto expected_scaled = reference(c, in, 1.0f / sqrtf((float)c.dk));
+        const auto r = run(backend_context, c, in);
+        const size_t n_out = (size_t)c.dv * c.heads * c.qlen;
+
+        float err = INFINITY;
+        if (r.size() == expected.size())
+            err = std::max(max_abs_diff(std::vector<float>(r.begin(), r.begin() + n_out),
+                                        std::vector<float>(expected_scaled.begin(), expected_scaled.begin() + n_out)),
+                           max_abs_diff(std::vector<float>(r.begin() + n_out, r.end()),
+                                        std::vector<float>(expected.begin() + n_out, expected.end())));
+        check_error(err, tolerance, format("gated_delta_net dk=%d dv=%d qlen=%d", c.dk, c.dv, c.qlen));
+    }
+
+    return result();
+}
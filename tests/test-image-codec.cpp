@@ -0,0 +1,276 @@
+// Tests of the in-process decoders on synthetic files: small valid PNG, JPEG, BMP & PPM images, and malformed ones
+// which must be rejected: truncated data, bad headers, over-subscribed JPEG Huffman tables, and zlib streams that
+// inflate to more than the image needs (e.g. decompression bombs).
+//
+// usage: test-image-codec
+
+#include "image_codec.h"
+
+#include <cstdio>
+#include <cstdint>
+#include <chrono>
+#include <string>
+#include <vector>
+
+class BitWriter
+{
+public:
+    // fields are packed starting from the least-significant bit
+    void put_bits(uint32_t value, int n)
+    {
+        for (int i = 0; i < n; i++)
+            put_bit((value >> i) & 1);
+    }
+
+    // Huffman codes are packed starting from the most-significant bit
+    void put_code(uint32_t code, int len)
+    {
+        for (int i = len - 1; i >= 0; i--)
+            put_bit((code >> i) & 1);
+    }
+
+    std::vector<uint8_t> bytes;
+private:
+    void put_bit(uint32_t b)
+    {
+        if (nbits == 0) bytes.push_back(0);
+        bytes.back() |= (uint8_t)(b << nbits);
+        nbits = (nbits + 1) & 7;
+    }
+
+    int nbits = 0;
+};
+
+static uint32_t crc32(const uint8_t *data, size_t size)
+{
+    uint32_t crc = 0xffffffff;
+    for (size_t i = 0; i < size; i++)
+    {
+        crc ^= data[i];
+        for (int k = 0; k < 8; k++)
+            crc = (crc >> 1) ^ (0xedb88320 & (0 - (crc & 1)));
+    }
+    return ~crc;
+}
+
+static void put_be32(std::vector<uint8_t> &out, uint32_t v)
+{
+    for (int i = 3; i >= 0; i--)
+        out.push_back((uint8_t)(v >> (i * 8)));
+}
+
+static void put_chunk(std::vector<uint8_t> &png, const char *type, const std::vector<uint8_t> &data)
+{
+    put_be32(png, (uint32_t)data.size());
+    const size_t start = png.size();
+    png.insert(png.end(), type, type + 4);
+    png.insert(png.end(), data.begin(), data.end());
+    put_be32(png, crc32(png.data() + start, png.size() - start));
+}
+
+// 8-bit RGB, `deflate` is the raw DEFLATE stream of IDAT (the adler32 checksum is not checked by the decoder)
+static std::vector<uint8_t> make_png(int width, int height, const std::vector<uint8_t> &deflate)
+{
+    std::vector<uint8_t> png = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+
+    std::vector<uint8_t> ihdr;
+    put_be32(ihdr, width);
+    put_be32(ihdr, height);
+    ihdr.insert(ihdr.end(), {8, 2, 0, 0, 0});
+    put_chunk(png, "IHDR", ihdr);
+
+    std::vector<uint8_t> idat = {0x78, 0x01};
+    idat.insert(idat.end(), deflate.begin(), deflate.end());
+    idat.insert(idat.end(), {0, 0, 0, 0});
+    put_chunk(png, "IDAT", idat);
+
+    put_chunk(png, "IEND", {});
+    return png;
+}
+
+static std::vector<uint8_t> stored_block(const std::vector<uint8_t> &raw)
+{
+    std::vector<uint8_t> out = {0x01};
+    const uint16_t len = (uint16_t)raw.size();
+    out.insert(out.end(), {(uint8_t)len, (uint8_t)(len >> 8), (uint8_t)~len, (uint8_t)(~len >> 8)});
+    out.insert(out.end(), raw.begin(), raw.end());
+    return out;
+}
+
+// a zero byte, then `matches` copies of 258 bytes at distance 1, with fixed Huffman codes
+static std::vector<uint8_t> fixed_block_of_zeros(int matches)
+{
+    BitWriter w;
+    w.put_bits(1, 1);               // BFINAL
+    w.put_bits(1, 2);               // BTYPE: fixed
+    w.put_code(0x30 + 0, 8);        // literal 0
+    for (int i = 0; i < matches; i++)
+    {
+        w.put_code(0xc0 + (285 - 280), 8);  // length 258
+        w.put_code(0, 5);                   // distance 1
+    }
+    w.put_code(0, 7);               // end of block
+    return w.bytes;
+}
+
+static void put_le16(std::vector<uint8_t> &out, uint32_t v)
+{
+    out.push_back((uint8_t)v);
+    out.push_back((uint8_t)(v >> 8));
+}
+
+static void put_le32(std::vector<uint8_t> &out, uint32_t v)
+{
+    put_le16(out, v);
+    put_le16(out, v >> 16);
+}
+
+static void put_segment(std::vector<uint8_t> &jpg, uint8_t marker, const std::vector<uint8_t> &data)
+{
+    jpg.insert(jpg.end(), {0xFF, marker, (uint8_t)((data.size() + 2) >> 8), (uint8_t)(data.size() + 2)});
+    jpg.insert(jpg.end(), data.begin(), data.end());
+}
+
+// DC table: `dc_counts` codes of length 1; AC table: a single code of length 1 for EOB
+static std::vector<uint8_t> dht(int dc_counts, const std::vector<uint8_t> &dc_values)
+{
+    std::vector<uint8_t> data = {0x00};
+    for (int i = 1; i <= 16; i++)
+        data.push_back(i == 1 ? (uint8_t)dc_counts : 0);
+    data.insert(data.end(), dc_values.begin(), dc_values.end());
+
+    data.push_back(0x10);
+    for (int i = 1; i <= 16; i++)
+        data.push_back(i == 1 ? 1 : 0);
+    data.push_back(0x00);
+    return data;
+}
+
+// baseline, 8-bit grayscale, all quantization steps are 1. EOI is appended if `eoi`.
+static std::vector<uint8_t> make_jpeg(int width, int height, const std::vector<uint8_t> &huffman,
+                                      const std::vector<uint8_t> &scan, bool eoi = true)
+{
+    std::vector<uint8_t> jpg = {0xFF, 0xD8};
+
+    std::vector<uint8_t> dqt = {0x00};
+    dqt.insert(dqt.end(), 64, 1);
+    put_segment(jpg, 0xDB, dqt);
+
+    put_segment(jpg, 0xC0, {8, (uint8_t)(height >> 8), (uint8_t)height, (uint8_t)(width >> 8), (uint8_t)width,
+                            1, 1, 0x11, 0});
+    put_segment(jpg, 0xC4, huffman);
+    put_segment(jpg, 0xDA, {1, 1, 0x00, 0, 63, 0});
+
+    jpg.insert(jpg.end(), scan.begin(), scan.end());
+    if (eoi) jpg.insert(jpg.end(), {0xFF, 0xD9});
+    return jpg;
+}
+
+static int failed = 0;
+
+static void check(bool cond, const char *name)
+{
+    printf("%-40s %s\n", name, cond ? "ok" : "FAILED");
+    if (!cond) failed++;
+}
+
+int main(int argc, char **argv)
+{
+    std::vector<uint8_t> rgb;
+    int w = 0;
+    int h = 0;
+
+    // 2x2, filter type 0 for each row
+    const std::vector<uint8_t> raw = {0, 255, 0, 0,   0, 255, 0,
+                                      0, 0, 0, 255,   255, 255, 255};
+    {
+        const auto png = make_png(2, 2, stored_block(raw));
+        const bool ok = vision::image_decode(png.data(), png.size(), rgb, w, h);
+        const std::vector<uint8_t> expected = {255, 0, 0,   0, 255, 0,
+                                               0, 0, 255,   255, 255, 255};
+        check(ok && (w == 2) && (h == 2) && (rgb == expected), "valid png");
+    }
+
+    {
+        const std::string header = "P6\n# comment\n2 1\n255\n";
+        std::vector<uint8_t> ppm(header.begin(), header.end());
+        ppm.insert(ppm.end(), {1, 2, 3, 4, 5, 6});
+        const bool ok = vision::image_decode(ppm.data(), ppm.size(), rgb, w, h);
+        check(ok && (w == 2) && (h == 1) && (rgb == std::vector<uint8_t>({1, 2, 3, 4, 5, 6})), "valid ppm");
+
+        ppm.pop_back();
+        check(!vision::image_decode(ppm.data(), ppm.size(), rgb, w, h), "truncated ppm");
+    }
+
+    {
+        const std::string header = "P6\n99999999999999999999 1\n255\n";
+        std::vector<uint8_t> ppm(header.begin(), header.end());
+        ppm.insert(ppm.end(), 64, 0);
+        check(!vision::image_decode(ppm.data(), ppm.size(), rgb, w, h), "ppm with overflowing width");
+    }
+
+    {
+        // DC: '0' -> category 0, '1' -> category 7. a block of: DC '1' + 80 ('1010000'), AC '0' (EOB)
+        const auto tables = dht(2, {0, 7});
+        const std::vector<uint8_t> block = {0xD0, 0x7F};
+
+        const auto jpg = make_jpeg(8, 8, tables, block);
+        const bool ok = vision::image_decode(jpg.data(), jpg.size(), rgb, w, h);
+        // DC of 80 adds 80 / 8 to the level shift of 128
+        check(ok && (w == 8) && (h == 8) && (rgb == std::vector<uint8_t>(8 * 8 * 3, 138)), "valid jpeg");
+
+        // 2 blocks are needed, but data of 1 block is given, without EOI
+        const auto truncated = make_jpeg(16, 8, tables, block, false);
+        check(!vision::image_decode(truncated.data(), truncated.size(), rgb, w, h), "truncated jpeg scan");
+
+        const auto zero_width = make_jpeg(0, 8, tables, block);
+        check(!vision::image_decode(zero_width.data(), zero_width.size(), rgb, w, h), "jpeg of zero width");
+
+        const auto huge = make_jpeg(60000, 60000, tables, block);
+        check(!vision::image_decode(huge.data(), huge.size(), rgb, w, h), "jpeg of huge dimensions");
+
+        // 255 codes of length 1
+        const auto bad_tables = dht(255, std::vector<uint8_t>(255, 0));
+        const auto bad_dht = make_jpeg(8, 8, bad_tables, block);
+        check(!vision::image_decode(bad_dht.data(), bad_dht.size(), rgb, w, h), "over-subscribed jpeg dht");
+    }
+
+    {
+        // 2x1, 24-bit, bottom-up, each row padded to 4 bytes
+        std::vector<uint8_t> bmp = {'B', 'M'};
+        put_le32(bmp, 14 + 40 + 8);
+        put_le32(bmp, 0);
+        put_le32(bmp, 14 + 40);
+        put_le32(bmp, 40);
+        put_le32(bmp, 2);
+        put_le32(bmp, 1);
+        put_le16(bmp, 1);
+        put_le16(bmp, 24);
+        bmp.insert(bmp.end(), 24, 0);
+        bmp.insert(bmp.end(), {3, 2, 1,   6, 5, 4,   0, 0});
+        const bool ok = vision::image_decode(bmp.data(), bmp.size(), rgb, w, h);
+        check(ok && (w == 2) && (h == 1) && (rgb == std::vector<uint8_t>({1, 2, 3, 4, 5, 6})), "valid bmp");
+
+        bmp.resize(bmp.size() - 3);
+        check(!vision::image_decode(bmp.data(), bmp.size(), rgb, w, h), "truncated bmp");
+    }
+
+    {
+        std::vector<uint8_t> longer = raw;
+        longer.insert(longer.end(), 100, 0);
+        const auto png = make_png(2, 2, stored_block(longer));
+        check(!vision::image_decode(png.data(), png.size(), rgb, w, h), "stored data longer than image");
+    }
+
+    {
+        // inflates to ~256 MiB, while 4 bytes are expected
+        const auto png = make_png(1, 1, fixed_block_of_zeros(1 << 20));
+        auto t0 = std::chrono::steady_clock::now();
+        const bool ok = vision::image_decode(png.data(), png.size(), rgb, w, h);
+        const double ms = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count() * 1000;
+        printf("%zu bytes rejected in %.2fms\n", png.size(), ms);
+        check(!ok, "decompression bomb");
+    }
+
+    return failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,183 @@
+// Tests of KV cache compression (`--set kv-cache-budget N`):
+//
+// * `KVCacheCompressor` alone: under a fixed budget, the least attended tokens out of the recent window are evicted
+//   (ties go to the later ones), and a rewind keeps tokens before it with all heads aligned;
+// * a `KVCacheAttention` fed chunk by chunk with `ComputeContext::compute` only (like models running their own graphs,
+//   without `after_eval`): the cache stays within its budget, the recent window is kept, and each slot of K/V holds
+//   the token of the position recorded by the compressor.
+//
+// usage: test-kv-cache-compression
+
+#include "test-common.h"
+
+using namespace chatllm;
+using namespace chatllm::test;
+
+class TestAttention : public TensorPosHelperPrelude, public KVCacheAttention
+{
+public:
+    TestAttention(InitContext *ctx, int num_attention_heads, int num_kv_heads, int head_size, int max_length)
+        : TensorPosHelperPrelude(new BaseTensorPosHelper(max_length)),
+          KVCacheAttention(ctx, num_attention_heads, num_kv_heads, head_size * num_kv_heads, head_size * num_kv_heads, max_length, max_length),
+          head_size(head_size)
+    {
+        TensorPosHelperPrelude::done();
+    }
+
+    // q: [head_size * heads, qlen], k & v: [head_size * kv_heads, qlen]
+    ggml::tensor *forward(ComputeContext *ctx, ggml::tensor *q, ggml::tensor *k, ggml::tensor *v, int n_past)
+    {
+        const int qlen = (int)ggml::get_dim(q, 1);
+        before_forward(ctx, n_past, qlen);
+        return cross_attention(ctx, head_size * num_attention_heads, n_past, qlen, q, k, v);
+    }
+
+    const KVCacheCompressor *get_compressor(void) const { return compressor.get(); }
+
+    const int head_size;
+};
+
+static std::vector<int> positions_of(const KVCacheCompressor &c, int h)
+{
+    return std::vector<int>(c.get_positions(h), c.get_positions(h) + c.used);
+}
+
+static void check_positions(const KVCacheCompressor &c, const std::vector<std::vector<int>> &expected, const std::string &name)
+{
+    bool ok = true;
+    for (int h = 0; h < c.num_kv_heads; h++)
+        ok = ok && (positions_of(c, h) == expected[h]);
+    check(ok, name);
+}
+
+static void test_compressor(void)
+{
+    // 2 heads, budget 6 (recent 2, slack 1)
+    KVCacheCompressor c(2, 12, 6, 2, 1);
+    std::vector<int> keep;
+
+    c.commit(0, 0, 7);
+    check(c.select_evicted(keep) == 0, "compressor: nothing evicted within budget + slack");
+
+    c.commit(7, 7, 1);
+
+    // head 0 attends to odd positions, head 1 to even ones (and a bit to 1)
+    std::vector<float> mass(2 * 8, 0.0f);
+    for (int i = 0; i < 8; i++)
+    {
+        mass[i]     = i % 2 ? 1.0f : 0.0f;
+        mass[8 + i] = i % 2 ? 0.0f : 1.0f;
+    }
+    mass[8 + 1] = 0.5f;
+    c.accumulate(mass.data(), 8);
+
+    int kept = c.select_evicted(keep);
+    check(kept == 6, "compressor: evicted down to the budget");
+    c.compact(keep, kept);
+    check_positions(c, {{0, 1, 3, 5, 6, 7}, {0, 1, 2, 4, 6, 7}}, "compressor: least attended ones evicted");
+    check(c.get_cache_n_past(8, 1) == 6, "compressor: cache n_past");
+
+    // rewind to 5: head 0 keeps {0, 1, 3}, head 1 has {0, 1, 2, 4} and evicts the least attended one (1)
+    kept = c.select_rewound(5, keep);
+    if (kept > 0) c.compact(keep, kept);
+    check_positions(c, {{0, 1, 3}, {0, 2, 4}}, "compressor: rewind");
+    check(c.get_cache_n_past(5, 1) == 3, "compressor: cache n_past after rewind");
+}
+
+static void test_attention(BackendContext &backend_context)
+{
+    const int heads = 4, kv_heads = 2, head_size = 8;
+    const int max_length = 64, chunk = 3;
+    const int budget = 8, recent = 2, slack = 2;
+
+    BlockParams::KVCacheCompression::setup({{"kv-cache-budget", std::to_string(budget)},
+                                            {"kv-cache-recent", std::to_string(recent)},
+                                            {"kv-cache-slack",  std::to_string(slack)}}, chunk);
+
+    InitContext init(&backend_context);
+    init.dtype = ggml::type::GGML_TYPE_F32;
+    init.cache_dtype = ggml::type::GGML_TYPE_F32;
+    init.gctx = GGMLContext({.mem_size = 64 * ggml_tensor_overhead(), .mem_buffer = nullptr, .no_alloc = true});
+    init.move_to_layer(0);
+    TestAttention attn(&init, heads, kv_heads, head_size, max_length);
+    attn.set_cache_buffer(init.get_allocator()->alloc(attn.get_cache_size(), BackendBufAllocator::Usage::Matrix));
+
+    BlockParams::KVCacheCompression::setup({}, 1);
+
+    const KVCacheCompressor *c = attn.get_compressor();
+    check(c && (attn.cache_length < max_length), "attention: cache is compressed");
+    if (nullptr == c) return;
+
+    std::mt19937 rng(7);
+    const int kv_hidden = head_size * kv_heads;
+    bool within_budget = true;
+    bool recent_kept   = true;
+    bool slots_match   = true;
+
+    for (int n_past = 0; n_past < 30; n_past += chunk)
+    {
+        // keys and values of each token are filled with its position (+1), so slots can be told apart
+        const auto q = random_vector(rng, (size_t)head_size * heads * chunk);
+        std::vector<float> kv((size_t)kv_hidden * chunk);
+        for (int t = 0; t < chunk; t++)
+            std::fill(kv.begin() + t * kv_hidden, kv.begin() + (t + 1) * kv_hidden, (float)(n_past + t + 1));
+
+        {
+            TestContext ctx(&backend_context);
+            auto tq = ggml::new_tensor_2d(&ctx, ggml::type::GGML_TYPE_F32, head_size * heads, chunk);
+            auto tk = ggml::new_tensor_2d(&ctx, ggml::type::GGML_TYPE_F32, kv_hidden, chunk);
+            auto tv = ggml::new_tensor_2d(&ctx, ggml::type::GGML_TYPE_F32, kv_hidden, chunk);
+
+            ctx.move_to_layer(0);
+            auto r = attn.forward(&ctx, tq, tk, tv, n_past);
+            ctx.build(r);
+            ctx.set_input(tq, q.data());
+            ctx.set_input(tk, kv.data());
+            ctx.set_input(tv, kv.data());
+            attn.before_eval(&ctx);
+            ctx.compute();
+        }
+
+        within_budget = within_budget && (c->used <= budget + slack) && (c->n_total == n_past + chunk);
+
+        std::vector<float> k_cache((size_t)c->used * kv_hidden);
+        Backend::read_tensor_data(attn.k_cache, k_cache.data(), 0, k_cache.size() * sizeof(float));
+
+        // v_cache: [kv_hidden, cache_length], F16
+        std::vector<ggml_fp16_t> v_cache(ggml::nelements(attn.v_cache));
+        Backend::read_tensor_data(attn.v_cache, v_cache.data());
+
+        for (int h = 0; h < kv_heads; h++)
+        {
+            const auto pos = positions_of(*c, h);
+            for (int p = c->n_total - recent; p < c->n_total; p++)
+                recent_kept = recent_kept && (std::find(pos.begin(), pos.end(), p) != pos.end());
+
+            for (int i = 0; i < c->used; i++)
+            {
+                const float expected = (float)(pos[i] + 1);
+                for (int j = 0; j < head_size; j++)
+                {
+                    const int d = h * head_size + j;
+                    slots_match = slots_match && (k_cache[(size_t)i * kv_hidden + d] == expected)
+                                              && (ggml_fp16_to_fp32(v_cache[(size_t)d * attn.cache_length + i]) == expected);
+                }
+            }
+        }
+    }
+
+    check(within_budget, "attention: evicted without after_eval");
+    check(recent_kept,   "attention: recent window kept");
+    check(slots_match,   "attention: K/V slots match kept positions");
+}
+
+int main(int argc, char **argv)
+{
+    BackendContext backend_context;
+    backend_context.init("", 1, 4096, 1);
+
+    test_compressor();
+    test_attention(backend_context);
+
+    return result();
+}
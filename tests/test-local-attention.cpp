@@ -0,0 +1,281 @@
+// Tests of the fused local attention kernel (`ggml::local_attention`, used on CPU by sliding-window and ALiBi attentions):
+//
+// * against the mask-based graph of `calc_attn_scores` (the path taken off CPU), with keys as provided by the caches;
+// * against a naive reference, with keys out of the window in the input, so that whole tiles are skipped.
+//
+// usage: test-local-attention
+
+#include "test-common.h"
+
+using namespace chatllm;
+using namespace chatllm::test;
+
+// the fused kernel is not used when computing on GPU, so the graph of the fallback is built instead
+class AttentionContext : public TestContext
+{
+public:
+    AttentionContext(BackendContext *backend_context, bool fallback) : TestContext(backend_context), fallback(fallback) {}
+
+    bool is_using_gpu(void) const override { return fallback; }
+
+    const bool fallback;
+};
+
+// attentions own their position helper, which is not the case for the default one of `CoreAttention`
+class TestSlidingWindowAttention : public TensorPosHelperPrelude, public BaseBaseSlidingWindowAttentionPartialCache
+{
+public:
+    TestSlidingWindowAttention(InitContext *ctx, int window, int hidden_size, int num_attention_heads, int num_kv_heads, int max_length)
+        : TensorPosHelperPrelude(new BaseTensorPosHelper(max_length)),
+          BaseBaseSlidingWindowAttentionPartialCache(ctx, window, 0, hidden_size, num_attention_heads, num_kv_heads, max_length, false, false)
+    {
+        TensorPosHelperPrelude::done();
+    }
+
+    using BaseBaseSlidingWindowAttentionPartialCache::calc_attn_scores;
+};
+
+class TestALiBiSelfAttention : public TensorPosHelperPrelude, public ALiBiSelfAttention
+{
+public:
+    TestALiBiSelfAttention(InitContext *ctx, int hidden_size, int num_attention_heads, int num_kv_heads, int max_length)
+        : TensorPosHelperPrelude(new BaseTensorPosHelper(max_length)),
+          ALiBiSelfAttention(ctx, hidden_size, num_attention_heads, num_kv_heads, max_length)
+    {
+        TensorPosHelperPrelude::done();
+    }
+
+    using ALiBiSelfAttention::calc_attn_scores;
+};
+
+struct Case
+{
+    int heads;
+    int kv_heads;
+    int head_size;
+    int qlen;
+    int klen;
+    int window;         // <= 0: unlimited (ALiBi)
+    float max_bias;     // 0: no ALiBi
+    ggml::type kv_type;
+};
+
+struct Inputs
+{
+    std::vector<float> q;   // [head_size, qlen, heads]
+    std::vector<float> k;   // [head_size, klen, kv_heads]
+    std::vector<float> v;   // [klen, head_size, kv_heads]
+};
+
+static Inputs make_inputs(const Case &c, std::mt19937 &rng)
+{
+    Inputs in;
+    in.q = random_vector(rng, (size_t)c.head_size * c.qlen * c.heads);
+    in.k = random_vector(rng, (size_t)c.head_size * c.klen * c.kv_heads);
+    in.v = random_vector(rng, (size_t)c.klen * c.head_size * c.kv_heads);
+
+    // values seen by the kernel
+    if (c.kv_type == ggml::type::GGML_TYPE_F16)
+    {
+        for (auto *x : {&in.k, &in.v})
+            for (auto &f : *x) f = ggml_fp16_to_fp32(ggml_fp32_to_fp16(f));
+    }
+    return in;
+}
+
+static void set_input(TestContext &ctx, ggml::tensor *tensor, const std::vector<float> &data)
+{
+    if (ggml::type_of(tensor) == ggml::type::GGML_TYPE_F16)
+    {
+        std::vector<ggml_fp16_t> buf(data.size());
+        ggml_fp32_to_fp16_row(data.data(), buf.data(), (int64_t)data.size());
+        ctx.set_input(tensor, buf.data());
+    }
+    else
+        ctx.set_input(tensor, data.data());
+}
+
+// output: [head_size, heads, qlen]
+template <class F> static std::vector<float> run(BackendContext &backend_context, const Case &c, const Inputs &in, bool fallback, F attention)
+{
+    AttentionContext ctx(&backend_context, fallback);
+
+    auto q = ggml::new_tensor_3d(&ctx, ggml::type::GGML_TYPE_F32, c.head_size, c.qlen, c.heads);
+    auto k = ggml::new_tensor_3d(&ctx, c.kv_type, c.head_size, c.klen, c.kv_heads);
+    auto v = ggml::new_tensor_3d(&ctx, c.kv_type, c.klen, c.head_size, c.kv_heads);
+
+    ctx.move_to_layer(0);
+    ggml::tensor *r = attention(&ctx, q, k, v);
+
+    ctx.build(r);
+    ctx.set_input(q, in.q.data());
+    set_input(ctx, k, in.k);
+    set_input(ctx, v, in.v);
+    ctx.compute();
+    return ctx.get_output(r);
+}
+
+// the i-th query is at position `klen - qlen + i`, and attends to keys in (p_i - window, p_i]
+static std::vector<float> reference(const Case &c, const Inputs &in, float scale)
+{
+    const int n_head_log2 = 1 << (int)floor(log2(c.heads));
+    const double m0 = pow(2.0, -(c.max_bias       ) / n_head_log2);
+    const double m1 = pow(2.0, -(c.max_bias / 2.0f) / n_head_log2);
+
+    std::vector<float> r((size_t)c.head_size * c.heads * c.qlen);
+    std::vector<double> s(c.klen);
+    for (int h = 0; h < c.heads; h++)
+    {
+        const int hk = h / (c.heads / c.kv_heads);
+        const double slope = c.max_bias > 0 ? (h < n_head_log2 ? pow(m0, h + 1) : pow(m1, 2 * (h - n_head_log2) + 1)) : 0.0;
+        for (int i = 0; i < c.qlen; i++)
+        {
+            const int p = c.klen - c.qlen + i;
+            const float *q = in.q.data() + ((size_t)h * c.qlen + i) * c.head_size;
+            double mx = -INFINITY;
+            for (int j = 0; j < c.klen; j++)
+            {
+                const bool visible = (j <= p) && ((c.window <= 0) || (j > p - c.window));
+                if (!visible)
+                {
+                    s[j] = -INFINITY;
+                    continue;
+                }
+                const float *k = in.k.data() + ((size_t)hk * c.klen + j) * c.head_size;
+                double dot = 0.0;
+                for (int d = 0; d < c.head_size; d++)
+                    dot += (double)q[d] * k[d];
+                s[j] = dot * scale + slope * (j - p);
+                mx = std::max(mx, s[j]);
+            }
+            double sum = 0.0;
+            for (int j = 0; j < c.klen; j++)
+            {
+                s[j] = exp(s[j] - mx);
+                sum += s[j];
+            }
+            float *out = r.data() + ((size_t)i * c.heads + h) * c.head_size;
+            for (int d = 0; d < c.head_size; d++)
+            {
+                const float *v = in.v.data() + ((size_t)hk * c.head_size + d) * c.klen;
+                double acc = 0.0;
+                for (int j = 0; j < c.klen; j++)
+                    acc += s[j] * v[j];
+                out[d] = (float)(acc / sum);
+            }
+        }
+    }
+    return r;
+}
+
+static const char *type_name(ggml::type t)
+{
+    return t == ggml::type::GGML_TYPE_F16 ? "f16" : "f32";
+}
+
+int main(int argc, char **argv)
+{
+    const int max_length = 160;
+
+    BackendContext backend_context;
+    backend_context.init("", 1, 4096, 2);
+
+    const auto F32 = ggml::type::GGML_TYPE_F32;
+    const auto F16 = ggml::type::GGML_TYPE_F16;
+
+    // the graph rounds queries to F16 when multiplying them by F16 keys
+    const float tolerance       = 1e-4f;
+    const float tolerance_graph = 2e-3f;
+    std::mt19937 rng(3);
+
+    // sliding window: keys are the last `min(n_past + qlen, window)` tokens in the cache
+    {
+        const int window = 32;
+        struct { int heads, kv_heads, qlen, n_past; ggml::type type; } cases[] = {
+            {4, 4,  1,   0, F32},
+            {3, 3,  1,  10, F32},       // odd head count
+            {6, 2,  1, 100, F16},       // GQA, n_past > window
+            {5, 1,  7,   0, F32},
+            {6, 3,  7,  50, F16},       // n_past > window
+            {4, 2, 20,  12, F32},
+        };
+
+        for (const auto &t : cases)
+        {
+            const int head_size = 16;
+            const int klen = std::min(t.n_past + t.qlen, window);
+            const Case c = {t.heads, t.kv_heads, head_size, t.qlen, klen, window, 0.0f, t.type};
+
+            InitContext init(&backend_context);
+            init.dtype = t.type;
+            init.gctx = GGMLContext({.mem_size = 64 * ggml_tensor_overhead(), .mem_buffer = nullptr, .no_alloc = true});
+            init.move_to_layer(0);
+            TestSlidingWindowAttention attn(&init, window, head_size * t.heads, t.heads, t.kv_heads, max_length);
+
+            const Inputs in = make_inputs(c, rng);
+            auto forward = [&](ComputeContext *ctx, ggml::tensor *q, ggml::tensor *k, ggml::tensor *v) {
+                return attn.calc_attn_scores(ctx, head_size * t.heads, t.n_past, t.qlen, k, q, v);
+            };
+            const auto fused    = run(backend_context, c, in, false, forward);
+            const auto expected = run(backend_context, c, in, true,  forward);
+            check_error(max_abs_diff(fused, expected), t.type == F16 ? tolerance_graph : tolerance,
+                        format("sliding window heads=%d/%d qlen=%d n_past=%d %s", t.heads, t.kv_heads, t.qlen, t.n_past, type_name(t.type)));
+        }
+    }
+
+    // ALiBi: all keys
+    {
+        struct { int heads, kv_heads, qlen, n_past; ggml::type type; } cases[] = {
+            {8, 8,  1,   0, F32},
+            {3, 3,  1,  37, F32},       // odd head count: slopes of the second series
+            {5, 5,  9,  20, F16},
+            {6, 2, 20,   0, F32},       // GQA
+            {6, 3, 70,  30, F16},       // several blocks of queries and tiles of keys
+        };
+
+        for (const auto &t : cases)
+        {
+            const int head_size = 16;
+            const Case c = {t.heads, t.kv_heads, head_size, t.qlen, t.n_past + t.qlen, 0, 8.0f, t.type};
+
+            InitContext init(&backend_context);
+            init.dtype = t.type;
+            init.gctx = GGMLContext({.mem_size = 64 * ggml_tensor_overhead(), .mem_buffer = nullptr, .no_alloc = true});
+            init.move_to_layer(0);
+            TestALiBiSelfAttention attn(&init, head_size * t.heads, t.heads, t.kv_heads, max_length);
+
+            const Inputs in = make_inputs(c, rng);
+            auto forward = [&](ComputeContext *ctx, ggml::tensor *q, ggml::tensor *k, ggml::tensor *v) {
+                return attn.calc_attn_scores(ctx, head_size * t.heads, t.n_past, t.qlen, k, q, v);
+            };
+            const auto fused    = run(backend_context, c, in, false, forward);
+            const auto expected = run(backend_context, c, in, true,  forward);
+            check_error(max_abs_diff(fused, expected), t.type == F16 ? tolerance_graph : tolerance,
+                        format("ALiBi heads=%d/%d qlen=%d n_past=%d %s", t.heads, t.kv_heads, t.qlen, t.n_past, type_name(t.type)));
+        }
+    }
+
+    // the kernel alone: keys out of the window of a whole block of queries are skipped
+    {
+        const Case cases[] = {
+            {4, 2, 16,  1, 300, 70, 0.0f, F32},
+            {3, 3, 16, 40, 300, 70, 0.0f, F16},
+            {5, 1, 16, 33, 200, 20, 8.0f, F32},    // window and ALiBi
+            {6, 3, 24, 50,  50, 64, 0.0f, F32},    // window larger than the keys
+        };
+
+        for (const auto &c : cases)
+        {
+            const float scale = 1.0f / sqrtf((float)c.head_size);
+            const Inputs in = make_inputs(c, rng);
+            const auto r = run(backend_context, c, in, false, [&](ComputeContext *ctx, ggml::tensor *q, ggml::tensor *k, ggml::tensor *v) {
+                return ggml::local_attention(ctx, q, k, v, scale, c.window, c.max_bias);
+            });
+            check_error(max_abs_diff(r, reference(c, in, scale)), tolerance,
+                        format("kernel heads=%d/%d qlen=%d klen=%d window=%d bias=%.0f %s",
+                               c.heads, c.kv_heads, c.qlen, c.klen, c.window, c.max_bias, type_name(c.kv_type)));
+        }
+    }
+
+    return result();
+}
@@ -0,0 +1,147 @@
+// Tests of batched media encoding (`BaseMediaProjectedEmbeddingGeneration`, option `media-batch`):
+// embeddings of media encoded in batches must match those encoded one by one, also when `run_batch` fails.
+//
+// The encoder is SmolVLM's pixel shuffle, which stacks images of a batch into a single grid.
+//
+// usage: test-media-batch
+
+#include "test-common.h"
+#include "../models/smol.h"
+
+#include <cstring>
+
+using namespace chatllm;
+using namespace chatllm::test;
+
+class TestProjector : public smol::vit::MultiModalProjector
+{
+public:
+    TestProjector(InitContext *ctx, const smol::vit::Config &config) : MultiModalProjector(ctx, config, config.hidden_size) {}
+    using MultiModalProjector::pixel_shuffle;
+};
+
+// media: features of patches, [hidden_size, grid_width * grid_height, 1, batch]
+class TestEncoder : public DynamicBlock
+{
+public:
+    TestEncoder(InitContext *ctx, const smol::vit::Config &config) : projector(ctx, config)
+    {
+        _loaded = true;
+    }
+
+    ggml::tensor *forward(ComputeContext *ctx, ggml::tensor *input) override
+    {
+        auto x = ggml::reshape_3d(ctx, input, ggml::get_dim(input, 0), ggml::get_dim(input, 1), ggml::get_dim(input, 3));
+        return projector.pixel_shuffle(ctx, x, width, height);
+    }
+
+public:
+    TestProjector projector;
+    int width  = 0;
+    int height = 0;
+};
+
+class TestTokenizer : public BaseTokenizer
+{
+public:
+    TestTokenizer() : BaseTokenizer(BaseConfig(), nullptr) {}
+    size_t load(tokenizer::DataReader *buffer, int n_vocab) override { return 0; }
+};
+
+class TestEmbeddingGeneration : public BaseMediaProjectedEmbeddingGeneration
+{
+public:
+    TestEmbeddingGeneration(const RuntimeConfig &runtime_config, const smol::vit::Config &config)
+        : BaseMediaProjectedEmbeddingGeneration(runtime_config)
+    {
+        backend_context.init(model_gpu_layers, 1, GRAPH_SIZE, n_threads);
+        _ctx.gctx = GGMLContext({.mem_size = 2 * ggml_tensor_overhead(), .mem_buffer = nullptr, .no_alloc = true});
+        _ctx.dtype = ggml::type::GGML_TYPE_F32;
+        model.reset(new TestEncoder(LayerMover(&_ctx, LayerAllocatorManager::MiscLayer::Epilog), config));
+    }
+
+    bool fail_batch = false;
+    int  batches    = 0;
+
+protected:
+    bool run_batch(const GenerationConfig &gen_config, BaseTokenizer *tok, ggml::type dtype, const MediaBatch &batch, std::vector<uint8_t> &buf) override
+    {
+        if (batch.size() > 1)
+        {
+            batches++;
+            if (fail_batch) return false;
+        }
+
+        auto encoder = dynamic_cast<TestEncoder *>(model.get());
+        encoder->width  = batch[0]->width;
+        encoder->height = batch[0]->height;
+        return BaseMediaProjectedEmbeddingGeneration::run_batch(gen_config, tok, dtype, batch, buf);
+    }
+
+    ggml::tensor *make_media_tensor(ComputeContext *ctx, const BaseTokenizer::MediaAsEmbeddingVector &media) override
+    {
+        return ggml::new_tensor_3d(ctx, ggml::type::GGML_TYPE_F32, media.data.size() / (media.grid_width * media.grid_height), media.grid_width * media.grid_height, 1);
+    }
+
+    bool support_batch(void) const override { return true; }
+};
+
+static std::vector<float> encode(const smol::vit::Config &config, TestTokenizer &tok, int batch_size, bool fail_batch, int &batches)
+{
+    RuntimeConfig runtime_config(false, 2, 1, ggml::type::GGML_TYPE_F16);
+    runtime_config.additional["media-batch"] = std::to_string(batch_size);
+
+    TestEmbeddingGeneration gen(runtime_config, config);
+    gen.fail_batch = fail_batch;
+
+    std::vector<uint8_t> buf;
+    gen.generate(GenerationConfig(), &tok, ggml::type::GGML_TYPE_F32, buf);
+    batches = gen.batches;
+
+    std::vector<float> r(buf.size() / sizeof(float));
+    memcpy(r.data(), buf.data(), r.size() * sizeof(float));
+    return r;
+}
+
+int main(int argc, char **argv)
+{
+    smol::vit::Config config;
+    memset(&config, 0, sizeof(config));
+    config.hidden_size  = 8;
+    config.patch_size   = 4;
+    config.scale_factor = 2;
+
+    // tiles of two shapes, interleaved, so that they are regrouped by shape and put back in order
+    const int shapes[][2] = {{4, 4}, {6, 4}, {4, 4}, {4, 4}, {6, 4}, {4, 4}, {4, 4}};
+
+    TestTokenizer tok;
+    std::mt19937 rng(7);
+    std::normal_distribution<float> dist;
+    for (const auto &shape : shapes)
+    {
+        BaseTokenizer::MediaAsEmbeddingVector media{};
+        media.grid_width  = shape[0];
+        media.grid_height = shape[1];
+        media.patch_size  = config.patch_size;
+        media.width  = shape[0] * config.patch_size;
+        media.height = shape[1] * config.patch_size;
+        media.data.resize((size_t)config.hidden_size * shape[0] * shape[1]);
+        for (auto &x : media.data) x = dist(rng);
+        tok.media_emb.push_back(std::move(media));
+    }
+
+    int batches = 0;
+    const auto expected = encode(config, tok, 1, false, batches);
+    check((expected.size() > 0) && (batches == 0), "batch size 1");
+
+    for (int batch_size : {2, 3, 8})
+    {
+        const auto r = encode(config, tok, batch_size, false, batches);
+        check((r == expected) && (batches > 0), format("batch size %d", batch_size));
+
+        const auto r_fallback = encode(config, tok, batch_size, true, batches);
+        check((r_fallback == expected) && (batches > 0), format("batch size %d, run_batch fails", batch_size));
+    }
+
+    return result();
+}
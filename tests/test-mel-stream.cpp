@@ -0,0 +1,113 @@
+// Tests of `audio::MelStream` against `audio::mel_spectrogram` of the whole audio:
+//
+// the signal is appended in uneven snippets (some shorter than the reflected prefix, some longer than many frames),
+// and frames are taken as they become available. Since frames taken before the end are clamped with the running
+// maximum, which is not above the maximum of the whole audio, a frame taken early either equals the one of
+// `mel_spectrogram`, or the latter is clamped and the former is not above it. Frames taken after `flush`
+// see the maximum of the whole audio, and are equal.
+//
+// usage: test-mel-stream
+
+#include "test-common.h"
+#include "audio_process.h"
+
+using namespace chatllm::test;
+
+static const int SAMPLE_RATE = 16000;
+static const int N_MEL       = 80;
+static const int N_FFT       = 400;
+static const int HOP_LENGTH  = 160;
+
+// a chirp that gets louder, so the running maximum keeps rising
+static std::vector<float> make_signal(int64_t n, std::mt19937 &rng)
+{
+    std::normal_distribution<float> noise(0.0f, 0.01f);
+    std::vector<float> r(n);
+    for (int64_t i = 0; i < n; i++)
+    {
+        const float t = (float)i / SAMPLE_RATE;
+        const float amp = 0.05f + 0.9f * (float)i / (float)n;
+        r[i] = amp * sinf(2.0f * 3.14159265f * (200.0f + 1500.0f * t) * t) + noise(rng);
+    }
+    return r;
+}
+
+int main(int argc, char **argv)
+{
+    std::mt19937 rng(3);
+
+    const int64_t n_samples = SAMPLE_RATE * 3 / 2 + 77;
+    const auto signal = make_signal(n_samples, rng);
+
+    std::vector<audio::mel> batch;
+    audio::mel_spectrogram(signal.data(), n_samples, 0, SAMPLE_RATE, N_MEL, N_FFT, HOP_LENGTH, batch);
+    const audio::mel &expected = batch[0];
+
+    float mmax = -1e20f;
+    for (auto v : expected.data) mmax = std::max(mmax, v);
+    const float clamp = mmax - 2.0f;    // (max - 8 + 4) / 4 = normalized max - 2
+
+    audio::MelStream stream(SAMPLE_RATE, N_MEL, N_FFT, HOP_LENGTH);
+
+    // frames taken so far, and whether they were taken before `flush`: [n_frames][n_mel]
+    std::vector<float> taken;
+    std::vector<bool>  early;
+    auto take = [&](int64_t n, bool is_early) {
+        audio::mel m;
+        stream.take(n, m);
+        for (int64_t i = 0; i < n; i++)
+        {
+            for (int j = 0; j < N_MEL; j++)
+                taken.push_back(m.data[j * m.n_len + i]);
+            early.push_back(is_early);
+        }
+    };
+
+    const int64_t pieces[] = {1, 7, 150, 199, 401, 1000, 33, 3333, 160, 2, 5000};
+    int64_t pos = 0;
+    for (int i = 0; pos < n_samples; i++)
+    {
+        const int64_t n = std::min(pieces[i % std::size(pieces)], n_samples - pos);
+        stream.append(signal.data() + pos, n);
+        pos += n;
+
+        // take all, a part, or nothing
+        switch (i % 3)
+        {
+        case 0: take(stream.available(), true);     break;
+        case 1: take(stream.available() / 2, true); break;
+        default: break;
+        }
+    }
+
+    stream.flush();
+    take(stream.available(), false);
+
+    check((int64_t)early.size() == expected.n_len, format("frames: %d vs %d", (int)early.size(), (int)expected.n_len));
+    if ((int64_t)early.size() != expected.n_len) return result();
+
+    const float tolerance = 1e-4f;
+    float err_late  = 0.0f;
+    float err_early = 0.0f;
+    int   n_early   = 0;
+    for (int64_t i = 0; i < expected.n_len; i++)
+    {
+        for (int j = 0; j < N_MEL; j++)
+        {
+            const float s = taken[i * N_MEL + j];
+            const float b = expected.data[j * expected.n_len + i];
+            const float e = fabsf(s - b);
+            if (!early[i])
+                err_late = std::max(err_late, e);
+            else if ((e >= tolerance) && !((fabsf(b - clamp) < tolerance) && (s <= b + tolerance)))
+                err_early = std::max(err_early, e);
+        }
+        if (early[i]) n_early++;
+    }
+
+    check(n_early > 0, format("frames taken before flush: %d", n_early));
+    check_error(err_early, tolerance, "taken before flush (but running-max clamp)");
+    check_error(err_late,  tolerance, "taken after flush");
+
+    return result();
+}
@@ -0,0 +1,193 @@
+// Tests of `MultiLinear` with experts in mixed types (grouped dispatch of `mul_mat_id`, see `BlockParams::MoEMixedTypes`)
+// against a reference computed from dequantized weights.
+//
+// The kernel converts each input row into `vec_dot_type` of the group, so does the reference;
+// what remains is rounding of the accumulation.
+//
+// usage: test-mul-mat-id-mixed
+
+#include "test-common.h"
+
+#include <ggml-alloc.h>
+#include <ggml-cpu.h>
+
+using namespace chatllm;
+using namespace chatllm::test;
+
+struct Case
+{
+    const char *name;
+    std::vector<ggml::type> expert_types;
+    int n_in;
+    int n_out;
+    int n_used;
+    int qlen;
+    bool shared_input;      // input: [n_in, 1, qlen] (e.g. gate/up) or [n_in, n_used, qlen] (e.g. down)
+};
+
+struct Experts
+{
+    std::vector<ggml::type> types;              // of groups
+    std::vector<std::vector<uint8_t>> data;     // of groups
+    std::vector<int> group_of_expert;
+    std::vector<int> index_in_group;
+    std::vector<std::vector<float>> dequantized;// of experts, [n_out, n_in]
+};
+
+static Experts make_experts(const Case &c, std::mt19937 &rng)
+{
+    std::normal_distribution<float> dist(0.0f, 0.1f);
+    Experts e;
+
+    for (auto type : c.expert_types)
+    {
+        auto it = std::find(e.types.begin(), e.types.end(), type);
+        if (it == e.types.end())
+        {
+            e.types.push_back(type);
+            e.data.emplace_back();
+            it = e.types.end() - 1;
+        }
+        const int g = (int)(it - e.types.begin());
+        const size_t row_size = ggml_row_size(type, c.n_in);
+
+        std::vector<float> w((size_t)c.n_in * c.n_out);
+        for (auto &x : w) x = dist(rng);
+
+        auto &data = e.data[g];
+        e.group_of_expert.push_back(g);
+        e.index_in_group.push_back((int)(data.size() / (row_size * c.n_out)));
+
+        const size_t offset = data.size();
+        data.resize(offset + row_size * c.n_out);
+        ggml_quantize_chunk(type, w.data(), data.data() + offset, 0, c.n_out, c.n_in, nullptr);
+
+        e.dequantized.emplace_back(w.size());
+        for (int o = 0; o < c.n_out; o++)
+            ggml_get_type_traits(type)->to_float(data.data() + offset + o * row_size, e.dequantized.back().data() + (size_t)o * c.n_in, c.n_in);
+    }
+    return e;
+}
+
+// output: [n_out, n_used, qlen]
+static std::vector<float> reference(const Case &c, const Experts &e, const std::vector<float> &x, const std::vector<int> &ids)
+{
+    std::vector<float> r((size_t)c.n_out * c.n_used * c.qlen);
+    std::vector<uint8_t> buf;
+    std::vector<float> y(c.n_in);
+
+    for (int t = 0; t < c.qlen; t++)
+    {
+        for (int i = 0; i < c.n_used; i++)
+        {
+            const int expert = ids[(size_t)t * c.n_used + i];
+            const float *x_row = x.data() + ((size_t)t * (c.shared_input ? 1 : c.n_used) + (c.shared_input ? 0 : i)) * c.n_in;
+
+            // the same conversion of the input row as the kernel
+            const ggml::type vec_dot_type = ggml_get_type_traits_cpu(e.types[e.group_of_expert[expert]])->vec_dot_type;
+            if (vec_dot_type != ggml::type::GGML_TYPE_F32)
+            {
+                buf.resize(ggml_row_size(vec_dot_type, c.n_in));
+                ggml_get_type_traits_cpu(vec_dot_type)->from_float(x_row, buf.data(), c.n_in);
+                ggml_get_type_traits(vec_dot_type)->to_float(buf.data(), y.data(), c.n_in);
+            }
+            else
+                std::copy(x_row, x_row + c.n_in, y.begin());
+
+            const float *w = e.dequantized[expert].data();
+            float *out = r.data() + ((size_t)t * c.n_used + i) * c.n_out;
+            for (int o = 0; o < c.n_out; o++)
+            {
+                double acc = 0.0;
+                for (int j = 0; j < c.n_in; j++)
+                    acc += (double)w[(size_t)o * c.n_in + j] * y[j];
+                out[o] = (float)acc;
+            }
+        }
+    }
+    return r;
+}
+
+static std::vector<float> run(BackendContext &backend_context, const Case &c, const Experts &e, const std::vector<float> &x, const std::vector<int> &ids)
+{
+    // experts are kept on CPU (see `MultiLinear::load_weight`)
+    GGMLContext weight_ctx({.mem_size = e.types.size() * ggml_tensor_overhead(), .mem_buffer = nullptr, .no_alloc = true});
+    MultiLinear linear;
+    linear.bias = nullptr;
+    for (size_t g = 0; g < e.types.size(); g++)
+    {
+        const int64_t n = (int64_t)(e.data[g].size() / (ggml_row_size(e.types[g], c.n_in) * c.n_out));
+        linear.groups.push_back(ggml_new_tensor_3d(weight_ctx.get(), e.types[g], c.n_in, c.n_out, n));
+    }
+    linear.group_of_expert = e.group_of_expert;
+    linear.index_in_group  = e.index_in_group;
+
+    ggml_backend_buffer_t weight_buf = ggml_backend_alloc_ctx_tensors_from_buft(weight_ctx.get(), ggml_backend_cpu_buffer_type());
+    for (size_t g = 0; g < e.types.size(); g++)
+        Backend::write_tensor_data(linear.groups[g], e.data[g].data());
+
+    std::vector<float> result;
+    {
+        TestContext ctx(&backend_context, 256);
+
+        auto input    = ggml::new_tensor_3d(&ctx, ggml::type::GGML_TYPE_F32, c.n_in, c.shared_input ? 1 : c.n_used, c.qlen);
+        auto selected = ggml::new_tensor_2d(&ctx, ggml::type::GGML_TYPE_I32, c.n_used, c.qlen);
+
+        ggml::tensor *r = linear.forward(&ctx, input, selected);
+
+        ctx.build(r);
+        ctx.set_input(input,    x.data());
+        ctx.set_input(selected, ids.data());
+        ctx.compute();
+        result = ctx.get_output(r);
+    }
+    ggml_backend_buffer_free(weight_buf);
+    return result;
+}
+
+int main(int argc, char **argv)
+{
+    // more than one thread, so that jobs are split among threads
+    BackendContext backend_context;
+    backend_context.init("", 1, 256, 4);
+
+    const auto Q8_0 = ggml::type::GGML_TYPE_Q8_0;
+    const auto Q4_0 = ggml::type::GGML_TYPE_Q4_0;
+    const auto F16  = ggml::type::GGML_TYPE_F16;
+
+    const float tolerance = 1e-4f;
+
+    const Case cases[] = {
+        {"mixed, shared input",         {Q8_0, Q4_0, F16, Q8_0, F16, Q4_0, Q4_0, Q8_0}, 128, 40, 3, 5, true},
+        {"mixed, input per expert",     {Q8_0, Q4_0, F16, Q8_0, F16, Q4_0, Q4_0, Q8_0}, 128, 40, 3, 5, false},
+        {"one expert in a group",       {F16, Q8_0, Q8_0, Q8_0, Q4_0, Q4_0},             64, 33, 2, 7, false},
+        {"a single token",              {Q4_0, F16, Q8_0, F16},                          256, 16, 4, 1, true},
+    };
+
+    std::mt19937 rng(42);
+    for (const auto &c : cases)
+    {
+        const Experts e = make_experts(c, rng);
+        const int n_expert = (int)c.expert_types.size();
+
+        const auto x = random_vector(rng, (size_t)c.n_in * (c.shared_input ? 1 : c.n_used) * c.qlen);
+
+        // distinct experts per token, covering every group
+        std::vector<int> ids((size_t)c.n_used * c.qlen);
+        for (int t = 0; t < c.qlen; t++)
+            for (int i = 0; i < c.n_used; i++)
+                ids[(size_t)t * c.n_used + i] = (t * c.n_used + i * 3 + t) % n_expert;
+        for (int t = 0; t < c.qlen; t++)
+            for (int i = 1; i < c.n_used; i++)
+                for (int j = 0; j < i; j++)
+                    if (ids[(size_t)t * c.n_used + i] == ids[(size_t)t * c.n_used + j])
+                    {
+                        ids[(size_t)t * c.n_used + i] = (ids[(size_t)t * c.n_used + i] + 1) % n_expert;
+                        j = -1;
+                    }
+
+        check_error(max_rel_diff(run(backend_context, c, e, x, ids), reference(c, e, x, ids)), tolerance, c.name);
+    }
+
+    return result();
+}
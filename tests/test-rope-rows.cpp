@@ -0,0 +1,183 @@
+// Tests of the custom RoPE kernels (rotation of rows with tabulated sin/cos) against `ggml_rope_ext`:
+//
+// * QWen dynamic NTK (NEOX): within `seq_length`, angles are those of the plain RoPE, on all or part of the dimensions;
+// * BlueLM mixed NTK (NORM, interleaved): frequencies of the plain RoPE are corrected by `freq_factors`.
+//
+// Positions beyond `max_length` are not tabulated, and are computed by the kernels.
+//
+// usage: test-rope-rows
+
+#include "test-common.h"
+
+using namespace chatllm;
+using namespace chatllm::test;
+
+// attentions own their position helper, which is not the case for the default one of `CoreAttention`
+class TestQWenSelfAttention : public TensorPosHelperPrelude, public QWenSelfAttention
+{
+public:
+    TestQWenSelfAttention(InitContext *ctx, int hidden_size, int num_attention_heads, int max_length)
+        : TensorPosHelperPrelude(new BaseTensorPosHelper(max_length)),
+          QWenSelfAttention(ctx, hidden_size, num_attention_heads, max_length)
+    {
+        TensorPosHelperPrelude::done();
+    }
+
+    using QWenSelfAttention::apply_pos_embedding_k;
+};
+
+class TestBlueLMSelfAttention : public TensorPosHelperPrelude, public BlueLMSelfAttention
+{
+public:
+    TestBlueLMSelfAttention(InitContext *ctx, int hidden_size, int num_attention_heads, int max_length)
+        : TensorPosHelperPrelude(new BaseTensorPosHelper(max_length)),
+          BlueLMSelfAttention(ctx, hidden_size, num_attention_heads, max_length)
+    {
+        TensorPosHelperPrelude::done();
+    }
+
+    using BlueLMSelfAttention::apply_pos_embedding_k;
+};
+
+struct Case
+{
+    int heads;
+    int head_size;
+    int qlen;
+    int n_past;
+    ggml::type type;
+};
+
+static void set_input(TestContext &ctx, ggml::tensor *tensor, const std::vector<float> &data)
+{
+    if (ggml::type_of(tensor) == ggml::type::GGML_TYPE_F16)
+    {
+        std::vector<ggml_fp16_t> buf(data.size());
+        ggml_fp32_to_fp16_row(data.data(), buf.data(), (int64_t)data.size());
+        ctx.set_input(tensor, buf.data());
+    }
+    else
+        ctx.set_input(tensor, data.data());
+}
+
+static std::vector<float> get_output(TestContext &ctx, ggml::tensor *tensor)
+{
+    if (ggml::type_of(tensor) != ggml::type::GGML_TYPE_F16)
+        return ctx.get_output(tensor);
+
+    std::vector<ggml_fp16_t> buf(ggml::nelements(tensor));
+    Backend::read_tensor_data(tensor, buf.data());
+    std::vector<float> r(buf.size());
+    ggml_fp16_to_fp32_row(buf.data(), r.data(), (int64_t)r.size());
+    return r;
+}
+
+// `rope(ctx, x, pos, freq_factors)` with x: [head_size, heads, qlen], pos: [qlen], freq_factors: [head_size / 2];
+// `freq_factors` is filled after the graph is built.
+template <class F> static std::vector<float> run(BackendContext &backend_context, const Case &c, const std::vector<float> &x,
+    const std::vector<float> &freq_factors, F rope)
+{
+    TestContext ctx(&backend_context);
+
+    auto input = ggml::new_tensor_3d(&ctx, c.type, c.head_size, c.heads, c.qlen);
+    auto pos   = ggml::new_tensor_1d(&ctx, ggml::type::GGML_TYPE_I32, c.qlen);
+    auto ff    = ggml::new_tensor_1d(&ctx, ggml::type::GGML_TYPE_F32, c.head_size / 2);
+
+    ctx.move_to_layer(0);
+    ggml::tensor *r = rope(&ctx, input, pos, ff);
+
+    ctx.build(r);
+
+    std::vector<int> v_pos(c.qlen);
+    for (int i = 0; i < c.qlen; i++) v_pos[i] = c.n_past + i;
+
+    set_input(ctx, input, x);
+    ctx.set_input(pos, v_pos.data());
+    if (freq_factors.size() > 0)
+        ctx.set_input(ff, freq_factors.data());
+    ctx.compute();
+    return get_output(ctx, r);
+}
+
+static void setup(InitContext &init)
+{
+    init.dtype = ggml::type::GGML_TYPE_F32;
+    init.gctx = GGMLContext({.mem_size = 64 * ggml_tensor_overhead(), .mem_buffer = nullptr, .no_alloc = true});
+    init.move_to_layer(0);
+}
+
+static const char *type_name(ggml::type t)
+{
+    return t == ggml::type::GGML_TYPE_F16 ? "f16" : "f32";
+}
+
+int main(int argc, char **argv)
+{
+    const int max_length = 64;
+    const float freq_base = 10000.0f;
+
+    BackendContext backend_context;
+    backend_context.init("", 1, 4096, 2);
+
+    const auto F32 = ggml::type::GGML_TYPE_F32;
+    const auto F16 = ggml::type::GGML_TYPE_F16;
+
+    std::mt19937 rng(5);
+
+    const Case cases[] = {
+        {4, 64,  1,   0, F32},
+        {3, 32,  1,  17, F32},
+        {4, 64,  9,  40, F32},      // crosses `max_length`
+        {2, 64,  5, 200, F32},      // not tabulated
+        {5, 32, 20,   3, F16},
+    };
+
+    for (const auto &c : cases)
+    {
+        const float tolerance = c.type == F16 ? 5e-3f : 1e-4f;
+        const auto x = random_vector(rng, (size_t)c.head_size * c.heads * c.qlen);
+
+        // NEOX, all and half of the dimensions
+        for (const int rope_dim : {c.head_size, c.head_size / 2})
+        {
+            InitContext init(&backend_context);
+            setup(init);
+            TestQWenSelfAttention attn(&init, c.head_size * c.heads, c.heads, max_length);
+            attn.config(rope_dim, freq_base, 1 << 20, true, false);
+
+            const auto r = run(backend_context, c, x, {}, [&](ComputeContext *ctx, ggml::tensor *input, ggml::tensor *pos, ggml::tensor *ff) {
+                return attn.apply_pos_embedding_k(ctx, input, c.head_size * c.heads, c.qlen, pos);
+            });
+            const auto expected = run(backend_context, c, x, {}, [&](ComputeContext *ctx, ggml::tensor *input, ggml::tensor *pos, ggml::tensor *ff) {
+                return ggml::rope_ext(ctx, input, pos, nullptr, rope_dim, RoPEMode::Original, max_length, freq_base, 1.0f, 0.0f, 1.0f, 32.0f, 1.0f);
+            });
+            check_error(max_abs_diff(r, expected), tolerance,
+                        format("neox heads=%d dim=%d/%d qlen=%d n_past=%d %s", c.heads, rope_dim, c.head_size, c.qlen, c.n_past, type_name(c.type)));
+        }
+
+        // NORM
+        {
+            InitContext init(&backend_context);
+            setup(init);
+            TestBlueLMSelfAttention attn(&init, c.head_size * c.heads, c.heads, max_length);
+            attn.config(freq_base, 4.0f, 0.3f);
+
+            const auto r = run(backend_context, c, x, {}, [&](ComputeContext *ctx, ggml::tensor *input, ggml::tensor *pos, ggml::tensor *ff) {
+                return attn.apply_pos_embedding_k(ctx, input, c.head_size * c.heads, c.qlen, pos);
+            });
+
+            // theta_i = pos * base^(-2i/n) / ff_i
+            std::vector<float> freq_factors(attn.inv_freq.size());
+            for (size_t i = 0; i < freq_factors.size(); i++)
+                freq_factors[i] = powf(freq_base, -2.0f * (float)i / (float)c.head_size) / attn.inv_freq[i];
+
+            const auto expected = run(backend_context, c, x, freq_factors, [&](ComputeContext *ctx, ggml::tensor *input, ggml::tensor *pos, ggml::tensor *ff) {
+                return ggml::rope_ext(ctx, input, pos, ff, c.head_size, RoPEMode::Interleaved, max_length, freq_base, 1.0f, 0.0f, 1.0f, 32.0f, 1.0f);
+            });
+            check_error(max_abs_diff(r, expected), tolerance,
+                        format("norm heads=%d dim=%d qlen=%d n_past=%d %s", c.heads, c.head_size, c.qlen, c.n_past, type_name(c.type)));
+        }
+    }
+
+    return result();
+}
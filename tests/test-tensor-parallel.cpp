@@ -0,0 +1,316 @@
+// Tests of tensor parallelism (`--set tensor-parallel IDS`): outputs of split layers must match the unsplit ones.
+//
+// * gather: gate/up/down of an MLP split by rows, outputs of each `Linear` are gathered;
+// * paired: rows of gate/up paired with columns of down (`BaseMLP`), outputs of down are summed;
+// * a `Linear` split by columns alone.
+//
+// usage: test-tensor-parallel [RPC_ENDPOINTS DEVICE_IDS [LAYERS HIDDEN INTERMEDIATE [f32]]]
+//
+// Without arguments, shards are put on the CPU twice (device IDs "0,0" on a machine without GPUs).
+// With RPC endpoints (servers started by `main --serve_rpc`), decoding latency of each mode is reported, e.g.
+//   test-tensor-parallel "8080;8081" 0,1 16 2048 8192 f32
+// Weights are in Q8_0 by default. Inputs of Q8_0 matrices are quantized too, so with many layers a rounding
+// difference of the reduce may flip a quantized value and outputs drift apart; use `f32` to compare deep stacks.
+
+#include "test-common.h"
+
+#include <chrono>
+#include <cstring>
+#include <map>
+
+using namespace chatllm;
+using namespace chatllm::test;
+
+// weights kept in memory, in the way of `ModelLoader`
+class TestLoader : public TensorLoader
+{
+public:
+    TestLoader(LayerAllocatorManager *allocators) : allocators(allocators) {}
+
+    void add(const std::string &name, ggml::type type, int64_t ne0, int64_t ne1, std::mt19937 &rng)
+    {
+        std::normal_distribution<float> dist(0.0f, 1.0f / sqrtf((float)ne0));
+        std::vector<float> w(ne0 * ne1);
+        for (auto &x : w) x = dist(rng);
+
+        Weight &t = weights[name];
+        t.type = type;
+        t.ne0  = ne0;
+        t.ne1  = ne1;
+        t.data.resize(ggml::row_size(type, ne0) * ne1);
+        ggml_quantize_chunk(type, w.data(), t.data.data(), 0, ne1, ne0, nullptr);
+    }
+
+    void read_tensor(const std::string &name, ggml::tensor *tensor, bool partial = false) override
+    {
+        const Weight &t = get(name);
+        CHATLLM_CHECK((tensor->ne[0] == t.ne0) && (tensor->ne[1] == t.ne1)) << "shape mismatch: " << name;
+        ggml::change_type(tensor, t.type);
+        alloc(tensor);
+        Backend::write_tensor_data(tensor, t.data.data());
+    }
+
+    void read_tensor(const std::string &name, const std::string &layer_prefix, int num, const std::string &suffix, ggml::tensor *tensor) override
+    {
+        CHATLLM_CHECK(false) << "not implemented";
+    }
+
+    void read_tensor(const std::string &name, const std::vector<std::string> &concat_list, ggml::tensor *tensor) override
+    {
+        CHATLLM_CHECK(false) << "not implemented";
+    }
+
+    void read_tensor_rows(const std::string &name, int64_t row_start, ggml::tensor *tensor) override
+    {
+        const Weight &t = get(name);
+        CHATLLM_CHECK((tensor->ne[0] == t.ne0) && (row_start + tensor->ne[1] <= t.ne1)) << "rows out of range: " << name;
+        ggml::change_type(tensor, t.type);
+        alloc(tensor);
+        Backend::write_tensor_data(tensor, t.data.data() + row_start * ggml::row_size(t.type, t.ne0));
+    }
+
+    void read_tensor_cols(const std::string &name, int64_t col_start, ggml::tensor *tensor) override
+    {
+        const Weight &t = get(name);
+        CHATLLM_CHECK((tensor->ne[1] == t.ne1) && (col_start + tensor->ne[0] <= t.ne0)) << "columns out of range: " << name;
+        ggml::change_type(tensor, t.type);
+        alloc(tensor);
+
+        const size_t row_size = ggml::row_size(t.type, tensor->ne[0]);
+        std::vector<uint8_t> buf(row_size * tensor->ne[1]);
+        for (int64_t i = 0; i < t.ne1; i++)
+            memcpy(buf.data() + i * row_size, t.data.data() + i * ggml::row_size(t.type, t.ne0) + ggml::row_size(t.type, col_start), row_size);
+        Backend::write_tensor_data(tensor, buf.data());
+    }
+
+    void read_scaler(const std::string &name, float *value) override
+    {
+        CHATLLM_CHECK(false) << "not implemented";
+    }
+
+    bool has_tensor(const std::string &name) const override
+    {
+        return weights.find(name) != weights.end();
+    }
+
+    ggml::type get_tensor_type(const std::string &name) const override
+    {
+        return get(name).type;
+    }
+
+protected:
+    struct Weight
+    {
+        ggml::type type;
+        int64_t ne0;
+        int64_t ne1;
+        std::vector<uint8_t> data;
+    };
+
+    const Weight &get(const std::string &name) const
+    {
+        auto it = weights.find(name);
+        CHATLLM_CHECK(it != weights.end()) << "tensor not exist: " << name;
+        return it->second;
+    }
+
+    void alloc(ggml::tensor *tensor)
+    {
+        CHATLLM_CHECK(allocators->get_allocator(tensor)->alloc(tensor)) << "failed to allocate tensor";
+    }
+
+    LayerAllocatorManager *allocators;
+    std::map<std::string, Weight> weights;
+};
+
+// an MLP built from three `Linear`, each split by rows
+class GatheredMLP : public Block
+{
+public:
+    GatheredMLP(InitContext *ctx, int hidden_size, int intermediate_size)
+        : gate_proj(ctx, hidden_size, intermediate_size, false),
+          down_proj(ctx, intermediate_size, hidden_size, false),
+            up_proj(ctx, hidden_size, intermediate_size, false)
+    {}
+
+    ggml::tensor *forward(ComputeContext *ctx, ggml::tensor *hidden_states) override
+    {
+        ggml::tensor *act = ggml::act(ctx, ActFunc::SILU, gate_proj.forward(ctx, hidden_states));
+        return down_proj.forward(ctx, ggml::mul_inplace(ctx, act, up_proj.forward(ctx, hidden_states)));
+    }
+
+    void load(const std::string &path, TensorLoader *loader) override
+    {
+        gate_proj.load(path + "gate_proj.", loader);
+        down_proj.load(path + "down_proj.", loader);
+          up_proj.load(path + "up_proj.", loader);
+    }
+
+public:
+    Linear gate_proj;
+    Linear down_proj;
+    Linear up_proj;
+};
+
+// a `Linear` split by columns
+class ColumnLinear : public Linear
+{
+public:
+    ColumnLinear(InitContext *ctx, int in_features, int out_features) : Linear(ctx, in_features, out_features, false)
+    {
+        split_by_columns(ctx);
+    }
+};
+
+struct Model
+{
+    std::vector<std::unique_ptr<Block>> layers;
+
+    ggml::tensor *forward(ComputeContext *ctx, ggml::tensor *input)
+    {
+        // normalized, as in real models: otherwise states grow quickly with layers, and so do rounding errors
+        for (auto &layer : layers)
+            input = ggml::add(ctx, input, layer->forward(ctx, ggml::rms_norm(ctx, input, 1e-5f)));
+        return input;
+    }
+};
+
+static std::vector<float> run(BackendContext &backend_context, Model &model, const std::vector<float> &x, int hidden_size, int iterations, double &ms)
+{
+    std::vector<float> result;
+    ms = 0.0;
+    for (int i = 0; i < iterations; i++)
+    {
+        TestContext ctx(&backend_context, 8192);
+        auto input = ggml::new_tensor_2d(&ctx, ggml::type::GGML_TYPE_F32, hidden_size, (int64_t)x.size() / hidden_size);
+
+        ctx.move_to_layer(0);
+        auto r = model.forward(&ctx, input);
+
+        ctx.build(r);
+        ctx.set_input(input, x.data());
+
+        auto t0 = std::chrono::steady_clock::now();
+        ctx.compute();
+        result = ctx.get_output(r);
+        auto t1 = std::chrono::steady_clock::now();
+
+        // the first one is a warm up
+        if ((i > 0) || (iterations == 1))
+            ms += std::chrono::duration<double, std::milli>(t1 - t0).count();
+    }
+    ms /= iterations > 1 ? iterations - 1 : 1;
+    return result;
+}
+
+static void check_timed(float err, float tolerance, const std::string &name, double ms)
+{
+    check_error(err, tolerance, format("%-28s %8.3f ms", name.c_str(), ms));
+}
+
+int main(int argc, char **argv)
+{
+    const std::string endpoints  = argc > 1 ? argv[1] : "";
+    const std::string device_ids = argc > 2 ? argv[2] : "0,0";
+    const int n_layers           = argc > 3 ? atoi(argv[3]) : 2;
+    const int hidden_size        = argc > 4 ? atoi(argv[4]) : 256;
+    const int intermediate_size  = argc > 5 ? atoi(argv[5]) : 352;     // 11 blocks of Q8_0: shards are not even
+    const bool use_f32           = (argc > 6) && (std::string(argv[6]) == "f32");
+    const int iterations         = endpoints.size() > 0 ? 11 : 1;
+
+    ComputeManager::init();
+    CHATLLM_CHECK(ComputeManager::prepare_rpc_devices(endpoints)) << "failed to prepare RPC devices";
+
+    BackendContext backend_context;
+    backend_context.set_tensor_parallel(device_ids);
+    backend_context.init("", n_layers, 8192, 1);
+
+    const auto dtype = use_f32 ? ggml::type::GGML_TYPE_F32 : ggml::type::GGML_TYPE_Q8_0;
+    std::mt19937 rng(1);
+    TestLoader loader(&backend_context.layer_allocators);
+    for (int i = 0; i < n_layers; i++)
+    {
+        const std::string prefix = "layers." + std::to_string(i) + ".";
+        loader.add(prefix + "gate_proj.weight",   dtype, hidden_size, intermediate_size, rng);
+        loader.add(prefix + "up_proj.weight",     dtype, hidden_size, intermediate_size, rng);
+        loader.add(prefix + "down_proj.weight",   dtype, intermediate_size, hidden_size, rng);
+    }
+    loader.add("column.weight", dtype, intermediate_size, hidden_size, rng);
+
+    InitContext ctx(&backend_context);
+    ctx.dtype = dtype;
+    ctx.gctx = GGMLContext({.mem_size = (size_t)(n_layers * 3 * 3 + 2) * ggml_tensor_overhead(), .mem_buffer = nullptr, .no_alloc = true});
+
+    Model unsplit;
+    Model gathered;
+    Model paired;
+
+    // blocks created out of hidden layers are not split
+    ctx.move_to_layer(LayerAllocatorManager::MiscLayer::Epilog);
+    for (int i = 0; i < n_layers; i++)
+        unsplit.layers.emplace_back(new SiLUMLP(&ctx, hidden_size, intermediate_size));
+    Linear column_ref(&ctx, intermediate_size, hidden_size, false);
+
+    for (int i = 0; i < n_layers; i++)
+    {
+        ctx.move_to_layer(i);
+        gathered.layers.emplace_back(new GatheredMLP(&ctx, hidden_size, intermediate_size));
+        paired.layers.emplace_back(new SiLUMLP(&ctx, hidden_size, intermediate_size));
+    }
+    ctx.move_to_layer(0);
+    ColumnLinear column(&ctx, intermediate_size, hidden_size);
+
+    for (int i = 0; i < n_layers; i++)
+    {
+        const std::string prefix = "layers." + std::to_string(i) + ".";
+        unsplit.layers[i]->load(prefix, &loader);
+        gathered.layers[i]->load(prefix, &loader);
+        paired.layers[i]->load(prefix, &loader);
+    }
+    column_ref.load("column.", &loader);
+    column.load("column.", &loader);
+
+    auto mlp = dynamic_cast<BaseMLP *>(paired.layers[0].get());
+    const bool is_paired = mlp->down_proj.is_sharded() && mlp->down_proj.shard_by_columns
+                           && (ggml::get_dim(mlp->gate_proj.shards[0], 1) == ggml::get_dim(mlp->down_proj.shards[0], 0));
+    check(is_paired && column.is_sharded() && column.shard_by_columns, "shards paired");
+
+    const float tolerance = 1e-4f;
+    for (int qlen : {1, 5})
+    {
+        const auto x = random_vector(rng, (size_t)hidden_size * qlen);
+
+        double ms = 0.0;
+        const auto expected = run(backend_context, unsplit, x, hidden_size, iterations, ms);
+        check_timed(expected.size() == x.size() ? 0.0f : INFINITY, tolerance, format("unsplit         qlen=%d", qlen), ms);
+
+        float err = max_rel_diff(run(backend_context, gathered, x, hidden_size, iterations, ms), expected);
+        check_timed(err, tolerance, format("gather          qlen=%d", qlen), ms);
+
+        err = max_rel_diff(run(backend_context, paired, x, hidden_size, iterations, ms), expected);
+        check_timed(err, tolerance, format("paired (reduce) qlen=%d", qlen), ms);
+    }
+
+    // a `Linear` split by columns alone
+    {
+        const int qlen = 3;
+        const auto x = random_vector(rng, (size_t)intermediate_size * qlen);
+
+        std::vector<float> r[2];
+        Linear *linears[2] = {&column_ref, &column};
+        for (int i = 0; i < 2; i++)
+        {
+            TestContext ctx(&backend_context, 1024);
+            auto input = ggml::new_tensor_2d(&ctx, ggml::type::GGML_TYPE_F32, intermediate_size, qlen);
+            ctx.move_to_layer(0);
+            auto out = linears[i]->forward(&ctx, input);
+            ctx.build(out);
+            ctx.set_input(input, x.data());
+            ctx.compute();
+            r[i] = ctx.get_output(out);
+        }
+        check_error(max_rel_diff(r[1], r[0]), tolerance, "Linear split by columns");
+    }
+
+    return result();
+}